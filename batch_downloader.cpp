@@ -0,0 +1,148 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-22 16:02:13
+ * @Description: 批量下载管理器实现
+ */
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include "batch_downloader.h"
+
+BatchManager::BatchManager(int worker_num, int host_conn_num)
+    : m_worker_num(worker_num > 0 ? worker_num : 1)
+    , m_host_conn_num(host_conn_num > 0 ? host_conn_num : m_worker_num)
+    , m_type(HTTP)
+    , m_map_page_num(MAP_PAGE_NUM)
+    , m_write_mode(WRITE_MMAP)
+    , m_writer_num(1)
+    , m_limit(nullptr)
+    , m_budget(nullptr)
+    , m_http2_conns(0)
+    , m_stall_timeout(STALL_TIMEOUT_DEFAULT)
+    , m_done_num(0) {
+
+}
+
+/**
+ * @description: 读取清单，每行为"url 保存路径 [文件大小] [校验值]"，#开头为注释，
+ *               保存路径以/结尾或为已存在的目录时文件名取url的最后一段，文件大小未知时可写-
+ * @param {const string&} path 清单文件路径
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool BatchManager::LoadManifest(const string& path) {
+    ifstream file(path);
+    if (!file) {
+        printf("open manifest(%s) failed\n", path.c_str());
+        return false;
+    }
+
+    string line;
+    int line_num = 0;
+    while (getline(file, line)) {
+        line_num++;
+        istringstream fields(line);
+        DownloadRequest entry;
+        string dest;
+        string size;
+        if (!(fields >> entry.url) || entry.url[0] == '#') {
+            continue;
+        }
+        if (!(fields >> dest)) {
+            printf("manifest line %d: missing save path\n", line_num);
+            return false;
+        }
+        fields >> size >> entry.checksum;
+
+        // 保存路径拆分为目录和文件名
+        struct stat dest_stat;
+        if (dest.back() == '/' || (0 == stat(dest.c_str(), &dest_stat) && S_ISDIR(dest_stat.st_mode))) {
+            entry.save_path = dest.size() > 1 && dest.back() == '/' ? dest.substr(0, dest.size() - 1) : dest;
+            entry.filename = entry.url.substr(entry.url.find_last_of('/') + 1);
+        }
+        else {
+            size_t slash = dest.find_last_of('/');
+            entry.save_path = slash == string::npos ? "." : (slash == 0 ? "/" : dest.substr(0, slash));
+            entry.filename = dest.substr(slash == string::npos ? 0 : slash + 1);
+        }
+
+        if (!size.empty() && size != "-") {
+            char* end = nullptr;
+            entry.filesize = strtoull(size.c_str(), &end, 10);
+            if (*end != '\0') {
+                printf("manifest line %d: invalid file size %s\n", line_num, size.c_str());
+                return false;
+            }
+        }
+        ChecksumType type;
+        string expected;
+        if (!entry.checksum.empty() && !StreamVerifier::Parse(entry.checksum, type, expected)) {
+            printf("manifest line %d: invalid checksum %s\n", line_num, entry.checksum.c_str());
+            return false;
+        }
+        m_entries.push_back(entry);
+    }
+    return true;
+}
+
+/**
+ * @description: 设置每个文件的下载器类型、映射页数和写盘方式
+ * @param {DownloaderType} type 下载器类型
+ * @param {int} map_page_num 映射页数
+ * @param {WriteMode} mode 写盘方式
+ * @param {int} writer_num 写线程数
+ */
+void BatchManager::SetFileOptions(DownloaderType type, int map_page_num, WriteMode mode, int writer_num) {
+    m_type = type;
+    m_map_page_num = map_page_num;
+    m_write_mode = mode;
+    m_writer_num = writer_num;
+}
+
+/**
+ * @description: 下载清单中的所有文件
+ * @return {bool} 全部成功返回true， 有文件失败返回false
+ */
+bool BatchManager::Download() {
+    auto begin_time = chrono::steady_clock::now();
+    vector<JobHandle> jobs;
+    {
+        DownloadPool pool(m_worker_num, m_host_conn_num);
+        pool.SetFileOptions(m_type, m_map_page_num, m_write_mode, m_writer_num);
+        pool.SetBandwidthLimit(m_limit);
+        pool.SetMemoryBudget(m_budget);
+        pool.SetHttp2(m_http2_conns);
+        pool.SetStallTimeout(m_stall_timeout);
+        pool.SetCpuAffinity(m_cpus);
+        for (auto& entry : m_entries) {
+            const DownloadRequest* request = &entry;
+            jobs.push_back(pool.Submit(entry, [this, request](JobState state) {
+                lock_guard<mutex> guard(m_lock);
+                m_done_num++;
+                printf("[%d/%d] %s/%s %s\n", m_done_num, (int)m_entries.size(), request->save_path.c_str(),
+                    request->filename.c_str(), state == JOB_DONE ? "done" : "failed");
+            }));
+        }
+        for (auto& job : jobs) {
+            job->Wait();
+        }
+    }
+
+    int failed_num = 0;
+    file_size_t done_size = 0;
+    for (auto& job : jobs) {
+        if (job->GetState() == JOB_DONE) {
+            done_size += job->GetFileSize();
+        }
+        else {
+            failed_num++;
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin_time).count();
+    printf("batch finished: %d/%d files succeeded, %llu bytes in %.2f s\n", (int)jobs.size() - failed_num,
+        (int)jobs.size(), done_size, seconds);
+    return failed_num == 0;
+}
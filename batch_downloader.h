@@ -0,0 +1,94 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-22 15:26:41
+ * @Description: 批量下载管理器，按清单下载多个文件，所有文件提交到同一个任务池，共用一组工作线程（连接）
+ */
+#ifndef _BATCH_DOWNLOADER_H_
+#define _BATCH_DOWNLOADER_H_
+#include <mutex>
+#include <string>
+#include <vector>
+#include "download_pool.h"
+using namespace std;
+
+class BatchManager {
+public:
+    /**
+     * @param {int} worker_num 工作线程数，即所有文件共用的连接数
+     * @param {int} host_conn_num 每个主机的最大连接数
+     */
+    BatchManager(int worker_num, int host_conn_num);
+
+    /**
+     * @description: 读取清单，每行为"url 保存路径 [文件大小] [校验值]"，#开头为注释，
+     *               保存路径以/结尾或为已存在的目录时文件名取url的最后一段，文件大小未知时可写-
+     * @param {const string&} path 清单文件路径
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool LoadManifest(const string& path);
+
+    /**
+     * @description: 设置每个文件的下载器类型、映射页数和写盘方式
+     * @param {DownloaderType} type 下载器类型
+     * @param {int} map_page_num 映射页数
+     * @param {WriteMode} mode 写盘方式
+     * @param {int} writer_num 写线程数
+     */
+    void SetFileOptions(DownloaderType type, int map_page_num, WriteMode mode, int writer_num);
+
+    /**
+     * @description: 设置所有文件共用的带宽限制
+     * @param {BandwidthLimit*} limit 带宽限制，为nullptr时不限制
+     */
+    void SetBandwidthLimit(BandwidthLimit* limit) { m_limit = limit; }
+
+    /**
+     * @description: 设置所有文件共用的内存预算
+     * @param {MemoryBudget*} budget 内存预算，为nullptr时不限制
+     */
+    void SetMemoryBudget(MemoryBudget* budget) { m_budget = budget; }
+
+    /**
+     * @description: 设置每个文件使用HTTP/2
+     * @param {int} max_conns 每个文件每个下载源的最大连接数，0为使用HTTP/1.1
+     */
+    void SetHttp2(int max_conns) { m_http2_conns = max_conns; }
+
+    /**
+     * @description: 设置每个文件的传输停滞超时
+     * @param {int} seconds 秒，0为不检测
+     */
+    void SetStallTimeout(int seconds) { m_stall_timeout = seconds; }
+
+    /**
+     * @description: 设置工作线程绑定的CPU
+     * @param {const vector<int>&} cpus CPU序号，为空时不绑定
+     */
+    void SetCpuAffinity(const vector<int>& cpus) { m_cpus = cpus; }
+
+    /**
+     * @description: 下载清单中的所有文件
+     * @return {bool} 全部成功返回true， 有文件失败返回false
+     */
+    bool Download();
+
+private:
+    int m_worker_num; // 工作线程数
+    int m_host_conn_num; // 每个主机的最大连接数
+    DownloaderType m_type; // 下载器类型
+    int m_map_page_num; // 映射页数
+    WriteMode m_write_mode; // 写盘方式
+    int m_writer_num; // 写线程数
+    BandwidthLimit* m_limit; // 所有文件共用的带宽限制
+    MemoryBudget* m_budget; // 所有文件共用的内存预算
+    int m_http2_conns; // 使用HTTP/2时的最大连接数，0为使用HTTP/1.1
+    int m_stall_timeout; // 传输停滞的超时，秒，0为不检测
+    vector<int> m_cpus; // 工作线程绑定的CPU
+    vector<DownloadRequest> m_entries; // 清单
+
+    mutex m_lock; // 保护以下成员
+    int m_done_num; // 已结束的文件数
+};
+
+#endif
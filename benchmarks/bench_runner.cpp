@@ -0,0 +1,82 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-06 19:30:12
+ * @Description: 在子进程中运行下载程序并统计资源占用
+ */
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <chrono>
+#include "bench_runner.h"
+
+/**
+ * @description: 运行一次下载程序并统计子进程资源占用，子进程的标准输出被丢弃
+ * @param {const vector<string>&} args 下载程序路径及参数
+ * @return {ProcessResult}
+ */
+ProcessResult RunDownloader(const vector<string>& args) {
+    ProcessResult result;
+    // 避免子进程重复输出缓冲区中的内容
+    fflush(stdout);
+    auto begin_time = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed:");
+        return result;
+    }
+    if (pid == 0) {
+        vector<char*> argv;
+        for (auto& arg : args) {
+            argv.push_back((char*)arg.c_str());
+        }
+        argv.push_back(nullptr);
+        // 不显示下载进度
+        freopen("/dev/null", "w", stdout);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4 failed:");
+        return result;
+    }
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - begin_time).count();
+    result.cpu_seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    result.max_rss_kb = usage.ru_maxrss;
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return result;
+}
+
+/**
+ * @description: 校验下载的文件内容
+ * @param {RangeServer&} server 本地服务
+ * @param {const string&} path 文件路径
+ * @param {file_size_t} filesize 文件大小
+ * @return {bool} 内容一致返回true
+ */
+bool CheckFile(RangeServer& server, const string& path, file_size_t filesize) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    vector<char> buf(RANGE_SERVER_PATTERN_SIZE);
+    file_size_t pos = 0;
+    size_t n = 0;
+    bool same = true;
+    while (same && (n = fread(buf.data(), 1, buf.size(), file)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (buf[i] != server.GetByte(pos + i)) {
+                same = false;
+                break;
+            }
+        }
+        pos += n;
+    }
+    fclose(file);
+    return same && pos == filesize;
+}
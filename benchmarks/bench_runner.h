@@ -0,0 +1,41 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-06 19:21:45
+ * @Description: 在子进程中运行下载程序并统计耗时、CPU时间和峰值内存
+ */
+#ifndef _BENCH_RUNNER_H_
+#define _BENCH_RUNNER_H_
+#include <string>
+#include <vector>
+#include "range_server.h"
+using namespace std;
+
+#define BYTE_MB (1024 * 1024)
+
+// 单次运行结果
+struct ProcessResult {
+    ProcessResult(): ok(false), seconds(0), cpu_seconds(0), max_rss_kb(0) {}
+    bool ok; // 下载程序是否正常退出
+    double seconds; // 耗时
+    double cpu_seconds; // 下载进程CPU时间，不包含本地服务
+    long max_rss_kb; // 下载进程峰值内存
+};
+
+/**
+ * @description: 运行一次下载程序并统计子进程资源占用，子进程的标准输出被丢弃
+ * @param {const vector<string>&} args 下载程序路径及参数
+ * @return {ProcessResult}
+ */
+ProcessResult RunDownloader(const vector<string>& args);
+
+/**
+ * @description: 校验下载的文件内容
+ * @param {RangeServer&} server 本地服务
+ * @param {const string&} path 文件路径
+ * @param {file_size_t} filesize 文件大小
+ * @return {bool} 内容一致返回true
+ */
+bool CheckFile(RangeServer& server, const string& path, file_size_t filesize);
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-16 10:12:26
+ * @Description: 运行下载程序下载本地服务的文件，对比不同写盘方式和内存预算在磁盘和tmpfs上的表现
+ */
+#include <getopt.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sstream>
+#include "bench_runner.h"
+
+int main(int argc, char* argv[]) {
+    int ch;
+    file_size_t size_mb = 1024;
+    int thread_num = 16;
+    int writer_num = 2;
+    string dir_list = "/tmp,/dev/shm";
+    string mode_list = "mmap,pwrite,direct";
+    string engine = "multi";
+    string memory_list = "0";
+
+    while ((ch = getopt(argc, argv, "s:t:W:d:w:e:M:h")) != EOF) {
+        switch (ch) {
+        case 's':
+        {
+            size_mb = strtoull(optarg, nullptr, 10);
+            break;
+        }
+        case 't':
+        {
+            thread_num = atoi(optarg);
+            break;
+        }
+        case 'W':
+        {
+            writer_num = atoi(optarg);
+            break;
+        }
+        case 'd':
+        {
+            dir_list.assign(optarg);
+            break;
+        }
+        case 'w':
+        {
+            mode_list.assign(optarg);
+            break;
+        }
+        case 'e':
+        {
+            engine.assign(optarg);
+            break;
+        }
+        case 'M':
+        {
+            memory_list.assign(optarg);
+            break;
+        }
+        default:
+        {
+            printf("Usage: %s [-s file size MB, default 1024] [-t connection num, default 16] "
+                "[-W writer thread num, default 2] [-d target dirs, default /tmp,/dev/shm] "
+                "[-w write modes, default mmap,pwrite,direct] [-e engine, default multi] "
+                "[-M --max-memory values, 0 for unlimited, default 0]\n", argv[0]);
+            return 0;
+        }
+        }
+    }
+
+    RangeServerOptions options;
+    options.file_size = size_mb * BYTE_MB;
+    RangeServer server(options);
+    if (!server.Start()) {
+        return -1;
+    }
+
+    printf("%-16s %-8s %-10s %10s %10s %12s %12s\n", "dir", "mode", "max_mem", "seconds", "MB/s", "cpu_seconds",
+        "max_rss_mb");
+    stringstream dirs(dir_list);
+    string dir;
+    while (getline(dirs, dir, ',')) {
+        stringstream modes(mode_list);
+        string mode;
+        while (getline(modes, mode, ',')) {
+            stringstream memories(memory_list);
+            string memory;
+            while (getline(memories, memory, ',')) {
+                string path = dir + "/bench.bin";
+                unlink(path.c_str());
+                vector<string> args = {DOWNLOADER_BIN, "-u", server.GetUrl(), "-d", dir, "-t",
+                    to_string(thread_num), "-e", engine, "-w", mode, "-W", to_string(writer_num)};
+                if (memory != "0") {
+                    args.push_back("--max-memory");
+                    args.push_back(memory);
+                }
+                ProcessResult result = RunDownloader(args);
+                bool same = result.ok && CheckFile(server, path, options.file_size);
+                printf("%-16s %-8s %-10s %10.3f %10.1f %12.3f %12.1f%s\n", dir.c_str(), mode.c_str(),
+                    memory.c_str(), result.seconds, options.file_size / result.seconds / BYTE_MB, result.cpu_seconds,
+                    result.max_rss_kb / 1024.0, same ? "" : " (failed)");
+                fflush(stdout);
+                unlink(path.c_str());
+            }
+        }
+    }
+    server.Stop();
+    return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-03-26 16:25:37
+ * @Description: 对比每连接一个线程的下载器与curl_multi事件驱动下载器在大量连接下的表现
+ */
+#include <sys/resource.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <condition_variable>
+#include <chrono>
+#include <sstream>
+#include "range_server.h"
+#include "multihttpdownloader.h"
+
+#define BYTE_MB (1024 * 1024)
+
+// 单次测试结果
+struct BenchResult {
+    BenchResult(): ok(false), seconds(0), cpu_seconds(0), ctx_switches(0) {}
+    bool ok; // 数据是否完整
+    double seconds; // 耗时
+    double cpu_seconds; // 进程CPU时间，包含本地服务
+    long ctx_switches; // 上下文切换次数
+};
+
+/**
+ * @description: 获取进程CPU时间和上下文切换次数
+ * @param {double&} cpu_seconds CPU时间
+ * @param {long&} ctx_switches 上下文切换次数
+ */
+static void GetUsage(double& cpu_seconds, long& ctx_switches) {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    cpu_seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    ctx_switches = usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+/**
+ * @description: 把文件平均分成conn_num段同时下载，只统计字节数
+ * @param {HttpDownloader*} downloader 已初始化的下载器
+ * @param {file_size_t} filesize 文件大小
+ * @param {int} conn_num 连接数
+ * @return {BenchResult}
+ */
+static BenchResult RunOnce(HttpDownloader* downloader, file_size_t filesize, int conn_num) {
+    BenchResult result;
+    atomic<file_size_t> received(0);
+    atomic<int> failed(0);
+    mutex done_lock;
+    condition_variable done_cond;
+    int done_num = 0;
+    vector<thread> threads;
+
+    double begin_cpu = 0;
+    long begin_ctx = 0;
+    GetUsage(begin_cpu, begin_ctx);
+    auto begin_time = chrono::steady_clock::now();
+
+    file_size_t seg_size = filesize / conn_num;
+    for (int i = 0; i < conn_num; i++) {
+        file_size_t start = seg_size * i;
+        file_size_t end = i == conn_num - 1 ? filesize - 1 : start + seg_size - 1;
+        DataDealCallback call = [&received](const char* data, size_t size)->bool {
+            received += size;
+            return true;
+        };
+        DownloadDoneCallback done = [&](bool ok) {
+            if (!ok) {
+                failed++;
+            }
+            lock_guard<mutex> guard(done_lock);
+            done_num++;
+            done_cond.notify_one();
+        };
+        if (downloader->IsAsyncSupported()) {
+            if (!downloader->DownloadAsync(start, end, call, done)) {
+                done(false);
+            }
+        }
+        else {
+            threads.emplace_back([=]() { done(downloader->Download(start, end, call)); });
+        }
+    }
+
+    {
+        unique_lock<mutex> guard(done_lock);
+        done_cond.wait(guard, [&]() { return done_num == conn_num; });
+    }
+    for (auto& one : threads) {
+        one.join();
+    }
+
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - begin_time).count();
+    GetUsage(result.cpu_seconds, result.ctx_switches);
+    result.cpu_seconds -= begin_cpu;
+    result.ctx_switches -= begin_ctx;
+    result.ok = failed == 0 && received == filesize;
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    int ch;
+    file_size_t size_mb = 256;
+    file_size_t conn_rate_kb = 2048;
+    string conn_list = "8,64,128,256";
+
+    while ((ch = getopt(argc, argv, "s:r:c:h")) != EOF) {
+        switch (ch) {
+        case 's':
+        {
+            size_mb = strtoull(optarg, nullptr, 10);
+            break;
+        }
+        case 'r':
+        {
+            conn_rate_kb = strtoull(optarg, nullptr, 10);
+            break;
+        }
+        case 'c':
+        {
+            conn_list.assign(optarg);
+            break;
+        }
+        default:
+        {
+            printf("Usage: %s [-s file size MB, default 256] [-r per-connection rate KB/s, 0 = unlimited, "
+                "default 2048] [-c connection counts, default 8,64,128,256]\n", argv[0]);
+            return 0;
+        }
+        }
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    RangeServerOptions options;
+    options.file_size = size_mb * BYTE_MB;
+    options.conn_rate = conn_rate_kb * 1024;
+    RangeServer server(options);
+    if (!server.Start()) {
+        return -1;
+    }
+
+    printf("%-8s %6s %10s %10s %12s %12s\n", "engine", "conns", "seconds", "MB/s", "cpu_seconds", "ctx_switches");
+    stringstream conns(conn_list);
+    string item;
+    while (getline(conns, item, ',')) {
+        int conn_num = atoi(item.c_str());
+        if (conn_num <= 0) {
+            continue;
+        }
+        HttpDownloader thread_engine;
+        MultiHttpDownloader multi_engine;
+        HttpDownloader* engines[] = {&thread_engine, &multi_engine};
+        const char* names[] = {"thread", "multi"};
+        for (int i = 0; i < 2; i++) {
+            if (!engines[i]->Init(server.GetUrl())) {
+                printf("init %s engine failed\n", names[i]);
+                return -1;
+            }
+            BenchResult result = RunOnce(engines[i], options.file_size, conn_num);
+            printf("%-8s %6d %10.3f %10.1f %12.3f %12ld%s\n", names[i], conn_num, result.seconds,
+                options.file_size / result.seconds / BYTE_MB, result.cpu_seconds, result.ctx_switches,
+                result.ok ? "" : " (incomplete)");
+            fflush(stdout);
+        }
+    }
+    server.Stop();
+    curl_global_cleanup();
+    return 0;
+}
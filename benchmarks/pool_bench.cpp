@@ -0,0 +1,197 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-24 09:31:08
+ * @Description: 对比每个连接一个线程、事件驱动下载器自建IO线程、事件循环运行在常驻线程池中时，
+ *               连续下载多个文件的耗时、CPU时间、上下文切换次数和峰值线程数
+ */
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include "bench_runner.h"
+#include "multithread_downloader.h"
+
+// 一组下载的结果
+struct PoolResult {
+    PoolResult(): ok(true), seconds(0), cpu_seconds(0), ctx_switches(0), thread_num(0) {}
+    bool ok; // 所有文件是否完整
+    double seconds; // 耗时
+    double cpu_seconds; // 进程CPU时间，包含本地服务
+    long ctx_switches; // 上下文切换次数
+    int thread_num; // 进程的峰值线程数，包含本地服务
+};
+
+/**
+ * @description: 读取进程当前的线程数
+ * @return {int} 读取失败时为0
+ */
+static int GetThreadNum() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 8, "Threads:") == 0) {
+            return atoi(line.c_str() + 8);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @description: 获取进程CPU时间和上下文切换次数
+ * @param {double&} cpu_seconds CPU时间
+ * @param {long&} ctx_switches 上下文切换次数
+ */
+static void GetUsage(double& cpu_seconds, long& ctx_switches) {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    cpu_seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    ctx_switches = usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+/**
+ * @description: 依次下载同一文件round_num次，下载管理器输出的日志被丢弃
+ * @param {RangeServer&} server 本地服务
+ * @param {const string&} dir 保存目录
+ * @param {int} conn_num 连接数
+ * @param {int} round_num 下载次数
+ * @param {DownloaderType} type 下载器类型
+ * @param {WorkerPool*} workers 线程池，为nullptr时不使用
+ * @return {PoolResult}
+ */
+static PoolResult RunRounds(RangeServer& server, const string& dir, int conn_num, int round_num,
+    DownloaderType type, WorkerPool* workers) {
+    PoolResult result;
+    string path = dir + "/pool_bench.bin";
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    double begin_cpu = 0;
+    long begin_ctx = 0;
+    GetUsage(begin_cpu, begin_ctx);
+    // 定期采样线程数，连接线程只在下载期间存在
+    atomic<bool> sampling(true);
+    thread sampler([&result, &sampling]() {
+        while (sampling) {
+            result.thread_num = max(result.thread_num, GetThreadNum());
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+    });
+    auto begin_time = chrono::steady_clock::now();
+    for (int i = 0; i < round_num && result.ok; i++) {
+        unlink(path.c_str());
+        DownloadManager manager(conn_num);
+        manager.SetFileName("pool_bench.bin");
+        manager.SetWorkerPool(workers);
+        result.ok = manager.Init(DownloadInfo(type, server.GetUrl()), dir) && manager.Download();
+    }
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - begin_time).count();
+    sampling = false;
+    sampler.join();
+    GetUsage(result.cpu_seconds, result.ctx_switches);
+    result.cpu_seconds -= begin_cpu;
+    result.ctx_switches -= begin_ctx;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    int ch;
+    file_size_t size_mb = 16;
+    int round_num = 20;
+    string conn_list = "8,32,128";
+    string affinity;
+    string dir = "/dev/shm";
+
+    while ((ch = getopt(argc, argv, "s:n:c:a:d:h")) != EOF) {
+        switch (ch) {
+        case 's':
+        {
+            size_mb = strtoull(optarg, nullptr, 10);
+            break;
+        }
+        case 'n':
+        {
+            round_num = atoi(optarg);
+            break;
+        }
+        case 'c':
+        {
+            conn_list.assign(optarg);
+            break;
+        }
+        case 'a':
+        {
+            affinity.assign(optarg);
+            break;
+        }
+        case 'd':
+        {
+            dir.assign(optarg);
+            break;
+        }
+        default:
+        {
+            printf("Usage: %s [-s file size MB, default 16] [-n downloads per run, default 20] "
+                "[-c connection counts, default 8,32,128] [-a cpu affinity, same as --cpu-affinity] "
+                "[-d target dir, default /dev/shm]\n", argv[0]);
+            return 0;
+        }
+        }
+    }
+    vector<int> cpus;
+    if (!affinity.empty() && !WorkerPool::ParseAffinity(affinity, cpus)) {
+        return -1;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    RangeServerOptions options;
+    options.file_size = size_mb * BYTE_MB;
+    RangeServer server(options);
+    if (!server.Start()) {
+        return -1;
+    }
+
+    printf("%-8s %6s %10s %12s %12s %12s %8s\n", "mode", "conns", "seconds", "ms/download", "cpu_seconds",
+        "ctx_switches", "threads");
+    stringstream conns(conn_list);
+    string item;
+    while (getline(conns, item, ',')) {
+        int conn_num = atoi(item.c_str());
+        if (conn_num <= 0) {
+            continue;
+        }
+        // 线程池大小固定为CPU数，事件循环在池中的线程上运行，连接分布到各事件循环
+        WorkerPool workers(0, cpus);
+        DownloaderType types[] = {HTTP, HTTP_MULTI, HTTP_MULTI};
+        WorkerPool* modes[] = {nullptr, nullptr, &workers};
+        const char* names[] = {"thread", "multi", "pool"};
+        for (int i = 0; i < 3; i++) {
+            PoolResult result = RunRounds(server, dir, conn_num, round_num, types[i], modes[i]);
+            bool same = result.ok && CheckFile(server, dir + "/pool_bench.bin", options.file_size);
+            printf("%-8s %6d %10.3f %12.2f %12.3f %12ld %8d%s\n", names[i], conn_num, result.seconds,
+                result.seconds * 1000 / round_num, result.cpu_seconds, result.ctx_switches, result.thread_num,
+                same ? "" : " (failed)");
+            fflush(stdout);
+        }
+    }
+    unlink((dir + "/pool_bench.bin").c_str());
+    server.Stop();
+    curl_global_cleanup();
+    return 0;
+}
@@ -0,0 +1,277 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-03-26 15:40:52
+ * @Description: 基准测试用的本地http服务实现
+ */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <chrono>
+#include "range_server.h"
+
+RangeServer::RangeServer(const RangeServerOptions& options)
+    : m_options(options)
+    , m_pattern(RANGE_SERVER_PATTERN_SIZE)
+    , m_listen_fd(-1)
+    , m_port(0)
+    , m_stop(false)
+    , m_failure_num(0) {
+    // 生成固定的伪随机内容，便于校验
+    unsigned int seed = 2166136261u;
+    for (auto& byte : m_pattern) {
+        seed = seed * 16777619u + 0x9e3779b9u;
+        byte = (char)(seed >> 24);
+    }
+}
+
+RangeServer::~RangeServer() {
+    Stop();
+}
+
+/**
+ * @description: 在回环地址的随机端口上启动服务
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool RangeServer::Start() {
+    m_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_listen_fd == -1) {
+        perror("socket failed:");
+        return false;
+    }
+    int on = 1;
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (-1 == bind(m_listen_fd, (sockaddr*)&addr, sizeof(addr)) || -1 == listen(m_listen_fd, 1024)
+        || -1 == getsockname(m_listen_fd, (sockaddr*)&addr, &len)) {
+        perror("listen failed:");
+        return false;
+    }
+    m_port = ntohs(addr.sin_port);
+    m_accept_thread = thread(&RangeServer::AcceptLoop, this);
+    return true;
+}
+
+/**
+ * @description: 停止服务并关闭所有连接
+ */
+void RangeServer::Stop() {
+    if (m_stop.exchange(true)) {
+        return;
+    }
+    if (m_listen_fd != -1) {
+        shutdown(m_listen_fd, SHUT_RDWR);
+    }
+    if (m_accept_thread.joinable()) {
+        m_accept_thread.join();
+    }
+    {
+        lock_guard<mutex> guard(m_conn_lock);
+        for (auto fd : m_conn_fds) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    for (auto& conn_thread : m_conn_threads) {
+        conn_thread.join();
+    }
+    for (auto fd : m_conn_fds) {
+        close(fd);
+    }
+    if (m_listen_fd != -1) {
+        close(m_listen_fd);
+        m_listen_fd = -1;
+    }
+}
+
+/**
+ * @description: 获取文件下载链接
+ * @param {const string&} name 文件名
+ * @return {string}
+ */
+string RangeServer::GetUrl(const string& name) {
+    return "http://127.0.0.1:" + to_string(m_port) + "/" + name;
+}
+
+/**
+ * @description: 接受连接的线程主体
+ */
+void RangeServer::AcceptLoop() {
+    while (!m_stop) {
+        sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int fd = accept(m_listen_fd, (sockaddr*)&addr, &len);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        lock_guard<mutex> guard(m_conn_lock);
+        // 每个连接的种子由配置和连接序号决定
+        unsigned int seed = m_options.seed * 2654435761u + (unsigned int)m_conn_fds.size();
+        m_conn_fds.push_back(fd);
+        m_conn_threads.emplace_back(&RangeServer::ServeConnection, this, fd, ntohl(addr.sin_addr.s_addr), seed);
+    }
+}
+
+/**
+ * @description: 按往返时延和抖动休眠
+ * @param {mt19937&} random 本连接的随机数生成器
+ */
+void RangeServer::Delay(mt19937& random) {
+    int delay_ms = m_options.rtt_ms;
+    if (m_options.jitter_ms > 0) {
+        delay_ms += uniform_int_distribution<int>(0, m_options.jitter_ms)(random);
+    }
+    if (delay_ms > 0) {
+        this_thread::sleep_for(chrono::milliseconds(delay_ms));
+    }
+}
+
+/**
+ * @description: 处理一个连接上的所有请求
+ * @param {int} fd 连接描述符
+ */
+void RangeServer::ServeConnection(int fd, unsigned int client, unsigned int seed) {
+    mt19937 random(seed);
+    uniform_real_distribution<double> chance(0, 1);
+    bool over_limit = false;
+    {
+        lock_guard<mutex> guard(m_conn_lock);
+        int conn_num = ++m_client_conns[client];
+        over_limit = m_options.max_client_conns > 0 && conn_num > m_options.max_client_conns;
+    }
+    // 建连的握手耗时
+    Delay(random);
+
+    string request;
+    char buf[4096];
+    while (!m_stop) {
+        // 读取完整的请求头
+        size_t header_end = request.find("\r\n\r\n");
+        if (header_end == string::npos) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                break;
+            }
+            request.append(buf, n);
+            continue;
+        }
+        string header = request.substr(0, header_end);
+        request.erase(0, header_end + 4);
+
+        bool head_only = header.compare(0, 5, "HEAD ") == 0;
+        file_size_t start = 0;
+        file_size_t end = m_options.file_size;
+        bool partial = false;
+        size_t range_pos = header.find("Range: bytes=");
+        if (range_pos != string::npos) {
+            unsigned long long range_start = 0;
+            unsigned long long range_end = 0;
+            int matched = sscanf(header.c_str() + range_pos, "Range: bytes=%llu-%llu", &range_start, &range_end);
+            if (matched >= 1 && range_start < m_options.file_size) {
+                start = range_start;
+                if (matched == 2 && range_end + 1 < end) {
+                    end = range_end + 1;
+                }
+                partial = true;
+            }
+        }
+
+        Delay(random);
+        if (over_limit || chance(random) < m_options.error_rate) {
+            if (!over_limit) {
+                m_failure_num++;
+            }
+            string error = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+            if (send(fd, error.c_str(), error.size(), MSG_NOSIGNAL) != (ssize_t)error.size()) {
+                break;
+            }
+            continue;
+        }
+        // 中途断开时只发送一半内容，客户端收到的数据少于Content-Length
+        bool reset = !head_only && chance(random) < m_options.reset_rate;
+        // 停止发送时连接不断开，客户端只能靠超时或其他连接发现，未开启时不抽取随机数，不改变其他注入的序列
+        bool stall = !head_only && !reset && m_options.stall_rate > 0 && chance(random) < m_options.stall_rate;
+
+        string response = partial ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+        response += "Content-Length: " + to_string(end - start) + "\r\n";
+        response += "Accept-Ranges: bytes\r\n";
+        if (partial) {
+            response += "Content-Range: bytes " + to_string(start) + "-" + to_string(end - 1) + "/"
+                + to_string(m_options.file_size) + "\r\n";
+        }
+        response += "\r\n";
+        if (send(fd, response.c_str(), response.size(), MSG_NOSIGNAL) != (ssize_t)response.size()) {
+            break;
+        }
+        if (reset) {
+            m_failure_num++;
+            SendRange(fd, start, start + (end - start) / 2);
+            shutdown(fd, SHUT_RDWR);
+            break;
+        }
+        if (stall) {
+            m_failure_num++;
+            SendRange(fd, start, start + (end - start) / 2);
+            while (recv(fd, buf, sizeof(buf), 0) > 0) {
+            }
+            break;
+        }
+        if (!head_only && !SendRange(fd, start, end)) {
+            break;
+        }
+    }
+
+    lock_guard<mutex> guard(m_conn_lock);
+    m_client_conns[client]--;
+}
+
+/**
+ * @description: 发送文件区间，按连接带宽上限限速
+ * @param {int} fd 连接描述符
+ * @param {file_size_t} start 起始字节
+ * @param {file_size_t} end 结束字节（不包含）
+ * @return {bool} 成功返回true， 连接断开返回false
+ */
+bool RangeServer::SendRange(int fd, file_size_t start, file_size_t end) {
+    auto begin_time = chrono::steady_clock::now();
+    file_size_t sent = 0;
+    file_size_t pos = start;
+    while (pos < end && !m_stop) {
+        size_t offset = pos % RANGE_SERVER_PATTERN_SIZE;
+        size_t size = RANGE_SERVER_PATTERN_SIZE - offset;
+        if (size > RANGE_SERVER_SEND_SIZE) {
+            size = RANGE_SERVER_SEND_SIZE;
+        }
+        if (size > end - pos) {
+            size = (size_t)(end - pos);
+        }
+        ssize_t n = send(fd, &m_pattern[offset], size, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        pos += n;
+        sent += n;
+
+        // 按已发送量计算应到达的时间，提前则休眠
+        if (m_options.conn_rate > 0) {
+            auto expect = begin_time + chrono::microseconds(sent * 1000000 / m_options.conn_rate);
+            this_thread::sleep_until(expect);
+        }
+    }
+    return pos == end;
+}
@@ -0,0 +1,115 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-03-26 15:02:11
+ * @Description: 基准测试用的本地http服务，按Range请求返回生成的文件内容
+ */
+#ifndef _RANGE_SERVER_H_
+#define _RANGE_SERVER_H_
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include <random>
+#include "downloaders.h"
+using namespace std;
+
+#define RANGE_SERVER_PATTERN_SIZE   (1024 * 1024) // 生成内容的循环周期
+#define RANGE_SERVER_SEND_SIZE      (64 * 1024) // 单次发送的最大字节数
+
+// 服务配置，随机行为使用固定种子，相同配置的多次运行注入的延迟和失败一致
+struct RangeServerOptions {
+    RangeServerOptions(): file_size(0), conn_rate(0), rtt_ms(0), jitter_ms(0), error_rate(0), reset_rate(0),
+        stall_rate(0), max_client_conns(0), seed(1) {}
+    file_size_t file_size; // 生成的文件大小
+    file_size_t conn_rate; // 每个连接的带宽上限，字节/秒，0表示不限
+    int rtt_ms; // 模拟的往返时延，新建连接和每个请求的响应各延迟一个往返
+    int jitter_ms; // 每次延迟额外增加0到该值的随机时长
+    double error_rate; // 请求直接返回503的概率
+    double reset_rate; // 请求发送一半内容后断开连接的概率
+    double stall_rate; // 请求发送一半内容后不再发送、保持连接直到客户端断开的概率
+    int max_client_conns; // 同一客户端地址的最大连接数，超出的连接上的请求返回503，0表示不限
+    unsigned int seed; // 随机数种子
+};
+
+class RangeServer {
+public:
+    explicit RangeServer(const RangeServerOptions& options);
+    ~RangeServer();
+
+    /**
+     * @description: 在回环地址的随机端口上启动服务
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Start();
+
+    /**
+     * @description: 停止服务并关闭所有连接
+     */
+    void Stop();
+
+    /**
+     * @description: 获取文件下载链接
+     * @param {const string&} name 文件名
+     * @return {string}
+     */
+    string GetUrl(const string& name = "bench.bin");
+
+    /**
+     * @description: 获取注入的失败次数，包括返回503、中途断开和中途停止发送
+     * @return {int}
+     */
+    int GetFailureNum() { return m_failure_num; }
+
+    /**
+     * @description: 获取指定位置的文件内容，用于校验下载结果
+     * @param {file_size_t} pos 文件位置
+     * @return {char}
+     */
+    char GetByte(file_size_t pos) { return m_pattern[pos % RANGE_SERVER_PATTERN_SIZE]; }
+
+private:
+    /**
+     * @description: 接受连接的线程主体
+     */
+    void AcceptLoop();
+
+    /**
+     * @description: 处理一个连接上的所有请求
+     * @param {int} fd 连接描述符
+     * @param {unsigned int} client 客户端地址
+     * @param {unsigned int} seed 本连接的随机数种子
+     */
+    void ServeConnection(int fd, unsigned int client, unsigned int seed);
+
+    /**
+     * @description: 按往返时延和抖动休眠
+     * @param {mt19937&} random 本连接的随机数生成器
+     */
+    void Delay(mt19937& random);
+
+    /**
+     * @description: 发送文件区间，按连接带宽上限限速
+     * @param {int} fd 连接描述符
+     * @param {file_size_t} start 起始字节
+     * @param {file_size_t} end 结束字节（不包含）
+     * @return {bool} 成功返回true， 连接断开返回false
+     */
+    bool SendRange(int fd, file_size_t start, file_size_t end);
+
+    RangeServerOptions m_options; // 服务配置
+    vector<char> m_pattern; // 循环使用的文件内容
+    int m_listen_fd; // 监听描述符
+    int m_port; // 监听端口
+    atomic<bool> m_stop; // 是否停止服务
+    thread m_accept_thread; // 接受连接的线程
+    mutex m_conn_lock; // 保护连接集合
+    vector<int> m_conn_fds; // 所有连接描述符
+    vector<thread> m_conn_threads; // 所有连接的处理线程
+    map<unsigned int, int> m_client_conns; // 客户端地址->当前连接数，由m_conn_lock保护
+    atomic<int> m_failure_num; // 注入的失败次数
+};
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-25 21:48:30
+ * @Description: 测量每块数据经过写入层的开销，对比经std::function回调、按连接序号查多个并列vector的写入方式
+ *               与编译期组合的写入流水线，写入目标为内存中的映射窗口，不经过网络和磁盘
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <sstream>
+#include "data_sink.h"
+
+#define BENCH_REGION_SIZE   (16 * 1024 * 1024) // 每个连接写入的循环区域
+#define BENCH_WINDOW_SIZE   (1024 * 1024) // 模拟的映射窗口大小
+
+// 为流水线提供映射窗口，窗口直接指向内存中各连接的区域
+class BufferMapper {
+public:
+    BufferMapper(char* base, ConnWriteState* states): m_base(base), m_states(states) {}
+
+    bool MapToFile(int conn, file_size_t pos) {
+        ConnWriteState& state = m_states[conn];
+        state.map_offset = pos / BENCH_WINDOW_SIZE * BENCH_WINDOW_SIZE;
+        state.map_size = BENCH_WINDOW_SIZE;
+        state.mem = m_base + (size_t)conn * BENCH_REGION_SIZE + state.map_offset;
+        return true;
+    }
+
+    void RecordWritten(int conn) {
+        m_states[conn].written_start = m_states[conn].written_end;
+    }
+
+private:
+    char* m_base;
+    ConnWriteState* m_states;
+};
+
+// 原有的写入方式，各连接的状态分别存放在按连接序号索引的并列vector中
+class LegacyWriter {
+public:
+    LegacyWriter(char* base, int conn_num, ProgressCounters* counters)
+        : m_base(base), m_mems(conn_num, nullptr), m_map_offsets(conn_num, 0), m_map_sizes(conn_num, 0)
+        , m_written_starts(conn_num, 0), m_written_ends(conn_num, 0), m_counters(counters) {}
+
+    bool Write(int conn, file_size_t pos, const char* data, size_t size) {
+        if (pos != m_written_ends[conn]) {
+            m_written_starts[conn] = pos;
+            m_written_ends[conn] = pos;
+        }
+        size_t offset = 0;
+        while (offset < size) {
+            if (m_mems[conn] == nullptr || pos < m_map_offsets[conn]
+                || pos >= m_map_offsets[conn] + m_map_sizes[conn]) {
+                m_map_offsets[conn] = pos / BENCH_WINDOW_SIZE * BENCH_WINDOW_SIZE;
+                m_map_sizes[conn] = BENCH_WINDOW_SIZE;
+                m_mems[conn] = m_base + (size_t)conn * BENCH_REGION_SIZE + m_map_offsets[conn];
+            }
+            size_t mem_pos = (size_t)(pos - m_map_offsets[conn]);
+            size_t copy_size = min(m_map_sizes[conn] - mem_pos, size - offset);
+            memcpy(m_mems[conn] + mem_pos, data + offset, copy_size);
+            offset += copy_size;
+            pos += copy_size;
+            m_written_ends[conn] = pos;
+        }
+        m_counters->Add(conn, size);
+        return true;
+    }
+
+private:
+    char* m_base;
+    vector<char*> m_mems;
+    vector<file_size_t> m_map_offsets;
+    vector<size_t> m_map_sizes;
+    vector<file_size_t> m_written_starts;
+    vector<file_size_t> m_written_ends;
+    ProgressCounters* m_counters;
+};
+
+/**
+ * @description: 多个线程各自作为一个连接连续写入，返回每块的平均耗时
+ * @param {int} thread_num 线程数
+ * @param {long long} chunk_num 每个线程写入的块数
+ * @param {size_t} chunk_size 块大小
+ * @param {function<void(int, const char*)>} body 线程主体，参数为连接序号和待写入的数据
+ * @return {double} 纳秒
+ */
+static double RunThreads(int thread_num, long long chunk_num, size_t chunk_size,
+    function<void(int conn, const char* data)> body) {
+    vector<char> data(chunk_size, 'x');
+    vector<thread> threads;
+    auto begin_time = chrono::steady_clock::now();
+    for (int i = 0; i < thread_num; i++) {
+        threads.emplace_back(body, i, data.data());
+    }
+    for (auto& one : threads) {
+        one.join();
+    }
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - begin_time).count();
+    return ns / chunk_num / thread_num;
+}
+
+int main(int argc, char* argv[]) {
+    int ch;
+    long long chunk_num = 2000000;
+    int thread_num = 4;
+    string size_list = "64,1024,16384";
+
+    while ((ch = getopt(argc, argv, "n:t:c:h")) != EOF) {
+        switch (ch) {
+        case 'n':
+        {
+            chunk_num = strtoll(optarg, nullptr, 10);
+            break;
+        }
+        case 't':
+        {
+            thread_num = atoi(optarg);
+            break;
+        }
+        case 'c':
+        {
+            size_list.assign(optarg);
+            break;
+        }
+        default:
+        {
+            printf("Usage: %s [-n chunks per thread, default 2000000] [-t threads, default 4] "
+                "[-c chunk sizes, default 64,1024,16384]\n", argv[0]);
+            return 0;
+        }
+        }
+    }
+    if (thread_num <= 0 || chunk_num <= 0) {
+        return -1;
+    }
+
+    vector<char> region((size_t)thread_num * BENCH_REGION_SIZE);
+    ConnWriteState* states = AllocCacheAligned<ConnWriteState>(thread_num);
+    if (!states) {
+        return -1;
+    }
+
+    printf("%-10s %10s %14s %14s %14s %14s\n", "chunk_size", "threads", "function_null", "pipeline_null",
+        "function_mmap", "pipeline_mmap");
+    stringstream sizes(size_list);
+    string item;
+    while (getline(sizes, item, ',')) {
+        size_t chunk_size = strtoull(item.c_str(), nullptr, 10);
+        if (chunk_size == 0 || chunk_size > BENCH_WINDOW_SIZE) {
+            continue;
+        }
+        for (int i = 0; i < thread_num; i++) {
+            states[i] = ConnWriteState();
+        }
+        ProgressCounters counters(thread_num);
+        LegacyWriter legacy(region.data(), thread_num, &counters);
+        BufferMapper mapper(region.data(), states);
+        file_size_t wrap = BENCH_REGION_SIZE / chunk_size * chunk_size;
+
+        // 只有分发和计数：std::function回调与流水线的空写盘级
+        double function_null = RunThreads(thread_num, chunk_num, chunk_size, [&](int conn, const char* data) {
+            DataDealCallback call = [&counters, conn](const char* buf, size_t size)->bool {
+                counters.Add(conn, size);
+                return true;
+            };
+            for (long long k = 0; k < chunk_num; k++) {
+                call(data, chunk_size);
+            }
+        });
+        double pipeline_null = RunThreads(thread_num, chunk_num, chunk_size, [&](int conn, const char* data) {
+            auto pipeline = MakeSinkPipeline(NullSink(), CountSink(&counters));
+            for (long long k = 0; k < chunk_num; k++) {
+                SinkChunk chunk(conn, 0, data, chunk_size);
+                pipeline.Put(chunk);
+            }
+        });
+
+        // 写入映射窗口并记录已写入区间
+        double function_mmap = RunThreads(thread_num, chunk_num, chunk_size, [&](int conn, const char* data) {
+            file_size_t pos = 0;
+            DataDealCallback call = [&legacy, &pos, conn](const char* buf, size_t size)->bool {
+                return legacy.Write(conn, pos, buf, size);
+            };
+            for (long long k = 0; k < chunk_num; k++) {
+                call(data, chunk_size);
+                pos = pos + chunk_size < wrap ? pos + chunk_size : 0;
+            }
+        });
+        double pipeline_mmap = RunThreads(thread_num, chunk_num, chunk_size, [&](int conn, const char* data) {
+            auto pipeline = MakeSinkPipeline(MmapSink<BufferMapper>(&mapper, states), CountSink(&counters));
+            file_size_t pos = 0;
+            for (long long k = 0; k < chunk_num; k++) {
+                SinkChunk chunk(conn, pos, data, chunk_size);
+                pipeline.Put(chunk);
+                pos = pos + chunk_size < wrap ? pos + chunk_size : 0;
+            }
+        });
+        printf("%-10zu %10d %11.2f ns %11.2f ns %11.2f ns %11.2f ns\n", chunk_size, thread_num, function_null,
+            pipeline_null, function_mmap, pipeline_mmap);
+        fflush(stdout);
+    }
+    FreeCacheAligned(states, thread_num);
+    return 0;
+}
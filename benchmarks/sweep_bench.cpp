@@ -0,0 +1,344 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-06 20:05:38
+ * @Description: 扫描连接数、映射块数和写盘方式的组合，运行下载程序下载本地服务的文件，
+ *               以JSON输出吞吐量、每GB的CPU时间和峰值内存，用于发现性能回退
+ */
+#include <getopt.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <sstream>
+#include "bench_runner.h"
+
+// 一组参数多次运行的汇总
+struct SweepResult {
+    SweepResult(): map_page_num(0), ok_num(0), seconds(0), p90_seconds(0), p99_seconds(0), cpu_seconds(0),
+        max_rss_kb(0) {}
+    string thread_num; // 连接数，可以是auto[:max]
+    int map_page_num; // 映射块数
+    string write_mode; // 写盘方式
+    int ok_num; // 成功且数据完整的次数
+    double seconds; // 成功运行耗时的中位数
+    double p90_seconds; // 成功运行耗时的90分位数
+    double p99_seconds; // 成功运行耗时的99分位数
+    double cpu_seconds; // 成功运行CPU时间的中位数
+    long max_rss_kb; // 所有运行中的最大峰值内存
+    vector<double> all_seconds; // 每次成功运行的耗时
+};
+
+/**
+ * @description: 按逗号拆分整数列表，忽略非正数
+ * @param {const string&} text 列表文本
+ * @return {vector<int>}
+ */
+static vector<int> ParseIntList(const string& text) {
+    vector<int> values;
+    stringstream items(text);
+    string item;
+    while (getline(items, item, ',')) {
+        int value = atoi(item.c_str());
+        if (value > 0) {
+            values.push_back(value);
+        }
+    }
+    return values;
+}
+
+/**
+ * @description: 按逗号拆分连接数列表，保留正整数和auto[:max]
+ * @param {const string&} text 列表文本
+ * @return {vector<string>}
+ */
+static vector<string> ParseThreadList(const string& text) {
+    vector<string> values;
+    stringstream items(text);
+    string item;
+    while (getline(items, item, ',')) {
+        if (atoi(item.c_str()) > 0 || item.compare(0, 4, "auto") == 0) {
+            values.push_back(item);
+        }
+    }
+    return values;
+}
+
+/**
+ * @description: 求中位数，会改变数组顺序
+ * @param {vector<double>&} values 数据
+ * @return {double} 数组为空时返回0
+ */
+static double Median(vector<double>& values) {
+    if (values.empty()) {
+        return 0;
+    }
+    sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+/**
+ * @description: 求分位数，取不小于该比例的最小一个值，会改变数组顺序
+ * @param {vector<double>&} values 数据
+ * @param {double} ratio 分位，0~1
+ * @return {double} 数组为空时返回0
+ */
+static double Percentile(vector<double>& values, double ratio) {
+    if (values.empty()) {
+        return 0;
+    }
+    sort(values.begin(), values.end());
+    size_t rank = (size_t)ceil(ratio * values.size());
+    return values[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * @description: 以JSON格式输出配置和所有结果
+ * @param {FILE*} out 输出文件
+ * @param {const RangeServerOptions&} options 本地服务配置
+ * @param {const string&} engine 下载引擎
+ * @param {const string&} extra 额外的下载程序参数
+ * @param {int} repeat 每组参数的运行次数
+ * @param {const vector<SweepResult>&} results 结果
+ */
+static void WriteJson(FILE* out, const RangeServerOptions& options, const string& engine, const string& extra,
+    int repeat, const vector<SweepResult>& results) {
+    double size_gb = (double)options.file_size / BYTE_MB / 1024;
+    fprintf(out, "{\n");
+    fprintf(out, "  \"file_size\": %llu,\n", options.file_size);
+    fprintf(out, "  \"engine\": \"%s\",\n", engine.c_str());
+    fprintf(out, "  \"repeat\": %d,\n", repeat);
+    fprintf(out, "  \"extra_args\": \"%s\",\n", extra.c_str());
+    fprintf(out, "  \"server\": {\"conn_rate\": %llu, \"rtt_ms\": %d, \"jitter_ms\": %d, \"error_rate\": %g, "
+        "\"reset_rate\": %g, \"stall_rate\": %g, \"max_client_conns\": %d, \"seed\": %u},\n", options.conn_rate,
+        options.rtt_ms, options.jitter_ms, options.error_rate, options.reset_rate, options.stall_rate,
+        options.max_client_conns, options.seed);
+    fprintf(out, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const SweepResult& result = results[i];
+        bool ok = result.ok_num > 0;
+        // 固定连接数输出为数字，自动模式输出为字符串
+        bool numeric = result.thread_num.find_first_not_of("0123456789") == string::npos;
+        const char* quote = numeric ? "" : "\"";
+        fprintf(out, "    {\"threads\": %s%s%s, \"map_pages\": %d, \"write_mode\": \"%s\", \"runs\": %d, "
+            "\"ok_runs\": %d, ", quote, result.thread_num.c_str(), quote, result.map_page_num,
+            result.write_mode.c_str(), repeat, result.ok_num);
+        if (ok) {
+            fprintf(out, "\"seconds\": %.4f, \"p90_seconds\": %.4f, \"p99_seconds\": %.4f, \"mb_per_s\": %.2f, "
+                "\"cpu_seconds_per_gb\": %.4f, ", result.seconds, result.p90_seconds, result.p99_seconds,
+                options.file_size / result.seconds / BYTE_MB, result.cpu_seconds / size_gb);
+        }
+        else {
+            fprintf(out, "\"seconds\": null, \"p90_seconds\": null, \"p99_seconds\": null, \"mb_per_s\": null, "
+                "\"cpu_seconds_per_gb\": null, ");
+        }
+        fprintf(out, "\"max_rss_mb\": %.1f, \"all_seconds\": [", result.max_rss_kb / 1024.0);
+        for (size_t j = 0; j < result.all_seconds.size(); j++) {
+            fprintf(out, "%s%.4f", j ? ", " : "", result.all_seconds[j]);
+        }
+        fprintf(out, "]}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[]) {
+    int ch;
+    file_size_t size_mb = 256;
+    file_size_t conn_rate_kb = 0;
+    string thread_list = "1,4,8,16,32,auto";
+    string page_list = "256,1024,4096";
+    string mode_list = "mmap,pwrite";
+    string engine = "multi";
+    string dir = "/tmp";
+    string output;
+    string extra;
+    int writer_num = 1;
+    int repeat = 3;
+    RangeServerOptions options;
+
+    while ((ch = getopt(argc, argv, "s:t:p:w:W:e:d:n:r:l:j:f:x:S:c:o:a:h")) != EOF) {
+        switch (ch) {
+        case 's':
+        {
+            size_mb = strtoull(optarg, nullptr, 10);
+            break;
+        }
+        case 't':
+        {
+            thread_list.assign(optarg);
+            break;
+        }
+        case 'p':
+        {
+            page_list.assign(optarg);
+            break;
+        }
+        case 'w':
+        {
+            mode_list.assign(optarg);
+            break;
+        }
+        case 'W':
+        {
+            writer_num = atoi(optarg);
+            break;
+        }
+        case 'e':
+        {
+            engine.assign(optarg);
+            break;
+        }
+        case 'd':
+        {
+            dir.assign(optarg);
+            break;
+        }
+        case 'n':
+        {
+            repeat = max(atoi(optarg), 1);
+            break;
+        }
+        case 'r':
+        {
+            conn_rate_kb = strtoull(optarg, nullptr, 10);
+            break;
+        }
+        case 'l':
+        {
+            options.rtt_ms = atoi(optarg);
+            break;
+        }
+        case 'j':
+        {
+            options.jitter_ms = atoi(optarg);
+            break;
+        }
+        case 'f':
+        {
+            options.error_rate = atof(optarg);
+            break;
+        }
+        case 'x':
+        {
+            options.reset_rate = atof(optarg);
+            break;
+        }
+        case 'S':
+        {
+            options.stall_rate = atof(optarg);
+            break;
+        }
+        case 'c':
+        {
+            options.max_client_conns = atoi(optarg);
+            break;
+        }
+        case 'o':
+        {
+            output.assign(optarg);
+            break;
+        }
+        case 'a':
+        {
+            extra.assign(optarg);
+            break;
+        }
+        default:
+        {
+            printf("Usage: %s [-s file size MB, default 256] "
+                "[-t connection nums or auto[:max], default 1,4,8,16,32,auto] "
+                "[-p map page nums, mmap mode only, default 256,1024,4096] [-w write modes, default mmap,pwrite] "
+                "[-W writer thread num, default 1] [-e engine, default multi] [-d target dir, default /tmp] "
+                "[-n runs per combination, default 3] [-r per-connection rate KB/s, default 0 = unlimited] "
+                "[-l rtt ms] [-j jitter ms] [-f 503 error rate 0~1] [-x mid-body reset rate 0~1] "
+                "[-S mid-body stall rate 0~1, the connection stays open without data] "
+                "[-c max connections per client] [-o json output file, default stdout] "
+                "[-a extra downloader arguments, space separated]\n", argv[0]);
+            return 0;
+        }
+        }
+    }
+
+    options.file_size = size_mb * BYTE_MB;
+    options.conn_rate = conn_rate_kb * 1024;
+    RangeServer server(options);
+    if (!server.Start()) {
+        return -1;
+    }
+
+    // 进度输出到标准错误，标准输出只包含JSON
+    vector<string> thread_nums = ParseThreadList(thread_list);
+    vector<int> page_nums = ParseIntList(page_list);
+    if (thread_nums.empty() || page_nums.empty()) {
+        fprintf(stderr, "empty connection or map page list\n");
+        return -1;
+    }
+    vector<SweepResult> results;
+    string path = dir + "/bench.bin";
+    stringstream modes(mode_list);
+    string mode;
+    while (getline(modes, mode, ',')) {
+        // 映射块数只影响mmap写盘
+        vector<int> mode_pages = mode == "mmap" ? page_nums : vector<int>(1, page_nums[0]);
+        for (auto& thread_num : thread_nums) {
+            for (int page_num : mode_pages) {
+                SweepResult result;
+                result.thread_num = thread_num;
+                result.map_page_num = page_num;
+                result.write_mode = mode;
+                vector<double> cpu_seconds;
+                for (int i = 0; i < repeat; i++) {
+                    unlink(path.c_str());
+                    vector<string> args = {DOWNLOADER_BIN, "-u", server.GetUrl(), "-d", dir,
+                        "-t", thread_num, "-p", to_string(page_num), "-e", engine,
+                        "-w", mode, "-W", to_string(writer_num)};
+                    stringstream extra_args(extra);
+                    string arg;
+                    while (extra_args >> arg) {
+                        args.push_back(arg);
+                    }
+                    ProcessResult run = RunDownloader(args);
+                    result.max_rss_kb = max(result.max_rss_kb, run.max_rss_kb);
+                    if (run.ok && CheckFile(server, path, options.file_size)) {
+                        result.ok_num++;
+                        result.all_seconds.push_back(run.seconds);
+                        cpu_seconds.push_back(run.cpu_seconds);
+                    }
+                }
+                unlink(path.c_str());
+                vector<double> seconds = result.all_seconds;
+                result.seconds = Median(seconds);
+                result.p90_seconds = Percentile(seconds, 0.9);
+                result.p99_seconds = Percentile(seconds, 0.99);
+                result.cpu_seconds = Median(cpu_seconds);
+                fprintf(stderr, "%-8s -t %-7s -p %-6d %8.1f MB/s  p50 %.3f s  p90 %.3f s  p99 %.3f s  %d/%d ok\n",
+                    mode.c_str(), thread_num.c_str(), page_num,
+                    result.ok_num ? options.file_size / result.seconds / BYTE_MB : 0.0, result.seconds,
+                    result.p90_seconds, result.p99_seconds, result.ok_num, repeat);
+                results.push_back(result);
+            }
+        }
+    }
+    server.Stop();
+    fprintf(stderr, "server injected %d failures\n", server.GetFailureNum());
+
+    FILE* out = output.empty() ? stdout : fopen(output.c_str(), "w");
+    if (!out) {
+        perror("open output failed:");
+        return -1;
+    }
+    WriteJson(out, options, engine, extra, repeat, results);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    // 有组合全部失败时返回非0，便于脚本发现回退
+    for (auto& result : results) {
+        if (result.ok_num == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
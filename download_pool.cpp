@@ -0,0 +1,489 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-13 10:05:52
+ * @Description: 下载任务池实现
+ */
+#include <algorithm>
+#include "download_pool.h"
+
+DownloadJob::DownloadJob(DownloadPool* pool, const DownloadRequest& request, JobDoneCallback done)
+    : m_pool(pool)
+    , m_request(request)
+    , m_done(done)
+    , m_state(JOB_PENDING)
+    , m_filesize(request.filesize)
+    , m_active_num(0)
+    , m_starting(false)
+    , m_failed(false)
+    , m_cancel(false)
+    , m_pause(false)
+    , m_future(m_result.get_future().share()) {
+
+}
+
+/**
+ * @description: 获取任务状态
+ * @return {JobState}
+ */
+JobState DownloadJob::GetState() {
+    return m_pool->GetJobState(this);
+}
+
+/**
+ * @description: 获取文件大小
+ * @return {file_size_t} 开始下载前为提交时的大小
+ */
+file_size_t DownloadJob::GetFileSize() {
+    lock_guard<mutex> guard(m_pool->m_lock);
+    return m_filesize;
+}
+
+/**
+ * @description: 取消任务，进行中的传输在下次收到数据时中断，任务在所有片段结束后变为取消状态
+ * @return {bool} 任务尚未结束返回true， 否则返回false
+ */
+bool DownloadJob::Cancel() {
+    return m_pool->CancelJob(this);
+}
+
+/**
+ * @description: 暂停任务，进行中的传输在下次收到数据时中断，连接转去下载其他任务
+ * @return {bool} 任务尚未结束返回true， 否则返回false
+ */
+bool DownloadJob::Pause() {
+    return m_pool->PauseJob(this, true);
+}
+
+/**
+ * @description: 恢复暂停的任务
+ * @return {bool} 任务尚未结束返回true， 否则返回false
+ */
+bool DownloadJob::Resume() {
+    return m_pool->PauseJob(this, false);
+}
+
+DownloadPool::DownloadPool(int worker_num, int host_conn_num)
+    : m_worker_num(worker_num > 0 ? worker_num : 1)
+    , m_host_conn_num(host_conn_num > 0 ? host_conn_num : m_worker_num)
+    , m_type(HTTP)
+    , m_map_page_num(MAP_PAGE_NUM)
+    , m_write_mode(WRITE_MMAP)
+    , m_writer_num(1)
+    , m_limit(nullptr)
+    , m_budget(nullptr)
+    , m_http2_conns(0)
+    , m_stall_timeout(STALL_TIMEOUT_DEFAULT)
+    , m_starting_num(0)
+    , m_exit(false) {
+    for (int i = 0; i < m_worker_num; i++) {
+        m_workers.emplace_back(&DownloadPool::WorkerLoop, this, i);
+    }
+}
+
+/**
+ * @description: 取消所有未结束的任务并等待工作线程退出
+ */
+DownloadPool::~DownloadPool() {
+    list<JobHandle> pending;
+    {
+        lock_guard<mutex> guard(m_lock);
+        m_exit = true;
+        pending.swap(m_pending);
+        for (auto& job : pending) {
+            job->m_cancel = true;
+        }
+        for (auto& job : m_active) {
+            job->m_cancel = true;
+            if (job->m_manager) {
+                job->m_manager->Stop();
+            }
+        }
+        m_cond.notify_all();
+    }
+    for (auto& job : pending) {
+        FinishJob(job);
+    }
+    for (auto& worker : m_workers) {
+        worker.join();
+    }
+}
+
+/**
+ * @description: 设置之后开始的任务的下载器类型、映射页数和写盘方式
+ * @param {DownloaderType} type 下载器类型，异步下载器的每个任务另有自己的IO线程
+ * @param {int} map_page_num 映射页数
+ * @param {WriteMode} mode 写盘方式
+ * @param {int} writer_num 写线程数
+ */
+void DownloadPool::SetFileOptions(DownloaderType type, int map_page_num, WriteMode mode, int writer_num) {
+    lock_guard<mutex> guard(m_lock);
+    m_type = type;
+    m_map_page_num = map_page_num;
+    m_write_mode = mode;
+    m_writer_num = writer_num;
+}
+
+/**
+ * @description: 设置之后开始的任务共用的带宽限制，需在任务池析构前保持有效
+ * @param {BandwidthLimit*} limit 带宽限制，为nullptr时不限制
+ */
+void DownloadPool::SetBandwidthLimit(BandwidthLimit* limit) {
+    lock_guard<mutex> guard(m_lock);
+    m_limit = limit;
+}
+
+/**
+ * @description: 设置之后开始的任务共用的内存预算，需在任务池析构前保持有效
+ * @param {MemoryBudget*} budget 内存预算，为nullptr时不限制
+ */
+void DownloadPool::SetMemoryBudget(MemoryBudget* budget) {
+    lock_guard<mutex> guard(m_lock);
+    m_budget = budget;
+}
+
+/**
+ * @description: 设置之后开始的任务使用HTTP/2，异步下载器的片段作为流复用每个任务的少量连接
+ * @param {int} max_conns 每个任务每个下载源的最大连接数，0为使用HTTP/1.1
+ */
+void DownloadPool::SetHttp2(int max_conns) {
+    lock_guard<mutex> guard(m_lock);
+    m_http2_conns = max_conns;
+}
+
+/**
+ * @description: 设置之后开始的任务的传输停滞超时
+ * @param {int} seconds 秒，0为不检测
+ */
+void DownloadPool::SetStallTimeout(int seconds) {
+    lock_guard<mutex> guard(m_lock);
+    m_stall_timeout = seconds;
+}
+
+/**
+ * @description: 将工作线程依次轮流绑定到指定的CPU
+ * @param {const vector<int>&} cpus CPU序号，可由WorkerPool::ParseAffinity解析得到
+ */
+void DownloadPool::SetCpuAffinity(const vector<int>& cpus) {
+    for (size_t i = 0; i < m_workers.size() && !cpus.empty(); i++) {
+        WorkerPool::PinThread(m_workers[i].native_handle(), cpus[i % cpus.size()]);
+    }
+}
+
+/**
+ * @description: 提交下载任务，立即返回，任务按提交顺序开始
+ * @param {const DownloadRequest&} request 下载请求
+ * @param {JobDoneCallback} done 任务结束的回调函数，可为空
+ * @return {JobHandle} 任务句柄
+ */
+JobHandle DownloadPool::Submit(const DownloadRequest& request, JobDoneCallback done) {
+    JobHandle job(new DownloadJob(this, request, done));
+    job->m_host = GetHost(request.url);
+    lock_guard<mutex> guard(m_lock);
+    m_pending.push_back(job);
+    m_cond.notify_all();
+    return job;
+}
+
+/**
+ * @description: 工作线程主体，循环收尾结束的任务、领取片段或开始新任务，直到任务池析构
+ * @param {int} worker_id 线程序号，也是在各任务管理器中使用的线程序号
+ */
+void DownloadPool::WorkerLoop(int worker_id) {
+    unique_lock<mutex> guard(m_lock);
+    while (true) {
+        // 片段全部结束的任务优先收尾，尽快释放文件和映射内存
+        JobHandle job = PickFinished();
+        if (job) {
+            guard.unlock();
+            FinishJob(job);
+            guard.lock();
+            continue;
+        }
+
+        // 先领取已开始任务的空闲区间，再开始新任务，最后才分走其他线程的区间，使小文件各由一个线程下载
+        Segment seg;
+        if (!PickSegment(worker_id, false, job, seg)) {
+            job = PickPending();
+            if (job) {
+                job->m_starting = true;
+                m_starting_num++;
+                m_host_conns[job->m_host]++;
+                guard.unlock();
+                unique_ptr<DownloadManager> manager;
+                bool ok = StartJob(job.get(), manager);
+                guard.lock();
+                m_starting_num--;
+                m_host_conns[job->m_host]--;
+                job->m_starting = false;
+                job->m_failed = !ok;
+                if (ok) {
+                    // 探测期间的取消和暂停在管理器创建后生效
+                    job->m_filesize = manager->GetFileSize();
+                    job->m_manager = move(manager);
+                    job->m_manager->SetPaused(job->m_pause);
+                    if (job->m_cancel) {
+                        job->m_manager->Stop();
+                    }
+                }
+                // 启动失败或续传时已全部完成的任务由PickFinished取出收尾
+                m_active.push_back(job);
+                m_cond.notify_all();
+                continue;
+            }
+            if (!PickSegment(worker_id, true, job, seg)) {
+                if (m_exit && m_pending.empty() && m_active.empty() && m_starting_num == 0) {
+                    break;
+                }
+                m_cond.wait(guard);
+                continue;
+            }
+        }
+
+        guard.unlock();
+        bool ok = job->m_manager->DownloadSegment(worker_id, seg);
+        guard.lock();
+        job->m_active_num--;
+        m_host_conns[job->m_host]--;
+        // 取消时被中断的片段也返回失败，不计为任务失败
+        if (!ok && !job->m_cancel) {
+            job->m_failed = true;
+        }
+        m_cond.notify_all();
+    }
+    m_cond.notify_all();
+}
+
+/**
+ * @description: 从已开始的任务中领取片段，调用前需持有m_lock
+ * @param {int} worker_id 线程序号
+ * @param {bool} steal 是否分走其他线程的区间
+ * @param {JobHandle&} job 片段所属任务
+ * @param {Segment&} seg 领取到的片段
+ * @return {bool} 成功返回true， 否则返回false
+ */
+bool DownloadPool::PickSegment(int worker_id, bool steal, JobHandle& job, Segment& seg) {
+    for (auto& one_job : m_active) {
+        if (one_job->m_failed || one_job->m_cancel || one_job->m_pause
+            || m_host_conns[one_job->m_host] >= m_host_conn_num) {
+            continue;
+        }
+        if (one_job->m_manager->AcquireSegment(worker_id, seg, steal)) {
+            job = one_job;
+            job->m_active_num++;
+            m_host_conns[job->m_host]++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @description: 取出一个未暂停且主机连接数未满的未开始任务，调用前需持有m_lock
+ * @return {JobHandle} 没有时返回nullptr
+ */
+JobHandle DownloadPool::PickPending() {
+    for (auto it = m_pending.begin(); it != m_pending.end(); ++it) {
+        if (!(*it)->m_pause && m_host_conns[(*it)->m_host] < m_host_conn_num) {
+            JobHandle job = *it;
+            m_pending.erase(it);
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * @description: 取出一个没有进行中的片段且已完成、失败或被取消的任务，调用前需持有m_lock
+ * @return {JobHandle} 没有时返回nullptr
+ */
+JobHandle DownloadPool::PickFinished() {
+    for (auto it = m_active.begin(); it != m_active.end(); ++it) {
+        DownloadJob* job = it->get();
+        if (job->m_active_num == 0 && (job->m_failed || job->m_cancel || job->m_manager->IsFinished())) {
+            JobHandle finished = *it;
+            m_active.erase(it);
+            return finished;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * @description: 创建管理器，探测文件信息、创建文件并初始化调度器
+ * @param {DownloadJob*} job 任务
+ * @param {unique_ptr<DownloadManager>&} manager 创建的管理器
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadPool::StartJob(DownloadJob* job, unique_ptr<DownloadManager>& manager) {
+    // 请求和选项在提交后不变，选项的读取需加锁
+    const DownloadRequest& request = job->m_request;
+    DownloaderType type;
+    int map_page_num;
+    WriteMode write_mode;
+    int writer_num;
+    BandwidthLimit* limit;
+    MemoryBudget* budget;
+    int http2_conns;
+    int stall_timeout;
+    {
+        lock_guard<mutex> guard(m_lock);
+        type = m_type;
+        map_page_num = m_map_page_num;
+        write_mode = m_write_mode;
+        writer_num = m_writer_num;
+        limit = m_limit;
+        budget = m_budget;
+        http2_conns = m_http2_conns;
+        stall_timeout = m_stall_timeout;
+    }
+
+    // 每个任务的管理器按全局线程数分配，任一工作线程都能下载任一任务
+    manager.reset(new DownloadManager(m_worker_num, map_page_num));
+    manager->SetWriteMode(write_mode, writer_num);
+    manager->SetBandwidthLimit(limit);
+    manager->SetMemoryBudget(budget);
+    if (!request.filename.empty()) {
+        manager->SetFileName(request.filename);
+    }
+    if (!request.checksum.empty() && !manager->SetChecksum(request.checksum)) {
+        manager.reset();
+        return false;
+    }
+    DownloadInfo info(type, request.url, request.filesize);
+    info.mirrors = request.mirrors;
+    info.http2_conns = http2_conns;
+    info.stall_timeout = stall_timeout;
+    if (!manager->Init(info, request.save_path)) {
+        manager.reset();
+        return false;
+    }
+    manager->Prepare();
+    return true;
+}
+
+/**
+ * @description: 任务所有片段结束后刷新、校验，设置结果并执行完成回调，调用前需已从任务列表移除
+ * @param {const JobHandle&} job 任务
+ */
+void DownloadPool::FinishJob(const JobHandle& job) {
+    // 已移出任务列表，其他线程只会在持锁时访问管理器
+    unique_ptr<DownloadManager> manager;
+    bool interrupted;
+    {
+        lock_guard<mutex> guard(m_lock);
+        manager = move(job->m_manager);
+        interrupted = job->m_failed || job->m_cancel;
+    }
+    bool ok = false;
+    file_size_t filesize = 0;
+    if (manager) {
+        ok = manager->Complete(!interrupted) && !interrupted;
+        // 大小未知的文件在收尾时才确定大小
+        filesize = manager->GetFileSize();
+    }
+    manager.reset();
+
+    JobState state = ok ? JOB_DONE : JOB_FAILED;
+    {
+        lock_guard<mutex> guard(m_lock);
+        if (filesize > 0) {
+            job->m_filesize = filesize;
+        }
+        if (!ok && job->m_cancel && !job->m_failed) {
+            state = JOB_CANCELED;
+        }
+        job->m_state = state;
+    }
+    if (job->m_done) {
+        job->m_done(state);
+    }
+    job->m_result.set_value(ok);
+}
+
+/**
+ * @description: 请求取消任务，未开始的任务直接结束
+ * @param {DownloadJob*} job 任务
+ * @return {bool} 任务尚未结束返回true， 否则返回false
+ */
+bool DownloadPool::CancelJob(DownloadJob* job) {
+    JobHandle pending;
+    {
+        lock_guard<mutex> guard(m_lock);
+        if (job->m_state != JOB_PENDING) {
+            return false;
+        }
+        if (job->m_cancel) {
+            return true;
+        }
+        job->m_cancel = true;
+        for (auto it = m_pending.begin(); it != m_pending.end(); ++it) {
+            if (it->get() == job) {
+                pending = *it;
+                m_pending.erase(it);
+                break;
+            }
+        }
+        if (job->m_manager) {
+            job->m_manager->Stop();
+        }
+        m_cond.notify_all();
+    }
+    if (pending) {
+        FinishJob(pending);
+    }
+    return true;
+}
+
+/**
+ * @description: 暂停或恢复任务
+ * @param {DownloadJob*} job 任务
+ * @param {bool} pause 是否暂停
+ * @return {bool} 任务尚未结束返回true， 否则返回false
+ */
+bool DownloadPool::PauseJob(DownloadJob* job, bool pause) {
+    lock_guard<mutex> guard(m_lock);
+    if (job->m_state != JOB_PENDING) {
+        return false;
+    }
+    job->m_pause = pause;
+    if (job->m_manager) {
+        job->m_manager->SetPaused(pause);
+    }
+    m_cond.notify_all();
+    return true;
+}
+
+/**
+ * @description: 获取任务状态
+ * @param {DownloadJob*} job 任务
+ * @return {JobState}
+ */
+JobState DownloadPool::GetJobState(DownloadJob* job) {
+    lock_guard<mutex> guard(m_lock);
+    // 结束前的状态由请求和进度推算，m_state只记录结束后的状态，已请求取消的任务在片段结束前仍为下载中
+    if (job->m_state != JOB_PENDING) {
+        return job->m_state;
+    }
+    if (job->m_cancel) {
+        return JOB_RUNNING;
+    }
+    if (job->m_pause) {
+        return JOB_PAUSED;
+    }
+    return job->m_manager || job->m_starting ? JOB_RUNNING : JOB_PENDING;
+}
+
+/**
+ * @description: 从url中取出主机部分
+ * @param {const string&} url 下载链接
+ * @return {string}
+ */
+string DownloadPool::GetHost(const string& url) {
+    size_t scheme = url.find("://");
+    size_t start = scheme == string::npos ? 0 : scheme + 3;
+    size_t end = url.find('/', start);
+    string host = url.substr(start, end == string::npos ? string::npos : end - start);
+    transform(host.begin(), host.end(), host.begin(), ::tolower);
+    return host;
+}
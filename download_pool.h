@@ -0,0 +1,279 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-13 09:47:18
+ * @Description: 下载任务池，供嵌入使用的异步接口，所有任务共用一组工作线程（连接）并限制每个主机的连接数，
+ *               提交任务返回句柄，可等待结果、取消、暂停和恢复
+ */
+#ifndef _DOWNLOAD_POOL_H_
+#define _DOWNLOAD_POOL_H_
+#include <map>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <future>
+#include <functional>
+#include <condition_variable>
+#include "multithread_downloader.h"
+using namespace std;
+
+// 任务状态
+enum JobState {
+    JOB_PENDING, // 等待开始
+    JOB_RUNNING, // 正在下载
+    JOB_PAUSED, // 已暂停，恢复后继续下载
+    JOB_DONE, // 下载成功
+    JOB_FAILED, // 下载失败，已下载的区间记入续传日志
+    JOB_CANCELED // 已取消，已下载的区间记入续传日志
+};
+
+// 一个文件的下载请求
+struct DownloadRequest {
+    DownloadRequest(): filesize(0) {}
+    string url; // 下载链接
+    string save_path; // 保存目录
+    string filename; // 保存的文件名，为空时取url的最后一段
+    file_size_t filesize; // 已知的文件大小，未知为0
+    string checksum; // 校验值，格式同--checksum，可为空
+    vector<string> mirrors; // 同一文件的镜像链接
+};
+
+// 任务结束的回调函数，在工作线程中执行，参数为结束时的状态
+typedef function<void(JobState state)> JobDoneCallback;
+
+class DownloadPool;
+
+// 任务句柄，控制接口需在任务池析构前调用
+class DownloadJob {
+public:
+    /**
+     * @description: 获取任务状态
+     * @return {JobState}
+     */
+    JobState GetState();
+
+    /**
+     * @description: 获取文件大小
+     * @return {file_size_t} 开始下载前为提交时的大小，大小未知的文件在结束后才确定
+     */
+    file_size_t GetFileSize();
+
+    /**
+     * @description: 获取任务结果，任务结束且完成回调返回后就绪
+     * @return {shared_future<bool>} 下载成功为true
+     */
+    shared_future<bool> GetFuture() { return m_future; }
+
+    /**
+     * @description: 阻塞等待任务结束
+     * @return {bool} 下载成功返回true， 失败或取消返回false
+     */
+    bool Wait() { return m_future.get(); }
+
+    /**
+     * @description: 取消任务，进行中的传输在下次收到数据时中断，任务在所有片段结束后变为取消状态
+     * @return {bool} 任务尚未结束返回true， 否则返回false
+     */
+    bool Cancel();
+
+    /**
+     * @description: 暂停任务，进行中的传输在下次收到数据时中断，连接转去下载其他任务
+     * @return {bool} 任务尚未结束返回true， 否则返回false
+     */
+    bool Pause();
+
+    /**
+     * @description: 恢复暂停的任务
+     * @return {bool} 任务尚未结束返回true， 否则返回false
+     */
+    bool Resume();
+
+    /**
+     * @description: 获取下载请求
+     * @return {const DownloadRequest&}
+     */
+    const DownloadRequest& GetRequest() const { return m_request; }
+
+private:
+    friend class DownloadPool;
+
+    DownloadJob(DownloadPool* pool, const DownloadRequest& request, JobDoneCallback done);
+
+    DownloadPool* m_pool; // 所属任务池
+    DownloadRequest m_request; // 下载请求
+    JobDoneCallback m_done; // 完成回调，可为空
+    string m_host; // 主机，用于限制连接数
+    // 以下成员由任务池的锁保护
+    unique_ptr<DownloadManager> m_manager; // 文件下载管理器，开始下载时创建，结束时释放
+    JobState m_state; // 结束后的状态，未结束时为JOB_PENDING
+    file_size_t m_filesize; // 文件大小
+    int m_active_num; // 正在下载的片段数
+    bool m_starting; // 是否正在探测文件信息
+    bool m_failed; // 是否有片段失败
+    bool m_cancel; // 是否请求取消
+    bool m_pause; // 是否请求暂停
+    promise<bool> m_result; // 任务结果
+    shared_future<bool> m_future; // 任务结果，可多次获取
+};
+
+typedef shared_ptr<DownloadJob> JobHandle;
+
+class DownloadPool {
+public:
+    /**
+     * @param {int} worker_num 工作线程数，即所有任务共用的连接数
+     * @param {int} host_conn_num 每个主机的最大连接数，不大于0时为工作线程数
+     */
+    DownloadPool(int worker_num, int host_conn_num = 0);
+
+    /**
+     * @description: 取消所有未结束的任务并等待工作线程退出
+     */
+    ~DownloadPool();
+
+    /**
+     * @description: 设置之后开始的任务的下载器类型、映射页数和写盘方式
+     * @param {DownloaderType} type 下载器类型，异步下载器的每个任务另有自己的IO线程
+     * @param {int} map_page_num 映射页数
+     * @param {WriteMode} mode 写盘方式
+     * @param {int} writer_num 写线程数
+     */
+    void SetFileOptions(DownloaderType type, int map_page_num, WriteMode mode, int writer_num);
+
+    /**
+     * @description: 设置之后开始的任务共用的带宽限制，需在任务池析构前保持有效
+     * @param {BandwidthLimit*} limit 带宽限制，为nullptr时不限制
+     */
+    void SetBandwidthLimit(BandwidthLimit* limit);
+
+    /**
+     * @description: 设置之后开始的任务共用的内存预算，需在任务池析构前保持有效
+     * @param {MemoryBudget*} budget 内存预算，为nullptr时不限制
+     */
+    void SetMemoryBudget(MemoryBudget* budget);
+
+    /**
+     * @description: 设置之后开始的任务使用HTTP/2，异步下载器的片段作为流复用每个任务的少量连接
+     * @param {int} max_conns 每个任务每个下载源的最大连接数，0为使用HTTP/1.1
+     */
+    void SetHttp2(int max_conns);
+
+    /**
+     * @description: 设置之后开始的任务的传输停滞超时
+     * @param {int} seconds 秒，0为不检测
+     */
+    void SetStallTimeout(int seconds);
+
+    /**
+     * @description: 将工作线程依次轮流绑定到指定的CPU
+     * @param {const vector<int>&} cpus CPU序号，可由WorkerPool::ParseAffinity解析得到
+     */
+    void SetCpuAffinity(const vector<int>& cpus);
+
+    /**
+     * @description: 提交下载任务，立即返回，任务按提交顺序开始
+     * @param {const DownloadRequest&} request 下载请求
+     * @param {JobDoneCallback} done 任务结束的回调函数，可为空
+     * @return {JobHandle} 任务句柄
+     */
+    JobHandle Submit(const DownloadRequest& request, JobDoneCallback done = nullptr);
+
+private:
+    friend class DownloadJob;
+
+    /**
+     * @description: 工作线程主体，循环收尾结束的任务、领取片段或开始新任务，直到任务池析构
+     * @param {int} worker_id 线程序号，也是在各任务管理器中使用的线程序号
+     */
+    void WorkerLoop(int worker_id);
+
+    /**
+     * @description: 从已开始的任务中领取片段，调用前需持有m_lock
+     * @param {int} worker_id 线程序号
+     * @param {bool} steal 是否分走其他线程的区间
+     * @param {JobHandle&} job 片段所属任务
+     * @param {Segment&} seg 领取到的片段
+     * @return {bool} 成功返回true， 否则返回false
+     */
+    bool PickSegment(int worker_id, bool steal, JobHandle& job, Segment& seg);
+
+    /**
+     * @description: 取出一个未暂停且主机连接数未满的未开始任务，调用前需持有m_lock
+     * @return {JobHandle} 没有时返回nullptr
+     */
+    JobHandle PickPending();
+
+    /**
+     * @description: 取出一个没有进行中的片段且已完成、失败或被取消的任务，调用前需持有m_lock
+     * @return {JobHandle} 没有时返回nullptr
+     */
+    JobHandle PickFinished();
+
+    /**
+     * @description: 创建管理器，探测文件信息、创建文件并初始化调度器
+     * @param {DownloadJob*} job 任务
+     * @param {unique_ptr<DownloadManager>&} manager 创建的管理器
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool StartJob(DownloadJob* job, unique_ptr<DownloadManager>& manager);
+
+    /**
+     * @description: 任务所有片段结束后刷新、校验，设置结果并执行完成回调，调用前需已从任务列表移除
+     * @param {const JobHandle&} job 任务
+     */
+    void FinishJob(const JobHandle& job);
+
+    /**
+     * @description: 请求取消任务，未开始的任务直接结束
+     * @param {DownloadJob*} job 任务
+     * @return {bool} 任务尚未结束返回true， 否则返回false
+     */
+    bool CancelJob(DownloadJob* job);
+
+    /**
+     * @description: 暂停或恢复任务
+     * @param {DownloadJob*} job 任务
+     * @param {bool} pause 是否暂停
+     * @return {bool} 任务尚未结束返回true， 否则返回false
+     */
+    bool PauseJob(DownloadJob* job, bool pause);
+
+    /**
+     * @description: 获取任务状态
+     * @param {DownloadJob*} job 任务
+     * @return {JobState}
+     */
+    JobState GetJobState(DownloadJob* job);
+
+    /**
+     * @description: 从url中取出主机部分
+     * @param {const string&} url 下载链接
+     * @return {string}
+     */
+    static string GetHost(const string& url);
+
+    int m_worker_num; // 工作线程数
+    int m_host_conn_num; // 每个主机的最大连接数
+    vector<thread> m_workers; // 工作线程
+
+    mutex m_lock; // 保护以下成员和各任务的状态
+    condition_variable m_cond; // 有任务提交、片段结束或任务状态变化时唤醒空闲线程
+    DownloaderType m_type; // 下载器类型
+    int m_map_page_num; // 映射页数
+    WriteMode m_write_mode; // 写盘方式
+    int m_writer_num; // 写线程数
+    BandwidthLimit* m_limit; // 所有任务共用的带宽限制
+    MemoryBudget* m_budget; // 所有任务共用的内存预算
+    int m_http2_conns; // 使用HTTP/2时的最大连接数，0为使用HTTP/1.1
+    int m_stall_timeout; // 传输停滞的超时，秒，0为不检测
+    list<JobHandle> m_pending; // 未开始的任务
+    list<JobHandle> m_active; // 已开始且未结束的任务
+    int m_starting_num; // 正在探测文件信息的任务数
+    map<string, int> m_host_conns; // 各主机正在使用的连接数
+    bool m_exit; // 任务池是否正在析构
+};
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-08 14:12:50
+ * @Description: curl句柄池，所有句柄通过curl_share共享DNS缓存、TLS会话和连接缓存，HTTP/2句柄不共享连接缓存
+ */
+#ifndef _CURL_HANDLE_POOL_H_
+#define _CURL_HANDLE_POOL_H_
+
+#include <mutex>
+#include <vector>
+#include <curl/curl.h>
+using namespace std;
+
+#define POOL_MAX_IDLE_HANDLES   256 // 最多保留的空闲句柄数
+#define POOL_MAX_CONNECTS       1024 // 共享连接缓存的最大连接数
+
+class CurlHandlePool {
+public:
+    /**
+     * @description: 获取进程内唯一的句柄池，使后续的片段和下载都能复用已建立的连接
+     * @return {CurlHandlePool&}
+     */
+    static CurlHandlePool& Instance();
+
+    /**
+     * @description: 取出一个已关联共享缓存的句柄，没有空闲句柄时新建
+     * @param {bool} share_conn 是否共享连接缓存，HTTP/2连接只能在建立它的multi句柄内复用，不能共享
+     * @return {CURL*} 成功返回句柄， 失败返回nullptr
+     */
+    CURL* Acquire(bool share_conn = true);
+
+    /**
+     * @description: 归还句柄，重置选项后留待复用，连接仍保留在共享缓存中
+     * @param {CURL*} handle 句柄
+     */
+    void Release(CURL* handle);
+
+    ~CurlHandlePool();
+
+private:
+    CurlHandlePool();
+    CurlHandlePool(const CurlHandlePool&) = delete;
+    CurlHandlePool& operator=(const CurlHandlePool&) = delete;
+
+    /**
+     * @description: 共享数据加锁回调
+     */
+    static void LockCallback(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr);
+
+    /**
+     * @description: 共享数据解锁回调
+     */
+    static void UnlockCallback(CURL* handle, curl_lock_data data, void* userptr);
+
+    CURLSH* m_share; // 共享的DNS、TLS会话和连接缓存
+    CURLSH* m_stream_share; // HTTP/2句柄共享的DNS和TLS会话，连接缓存属于各multi句柄
+    mutex m_share_locks[CURL_LOCK_DATA_LAST]; // 各类共享数据的锁
+    mutex m_idle_lock; // 保护m_idle
+    vector<CURL*> m_idle; // 空闲句柄
+};
+
+#endif
@@ -5,25 +5,56 @@
  * @Description: file content
  */
 #ifndef _DOWNLOADERS_H_
+#define _DOWNLOADERS_H_
 #include <string>
+#include <vector>
 #include <functional>
 using namespace std;
 
 #define file_size_t unsigned long long
+#define RANGE_END_UNKNOWN   ((file_size_t)-1) // 文件大小未知时下载的结束字节，一直接收到响应结束
+#define STALL_TIMEOUT_DEFAULT   30 // 连接持续收不到数据的默认超时，秒，超时后传输失败并由管理器重试
+#define TRANSFER_CHECK_MS       100 // 连接收不到数据时检查传输是否应继续的间隔，毫秒
 
+// 接收数据的回调函数，返回false时中断传输；连接收不到数据时下载器定期传入0字节，只检查传输是否应继续
 typedef function<bool(const char*, size_t)> DataDealCallback;
+typedef function<void(bool)> DownloadDoneCallback;
+// 把长期运行的任务交给外部的空闲线程执行，没有空闲线程时不接受并返回false
+typedef function<bool(function<void()>)> TaskRunner;
+// 零拷贝接收时向管理器申请目标内存，传入希望接收的字节数，返回可写内存并把大小改为实际可写的字节数，返回nullptr时中断传输
+typedef function<char*(size_t& size)> BufferAcquireCallback;
+// 零拷贝接收时提交已收到申请的内存中的数据，返回false时中断传输，同样会以0字节检查传输是否应继续
+typedef function<bool(const char* data, size_t size)> BufferCommitCallback;
 
 // 下载器类型
 enum DownloaderType {
-    HTTP
+    HTTP, // 每个片段一个线程阻塞下载
+    HTTP_MULTI, // 基于curl_multi的事件驱动下载，少量IO线程驱动所有连接
+    HTTP_NATIVE // 每个片段一个线程，http链接用自带的HTTP/1.1客户端直接收到目标内存，其他链接同HTTP
+};
+
+
+// 一次传输各阶段的耗时，微秒，复用连接时DNS、建连和TLS耗时为0
+struct TransferTiming {
+    TransferTiming(): dns_us(0), connect_us(0), tls_us(0), ttfb_us(0), total_us(0) {}
+    long long dns_us; // DNS解析
+    long long connect_us; // TCP建连
+    long long tls_us; // TLS握手
+    long long ttfb_us; // 发出请求到收到第一个字节
+    long long total_us; // 传输总耗时
 };
 
 
 // 下载相关信息
 struct DownloadInfo {
-    DownloadInfo(DownloaderType type, string url): type(type), url(url) {}
+    DownloadInfo(DownloaderType type, string url, file_size_t filesize = 0)
+        : type(type), url(url), filesize(filesize), http2_conns(0), stall_timeout(STALL_TIMEOUT_DEFAULT) {}
     DownloaderType type; // 使用的下载器类型
     string url; // 文件下载链接
+    file_size_t filesize; // 已知的文件大小，为0时由下载器探测
+    int http2_conns; // 使用HTTP/2时每个下载源的最大连接数，片段作为流复用这些连接，0为使用HTTP/1.1
+    int stall_timeout; // 传输持续收不到数据的超时，秒，0为不检测
+    vector<string> mirrors; // 同一文件的其他下载链接，片段按各链接的实测速度分配
 };
 
 
@@ -45,10 +76,18 @@ public:
      */
     virtual bool Init(const string& url) = 0;
 
+    /**
+     * @description: 使用已知的文件大小初始化下载器，不向服务器探测，视为不支持断点续传
+     * @param {const string&} url 下载的url
+     * @param {file_size_t} filesize 文件大小
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    virtual bool InitKnownSize(const string& url, file_size_t filesize) { return Init(url); }
+
     /**
      * @description: 下载文件
      * @param {const file_size_t} start_pos 下载起始字节
-     * @param {const file_size_t end_pos 下载结束字节
+     * @param {const file_size_t} end_pos 下载结束字节，为RANGE_END_UNKNOWN时下载到响应结束
      * @param {DataDealCallback} call 管理器提供的回调函数
      * @return {bool} 成功返回true， 失败返回false
      */
@@ -60,6 +99,102 @@ public:
      */
     virtual file_size_t GetFileSize() = 0;
 
+    /**
+     * @description: 判断文件大小是否已知，服务器未给出长度（如分块传输）时只能流式下载
+     * @return {bool}
+     */
+    virtual bool IsSizeKnown() { return true; }
+
+    /**
+     * @description: 获取服务器返回的ETag，用于校验续传的文件是否变化
+     * @return {string} 服务器未返回时为空
+     */
+    virtual string GetETag() { return ""; }
+
+    /**
+     * @description: 获取服务器返回的Last-Modified，用于校验续传的文件是否变化
+     * @return {string} 服务器未返回时为空
+     */
+    virtual string GetLastModified() { return ""; }
+
+    /**
+     * @description: 获取连接复用情况的统计报告
+     * @return {string} 无统计时为空
+     */
+    virtual string GetConnectionReport() { return ""; }
+
+    /**
+     * @description: 获取服务器以限流状态（429/503）拒绝的请求数，用于调整连接数
+     * @return {int} 累计次数
+     */
+    virtual int GetThrottledNum() { return 0; }
+
+    /**
+     * @description: 设置之后开始的每个传输的最大接收速率
+     * @param {file_size_t} rate 字节/秒，0为不限制
+     */
+    virtual void SetConnectionRate(file_size_t rate) {}
+
+    /**
+     * @description: 设置使用HTTP/2，需在初始化前调用，并发的片段作为流复用少量连接
+     * @param {int} max_conns 每个下载源的最大连接数，0为使用HTTP/1.1
+     */
+    virtual void SetHttp2(int max_conns) {}
+
+    /**
+     * @description: 设置传输停滞的超时，需在初始化前调用，连接未断开但持续收不到数据时传输失败
+     * @param {int} seconds 秒，0为不检测
+     */
+    virtual void SetStallTimeout(int seconds) {}
+
+    /**
+     * @description: 设置运行事件循环的外部线程，需在初始化前调用，只有异步下载器使用
+     * @param {TaskRunner} runner 执行长期任务的函数
+     * @param {int} thread_num 外部线程数，即最多的事件循环数
+     */
+    virtual void SetTaskRunner(TaskRunner runner, int thread_num) {}
+
+    /**
+     * @description: 获取当前线程上最近结束的传输的耗时，需在Download返回后或异步下载的完成回调中调用
+     * @param {TransferTiming&} timing 传输耗时
+     * @return {bool} 有记录返回true
+     */
+    virtual bool GetLastTiming(TransferTiming& timing) { return false; }
+
+    /**
+     * @description: 判断下载器是否支持异步下载
+     * @return {bool}
+     */
+    virtual bool IsAsyncSupported() { return false; }
+
+    /**
+     * @description: 异步下载文件，数据回调和完成回调均在下载器的IO线程中执行
+     * @param {const file_size_t} start_pos 下载起始字节
+     * @param {const file_size_t} end_pos 下载结束字节
+     * @param {DataDealCallback} call 管理器提供的回调函数
+     * @param {DownloadDoneCallback} done 下载结束的回调函数，参数为是否成功
+     * @return {bool} 提交成功返回true， 失败返回false
+     */
+    virtual bool DownloadAsync(const file_size_t start_pos, const file_size_t end_pos, DataDealCallback call,
+        DownloadDoneCallback done) { return false; }
+
+    /**
+     * @description: 判断下载器是否支持零拷贝接收
+     * @return {bool}
+     */
+    virtual bool IsZeroCopySupported() { return false; }
+
+    /**
+     * @description: 零拷贝下载文件，数据直接接收到管理器提供的内存中
+     * @param {const file_size_t} start_pos 下载起始字节
+     * @param {const file_size_t} end_pos 下载结束字节
+     * @param {BufferAcquireCallback} acquire 申请目标内存的回调函数
+     * @param {BufferCommitCallback} commit 提交已接收数据的回调函数
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    virtual bool DownloadInto(const file_size_t start_pos, const file_size_t end_pos, BufferAcquireCallback acquire,
+        BufferCommitCallback commit) { return false; }
+
     virtual ~Downloader() {};
 };
 
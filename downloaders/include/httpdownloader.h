@@ -4,10 +4,27 @@
  * @Date: 2022-11-15 23:43:09
  * @Description: http下载器
  */
-#ifndef HttpDownloader
+#ifndef _HTTP_DOWNLOADER_H_
+#define _HTTP_DOWNLOADER_H_
 
+#include <mutex>
+#include <atomic>
 #include <curl/curl.h>
 #include "downloaders.h"
+#include "curlhandlepool.h"
+
+#define CONN_RATE_BURST_NS  (50LL * 1000 * 1000) // 单连接速率允许的突发时长，纳秒
+
+// 一次传输的接收上下文，设置了单连接速率时按GCRA节流
+struct TransferContext {
+    TransferContext(): call(nullptr), rate(0), tat(0), resume(0), checked_size(0), pausable(false) {}
+    DataDealCallback* call; // 管理器提供的回调函数
+    file_size_t rate; // 最大接收速率，字节/秒，0为不限制
+    long long tat; // 理论到达时间，纳秒
+    long long resume; // 被暂停的传输恢复接收的时刻，纳秒，未暂停为0
+    file_size_t checked_size; // 上次进度回调时已收到的字节数，没有新数据时才检查传输是否应继续
+    bool pausable; // 超速时暂停传输交给事件循环恢复，否则在回调中休眠
+};
 
 class HttpDownloader: public Downloader {
 public:
@@ -25,6 +42,61 @@ public:
      */
     bool IsRangeAvailable();
 
+    /**
+     * @description: 判断文件大小是否已知
+     * @return {bool}
+     */
+    bool IsSizeKnown() { return m_size_known; }
+
+    /**
+     * @description: 获取服务器返回的ETag
+     * @return {string} 服务器未返回时为空
+     */
+    string GetETag();
+
+    /**
+     * @description: 获取服务器返回的Last-Modified
+     * @return {string} 服务器未返回时为空
+     */
+    string GetLastModified();
+
+    /**
+     * @description: 获取连接复用情况的统计报告，包括每个复用连接的片段节省的建连耗时
+     * @return {string} 无统计时为空
+     */
+    string GetConnectionReport();
+
+    /**
+     * @description: 获取服务器以限流状态（429/503）拒绝的请求数
+     * @return {int} 累计次数
+     */
+    int GetThrottledNum() { return m_throttled_num; }
+
+    /**
+     * @description: 设置之后开始的每个传输的最大接收速率
+     * @param {file_size_t} rate 字节/秒，0为不限制
+     */
+    void SetConnectionRate(file_size_t rate) { m_conn_rate = rate; }
+
+    /**
+     * @description: 设置使用HTTP/2，需在初始化前调用，https通过ALPN协商，http通过Upgrade升级，服务器不支持时使用HTTP/1.1
+     * @param {int} max_conns 最大连接数，只有异步下载器能在一个连接上复用多个流，0为使用HTTP/1.1
+     */
+    void SetHttp2(int max_conns) { m_http2_conns = max_conns > 0 ? max_conns : 0; }
+
+    /**
+     * @description: 设置传输停滞的超时，需在初始化前调用，平均速度在该时长内低于1字节/秒时传输失败
+     * @param {int} seconds 秒，0为不检测
+     */
+    void SetStallTimeout(int seconds) { m_stall_timeout = seconds > 0 ? seconds : 0; }
+
+    /**
+     * @description: 获取当前线程上最近结束的传输的耗时，需在Download返回后或异步下载的完成回调中调用
+     * @param {TransferTiming&} timing 传输耗时
+     * @return {bool} 有记录返回true
+     */
+    bool GetLastTiming(TransferTiming& timing);
+
     /**
      * @description: 初始化下载器
      * @param {const string&} url 下载的url
@@ -32,10 +104,18 @@ public:
      */
     bool Init(const std::string& url);
 
+    /**
+     * @description: 使用已知的文件大小初始化下载器，不向服务器探测，视为不支持断点续传
+     * @param {const string&} url 下载的url
+     * @param {file_size_t} filesize 文件大小
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool InitKnownSize(const std::string& url, file_size_t filesize);
+
     /**
      * @description: 下载文件
      * @param {const file_size_t} start_pos 下载起始字节
-     * @param {const file_size_t} end_pos 下载结束字节
+     * @param {const file_size_t} end_pos 下载结束字节，为RANGE_END_UNKNOWN时下载到响应结束
      * @param {DataDealCallback} call 管理器提供的回调函数
      * @return {bool} 成功返回true， 失败返回false
      */
@@ -43,26 +123,116 @@ public:
 
     ~HttpDownloader();
 
-private:
+protected:
     /**
      * @description: 获取文件信息
      * @return {bool} 成功返回true， 失败返回false
      */    
     bool GetFileInfo();
 
+    /**
+     * @description: HEAD未给出长度时请求第一个字节，从Content-Range中取得文件总大小
+     * @return {bool} 取得大小返回true， 否则返回false
+     */
+    bool ProbeContentRange();
+
+    /**
+     * @description: 生成Range请求的区间
+     * @param {file_size_t} start_pos 下载起始字节
+     * @param {file_size_t} end_pos 下载结束字节，为RANGE_END_UNKNOWN时不限制结束
+     * @return {string} 格式为"起始-结束"或"起始-"
+     */
+    static string FormatRange(file_size_t start_pos, file_size_t end_pos);
+
+    /**
+     * @description: 丢弃探测请求收到的内容，收到第一份数据后中断，服务器忽略Range时不会下载整个文件
+     * @return {size_t} 总是返回0
+     */
+    static size_t DiscardDataCallback(void* data, size_t size, size_t nmemb, void* stream);
+
+    /**
+     * @description: 创建并设置下载指定区间的curl句柄
+     * @param {const string&} range 下载区间，格式为"起始-结束"
+     * @param {TransferContext*} context 接收上下文，需在传输结束前保持有效，其中的速率由本函数设置
+     * @return {CURL*} 成功返回句柄， 失败返回nullptr
+     */
+    CURL* CreateRangeHandle(const string& range, TransferContext* context);
+
+    /**
+     * @description: 设置句柄使用的HTTP版本，启用HTTP/2时等待复用已有连接而不是新建连接
+     * @param {CURL*} handle 句柄
+     * @param {bool} probe 是否为探测请求
+     */
+    void SetHttpVersion(CURL* handle, bool probe = false);
+
+    /**
+     * @description: 记录一次传输的建连耗时以及是否复用了已有连接
+     * @param {CURL*} handle 已结束传输的句柄
+     */
+    void RecordTransferStats(CURL* handle);
+
+    /**
+     * @description: 记录传输各阶段的耗时，供同一线程随后调用GetLastTiming获取
+     * @param {CURL*} handle 已结束传输的句柄
+     */
+    static void RecordTiming(CURL* handle);
+
+    /**
+     * @description: 记录失败的传输，服务器返回429/503时计入限流次数
+     * @param {CURL*} handle 已结束传输的句柄
+     * @param {CURLcode} res 传输结果
+     */
+    void RecordFailure(CURL* handle, CURLcode res);
+
     /**
      * @description: 接收的文件内容的处理回调函数
      * @param {void*} data 传入的数据
      * @param {size_t} size 
      * @param {size_t} nmemb
-     * @param {void*} stream
-     * @return {size_t} 成功返回实际处理的字节数， 失败返回 0
+     * @param {void*} stream 接收上下文
+     * @return {size_t} 成功返回实际处理的字节数，需要暂停时返回CURL_WRITEFUNC_PAUSE， 失败返回 0
      */    
     static size_t ReadDataCallback(void* data, size_t size, size_t nmemb, void* stream);
-    
+
+    /**
+     * @description: 传输的进度回调函数，自上次调用以来没有收到数据时以0字节调用管理器的回调，检查传输是否应继续
+     * @param {void*} clientp 接收上下文
+     * @param {curl_off_t} dltotal 需接收的总字节数
+     * @param {curl_off_t} dlnow 已接收的字节数
+     * @param {curl_off_t} ultotal
+     * @param {curl_off_t} ulnow
+     * @return {int} 继续返回0， 中断返回1
+     */
+    static int ProgressCallback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+        curl_off_t ulnow);
+
+    /**
+     * @description: 接收的响应头的处理回调函数，记录ETag、Last-Modified和Content-Range中的总大小
+     * @param {char*} buffer 一行响应头
+     * @param {size_t} size
+     * @param {size_t} nitems
+     * @param {void*} userdata 下载器对象
+     * @return {size_t} 返回处理的字节数
+     */
+    static size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* userdata);
+
     string m_url;
+    string m_etag;
+    string m_last_modified;
+
+    mutex m_stats_lock; // 保护以下统计数据
+    long m_cold_num; // 新建连接的片段数
+    long m_warm_num; // 复用连接的片段数
+    curl_off_t m_cold_startup_us; // 新建连接的片段建连耗时总和，微秒
+    curl_off_t m_warm_startup_us; // 复用连接的片段建连耗时总和，微秒
+    atomic<int> m_throttled_num; // 服务器限流拒绝的请求数
+    atomic<file_size_t> m_conn_rate; // 单个传输的最大接收速率，0为不限制
+    int m_http2_conns; // 使用HTTP/2时的最大连接数，0为使用HTTP/1.1
+    int m_stall_timeout; // 传输停滞的超时，秒，0为不检测
+    long long m_range_total; // Content-Range中的文件总大小，未给出为-1
     double m_filesize;
     bool m_range_supported;
+    bool m_size_known; // 文件大小是否已知
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,181 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-03-24 20:31:17
+ * @Description: 基于curl_multi和epoll的事件驱动http下载器，少量IO线程驱动所有区间下载
+ */
+#ifndef _MULTI_HTTP_DOWNLOADER_H_
+#define _MULTI_HTTP_DOWNLOADER_H_
+
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include "httpdownloader.h"
+
+#define MULTI_MAX_EVENTS    256 // 单次epoll_wait处理的最大事件数
+#define MULTI_MAX_CONNECTS  1024 // 单个事件循环缓存的最大连接数
+#define MULTI_HTTP2_KICK_MS 10 // 使用HTTP/2时socket空闲多久后主动让curl处理所有传输，毫秒
+
+class MultiHttpDownloader: public HttpDownloader {
+public:
+    /**
+     * @param {int} loop_num 事件循环（IO线程）数量
+     */
+    explicit MultiHttpDownloader(int loop_num = 1);
+
+    /**
+     * @description: 初始化下载器并启动事件循环
+     * @param {const string&} url 下载的url
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Init(const std::string& url);
+
+    /**
+     * @description: 使用已知的文件大小初始化下载器并启动事件循环
+     * @param {const string&} url 下载的url
+     * @param {file_size_t} filesize 文件大小
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool InitKnownSize(const std::string& url, file_size_t filesize);
+
+    /**
+     * @description: 下载文件，提交到事件循环后阻塞等待完成
+     * @param {const file_size_t} start_pos 下载起始字节
+     * @param {const file_size_t} end_pos 下载结束字节
+     * @param {DataDealCallback} call 管理器提供的回调函数
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Download(const file_size_t start_pos, const file_size_t end_pos, DataDealCallback call);
+
+    /**
+     * @description: 判断下载器是否支持异步下载
+     * @return {bool}
+     */
+    bool IsAsyncSupported() { return true; }
+
+    /**
+     * @description: 异步下载文件，数据回调和完成回调均在IO线程中执行
+     * @param {const file_size_t} start_pos 下载起始字节
+     * @param {const file_size_t} end_pos 下载结束字节
+     * @param {DataDealCallback} call 管理器提供的回调函数
+     * @param {DownloadDoneCallback} done 下载结束的回调函数，参数为是否成功
+     * @return {bool} 提交成功返回true， 失败返回false
+     */
+    bool DownloadAsync(const file_size_t start_pos, const file_size_t end_pos, DataDealCallback call,
+        DownloadDoneCallback done);
+
+    /**
+     * @description: 设置运行事件循环的外部线程，需在初始化前调用，每个外部线程运行一个事件循环，传输轮询分配到各事件循环
+     * @param {TaskRunner} runner 执行长期任务的函数
+     * @param {int} thread_num 外部线程数，即最多的事件循环数
+     */
+    void SetTaskRunner(TaskRunner runner, int thread_num);
+
+    ~MultiHttpDownloader();
+
+private:
+    // 一次区间传输
+    struct Transfer {
+        CURL* handle;
+        DataDealCallback call;
+        DownloadDoneCallback done;
+        TransferContext context; // 接收上下文，超过单连接速率时由回调暂停
+    };
+
+    // 事件循环，一个IO线程驱动一个curl_multi句柄
+    struct EventLoop {
+        EventLoop(): multi(nullptr), epoll_fd(-1), event_fd(-1), has_deadline(false), running(0) {}
+        CURLM* multi;
+        int epoll_fd;
+        int event_fd; // 用于唤醒epoll_wait，提交新传输或退出
+        bool has_deadline; // curl是否要求了超时处理
+        chrono::steady_clock::time_point deadline; // curl要求的下次超时处理时间
+        chrono::steady_clock::time_point next_check; // 下次检查各传输是否应继续的时间
+        int running; // 进行中的传输数
+        mutex pending_lock; // 保护pending
+        vector<Transfer*> pending; // 其他线程提交、尚未加入multi的传输
+        set<Transfer*> active; // 已加入multi的传输，只在IO线程中访问
+        thread worker; // 自建的IO线程，在外部线程中运行时为空
+        future<void> exited; // 在外部线程中运行时，事件循环结束的通知
+    };
+
+    /**
+     * @description: 启动所有事件循环
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool StartLoops();
+
+    /**
+     * @description: 停止并释放所有事件循环
+     */
+    void StopLoops();
+
+    /**
+     * @description: 释放事件循环的multi句柄和描述符，事件循环需已停止且没有传输
+     * @param {EventLoop*} loop 事件循环，返回后被释放
+     */
+    static void FreeLoop(EventLoop* loop);
+
+    /**
+     * @description: 事件循环主体
+     * @param {EventLoop*} loop 事件循环
+     */
+    void RunLoop(EventLoop* loop);
+
+    /**
+     * @description: 将提交的传输加入multi句柄
+     * @param {EventLoop*} loop 事件循环
+     */
+    void AddPending(EventLoop* loop);
+
+    /**
+     * @description: 处理已结束的传输并执行完成回调
+     * @param {EventLoop*} loop 事件循环
+     */
+    void CheckDone(EventLoop* loop);
+
+    /**
+     * @description: 将传输移出multi句柄，记录统计并执行完成回调
+     * @param {EventLoop*} loop 事件循环
+     * @param {Transfer*} transfer 已结束的传输，返回后被释放
+     * @param {CURLcode} res 传输结果
+     */
+    void FinishTransfer(EventLoop* loop, Transfer* transfer, CURLcode res);
+
+    /**
+     * @description: 每隔TRANSFER_CHECK_MS以0字节调用各传输的回调，不应继续的传输直接移出multi句柄并结束
+     * @param {EventLoop*} loop 事件循环
+     */
+    void CheckAlive(EventLoop* loop);
+
+    /**
+     * @description: 恢复已到时间的被暂停传输
+     * @param {EventLoop*} loop 事件循环
+     * @return {long long} 最早的恢复时刻，纳秒，没有被暂停的传输时为0
+     */
+    long long ResumePaused(EventLoop* loop);
+
+    /**
+     * @description: curl通知需要关注的socket事件
+     * @return {int} 固定返回0
+     */
+    static int SocketCallback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp);
+
+    /**
+     * @description: curl通知下次超时时间
+     * @return {int} 固定返回0
+     */
+    static int TimerCallback(CURLM* multi, long timeout_ms, void* userp);
+
+    int m_loop_num; // 事件循环数量
+    TaskRunner m_runner; // 运行事件循环的外部线程，为空时每个事件循环自建IO线程
+    atomic<unsigned> m_next_loop; // 轮询分配传输的序号
+    atomic<bool> m_stop; // 是否停止事件循环
+    vector<EventLoop*> m_loops; // 事件循环集合
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-16 20:31:07
+ * @Description: 自带的HTTP/1.1区间下载器，探测仍使用curl，http链接的区间请求直接用socket收到管理器提供的内存中，
+ *               省去curl接收缓冲区到目标内存的一次复制；https、代理等情况退回curl下载
+ */
+#ifndef _NATIVE_HTTP_DOWNLOADER_H_
+#define _NATIVE_HTTP_DOWNLOADER_H_
+#include <netdb.h>
+#include <mutex>
+#include <vector>
+#include "httpdownloader.h"
+
+#define NATIVE_HEAD_MAX_SIZE    (16 * 1024) // 响应头的最大长度
+#define NATIVE_RECV_SIZE        (64 * 1024) // 非零拷贝下载时自带接收缓冲区的大小
+#define NATIVE_IDLE_MAX_NUM     64 // 保留的空闲连接数上限
+
+// 解析后的响应头
+struct NativeResponse {
+    NativeResponse(): status(0), content_length(-1), keep_alive(true), chunked(false) {}
+    int status; // 状态码
+    long long content_length; // 响应体长度，未给出为-1
+    bool keep_alive; // 响应结束后连接是否可以复用
+    bool chunked; // 是否为分块传输
+};
+
+class NativeHttpDownloader: public HttpDownloader {
+public:
+    explicit NativeHttpDownloader();
+
+    /**
+     * @description: 初始化下载器，用curl探测文件信息，http链接解析出主机地址
+     * @param {const string&} url 下载的url
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Init(const std::string& url);
+
+    /**
+     * @description: 使用已知的文件大小初始化下载器，不向服务器探测，视为不支持断点续传
+     * @param {const string&} url 下载的url
+     * @param {file_size_t} filesize 文件大小
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool InitKnownSize(const std::string& url, file_size_t filesize);
+
+    /**
+     * @description: 下载文件，数据先收到自带的缓冲区再交给回调函数
+     * @param {const file_size_t} start_pos 下载起始字节
+     * @param {const file_size_t} end_pos 下载结束字节
+     * @param {DataDealCallback} call 管理器提供的回调函数
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Download(const file_size_t start_pos, const file_size_t end_pos, DataDealCallback call);
+
+    /**
+     * @description: 判断下载器是否支持零拷贝接收，只有使用自带客户端的http链接支持
+     * @return {bool}
+     */
+    bool IsZeroCopySupported() { return m_native; }
+
+    /**
+     * @description: 零拷贝下载文件，数据直接接收到管理器提供的内存中
+     * @param {const file_size_t} start_pos 下载起始字节
+     * @param {const file_size_t} end_pos 下载结束字节
+     * @param {BufferAcquireCallback} acquire 申请目标内存的回调函数
+     * @param {BufferCommitCallback} commit 提交已接收数据的回调函数
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool DownloadInto(const file_size_t start_pos, const file_size_t end_pos, BufferAcquireCallback acquire,
+        BufferCommitCallback commit);
+
+    /**
+     * @description: 获取当前线程上最近结束的传输的耗时，需在Download返回后调用
+     * @param {TransferTiming&} timing 传输耗时
+     * @return {bool} 有记录返回true
+     */
+    bool GetLastTiming(TransferTiming& timing);
+
+    ~NativeHttpDownloader();
+
+private:
+    /**
+     * @description: 解析url并解析主机地址，不能由自带客户端下载时返回false
+     * @return {bool} 可以使用自带客户端返回true
+     */
+    bool PrepareNative();
+
+    /**
+     * @description: 取出一个空闲连接，没有时新建连接
+     * @param {bool&} reused 是否复用了空闲连接
+     * @return {int} 成功返回socket， 失败返回-1
+     */
+    int AcquireConnection(bool& reused);
+
+    /**
+     * @description: 归还可以复用的连接
+     * @param {int} fd socket
+     */
+    void ReleaseConnection(int fd);
+
+    /**
+     * @description: 新建到服务器的连接
+     * @return {int} 成功返回socket， 失败返回-1
+     */
+    int Connect();
+
+    /**
+     * @description: 接收数据，每隔TRANSFER_CHECK_MS收不到数据时检查传输是否应继续，持续收不到数据超过停滞超时时失败
+     * @param {int} fd socket
+     * @param {char*} buffer 接收缓冲区
+     * @param {size_t} size 缓冲区大小
+     * @param {const BufferCommitCallback*} check 以0字节调用，返回false时中断，为nullptr时不检查
+     * @return {ssize_t} 收到的字节数，连接关闭返回0，失败返回-1，停滞时errno为ETIMEDOUT，被中断时为ECANCELED
+     */
+    ssize_t Receive(int fd, char* buffer, size_t size, const BufferCommitCallback* check);
+
+    /**
+     * @description: 发送区间请求并接收响应头
+     * @param {int} fd socket
+     * @param {const string&} request 请求
+     * @param {NativeResponse&} response 解析后的响应头
+     * @param {char*} head 响应头缓冲区，大小为NATIVE_HEAD_MAX_SIZE
+     * @param {size_t&} head_size 响应头长度，响应体从head + head_size开始
+     * @param {size_t&} body_size 缓冲区中响应头之后已收到的响应体字节数
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Request(int fd, const string& request, NativeResponse& response, char* head, size_t& head_size,
+        size_t& body_size);
+
+    /**
+     * @description: 解析响应头
+     * @param {const char*} head 响应头，不含结尾的空行
+     * @param {size_t} size 长度
+     * @param {NativeResponse&} response 解析结果
+     * @return {bool} 状态行格式正确返回true
+     */
+    static bool ParseResponse(const char* head, size_t size, NativeResponse& response);
+
+    /**
+     * @description: 按单连接速率节流，超速时在当前线程休眠
+     * @param {long long&} tat 理论到达时间，纳秒
+     * @param {file_size_t} rate 速率，字节/秒
+     * @param {size_t} size 收到的字节数
+     */
+    static void Throttle(long long& tat, file_size_t rate, size_t size);
+
+    bool m_native; // 是否使用自带客户端
+    string m_host; // Host请求头
+    string m_path; // 请求路径，包括查询参数
+    addrinfo* m_addrs; // 服务器地址
+
+    mutex m_idle_lock; // 保护空闲连接
+    vector<int> m_idle_fds; // 可复用的空闲连接
+};
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-08 14:40:03
+ * @Description: curl句柄池实现
+ */
+#include "curlhandlepool.h"
+
+CurlHandlePool::CurlHandlePool() {
+    m_share = curl_share_init();
+    if (m_share) {
+        curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, &CurlHandlePool::LockCallback);
+        curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, &CurlHandlePool::UnlockCallback);
+        curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+    // 多个multi句柄共享连接缓存时，curl 7.88会把同一个HTTP/2连接同时交给不同的multi句柄，传输出错
+    m_stream_share = curl_share_init();
+    if (m_stream_share) {
+        curl_share_setopt(m_stream_share, CURLSHOPT_LOCKFUNC, &CurlHandlePool::LockCallback);
+        curl_share_setopt(m_stream_share, CURLSHOPT_UNLOCKFUNC, &CurlHandlePool::UnlockCallback);
+        curl_share_setopt(m_stream_share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(m_stream_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(m_stream_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+}
+
+CurlHandlePool::~CurlHandlePool() {
+    for (auto handle : m_idle) {
+        curl_easy_cleanup(handle);
+    }
+    m_idle.clear();
+    if (m_share) {
+        curl_share_cleanup(m_share);
+    }
+    if (m_stream_share) {
+        curl_share_cleanup(m_stream_share);
+    }
+}
+
+/**
+ * @description: 获取进程内唯一的句柄池，使后续的片段和下载都能复用已建立的连接
+ * @return {CurlHandlePool&}
+ */
+CurlHandlePool& CurlHandlePool::Instance() {
+    static CurlHandlePool pool;
+    return pool;
+}
+
+/**
+ * @description: 取出一个已关联共享缓存的句柄，没有空闲句柄时新建
+ * @param {bool} share_conn 是否共享连接缓存，HTTP/2连接只能在建立它的multi句柄内复用，不能共享
+ * @return {CURL*} 成功返回句柄， 失败返回nullptr
+ */
+CURL* CurlHandlePool::Acquire(bool share_conn) {
+    CURL* handle = nullptr;
+    {
+        lock_guard<mutex> guard(m_idle_lock);
+        if (!m_idle.empty()) {
+            handle = m_idle.back();
+            m_idle.pop_back();
+        }
+    }
+    if (!handle) {
+        handle = curl_easy_init();
+        if (!handle) {
+            return nullptr;
+        }
+    }
+    CURLSH* share = share_conn ? m_share : m_stream_share;
+    if (share) {
+        curl_easy_setopt(handle, CURLOPT_SHARE, share);
+    }
+    curl_easy_setopt(handle, CURLOPT_MAXCONNECTS, (long)POOL_MAX_CONNECTS);
+    return handle;
+}
+
+/**
+ * @description: 归还句柄，重置选项后留待复用，连接仍保留在共享缓存中
+ * @param {CURL*} handle 句柄
+ */
+void CurlHandlePool::Release(CURL* handle) {
+    if (!handle) {
+        return;
+    }
+    curl_easy_reset(handle);
+    {
+        lock_guard<mutex> guard(m_idle_lock);
+        if (m_idle.size() < POOL_MAX_IDLE_HANDLES) {
+            m_idle.push_back(handle);
+            return;
+        }
+    }
+    curl_easy_cleanup(handle);
+}
+
+/**
+ * @description: 共享数据加锁回调
+ */
+void CurlHandlePool::LockCallback(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr) {
+    CurlHandlePool* pool = (CurlHandlePool*)userptr;
+    pool->m_share_locks[data].lock();
+}
+
+/**
+ * @description: 共享数据解锁回调
+ */
+void CurlHandlePool::UnlockCallback(CURL* handle, curl_lock_data data, void* userptr) {
+    CurlHandlePool* pool = (CurlHandlePool*)userptr;
+    pool->m_share_locks[data].unlock();
+}
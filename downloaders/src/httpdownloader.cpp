@@ -7,12 +7,30 @@
 #include "string.h"
 #include "httpdownloader.h"
 #include <curl/curl.h>
+#include <chrono>
+#include <thread>
 using namespace std;
 
 #define TCP_KEEPIDLE 120L
 #define TCP_KEEPINTVL 60L
 
-HttpDownloader::HttpDownloader(): m_filesize(0), m_range_supported(true) {
+// 传输结束与读取耗时在同一线程，线程模式为工作线程，异步模式为IO线程
+static thread_local TransferTiming s_last_timing;
+static thread_local bool s_has_timing = false;
+
+HttpDownloader::HttpDownloader()
+    : m_cold_num(0)
+    , m_warm_num(0)
+    , m_cold_startup_us(0)
+    , m_warm_startup_us(0)
+    , m_throttled_num(0)
+    , m_conn_rate(0)
+    , m_http2_conns(0)
+    , m_stall_timeout(STALL_TIMEOUT_DEFAULT)
+    , m_range_total(-1)
+    , m_filesize(0)
+    , m_range_supported(true)
+    , m_size_known(true) {
 
 }
 
@@ -30,50 +48,157 @@ bool HttpDownloader::Init(const std::string& url) {
     return GetFileInfo();
 }
 
+/**
+ * @description: 使用已知的文件大小初始化下载器，不向服务器探测，视为不支持断点续传
+ * @param {const string&} url 下载的url
+ * @param {file_size_t} filesize 文件大小
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool HttpDownloader::InitKnownSize(const std::string& url, file_size_t filesize) {
+    // 未探测时不能确认服务器支持Range，只能从0开始整体下载
+    m_url = url;
+    m_filesize = filesize;
+    m_range_supported = false;
+    return true;
+}
+
 /**
  * @description: 接收的文件内容的处理回调函数
  * @param {void*} data 传入的数据
  * @param {size_t} size
  * @param {size_t} nmemb
- * @param {void*} stream
- * @return {size_t} 成功返回实际处理的字节数， 失败返回 0
+ * @param {void*} stream 接收上下文
+ * @return {size_t} 成功返回实际处理的字节数，需要暂停时返回CURL_WRITEFUNC_PAUSE， 失败返回 0
  */
 size_t HttpDownloader::ReadDataCallback(void* data, size_t size, size_t nmemb, void* stream) {
     size_t total_size = size * nmemb;
-    DataDealCallback* call = (DataDealCallback*)stream;
-    if (!(*call)((char*)data, total_size)) {
+    TransferContext* context = (TransferContext*)stream;
+    long long now = 0;
+    if (context->rate > 0) {
+        now = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        // 超速时暂停，curl会在恢复后重新传入这份数据
+        if (context->pausable && context->tat - now > CONN_RATE_BURST_NS) {
+            context->resume = context->tat - CONN_RATE_BURST_NS;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        context->resume = 0;
+    }
+
+    if (!(*context->call)((char*)data, total_size)) {
         return 0;
     }
+
+    if (context->rate > 0) {
+        long long cost = (long long)((double)total_size * 1e9 / context->rate);
+        context->tat = (context->tat > now ? context->tat : now) + cost;
+        long long wait = context->tat - now - CONN_RATE_BURST_NS;
+        if (!context->pausable && wait > 0) {
+            this_thread::sleep_for(chrono::nanoseconds(wait));
+        }
+    }
+    return total_size;
+}
+
+/**
+ * @description: 传输的进度回调函数，自上次调用以来没有收到数据时以0字节调用管理器的回调，检查传输是否应继续
+ * @param {void*} clientp 接收上下文
+ * @param {curl_off_t} dltotal 需接收的总字节数
+ * @param {curl_off_t} dlnow 已接收的字节数
+ * @param {curl_off_t} ultotal
+ * @param {curl_off_t} ulnow
+ * @return {int} 继续返回0， 中断返回1
+ */
+int HttpDownloader::ProgressCallback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+    curl_off_t ulnow) {
+    // 收到数据时接收回调已做过同样的检查，只在连接空闲时检查，收尾阶段落后的重复请求收不到数据也能中断
+    TransferContext* context = (TransferContext*)clientp;
+    if ((file_size_t)dlnow != context->checked_size) {
+        context->checked_size = (file_size_t)dlnow;
+        return 0;
+    }
+    return (*context->call)(nullptr, 0) ? 0 : 1;
+}
+
+/**
+ * @description: 丢弃探测请求收到的内容，收到第一份数据后中断，服务器忽略Range时不会下载整个文件
+ * @return {size_t} 总是返回0
+ */
+size_t HttpDownloader::DiscardDataCallback(void* data, size_t size, size_t nmemb, void* stream) {
+    return 0;
+}
+
+/**
+ * @description: 接收的响应头的处理回调函数，记录ETag、Last-Modified和Content-Range中的总大小
+ * @param {char*} buffer 一行响应头
+ * @param {size_t} size
+ * @param {size_t} nitems
+ * @param {void*} userdata 下载器对象
+ * @return {size_t} 返回处理的字节数
+ */
+size_t HttpDownloader::HeaderCallback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    size_t total_size = size * nitems;
+    HttpDownloader* downloader = (HttpDownloader*)userdata;
+    string line(buffer, total_size);
+    size_t colon = line.find(':');
+    if (colon == string::npos) {
+        return total_size;
+    }
+
+    // 字段名不区分大小写，值去掉首尾空白
+    string name = line.substr(0, colon);
+    for (auto& c : name) {
+        c = tolower(c);
+    }
+    size_t value_start = line.find_first_not_of(" \t", colon + 1);
+    size_t value_end = line.find_last_not_of(" \t\r\n");
+    string value = value_start == string::npos || value_end < value_start ? ""
+        : line.substr(value_start, value_end - value_start + 1);
+    if (name == "etag") {
+        downloader->m_etag = value;
+    }
+    else if (name == "last-modified") {
+        downloader->m_last_modified = value;
+    }
+    else if (name == "content-range") {
+        // 格式为"bytes 起始-结束/总大小"，总大小未知时为"*"
+        size_t slash = value.find('/');
+        if (slash != string::npos && slash + 1 < value.size() && isdigit(value[slash + 1])) {
+            downloader->m_range_total = strtoll(value.c_str() + slash + 1, nullptr, 10);
+        }
+    }
     return total_size;
 }
 
 /**
  * @description: 下载文件
  * @param {const file_size_t} start_pos 下载起始字节
- * @param {const file_size_t} end_pos 下载结束字节
+ * @param {const file_size_t} end_pos 下载结束字节，为RANGE_END_UNKNOWN时下载到响应结束
  * @param {DataDealCallback} call 管理器提供的回调函数
  * @return {bool} 成功返回true， 失败返回false
  */
 bool HttpDownloader::Download(const file_size_t start_pos, const file_size_t end_pos, DataDealCallback call) {
-    string range = to_string(start_pos) + "-" + to_string(end_pos);
+    string range = FormatRange(start_pos, end_pos);
 
-    CURL* curl_handle = curl_easy_init();
+    TransferContext context;
+    context.call = &call;
+    CURL* curl_handle = CreateRangeHandle(range, &context);
     if (!curl_handle) {
         return false;
     }
-    // 设置参数
-    curl_easy_setopt(curl_handle, CURLOPT_URL, m_url.c_str());
-    curl_easy_setopt(curl_handle, CURLOPT_RANGE, range.c_str());
-    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
-    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPIDLE, TCP_KEEPIDLE);
-    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPINTVL, TCP_KEEPINTVL);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &call);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, &HttpDownloader::ReadDataCallback);
+    // 阻塞在curl_easy_perform中时只能由进度回调中断，连接空闲时curl约每秒调用一次
+    curl_easy_setopt(curl_handle, CURLOPT_XFERINFODATA, &context);
+    curl_easy_setopt(curl_handle, CURLOPT_XFERINFOFUNCTION, &HttpDownloader::ProgressCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 0L);
     // 运行
     CURLcode res = curl_easy_perform(curl_handle);
+    RecordTiming(curl_handle);
     if (res != CURLE_OK) {
-        printf("curl_easy_perform failed: %s\n", curl_easy_strerror(res));
-        curl_easy_cleanup(curl_handle);
+        // 回调主动中断（如片段被其他线程分走）不属于网络错误，由调用方判断
+        if (res != CURLE_WRITE_ERROR && res != CURLE_ABORTED_BY_CALLBACK) {
+            printf("curl_easy_perform failed: %s\n", curl_easy_strerror(res));
+        }
+        RecordFailure(curl_handle, res);
+        CurlHandlePool::Instance().Release(curl_handle);
         return false;
     }
 
@@ -83,16 +208,148 @@ bool HttpDownloader::Download(const file_size_t start_pos, const file_size_t end
     printf("current download size is %f\n", download_size);
 #endif
 
-    curl_easy_cleanup(curl_handle);
+    RecordTransferStats(curl_handle);
+    CurlHandlePool::Instance().Release(curl_handle);
     return true;
 }
 
+/**
+ * @description: 创建并设置下载指定区间的curl句柄
+ * @param {const string&} range 下载区间，格式为"起始-结束"
+ * @param {TransferContext*} context 接收上下文，需在传输结束前保持有效，其中的速率由本函数设置
+ * @return {CURL*} 成功返回句柄， 失败返回nullptr
+ */
+CURL* HttpDownloader::CreateRangeHandle(const string& range, TransferContext* context) {
+    CURL* curl_handle = CurlHandlePool::Instance().Acquire(m_http2_conns == 0);
+    if (!curl_handle) {
+        return nullptr;
+    }
+    // 设置参数，CURLOPT_RANGE会复制字符串，range无需在传输期间保持有效
+    curl_easy_setopt(curl_handle, CURLOPT_URL, m_url.c_str());
+    curl_easy_setopt(curl_handle, CURLOPT_RANGE, range.c_str());
+    // 错误页面不是文件内容，不能写入文件
+    curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1L);
+    // curl自带的CURLOPT_MAX_RECV_SPEED_LARGE在短传输上几乎不限速，改为在接收回调中节流
+    context->rate = m_conn_rate;
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPIDLE, TCP_KEEPIDLE);
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPINTVL, TCP_KEEPINTVL);
+    // 对端不断开却不再发送时TCP保活探测不到，按接收速度判断停滞，失败后由管理器从已写入的位置重试
+    if (m_stall_timeout > 0) {
+        curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_TIME, (long)m_stall_timeout);
+    }
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, context);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, &HttpDownloader::ReadDataCallback);
+    SetHttpVersion(curl_handle);
+    return curl_handle;
+}
+
+/**
+ * @description: 设置句柄使用的HTTP版本，启用HTTP/2时等待复用已有连接而不是新建连接
+ * @param {CURL*} handle 句柄
+ * @param {bool} probe 是否为探测请求
+ */
+void HttpDownloader::SetHttpVersion(CURL* handle, bool probe) {
+    if (m_http2_conns == 0) {
+        return;
+    }
+    // HTTP/2连接不共享，探测连接留在句柄内无法被事件循环复用，只会多占一个连接
+    if (probe) {
+        curl_easy_setopt(handle, CURLOPT_FORBID_REUSE, 1L);
+    }
+    // https通过ALPN协商，明文http由第一个请求升级为h2c；curl 7.88在prior knowledge连接上复用流会出错，不使用
+    curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_0);
+    // 同时开始的流先等第一个连接确认可以复用，否则每个流都会新建连接
+    curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+}
+
+/**
+ * @description: 记录一次传输的建连耗时以及是否复用了已有连接
+ * @param {CURL*} handle 已结束传输的句柄
+ */
+void HttpDownloader::RecordTransferStats(CURL* handle) {
+    long connects = 0;
+    curl_off_t pretransfer_us = 0;
+    // 建连耗时取开始发送请求前的总耗时，包含DNS、TCP握手和TLS握手
+    if (CURLE_OK != curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects)
+        || CURLE_OK != curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer_us)) {
+        return;
+    }
+    lock_guard<mutex> guard(m_stats_lock);
+    if (connects == 0) {
+        m_warm_num++;
+        m_warm_startup_us += pretransfer_us;
+    }
+    else {
+        m_cold_num++;
+        m_cold_startup_us += pretransfer_us;
+    }
+}
+
+/**
+ * @description: 获取当前线程上最近结束的传输的耗时，需在Download返回后或异步下载的完成回调中调用
+ * @param {TransferTiming&} timing 传输耗时
+ * @return {bool} 有记录返回true
+ */
+bool HttpDownloader::GetLastTiming(TransferTiming& timing) {
+    if (!s_has_timing) {
+        return false;
+    }
+    timing = s_last_timing;
+    return true;
+}
+
+/**
+ * @description: 记录传输各阶段的耗时，供同一线程随后调用GetLastTiming获取
+ * @param {CURL*} handle 已结束传输的句柄
+ */
+void HttpDownloader::RecordTiming(CURL* handle) {
+    // curl给出的是从开始到各阶段结束的累计耗时
+    curl_off_t namelookup_us = 0;
+    curl_off_t connect_us = 0;
+    curl_off_t appconnect_us = 0;
+    curl_off_t pretransfer_us = 0;
+    curl_off_t starttransfer_us = 0;
+    curl_off_t total_us = 0;
+    curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &namelookup_us);
+    curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect_us);
+    curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &appconnect_us);
+    curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer_us);
+    curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer_us);
+    curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total_us);
+
+    s_last_timing.dns_us = namelookup_us;
+    s_last_timing.connect_us = connect_us > namelookup_us ? connect_us - namelookup_us : 0;
+    s_last_timing.tls_us = appconnect_us > connect_us ? appconnect_us - connect_us : 0;
+    s_last_timing.ttfb_us = starttransfer_us > pretransfer_us ? starttransfer_us - pretransfer_us : 0;
+    s_last_timing.total_us = total_us;
+    s_has_timing = true;
+}
+
+/**
+ * @description: 记录失败的传输，服务器返回429/503时计入限流次数
+ * @param {CURL*} handle 已结束传输的句柄
+ * @param {CURLcode} res 传输结果
+ */
+void HttpDownloader::RecordFailure(CURL* handle, CURLcode res) {
+    if (res != CURLE_HTTP_RETURNED_ERROR) {
+        return;
+    }
+    long response_code = 0;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &response_code);
+    if (response_code == 429 || response_code == 503) {
+        m_throttled_num++;
+    }
+}
+
 /**
  * @description: 获取文件信息
  * @return {bool} 成功返回true， 失败返回false
  */
 bool HttpDownloader::GetFileInfo() {
-    CURL* curl_handle = curl_easy_init();
+    // 探测使用的连接会留在共享缓存中，供第一个片段复用
+    CURL* curl_handle = CurlHandlePool::Instance().Acquire(m_http2_conns == 0);
     if (!curl_handle) {
         return false;
     }
@@ -101,9 +358,19 @@ bool HttpDownloader::GetFileInfo() {
     curl_easy_setopt(curl_handle, CURLOPT_URL, m_url.c_str());
     curl_easy_setopt(curl_handle, CURLOPT_NOBODY, 1L);
     curl_easy_setopt(curl_handle, CURLOPT_RANGE, "0-");
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, this);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, &HttpDownloader::HeaderCallback);
+    SetHttpVersion(curl_handle, true);
 
     // 运行
     CURLcode res = curl_easy_perform(curl_handle);
+    if (res != CURLE_OK && res != CURLE_RANGE_ERROR && m_http2_conns > 0) {
+        // 只接受直接以HTTP/2开始的明文服务器会关闭升级请求的连接，改用HTTP/1.1重新探测
+        printf("http/2 probe failed: %s, use http/1.1\n", curl_easy_strerror(res));
+        CurlHandlePool::Instance().Release(curl_handle);
+        m_http2_conns = 0;
+        return GetFileInfo();
+    }
     if (res == CURLE_RANGE_ERROR) {
         m_range_supported = false;
     }
@@ -112,20 +379,88 @@ bool HttpDownloader::GetFileInfo() {
         goto end;
     }
 
-    // 获取文件大小
+    // 错误页面的长度不是文件大小
+    long response_code;
+    response_code = 0;
+    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &response_code);
+    if (response_code >= 400) {
+        printf("request failed, http status %ld\n", response_code);
+        goto end;
+    }
+
+    // 获取文件大小，区间响应以Content-Range中的总大小为准
     res = curl_easy_getinfo(curl_handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &m_filesize);
     if (CURLE_OK != res) {
         printf("cannot get filesize: %s\n", curl_easy_strerror(res));
         goto end;
     }
+    if (m_range_total >= 0) {
+        m_filesize = (double)m_range_total;
+    }
+    // 不支持HTTP/2的服务器上连接数上限会使片段排队，退回HTTP/1.1的多连接下载
+    long http_version;
+    http_version = 0;
+    curl_easy_getinfo(curl_handle, CURLINFO_HTTP_VERSION, &http_version);
+    if (m_http2_conns > 0 && http_version != CURL_HTTP_VERSION_2_0) {
+        printf("server does not support http/2, use http/1.1\n");
+        m_http2_conns = 0;
+    }
+    CurlHandlePool::Instance().Release(curl_handle);
 
-    curl_easy_cleanup(curl_handle);
+    // 未给出长度（如分块传输）时再用GET探测，仍未知时只能单连接流式下载
+    if (m_filesize < 0 && !ProbeContentRange()) {
+        printf("file size is unknown, download as a stream\n");
+        m_filesize = 0;
+        m_size_known = false;
+        m_range_supported = false;
+    }
     return true;
 end:
-    curl_easy_cleanup(curl_handle);
+    CurlHandlePool::Instance().Release(curl_handle);
     return false;
 }
 
+/**
+ * @description: HEAD未给出长度时请求第一个字节，从Content-Range中取得文件总大小
+ * @return {bool} 取得大小返回true， 否则返回false
+ */
+bool HttpDownloader::ProbeContentRange() {
+    CURL* curl_handle = CurlHandlePool::Instance().Acquire(m_http2_conns == 0);
+    if (!curl_handle) {
+        return false;
+    }
+    m_range_total = -1;
+    curl_easy_setopt(curl_handle, CURLOPT_URL, m_url.c_str());
+    curl_easy_setopt(curl_handle, CURLOPT_RANGE, "0-0");
+    curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, this);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, &HttpDownloader::HeaderCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, &HttpDownloader::DiscardDataCallback);
+    SetHttpVersion(curl_handle, true);
+
+    // 收到数据后主动中断，返回写入错误
+    CURLcode res = curl_easy_perform(curl_handle);
+    long response_code = 0;
+    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &response_code);
+    CurlHandlePool::Instance().Release(curl_handle);
+    if ((res != CURLE_OK && res != CURLE_WRITE_ERROR) || response_code != 206 || m_range_total < 0) {
+        return false;
+    }
+    m_filesize = (double)m_range_total;
+    m_range_supported = true;
+    return true;
+}
+
+/**
+ * @description: 生成Range请求的区间
+ * @param {file_size_t} start_pos 下载起始字节
+ * @param {file_size_t} end_pos 下载结束字节，为RANGE_END_UNKNOWN时不限制结束
+ * @return {string} 格式为"起始-结束"或"起始-"
+ */
+string HttpDownloader::FormatRange(file_size_t start_pos, file_size_t end_pos) {
+    return to_string(start_pos) + "-" + (end_pos == RANGE_END_UNKNOWN ? "" : to_string(end_pos));
+}
+
 /**
  * @description: 获取文件大小，单位字节
  * @return {file_size_t} 返回字节数
@@ -141,3 +476,39 @@ file_size_t HttpDownloader::GetFileSize() {
 bool HttpDownloader::IsRangeAvailable() {
     return m_range_supported;
 }
+
+
+/**
+ * @description: 获取服务器返回的ETag
+ * @return {string} 服务器未返回时为空
+ */
+string HttpDownloader::GetETag() {
+    return m_etag;
+}
+
+/**
+ * @description: 获取服务器返回的Last-Modified
+ * @return {string} 服务器未返回时为空
+ */
+string HttpDownloader::GetLastModified() {
+    return m_last_modified;
+}
+
+/**
+ * @description: 获取连接复用情况的统计报告，包括每个复用连接的片段节省的建连耗时
+ * @return {string} 无统计时为空
+ */
+string HttpDownloader::GetConnectionReport() {
+    lock_guard<mutex> guard(m_stats_lock);
+    long total = m_cold_num + m_warm_num;
+    if (total == 0) {
+        return "";
+    }
+    double cold_ms = m_cold_num ? (double)m_cold_startup_us / m_cold_num / 1000 : 0;
+    double warm_ms = m_warm_num ? (double)m_warm_startup_us / m_warm_num / 1000 : 0;
+    char report[256];
+    snprintf(report, sizeof(report), "connection reuse: %ld/%ld segments, startup cold %.2f ms, warm %.2f ms, "
+        "saved %.2f ms per reused segment", m_warm_num, total, cold_ms, warm_ms,
+        m_cold_num && m_warm_num ? cold_ms - warm_ms : 0);
+    return report;
+}
\ No newline at end of file
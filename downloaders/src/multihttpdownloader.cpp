@@ -0,0 +1,460 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-03-24 20:58:40
+ * @Description: 基于curl_multi和epoll的事件驱动http下载器
+ */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <future>
+#include <memory>
+#include "multihttpdownloader.h"
+using namespace std;
+
+MultiHttpDownloader::MultiHttpDownloader(int loop_num)
+    : m_loop_num(loop_num > 0 ? loop_num : 1)
+    , m_next_loop(0)
+    , m_stop(false) {
+
+}
+
+MultiHttpDownloader::~MultiHttpDownloader() {
+    StopLoops();
+}
+
+/**
+ * @description: 初始化下载器并启动事件循环
+ * @param {const string&} url 下载的url
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool MultiHttpDownloader::Init(const std::string& url) {
+    if (!HttpDownloader::Init(url)) {
+        return false;
+    }
+    return m_loops.empty() ? StartLoops() : true;
+}
+
+/**
+ * @description: 使用已知的文件大小初始化下载器并启动事件循环
+ * @param {const string&} url 下载的url
+ * @param {file_size_t} filesize 文件大小
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool MultiHttpDownloader::InitKnownSize(const std::string& url, file_size_t filesize) {
+    if (!HttpDownloader::InitKnownSize(url, filesize)) {
+        return false;
+    }
+    return m_loops.empty() ? StartLoops() : true;
+}
+
+/**
+ * @description: 启动所有事件循环
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool MultiHttpDownloader::StartLoops() {
+    // HTTP/2连接只在建立它的multi句柄内复用，每个连接一个事件循环，传输轮询分配即均分到各连接
+    int loop_num = m_http2_conns > 0 ? m_http2_conns : m_loop_num;
+    for (int i = 0; i < loop_num; i++) {
+        EventLoop* loop = new EventLoop();
+        m_loops.push_back(loop);
+        loop->multi = curl_multi_init();
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        loop->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (!loop->multi || loop->epoll_fd == -1 || loop->event_fd == -1) {
+            perror("create event loop failed:");
+            return false;
+        }
+
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = loop->event_fd;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &ev);
+
+        curl_multi_setopt(loop->multi, CURLMOPT_SOCKETFUNCTION, &MultiHttpDownloader::SocketCallback);
+        curl_multi_setopt(loop->multi, CURLMOPT_SOCKETDATA, loop);
+        curl_multi_setopt(loop->multi, CURLMOPT_TIMERFUNCTION, &MultiHttpDownloader::TimerCallback);
+        curl_multi_setopt(loop->multi, CURLMOPT_TIMERDATA, loop);
+        curl_multi_setopt(loop->multi, CURLMOPT_MAXCONNECTS, (long)MULTI_MAX_CONNECTS);
+        if (m_http2_conns > 0) {
+            // 同一事件循环内的传输作为流复用它自己的一个连接，新的传输等待该连接而不是另建连接
+            curl_multi_setopt(loop->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+            curl_multi_setopt(loop->multi, CURLMOPT_MAX_HOST_CONNECTIONS, 1L);
+        }
+
+        if (m_runner) {
+            auto exited = make_shared<promise<void>>();
+            loop->exited = exited->get_future();
+            if (m_runner([this, loop, exited] { RunLoop(loop); exited->set_value(); })) {
+                continue;
+            }
+            loop->exited = future<void>();
+            // 外部线程已被占满时少建事件循环，由已启动的事件循环承担所有传输；HTTP/2的连接数仍需保证
+            if (i > 0 && m_http2_conns == 0) {
+                m_loops.pop_back();
+                FreeLoop(loop);
+                break;
+            }
+        }
+        loop->worker = thread(&MultiHttpDownloader::RunLoop, this, loop);
+    }
+    return true;
+}
+
+/**
+ * @description: 停止并释放所有事件循环
+ */
+void MultiHttpDownloader::StopLoops() {
+    m_stop = true;
+    for (auto loop : m_loops) {
+        uint64_t one = 1;
+        if (loop->worker.joinable()) {
+            write(loop->event_fd, &one, sizeof(one));
+            loop->worker.join();
+        }
+        else if (loop->exited.valid()) {
+            write(loop->event_fd, &one, sizeof(one));
+            loop->exited.wait();
+        }
+
+        // 未完成的传输按失败处理
+        AddPending(loop);
+        for (auto transfer : loop->active) {
+            curl_multi_remove_handle(loop->multi, transfer->handle);
+            CurlHandlePool::Instance().Release(transfer->handle);
+            transfer->done(false);
+            delete transfer;
+        }
+        loop->active.clear();
+        FreeLoop(loop);
+    }
+    m_loops.clear();
+}
+
+/**
+ * @description: 释放事件循环的multi句柄和描述符，事件循环需已停止且没有传输
+ * @param {EventLoop*} loop 事件循环，返回后被释放
+ */
+void MultiHttpDownloader::FreeLoop(EventLoop* loop) {
+    if (loop->multi) {
+        curl_multi_cleanup(loop->multi);
+    }
+    if (loop->epoll_fd != -1) {
+        close(loop->epoll_fd);
+    }
+    if (loop->event_fd != -1) {
+        close(loop->event_fd);
+    }
+    delete loop;
+}
+
+/**
+ * @description: 设置运行事件循环的外部线程，需在初始化前调用，每个外部线程运行一个事件循环，传输轮询分配到各事件循环
+ * @param {TaskRunner} runner 执行长期任务的函数
+ * @param {int} thread_num 外部线程数，即最多的事件循环数
+ */
+void MultiHttpDownloader::SetTaskRunner(TaskRunner runner, int thread_num) {
+    m_runner = runner;
+    if (thread_num > 0) {
+        m_loop_num = thread_num;
+    }
+}
+
+/**
+ * @description: 下载文件，提交到事件循环后阻塞等待完成
+ * @param {const file_size_t} start_pos 下载起始字节
+ * @param {const file_size_t} end_pos 下载结束字节
+ * @param {DataDealCallback} call 管理器提供的回调函数
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool MultiHttpDownloader::Download(const file_size_t start_pos, const file_size_t end_pos, DataDealCallback call) {
+    promise<bool> result;
+    future<bool> done_future = result.get_future();
+    if (!DownloadAsync(start_pos, end_pos, call, [&result](bool ok) { result.set_value(ok); })) {
+        return false;
+    }
+    return done_future.get();
+}
+
+/**
+ * @description: 异步下载文件，数据回调和完成回调均在IO线程中执行
+ * @param {const file_size_t} start_pos 下载起始字节
+ * @param {const file_size_t} end_pos 下载结束字节
+ * @param {DataDealCallback} call 管理器提供的回调函数
+ * @param {DownloadDoneCallback} done 下载结束的回调函数，参数为是否成功
+ * @return {bool} 提交成功返回true， 失败返回false
+ */
+bool MultiHttpDownloader::DownloadAsync(const file_size_t start_pos, const file_size_t end_pos, DataDealCallback call,
+    DownloadDoneCallback done) {
+    if (m_loops.empty() || m_stop) {
+        return false;
+    }
+
+    Transfer* transfer = new Transfer();
+    transfer->call = call;
+    transfer->done = done;
+    string range = FormatRange(start_pos, end_pos);
+    transfer->context.call = &transfer->call;
+    transfer->context.pausable = true;
+    transfer->handle = CreateRangeHandle(range, &transfer->context);
+    if (!transfer->handle) {
+        delete transfer;
+        return false;
+    }
+    curl_easy_setopt(transfer->handle, CURLOPT_PRIVATE, transfer);
+
+    // 轮询分配到各事件循环，由IO线程加入multi句柄
+    EventLoop* loop = m_loops[m_next_loop++ % m_loops.size()];
+    {
+        lock_guard<mutex> guard(loop->pending_lock);
+        loop->pending.push_back(transfer);
+    }
+    uint64_t one = 1;
+    write(loop->event_fd, &one, sizeof(one));
+    return true;
+}
+
+/**
+ * @description: 事件循环主体
+ * @param {EventLoop*} loop 事件循环
+ */
+void MultiHttpDownloader::RunLoop(EventLoop* loop) {
+    epoll_event events[MULTI_MAX_EVENTS];
+    while (!m_stop) {
+        // 恢复传输后需要立即处理，需在计算超时前进行
+        long long resume = ResumePaused(loop);
+        int timeout_ms = -1;
+        if (loop->has_deadline) {
+            auto left = loop->deadline - chrono::steady_clock::now();
+            timeout_ms = left.count() > 0 ? (int)chrono::duration_cast<chrono::milliseconds>(left).count() + 1 : 0;
+        }
+        if (resume > 0) {
+            long long now = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now().time_since_epoch()).count();
+            int resume_ms = resume > now ? (int)((resume - now) / 1000000) + 1 : 0;
+            timeout_ms = timeout_ms < 0 ? resume_ms : min(timeout_ms, resume_ms);
+        }
+        // HTTP/2的多个流共用一个socket，curl 7.88有时已把某个流的数据全部读入内存却不再要求处理，
+        // socket上没有新事件时该流会一直停住，有传输时定期让curl处理所有传输
+        bool kick = m_http2_conns > 0 && !loop->active.empty();
+        if (kick) {
+            timeout_ms = timeout_ms < 0 ? MULTI_HTTP2_KICK_MS : min(timeout_ms, MULTI_HTTP2_KICK_MS);
+        }
+        if (!loop->active.empty()) {
+            auto left = loop->next_check - chrono::steady_clock::now();
+            int check_ms = left.count() > 0 ? (int)chrono::duration_cast<chrono::milliseconds>(left).count() + 1 : 0;
+            timeout_ms = timeout_ms < 0 ? check_ms : min(timeout_ms, check_ms);
+        }
+        int n = epoll_wait(loop->epoll_fd, events, MULTI_MAX_EVENTS, timeout_ms);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed:");
+            break;
+        }
+        if (n == 0 && kick) {
+            curl_multi_perform(loop->multi, &loop->running);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == loop->event_fd) {
+                uint64_t count = 0;
+                read(loop->event_fd, &count, sizeof(count));
+                AddPending(loop);
+                continue;
+            }
+            int flags = 0;
+            if (events[i].events & EPOLLIN) {
+                flags |= CURL_CSELECT_IN;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flags |= CURL_CSELECT_OUT;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                flags |= CURL_CSELECT_ERR;
+            }
+            curl_multi_socket_action(loop->multi, events[i].data.fd, flags, &loop->running);
+        }
+
+        // 到期后由curl处理内部定时任务，连接繁忙时也要检查，否则新加入的传输可能一直不开始
+        if (loop->has_deadline && chrono::steady_clock::now() >= loop->deadline) {
+            loop->has_deadline = false;
+            curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &loop->running);
+        }
+        CheckDone(loop);
+        CheckAlive(loop);
+    }
+}
+
+/**
+ * @description: 将提交的传输加入multi句柄
+ * @param {EventLoop*} loop 事件循环
+ */
+void MultiHttpDownloader::AddPending(EventLoop* loop) {
+    vector<Transfer*> pending;
+    {
+        lock_guard<mutex> guard(loop->pending_lock);
+        pending.swap(loop->pending);
+    }
+    for (auto transfer : pending) {
+        // 加入后curl会通过TimerCallback要求立即超时，从而开始传输
+        curl_multi_add_handle(loop->multi, transfer->handle);
+        loop->active.insert(transfer);
+    }
+}
+
+/**
+ * @description: 处理已结束的传输并执行完成回调
+ * @param {EventLoop*} loop 事件循环
+ */
+void MultiHttpDownloader::CheckDone(EventLoop* loop) {
+    CURLMsg* msg = nullptr;
+    int msgs_left = 0;
+    while ((msg = curl_multi_info_read(loop->multi, &msgs_left)) != nullptr) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+        Transfer* transfer = nullptr;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &transfer);
+        FinishTransfer(loop, transfer, msg->data.result);
+    }
+}
+
+/**
+ * @description: 将传输移出multi句柄，记录统计并执行完成回调
+ * @param {EventLoop*} loop 事件循环
+ * @param {Transfer*} transfer 已结束的传输，返回后被释放
+ * @param {CURLcode} res 传输结果
+ */
+void MultiHttpDownloader::FinishTransfer(EventLoop* loop, Transfer* transfer, CURLcode res) {
+    curl_multi_remove_handle(loop->multi, transfer->handle);
+    RecordTiming(transfer->handle);
+    if (res == CURLE_OK) {
+        RecordTransferStats(transfer->handle);
+    }
+    else {
+        RecordFailure(transfer->handle, res);
+    }
+    CurlHandlePool::Instance().Release(transfer->handle);
+    loop->active.erase(transfer);
+
+    // 回调主动中断（如片段被其他线程分走）不属于网络错误，由调用方判断
+    if (res != CURLE_OK && res != CURLE_WRITE_ERROR && res != CURLE_ABORTED_BY_CALLBACK) {
+        printf("curl transfer failed: %s\n", curl_easy_strerror(res));
+    }
+
+    // 完成回调中可能提交新的传输，新传输通过eventfd在下一轮加入
+    transfer->done(res == CURLE_OK);
+    delete transfer;
+}
+
+/**
+ * @description: 每隔TRANSFER_CHECK_MS以0字节调用各传输的回调，不应继续的传输直接移出multi句柄并结束
+ * @param {EventLoop*} loop 事件循环
+ */
+void MultiHttpDownloader::CheckAlive(EventLoop* loop) {
+    auto now = chrono::steady_clock::now();
+    if (loop->active.empty() || now < loop->next_check) {
+        return;
+    }
+    loop->next_check = now + chrono::milliseconds(TRANSFER_CHECK_MS);
+    // 收尾阶段落后的重复请求可能一直收不到数据，接收回调没有机会中断它，只能由事件循环主动结束
+    vector<Transfer*> stopped;
+    for (auto transfer : loop->active) {
+        if (!transfer->call(nullptr, 0)) {
+            stopped.push_back(transfer);
+        }
+    }
+    for (auto transfer : stopped) {
+        FinishTransfer(loop, transfer, CURLE_ABORTED_BY_CALLBACK);
+    }
+}
+
+/**
+ * @description: 恢复已到时间的被暂停传输
+ * @param {EventLoop*} loop 事件循环
+ * @return {long long} 最早的恢复时刻，纳秒，没有被暂停的传输时为0
+ */
+long long MultiHttpDownloader::ResumePaused(EventLoop* loop) {
+    if (loop->active.empty()) {
+        return 0;
+    }
+    long long now = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    long long next = 0;
+    vector<pair<Transfer*, CURLcode>> failed;
+    for (auto transfer : loop->active) {
+        long long resume = transfer->context.resume;
+        if (resume == 0) {
+            continue;
+        }
+        if (resume <= now) {
+            // 恢复时curl会重新传入暂停时的数据，回调中再次检查速率；在socket_action之外恢复时
+            // curl不一定通知超时，主动要求立即处理，否则已收完数据的传输可能一直不结束
+            transfer->context.resume = 0;
+            CURLcode res = curl_easy_pause(transfer->handle, CURLPAUSE_CONT);
+            loop->has_deadline = true;
+            loop->deadline = chrono::steady_clock::now();
+            // 重新传入的数据被回调拒绝时curl不会再报告该传输结束，需要自行结束
+            if (res != CURLE_OK) {
+                failed.push_back(make_pair(transfer, res));
+                continue;
+            }
+            resume = transfer->context.resume;
+        }
+        if (resume > 0 && (next == 0 || resume < next)) {
+            next = resume;
+        }
+    }
+    for (auto& one : failed) {
+        FinishTransfer(loop, one.first, one.second);
+    }
+    return next;
+}
+
+/**
+ * @description: curl通知需要关注的socket事件
+ * @return {int} 固定返回0
+ */
+int MultiHttpDownloader::SocketCallback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp) {
+    EventLoop* loop = (EventLoop*)userp;
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, s, nullptr);
+        curl_multi_assign(loop->multi, s, nullptr);
+        return 0;
+    }
+
+    epoll_event ev;
+    ev.events = 0;
+    ev.data.fd = s;
+    if (what & CURL_POLL_IN) {
+        ev.events |= EPOLLIN;
+    }
+    if (what & CURL_POLL_OUT) {
+        ev.events |= EPOLLOUT;
+    }
+
+    // 用socketp标记socket是否已注册
+    if (socketp) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, s, &ev);
+    }
+    else {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, s, &ev);
+        curl_multi_assign(loop->multi, s, loop);
+    }
+    return 0;
+}
+
+/**
+ * @description: curl通知下次超时时间
+ * @return {int} 固定返回0
+ */
+int MultiHttpDownloader::TimerCallback(CURLM* multi, long timeout_ms, void* userp) {
+    EventLoop* loop = (EventLoop*)userp;
+    loop->has_deadline = timeout_ms >= 0;
+    if (loop->has_deadline) {
+        loop->deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+    }
+    return 0;
+}
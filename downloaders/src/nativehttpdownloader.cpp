@@ -0,0 +1,533 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-16 20:48:22
+ * @Description: 自带的HTTP/1.1区间下载器
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <chrono>
+#include <thread>
+#include "nativehttpdownloader.h"
+using namespace std;
+
+#define NATIVE_KEEPIDLE     120 // 与curl下载器相同的TCP保活参数，秒
+#define NATIVE_KEEPINTVL    60
+
+// 传输结束与读取耗时在同一个工作线程
+static thread_local TransferTiming s_last_timing;
+static thread_local bool s_has_timing = false;
+
+/**
+ * @description: 获取单调时钟的当前时间
+ * @return {long long} 纳秒
+ */
+static long long NowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+NativeHttpDownloader::NativeHttpDownloader()
+    : m_native(false)
+    , m_addrs(nullptr) {
+
+}
+
+NativeHttpDownloader::~NativeHttpDownloader() {
+    for (int fd : m_idle_fds) {
+        close(fd);
+    }
+    if (m_addrs) {
+        freeaddrinfo(m_addrs);
+    }
+}
+
+/**
+ * @description: 初始化下载器，用curl探测文件信息，http链接解析出主机地址
+ * @param {const string&} url 下载的url
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool NativeHttpDownloader::Init(const std::string& url) {
+    if (!HttpDownloader::Init(url)) {
+        return false;
+    }
+    // 大小未知的响应可能是分块传输，交给curl解码；自带客户端只支持HTTP/1.1
+    m_native = m_size_known && m_http2_conns == 0 && PrepareNative();
+    return true;
+}
+
+/**
+ * @description: 使用已知的文件大小初始化下载器，不向服务器探测，视为不支持断点续传
+ * @param {const string&} url 下载的url
+ * @param {file_size_t} filesize 文件大小
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool NativeHttpDownloader::InitKnownSize(const std::string& url, file_size_t filesize) {
+    if (!HttpDownloader::InitKnownSize(url, filesize)) {
+        return false;
+    }
+    m_native = m_http2_conns == 0 && PrepareNative();
+    return true;
+}
+
+/**
+ * @description: 解析url并解析主机地址，不能由自带客户端下载时返回false
+ * @return {bool} 可以使用自带客户端返回true
+ */
+bool NativeHttpDownloader::PrepareNative() {
+    // 只处理明文http，设置了代理时交给curl
+    static const string scheme = "http://";
+    if (m_url.compare(0, scheme.size(), scheme) != 0 || getenv("http_proxy") || getenv("all_proxy")
+        || getenv("ALL_PROXY")) {
+        return false;
+    }
+    size_t host_start = scheme.size();
+    size_t host_end = m_url.find_first_of("/?#", host_start);
+    string authority = m_url.substr(host_start, host_end == string::npos ? string::npos : host_end - host_start);
+    // 带用户名密码的链接需要认证，交给curl
+    if (authority.empty() || authority.find('@') != string::npos) {
+        return false;
+    }
+    if (host_end == string::npos || m_url[host_end] == '#') {
+        m_path = "/";
+    }
+    else {
+        m_path = m_url.substr(host_end, m_url.find('#', host_end) - host_end);
+        if (m_path[0] == '?') {
+            m_path.insert(0, "/");
+        }
+    }
+
+    // 主机可以是方括号括起的IPv6地址
+    string host;
+    string port = "80";
+    size_t port_sep = string::npos;
+    if (authority[0] == '[') {
+        size_t close_bracket = authority.find(']');
+        if (close_bracket == string::npos) {
+            return false;
+        }
+        host = authority.substr(1, close_bracket - 1);
+        if (close_bracket + 1 < authority.size()) {
+            port_sep = authority[close_bracket + 1] == ':' ? close_bracket + 1 : string::npos;
+            if (port_sep == string::npos) {
+                return false;
+            }
+        }
+    }
+    else {
+        port_sep = authority.find(':');
+        host = authority.substr(0, port_sep);
+    }
+    if (port_sep != string::npos && port_sep + 1 < authority.size()) {
+        port = authority.substr(port_sep + 1);
+    }
+    m_host = authority;
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (m_addrs) {
+        freeaddrinfo(m_addrs);
+        m_addrs = nullptr;
+    }
+    int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &m_addrs);
+    if (ret != 0) {
+        printf("resolve %s failed: %s, fall back to curl\n", host.c_str(), gai_strerror(ret));
+        m_addrs = nullptr;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @description: 新建到服务器的连接
+ * @return {int} 成功返回socket， 失败返回-1
+ */
+int NativeHttpDownloader::Connect() {
+    for (addrinfo* addr = m_addrs; addr; addr = addr->ai_next) {
+        int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+            // 请求只有一个包，不等待合并
+            int on = 1;
+            int idle = NATIVE_KEEPIDLE;
+            int interval = NATIVE_KEEPINTVL;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+            // 接收定期超时返回，由Receive检查传输是否应继续并累计停滞时长
+            timeval timeout = {TRANSFER_CHECK_MS / 1000, TRANSFER_CHECK_MS % 1000 * 1000};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            return fd;
+        }
+        close(fd);
+    }
+    perror("connect failed:");
+    return -1;
+}
+
+/**
+ * @description: 取出一个空闲连接，没有时新建连接
+ * @param {bool&} reused 是否复用了空闲连接
+ * @return {int} 成功返回socket， 失败返回-1
+ */
+int NativeHttpDownloader::AcquireConnection(bool& reused) {
+    {
+        lock_guard<mutex> guard(m_idle_lock);
+        if (!m_idle_fds.empty()) {
+            int fd = m_idle_fds.back();
+            m_idle_fds.pop_back();
+            reused = true;
+            return fd;
+        }
+    }
+    reused = false;
+    return Connect();
+}
+
+/**
+ * @description: 归还可以复用的连接
+ * @param {int} fd socket
+ */
+void NativeHttpDownloader::ReleaseConnection(int fd) {
+    {
+        lock_guard<mutex> guard(m_idle_lock);
+        if (m_idle_fds.size() < NATIVE_IDLE_MAX_NUM) {
+            m_idle_fds.push_back(fd);
+            return;
+        }
+    }
+    close(fd);
+}
+
+/**
+ * @description: 接收数据，每隔TRANSFER_CHECK_MS收不到数据时检查传输是否应继续，持续收不到数据超过停滞超时时失败
+ * @param {int} fd socket
+ * @param {char*} buffer 接收缓冲区
+ * @param {size_t} size 缓冲区大小
+ * @param {const BufferCommitCallback*} check 以0字节调用，返回false时中断，为nullptr时不检查
+ * @return {ssize_t} 收到的字节数，连接关闭返回0，失败返回-1，停滞时errno为ETIMEDOUT，被中断时为ECANCELED
+ */
+ssize_t NativeHttpDownloader::Receive(int fd, char* buffer, size_t size, const BufferCommitCallback* check) {
+    int idle_ms = 0;
+    while (true) {
+        ssize_t ret = recv(fd, buffer, size, 0);
+        if (ret >= 0) {
+            return ret;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        // 对端不断开却不再发送时保活探测不到，超时后传输失败，由管理器从已写入的位置重试
+        idle_ms += TRANSFER_CHECK_MS;
+        if (check && !(*check)(nullptr, 0)) {
+            errno = ECANCELED;
+            return -1;
+        }
+        if (m_stall_timeout > 0 && idle_ms >= m_stall_timeout * 1000) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+/**
+ * @description: 解析响应头
+ * @param {const char*} head 响应头，不含结尾的空行
+ * @param {size_t} size 长度
+ * @param {NativeResponse&} response 解析结果
+ * @return {bool} 状态行格式正确返回true
+ */
+bool NativeHttpDownloader::ParseResponse(const char* head, size_t size, NativeResponse& response) {
+    string text(head, size);
+    size_t line_end = text.find("\r\n");
+    string status_line = text.substr(0, line_end);
+    // HTTP/1.0默认不保持连接
+    if (status_line.compare(0, 5, "HTTP/") != 0 || status_line.size() < 12) {
+        return false;
+    }
+    response.keep_alive = status_line.compare(0, 8, "HTTP/1.0") != 0;
+    response.status = atoi(status_line.c_str() + 9);
+
+    while (line_end != string::npos) {
+        size_t line_start = line_end + 2;
+        line_end = text.find("\r\n", line_start);
+        string line = text.substr(line_start, line_end == string::npos ? string::npos : line_end - line_start);
+        size_t colon = line.find(':');
+        if (colon == string::npos) {
+            continue;
+        }
+        // 字段名和取值都不区分大小写
+        string name = line.substr(0, colon);
+        for (auto& c : name) {
+            c = tolower(c);
+        }
+        size_t value_start = line.find_first_not_of(" \t", colon + 1);
+        string value = value_start == string::npos ? "" : line.substr(value_start);
+        for (auto& c : value) {
+            c = tolower(c);
+        }
+        if (name == "content-length") {
+            response.content_length = strtoll(value.c_str(), nullptr, 10);
+        }
+        else if (name == "transfer-encoding") {
+            response.chunked = value.find("chunked") != string::npos;
+        }
+        else if (name == "connection") {
+            if (value.find("close") != string::npos) {
+                response.keep_alive = false;
+            }
+            else if (value.find("keep-alive") != string::npos) {
+                response.keep_alive = true;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @description: 发送区间请求并接收响应头
+ * @param {int} fd socket
+ * @param {const string&} request 请求
+ * @param {NativeResponse&} response 解析后的响应头
+ * @param {char*} head 响应头缓冲区，大小为NATIVE_HEAD_MAX_SIZE
+ * @param {size_t&} head_size 响应头长度，响应体从head + head_size开始
+ * @param {size_t&} body_size 缓冲区中响应头之后已收到的响应体字节数
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool NativeHttpDownloader::Request(int fd, const string& request, NativeResponse& response, char* head,
+    size_t& head_size, size_t& body_size) {
+    size_t sent = 0;
+    while (sent < request.size()) {
+        ssize_t ret = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        sent += ret;
+    }
+
+    // 响应头之后的数据可能已一起收到，留给调用方作为响应体的开头
+    size_t received = 0;
+    while (received < NATIVE_HEAD_MAX_SIZE) {
+        ssize_t ret = Receive(fd, head + received, NATIVE_HEAD_MAX_SIZE - received, nullptr);
+        if (ret <= 0) {
+            return false;
+        }
+        size_t search_start = received > 3 ? received - 3 : 0;
+        received += ret;
+        void* end = memmem(head + search_start, received - search_start, "\r\n\r\n", 4);
+        if (end) {
+            head_size = (char*)end - head + 4;
+            body_size = received - head_size;
+            return ParseResponse(head, head_size - 4, response);
+        }
+    }
+    printf("response header too large\n");
+    return false;
+}
+
+/**
+ * @description: 按单连接速率节流，超速时在当前线程休眠
+ * @param {long long&} tat 理论到达时间，纳秒
+ * @param {file_size_t} rate 速率，字节/秒
+ * @param {size_t} size 收到的字节数
+ */
+void NativeHttpDownloader::Throttle(long long& tat, file_size_t rate, size_t size) {
+    long long now = NowNs();
+    long long cost = (long long)((double)size * 1e9 / rate);
+    tat = (tat > now ? tat : now) + cost;
+    long long wait = tat - now - CONN_RATE_BURST_NS;
+    if (wait > 0) {
+        this_thread::sleep_for(chrono::nanoseconds(wait));
+    }
+}
+
+/**
+ * @description: 零拷贝下载文件，数据直接接收到管理器提供的内存中
+ * @param {const file_size_t} start_pos 下载起始字节
+ * @param {const file_size_t} end_pos 下载结束字节
+ * @param {BufferAcquireCallback} acquire 申请目标内存的回调函数
+ * @param {BufferCommitCallback} commit 提交已接收数据的回调函数
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool NativeHttpDownloader::DownloadInto(const file_size_t start_pos, const file_size_t end_pos,
+    BufferAcquireCallback acquire, BufferCommitCallback commit) {
+    if (!m_native) {
+        return false;
+    }
+    string request = "GET " + m_path + " HTTP/1.1\r\nHost: " + m_host + "\r\nRange: bytes="
+        + to_string(start_pos) + "-" + to_string(end_pos) + "\r\nAccept: */*\r\n\r\n";
+    file_size_t rate = m_conn_rate;
+    long long tat = 0;
+    long long begin_ns = NowNs();
+    s_last_timing = TransferTiming();
+    s_has_timing = true;
+
+    // 复用的空闲连接可能已被服务器关闭，没收到响应时换新连接重试一次
+    NativeResponse response;
+    char head[NATIVE_HEAD_MAX_SIZE];
+    size_t head_size = 0;
+    size_t body_size = 0;
+    bool reused = false;
+    long long connect_ns = 0;
+    int fd = -1;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        long long connect_begin = NowNs();
+        fd = AcquireConnection(reused);
+        if (fd < 0) {
+            return false;
+        }
+        connect_ns = NowNs() - connect_begin;
+        long long request_begin = NowNs();
+        if (Request(fd, request, response, head, head_size, body_size)) {
+            s_last_timing.ttfb_us = (NowNs() - request_begin) / 1000;
+            break;
+        }
+        close(fd);
+        fd = -1;
+        if (!reused) {
+            break;
+        }
+    }
+    if (fd < 0) {
+        printf("native http request failed\n");
+        return false;
+    }
+    s_last_timing.connect_us = reused ? 0 : connect_ns / 1000;
+    {
+        lock_guard<mutex> guard(m_stats_lock);
+        if (reused) {
+            m_warm_num++;
+        }
+        else {
+            m_cold_num++;
+            m_cold_startup_us += connect_ns / 1000;
+        }
+    }
+
+    // 不支持Range的服务器对从0开始的请求返回整个文件，只取需要的部分
+    file_size_t expected = end_pos - start_pos + 1;
+    bool status_ok = response.status == 206 || (response.status == 200 && start_pos == 0);
+    if (!status_ok || response.chunked || response.content_length < 0
+        || (file_size_t)response.content_length < expected) {
+        if (response.status == 429 || response.status == 503) {
+            m_throttled_num++;
+        }
+        printf("native http request failed, http status %d\n", response.status);
+        close(fd);
+        s_last_timing.total_us = (NowNs() - begin_ns) / 1000;
+        return false;
+    }
+
+    // 先交付与响应头一起收到的数据，之后每次recv直接写入申请到的目标内存
+    file_size_t remain = expected;
+    const char* pending = head + head_size;
+    size_t pending_size = body_size < remain ? body_size : (size_t)remain;
+    bool ok = true;
+    while (remain > 0) {
+        size_t size = remain > (file_size_t)SIZE_MAX ? SIZE_MAX : (size_t)remain;
+        if (pending_size > 0 && size > pending_size) {
+            size = pending_size;
+        }
+        char* buffer = acquire(size);
+        if (!buffer || size == 0) {
+            ok = false;
+            break;
+        }
+        ssize_t ret = 0;
+        if (pending_size > 0) {
+            memcpy(buffer, pending, size);
+            pending += size;
+            pending_size -= size;
+            ret = size;
+        }
+        else {
+            ret = Receive(fd, buffer, size, &commit);
+            if (ret <= 0) {
+                // 被回调中断（如收尾阶段另一连接已写完片段）不属于网络错误，由调用方判断
+                if (ret == 0 || errno != ECANCELED) {
+                    printf("native http receive failed: %s\n", ret == 0 ? "connection closed"
+                        : errno == ETIMEDOUT ? "stalled" : strerror(errno));
+                }
+                ok = false;
+                break;
+            }
+        }
+        remain -= ret;
+        if (!commit(buffer, ret)) {
+            ok = false;
+            break;
+        }
+        if (rate > 0) {
+            Throttle(tat, rate, ret);
+        }
+    }
+    s_last_timing.total_us = (NowNs() - begin_ns) / 1000;
+
+    // 只有完整读完响应体的连接才能复用
+    if (ok && response.keep_alive && (file_size_t)response.content_length == expected && body_size <= expected) {
+        ReleaseConnection(fd);
+    }
+    else {
+        close(fd);
+    }
+    return ok;
+}
+
+/**
+ * @description: 下载文件，数据先收到自带的缓冲区再交给回调函数
+ * @param {const file_size_t} start_pos 下载起始字节
+ * @param {const file_size_t} end_pos 下载结束字节
+ * @param {DataDealCallback} call 管理器提供的回调函数
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool NativeHttpDownloader::Download(const file_size_t start_pos, const file_size_t end_pos, DataDealCallback call) {
+    if (!m_native) {
+        return HttpDownloader::Download(start_pos, end_pos, call);
+    }
+    vector<char> buffer(NATIVE_RECV_SIZE);
+    BufferAcquireCallback acquire = [&buffer](size_t& size)->char* {
+        if (size > buffer.size()) {
+            size = buffer.size();
+        }
+        return buffer.data();
+    };
+    BufferCommitCallback commit = [&call](const char* data, size_t size)->bool {
+        return call(data, size);
+    };
+    return DownloadInto(start_pos, end_pos, acquire, commit);
+}
+
+/**
+ * @description: 获取当前线程上最近结束的传输的耗时，需在Download返回后调用
+ * @param {TransferTiming&} timing 传输耗时
+ * @return {bool} 有记录返回true
+ */
+bool NativeHttpDownloader::GetLastTiming(TransferTiming& timing) {
+    if (!m_native) {
+        return HttpDownloader::GetLastTiming(timing);
+    }
+    if (!s_has_timing) {
+        return false;
+    }
+    timing = s_last_timing;
+    return true;
+}
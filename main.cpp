@@ -0,0 +1,592 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-13 10:21:36
+ * @Description: 命令行入口，下载单个文件或按清单批量下载
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <sstream>
+#include <iostream>
+#include "multithread_downloader.h"
+#include "batch_downloader.h"
+#include "zip_reader.h"
+#include "version.h"
+
+#define OPT_CHECKSUM        256 // 长选项--checksum
+#define OPT_LIMIT_RATE      257 // 长选项--limit-rate
+#define OPT_CONN_LIMIT_RATE 258 // 长选项--conn-limit-rate
+#define OPT_LIMIT_FILE      259 // 长选项--limit-file
+#define OPT_METRICS_JSON    260 // 长选项--metrics-json
+#define OPT_METRICS_PROM    261 // 长选项--metrics-prom
+#define OPT_IO_OPTIONS      262 // 长选项--io-opts
+#define OPT_HTTP2           263 // 长选项--http2
+#define OPT_SEED            264 // 长选项--seed
+#define OPT_DELTA_INDEX     265 // 长选项--delta-index
+#define OPT_MAKE_INDEX      266 // 长选项--make-index
+#define OPT_BLOCK_SIZE      267 // 长选项--block-size
+#define OPT_READ_RANGE      268 // 长选项--read-range
+#define OPT_ZIP_LIST        269 // 长选项--zip-list
+#define OPT_ZIP_EXTRACT     270 // 长选项--zip-extract
+#define OPT_CPU_AFFINITY    271 // 长选项--cpu-affinity
+#define OPT_MAX_MEMORY      272 // 长选项--max-memory
+#define OPT_STALL_TIMEOUT   273 // 长选项--stall-timeout
+
+/**
+ * @description: 解析IO选项列表
+ * @param {const string&} text 逗号分隔的prealloc、populate、writeback，或none
+ * @param {int&} options 解析结果，IoOption的按位组合
+ * @return {bool} 格式正确返回true， 否则返回false
+ */
+bool ParseIoOptions(const string& text, int& options) {
+    options = 0;
+    stringstream items(text);
+    string item;
+    while (getline(items, item, ',')) {
+        if (item == "prealloc") {
+            options |= IO_PREALLOC;
+        }
+        else if (item == "populate") {
+            options |= IO_POPULATE;
+        }
+        else if (item == "writeback") {
+            options |= IO_WRITEBACK;
+        }
+        else if (item != "none") {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @description: SIGHUP处理函数，请求重新读取带宽限制的控制文件
+ * @param {int} sig 信号
+ */
+void ReloadLimitHandler(int sig) {
+    BandwidthLimit::RequestReload();
+}
+
+/**
+ * @description: 将数据写入文件的回调函数
+ * @param {FILE*} file 文件
+ * @return {DataDealCallback}
+ */
+static DataDealCallback WriteTo(FILE* file) {
+    return [file](const char* data, size_t size)->bool {
+        return fwrite(data, 1, size, file) == size;
+    };
+}
+
+/**
+ * @description: 通过块缓存读取远程文件的一段，或列出、解压远程ZIP文件的成员
+ * @param {const string&} url 链接
+ * @param {DownloaderType} type 下载器类型
+ * @param {const string&} path 保存目录
+ * @param {const string&} range 读取的区间，格式为"起始字节-结束字节"，为空时不读取
+ * @param {bool} zip_list 是否列出ZIP成员
+ * @param {const string&} member 解压的ZIP成员，为空时不解压
+ * @return {bool} 成功返回true， 失败返回false
+ */
+static bool ReadRemote(const string& url, DownloaderType type, const string& path, const string& range,
+    bool zip_list, const string& member) {
+    RemoteFile file;
+    if (!file.Open(url, type)) {
+        return false;
+    }
+    bool ok = true;
+    if (!range.empty()) {
+        file_size_t start = 0;
+        file_size_t end = 0;
+        if (sscanf(range.c_str(), "%llu-%llu", &start, &end) != 2 || end < start || end >= file.GetFileSize()) {
+            printf("invalid range: %s, file size %llu\n", range.c_str(), file.GetFileSize());
+            return false;
+        }
+        string out_path = path + "/" + url.substr(url.find_last_of('/') + 1) + "." + range;
+        FILE* out = fopen(out_path.c_str(), "wb");
+        if (!out) {
+            perror("create output file failed:");
+            return false;
+        }
+        // 读取范围已知，不需要预读，每次读取的缺失块合并为一个请求
+        file.SetReadahead(0);
+        vector<char> buf(REMOTE_READAHEAD_MAX);
+        DataDealCallback write = WriteTo(out);
+        for (file_size_t pos = start; ok && pos <= end; pos += buf.size()) {
+            size_t size = end - pos + 1 < buf.size() ? (size_t)(end - pos + 1) : buf.size();
+            ok = file.Pread(buf.data(), size, pos) == (ssize_t)size && write(buf.data(), size);
+        }
+        ok = fclose(out) == 0 && ok;
+        if (ok) {
+            printf("bytes %s written to %s\n", range.c_str(), out_path.c_str());
+        }
+    }
+    if (ok && (zip_list || !member.empty())) {
+        ZipReader zip(&file);
+        ok = zip.Open();
+        if (ok && zip_list) {
+            for (auto& entry : zip.GetEntries()) {
+                printf("%12llu %12llu  %s\n", entry.size, entry.compressed_size, entry.name.c_str());
+            }
+        }
+        const ZipEntry* entry = ok && !member.empty() ? zip.Find(member) : nullptr;
+        if (ok && !member.empty() && !entry) {
+            printf("%s not found in the zip file\n", member.c_str());
+            ok = false;
+        }
+        if (entry) {
+            string out_path = path + "/" + member.substr(member.find_last_of('/') + 1);
+            FILE* out = fopen(out_path.c_str(), "wb");
+            if (!out) {
+                perror("create output file failed:");
+                return false;
+            }
+            ok = zip.Extract(*entry, WriteTo(out));
+            ok = fclose(out) == 0 && ok;
+            if (ok) {
+                printf("%s extracted to %s\n", member.c_str(), out_path.c_str());
+            }
+        }
+    }
+    RemoteFileStats stats = file.GetStats();
+    printf("fetched %llu of %llu bytes in %llu requests, cache hit %llu/%llu blocks\n", stats.fetched_bytes,
+        file.GetFileSize(), stats.requests, stats.hit_blocks, stats.hit_blocks + stats.miss_blocks);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    int ch;
+    string url;
+    string path;
+    int thread_num = 5;
+    int map_page_num = MAP_PAGE_NUM;
+    DownloaderType type = HTTP;
+    WriteMode write_mode = WRITE_MMAP;
+    int writer_num = 1;
+    string checksum;
+    string manifest;
+    int host_conn_num = 0;
+    vector<string> mirrors;
+    bool auto_conn = false;
+    file_size_t limit_rate = 0;
+    file_size_t conn_limit_rate = 0;
+    string limit_file;
+    string metrics_json;
+    string metrics_prom;
+    bool quiet = false;
+    int io_options = IO_DEFAULT_OPTIONS;
+    int http2_conns = 0;
+    string seed_path;
+    string delta_index;
+    string index_source;
+    int block_size = DELTA_BLOCK_SIZE;
+    string read_range;
+    bool zip_list = false;
+    string zip_member;
+    vector<int> cpus;
+    file_size_t max_memory = 0;
+    int stall_timeout = STALL_TIMEOUT_DEFAULT;
+    static const struct option long_options[] = {
+        {"checksum", required_argument, nullptr, OPT_CHECKSUM},
+        {"limit-rate", required_argument, nullptr, OPT_LIMIT_RATE},
+        {"conn-limit-rate", required_argument, nullptr, OPT_CONN_LIMIT_RATE},
+        {"limit-file", required_argument, nullptr, OPT_LIMIT_FILE},
+        {"metrics-json", required_argument, nullptr, OPT_METRICS_JSON},
+        {"metrics-prom", required_argument, nullptr, OPT_METRICS_PROM},
+        {"io-opts", required_argument, nullptr, OPT_IO_OPTIONS},
+        {"http2", optional_argument, nullptr, OPT_HTTP2},
+        {"seed", required_argument, nullptr, OPT_SEED},
+        {"delta-index", required_argument, nullptr, OPT_DELTA_INDEX},
+        {"make-index", required_argument, nullptr, OPT_MAKE_INDEX},
+        {"block-size", required_argument, nullptr, OPT_BLOCK_SIZE},
+        {"read-range", required_argument, nullptr, OPT_READ_RANGE},
+        {"zip-list", no_argument, nullptr, OPT_ZIP_LIST},
+        {"zip-extract", required_argument, nullptr, OPT_ZIP_EXTRACT},
+        {"cpu-affinity", required_argument, nullptr, OPT_CPU_AFFINITY},
+        {"max-memory", required_argument, nullptr, OPT_MAX_MEMORY},
+        {"stall-timeout", required_argument, nullptr, OPT_STALL_TIMEOUT},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    while ((ch = getopt_long(argc, argv, "t:u:d:p:e:w:W:b:H:m:qhv", long_options, nullptr)) != EOF) {
+        switch (ch) {
+        case 'u':
+        {
+            url.assign(optarg);
+            break;
+        }
+        case 'd':
+        {
+            path.assign(optarg);
+            cout << "filepath is  " << optarg << endl;
+            break;
+        }
+        case 'h':
+        {
+            cout << "Usage:" << endl;
+            cout << "-u * set URL" << endl;
+            cout << "-d * set file path to save result" << endl;
+            cout << "-h show this help" << endl;
+            cout << "-t set thread num (connection num for multi engine), default = 5; auto[:max] starts with "
+                << CONN_AUTO_START << " connections and adjusts by measured throughput, backing off on errors and "
+                "http 429/503, max default = " << CONN_AUTO_MAX << endl;
+            cout << "-p set map_page_num (4K pages per mmap window), default = " << MAP_PAGE_NUM << endl;
+            cout << "-e set download engine: thread (one thread per connection), multi (curl_multi event loop) or "
+                "native (one thread per connection, plain http received straight into the mmap window), "
+                "default = thread" << endl;
+            cout << "-w set write mode: mmap (write into mapped memory on network threads), pwrite (dedicated "
+                "writer threads) or direct (pwrite with O_DIRECT), default = mmap" << endl;
+            cout << "-W set writer thread num for pwrite/direct mode, default = 1" << endl;
+            cout << "-b download all files in a manifest, one \"url save_path [size|-] [checksum]\" per line, "
+                "save_path ending with / is a directory; -t is then the total connection num of all files" << endl;
+            cout << "-H set max connection num per host in batch mode, default = -t" << endl;
+            cout << "-m add a mirror URL of the same file, can be given multiple times; segments are spread over "
+                "all sources by measured speed, mirrors differing in size or ETag are ignored" << endl;
+            cout << "-q quiet, do not show the progress bar" << endl;
+            cout << "--checksum sha256:<hex>|crc32c:<hex> verify the file while downloading and fail on mismatch, "
+                "give only the algorithm to print the checksum" << endl;
+            cout << "--limit-rate <rate> limit the total download speed of all connections, e.g. 500K, 10M" << endl;
+            cout << "--conn-limit-rate <rate> limit the download speed of each connection" << endl;
+            cout << "--limit-file <file> read \"rate=<rate>\" and \"conn-rate=<rate>\" lines from a file, "
+                "reloaded when the file changes or on SIGHUP; overrides the two options above" << endl;
+            cout << "--metrics-json <file> write per-connection throughput, copy/remap/stall time and latency "
+                "percentiles to a JSON file when the download ends" << endl;
+            cout << "--metrics-prom <file> keep a Prometheus text file updated with the same metrics while "
+                "downloading, for node_exporter textfile collector" << endl;
+            cout << "--io-opts <list> comma separated file io options, or none: prealloc (fallocate the file), "
+                "populate (prefault mmap windows), writeback (start writeback of each finished mmap window), "
+                "default = prealloc,writeback" << endl;
+            cout << "--http2[=N] use HTTP/2 and carry the -t segments as multiplexed streams over at most N "
+                "connections per source, default N = 1; implies -e multi, plain http is upgraded to h2c, servers "
+                "without HTTP/2 fall back to HTTP/1.1" << endl;
+            cout << "--seed <file> delta download: copy the blocks that are unchanged in this local older copy and "
+                "fetch only the rest, needs the block index of the new file" << endl;
+            cout << "--delta-index <file|url> block index of the new file for --seed, default = URL + "
+                << DELTA_INDEX_SUFFIX << endl;
+            cout << "--make-index <file> write the block index of a file to <file>" << DELTA_INDEX_SUFFIX
+                << " and exit, publish it next to the file" << endl;
+            cout << "--block-size <bytes> block size for --make-index, default = " << DELTA_BLOCK_SIZE << endl;
+            cout << "--read-range <start>-<end> fetch only bytes start..end (inclusive) of the URL into "
+                "<-d>/<filename>.<start>-<end> through the block cache" << endl;
+            cout << "--zip-list list the members of a remote zip file, fetching only its central directory" << endl;
+            cout << "--zip-extract <member> extract one member of a remote zip file into the -d directory, "
+                "fetching only the directory and that member" << endl;
+            cout << "--cpu-affinity <cpus|node:N|nic:IFACE> pin the multi engine's io threads (one per cpu) or the "
+                "other engines' connection threads round-robin to a cpu list "
+                "like 0-3,8, to the cpus of numa node N, or to the cpus local to network interface IFACE" << endl;
+            cout << "--max-memory <size|auto> cap the mmap windows and not yet written back pages of all connections, "
+                "e.g. 256M (K/M/G/T suffixes); windows shrink and connections wait for writeback when over it, auto = 1/"
+                << BUDGET_CGROUP_SHARE << " of the cgroup memory limit" << endl;
+            cout << "--stall-timeout <seconds> fail and retry a segment whose connection receives nothing for this "
+                "long, 0 = never, default = " << STALL_TIMEOUT_DEFAULT << endl;
+            cout << "e.g. ./multithread_downloader -u "
+                "http://mirrors.163.com/centos-vault/6.2/isos/x86_64/CentOS-6.2-x86_64-netinstall.iso -d /root/"
+                << endl;
+            return 0;
+        }
+        case 't':
+        {
+            // auto或auto:最大连接数
+            string value(optarg);
+            if (value.compare(0, 4, "auto") == 0) {
+                auto_conn = true;
+                thread_num = value.size() > 5 && value[4] == ':' ? atoi(value.c_str() + 5) : CONN_AUTO_MAX;
+            }
+            else {
+                thread_num = atoi(optarg);
+            }
+            break;
+        }
+        case 'p':
+        {
+            map_page_num = atoi(optarg);
+            break;
+        }
+        case 'w':
+        {
+            string mode(optarg);
+            if (mode == "pwrite") {
+                write_mode = WRITE_PWRITE;
+            }
+            else if (mode == "direct") {
+                write_mode = WRITE_DIRECT;
+            }
+            else if (mode != "mmap") {
+                cout << "unknown write mode: " << optarg << endl;
+                return -1;
+            }
+            break;
+        }
+        case 'W':
+        {
+            writer_num = atoi(optarg);
+            break;
+        }
+        case 'e':
+        {
+            if (string(optarg) == "multi") {
+                type = HTTP_MULTI;
+            }
+            else if (string(optarg) == "native") {
+                type = HTTP_NATIVE;
+            }
+            else if (string(optarg) != "thread") {
+                cout << "unknown engine: " << optarg << endl;
+                return -1;
+            }
+            break;
+        }
+        case 'b':
+        {
+            manifest.assign(optarg);
+            break;
+        }
+        case 'H':
+        {
+            host_conn_num = atoi(optarg);
+            break;
+        }
+        case 'm':
+        {
+            mirrors.push_back(optarg);
+            break;
+        }
+        case 'q':
+        {
+            quiet = true;
+            break;
+        }
+        case OPT_CHECKSUM:
+        {
+            checksum.assign(optarg);
+            break;
+        }
+        case OPT_LIMIT_RATE:
+        case OPT_CONN_LIMIT_RATE:
+        {
+            if (!BandwidthLimit::ParseRate(optarg, ch == OPT_LIMIT_RATE ? limit_rate : conn_limit_rate)) {
+                cout << "invalid rate: " << optarg << endl;
+                return -1;
+            }
+            break;
+        }
+        case OPT_LIMIT_FILE:
+        {
+            limit_file.assign(optarg);
+            break;
+        }
+        case OPT_METRICS_JSON:
+        {
+            metrics_json.assign(optarg);
+            break;
+        }
+        case OPT_METRICS_PROM:
+        {
+            metrics_prom.assign(optarg);
+            break;
+        }
+        case OPT_IO_OPTIONS:
+        {
+            if (!ParseIoOptions(optarg, io_options)) {
+                cout << "invalid io options: " << optarg << endl;
+                return -1;
+            }
+            break;
+        }
+        case OPT_HTTP2:
+        {
+            http2_conns = optarg ? atoi(optarg) : 1;
+            if (http2_conns <= 0) {
+                cout << "invalid http2 connection num: " << optarg << endl;
+                return -1;
+            }
+            break;
+        }
+        case OPT_SEED:
+        {
+            seed_path.assign(optarg);
+            break;
+        }
+        case OPT_DELTA_INDEX:
+        {
+            delta_index.assign(optarg);
+            break;
+        }
+        case OPT_MAKE_INDEX:
+        {
+            index_source.assign(optarg);
+            break;
+        }
+        case OPT_BLOCK_SIZE:
+        {
+            block_size = atoi(optarg);
+            if (block_size <= 0) {
+                cout << "invalid block size: " << optarg << endl;
+                return -1;
+            }
+            break;
+        }
+        case OPT_READ_RANGE:
+        {
+            read_range.assign(optarg);
+            break;
+        }
+        case OPT_ZIP_LIST:
+        {
+            zip_list = true;
+            break;
+        }
+        case OPT_ZIP_EXTRACT:
+        {
+            zip_member.assign(optarg);
+            break;
+        }
+        case OPT_CPU_AFFINITY:
+        {
+            if (!WorkerPool::ParseAffinity(optarg, cpus)) {
+                cout << "invalid cpu affinity: " << optarg << endl;
+                return -1;
+            }
+            break;
+        }
+        case OPT_MAX_MEMORY:
+        {
+            // auto取cgroup内存上限的一部分，不在cgroup中或没有上限时不限制
+            if (string(optarg) == "auto") {
+                max_memory = MemoryBudget::DetectCgroupLimit() / BUDGET_CGROUP_SHARE;
+                if (max_memory == 0) {
+                    cout << "warning: no cgroup memory limit found, --max-memory auto is ignored" << endl;
+                }
+            }
+            else if (!MemoryBudget::ParseSize(optarg, max_memory) || max_memory == 0) {
+                cout << "invalid memory size: " << optarg << endl;
+                return -1;
+            }
+            break;
+        }
+        case OPT_STALL_TIMEOUT:
+        {
+            char* end = nullptr;
+            long value = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || value < 0 || value > INT_MAX) {
+                cout << "invalid stall timeout: " << optarg << endl;
+                return -1;
+            }
+            stall_timeout = (int)value;
+            break;
+        }
+        case 'v':
+        {
+            printf("version: %d.%d\n", MULTITHREAD_DOWNLOADER_VERSION_MAJOR, MULTITHREAD_DOWNLOADER_VERSION_MINOR);
+            break;
+        }
+        default:
+        {
+            cout << "undefined option: -" << ch << endl;
+        }
+        }
+    }
+    // 生成索引不需要下载
+    if (!index_source.empty()) {
+        DeltaIndex index;
+        string index_path = index_source + DELTA_INDEX_SUFFIX;
+        if (!index.Build(index_source, block_size) || !index.Save(index_path)) {
+            return -1;
+        }
+        printf("index written to %s, block size %d, sha256 %s\n", index_path.c_str(), block_size,
+            index.GetSha256().c_str());
+        return 0;
+    }
+    if (manifest.empty() && (url.empty() || path.empty())) {
+        cout << "please insert url by -u, and output path by -d!!" << endl;
+    }
+    // 只有事件循环能在一个连接上同时驱动多个流，阻塞的线程模式每个片段仍各占一个连接
+    if (http2_conns > 0 && type != HTTP_MULTI) {
+        cout << "--http2 multiplexes streams on the multi engine, switching to -e multi" << endl;
+        type = HTTP_MULTI;
+    }
+    // 多线程使用curl前需先全局初始化
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    // 随机读取只下载需要的区间
+    if (!read_range.empty() || zip_list || !zip_member.empty()) {
+        return ReadRemote(url, type, path, read_range, zip_list, zip_member) ? 0 : -1;
+    }
+
+    // 带宽限制由所有连接共用，需比下载管理器后析构
+    BandwidthLimit limit;
+    limit.SetRates(limit_rate, conn_limit_rate);
+    if (!limit_file.empty()) {
+        if (!limit.LoadFile(limit_file)) {
+            return -1;
+        }
+        signal(SIGHUP, ReloadLimitHandler);
+        limit.Watch(limit_file);
+    }
+    BandwidthLimit* shared_limit = limit.IsEnabled() || !limit_file.empty() ? &limit : nullptr;
+
+    // 内存预算同样由所有连接共用
+    MemoryBudget budget(max_memory);
+    MemoryBudget* shared_budget = max_memory > 0 ? &budget : nullptr;
+
+    // 批量模式下所有文件共用-t个连接
+    if (!manifest.empty()) {
+        BatchManager batch(thread_num, host_conn_num);
+        if (!batch.LoadManifest(manifest)) {
+            return -1;
+        }
+        batch.SetFileOptions(type, map_page_num, write_mode, writer_num);
+        batch.SetBandwidthLimit(shared_limit);
+        batch.SetMemoryBudget(shared_budget);
+        batch.SetHttp2(http2_conns);
+        batch.SetStallTimeout(stall_timeout);
+        batch.SetCpuAffinity(cpus);
+        return batch.Download() ? 0 : -1;
+    }
+    // 统计、进度条和线程池需比下载管理器后析构，未指定输出时不统计
+    DownloadMetrics metrics;
+    ConsoleProgress console(auto_conn);
+    WorkerPool workers(0, cpus);
+    DownloadManager app(thread_num, map_page_num);
+    app.SetWorkerPool(&workers);
+    app.SetWriteMode(write_mode, writer_num);
+    app.SetIoOptions(io_options);
+    app.SetAutoConnections(auto_conn);
+    app.SetBandwidthLimit(shared_limit);
+    app.SetMemoryBudget(shared_budget);
+    if (!quiet) {
+        app.SetProgressObserver(&console);
+    }
+    if (!metrics_json.empty() || !metrics_prom.empty()) {
+        if (!metrics.Init(thread_num, metrics_json, metrics_prom)) {
+            return -1;
+        }
+        app.SetMetrics(&metrics);
+    }
+    if (!checksum.empty() && !app.SetChecksum(checksum)) {
+        cout << "invalid checksum: " << checksum << endl;
+        return -1;
+    }
+    if (!seed_path.empty()) {
+        app.SetDelta(seed_path, delta_index);
+    }
+    DownloadInfo info(type, url);
+    info.mirrors = mirrors;
+    info.http2_conns = http2_conns;
+    info.stall_timeout = stall_timeout;
+    if (!app.Init(info, path)) {
+        cout << "error occur, please try again" << endl;
+        return -1;
+    }
+    if (!app.Download()) {
+        cout << "download failed, please try again" << endl;
+        return -1;
+    }
+    if (shared_budget && budget.GetWaitTime() > 0) {
+        printf("waited %.3f s for writeback to stay within --max-memory\n", budget.GetWaitTime() / 1e9);
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-03 20:18:36
+ * @Description: 带宽限制，总速率由所有连接共用的无锁令牌桶（GCRA）控制，单连接速率由下载器在接收回调中节流，
+ *               可通过控制文件和SIGHUP在运行时调整
+ */
+#ifndef _BANDWIDTH_LIMIT_H_
+#define _BANDWIDTH_LIMIT_H_
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "downloaders.h"
+using namespace std;
+
+#define LIMIT_BURST_NS          (100LL * 1000 * 1000) // 总速率允许的突发时长，纳秒
+#define LIMIT_WATCH_INTERVAL    1000 // 检查控制文件和重新加载信号的间隔，毫秒
+
+class BandwidthLimit {
+public:
+    BandwidthLimit(): m_tat(0), m_total_rate(0), m_conn_rate(0), m_watch_stop(false) {}
+    ~BandwidthLimit();
+
+    /**
+     * @description: 设置速率限制
+     * @param {file_size_t} total_rate 所有连接的总速率，字节/秒，0为不限制
+     * @param {file_size_t} conn_rate 单个连接的速率，字节/秒，0为不限制
+     */
+    void SetRates(file_size_t total_rate, file_size_t conn_rate);
+
+    /**
+     * @description: 收到数据后按总速率扣除令牌，返回需要等待的时长，多线程并发调用无锁
+     * @param {size_t} size 收到的字节数
+     * @return {long long} 需要等待的纳秒数，不需要等待时为0
+     */
+    long long Consume(size_t size);
+
+    /**
+     * @description: 获取单个连接的速率限制
+     * @return {file_size_t} 字节/秒，0为不限制
+     */
+    file_size_t GetConnRate() { return m_conn_rate; }
+
+    /**
+     * @description: 是否设置了任一限制
+     * @return {bool}
+     */
+    bool IsEnabled() { return m_total_rate > 0 || m_conn_rate > 0; }
+
+    /**
+     * @description: 读取控制文件，每行为"rate=速率"或"conn-rate=速率"，#开头为注释，未出现的项为不限制
+     * @param {const string&} path 控制文件路径
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool LoadFile(const string& path);
+
+    /**
+     * @description: 启动后台线程，控制文件修改或收到SIGHUP时重新读取
+     * @param {const string&} path 控制文件路径
+     */
+    void Watch(const string& path);
+
+    /**
+     * @description: 请求重新读取控制文件，可在信号处理函数中调用
+     */
+    static void RequestReload() { s_reload = true; }
+
+    /**
+     * @description: 解析速率，支持K、M、G后缀（1024进制）
+     * @param {const string&} text 速率文本
+     * @param {file_size_t&} rate 字节/秒
+     * @return {bool} 格式正确返回true， 否则返回false
+     */
+    static bool ParseRate(const string& text, file_size_t& rate);
+
+private:
+    /**
+     * @description: 后台线程主体，按间隔检查控制文件的修改时间和重新加载请求
+     */
+    void WatchLoop();
+
+    atomic<long long> m_tat; // 理论到达时间，纳秒，为下一份数据按总速率应到达的时刻
+    atomic<file_size_t> m_total_rate; // 总速率，字节/秒
+    atomic<file_size_t> m_conn_rate; // 单连接速率，字节/秒
+    string m_watch_path; // 控制文件路径
+    thread m_watch_thread; // 检查控制文件的线程
+    mutex m_watch_lock; // 与m_watch_cond配合，用于及时停止后台线程
+    condition_variable m_watch_cond;
+    bool m_watch_stop; // 停止后台线程
+    static atomic<bool> s_reload; // 收到重新加载信号
+};
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-19 20:41:05
+ * @Description: 缓存行大小和按缓存行对齐的数组分配，各连接独占缓存行的数据用它分配以避免伪共享
+ */
+#ifndef _CACHE_LINE_H_
+#define _CACHE_LINE_H_
+#include <stdlib.h>
+#include <new>
+
+#define CACHE_LINE_SIZE     64
+
+/**
+ * @description: 按缓存行对齐分配并构造数组，C++11的new和std::allocator不保证超过16字节的对齐
+ * @param {int} num 元素个数
+ * @return {T*} 失败返回nullptr
+ */
+template <class T>
+T* AllocCacheAligned(int num) {
+    void* mem = nullptr;
+    if (0 != posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(T) * (num > 0 ? num : 1))) {
+        return nullptr;
+    }
+    T* objs = (T*)mem;
+    for (int i = 0; i < num; i++) {
+        new (&objs[i]) T();
+    }
+    return objs;
+}
+
+/**
+ * @description: 析构并释放AllocCacheAligned分配的数组
+ * @param {T*} objs 数组，可为nullptr
+ * @param {int} num 元素个数
+ */
+template <class T>
+void FreeCacheAligned(T* objs, int num) {
+    if (objs == nullptr) {
+        return;
+    }
+    for (int i = 0; i < num; i++) {
+        objs[i].~T();
+    }
+    free(objs);
+}
+
+#endif
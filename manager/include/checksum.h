@@ -0,0 +1,75 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-18 20:14:52
+ * @Description: 校验算法，CRC32C优先使用SSE4.2/ARMv8指令，SHA-256优先使用SHA扩展指令
+ */
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "downloaders.h"
+using namespace std;
+
+#define CRC32C_POLY         0x82f63b78 // CRC32C反转多项式
+#define SHA256_BLOCK_SIZE   64
+#define SHA256_DIGEST_SIZE  32
+
+/**
+ * @description: 计算CRC32C，可在前一段结果上继续计算
+ * @param {uint32_t} crc 前一段数据的CRC，首段为0
+ * @param {const char*} data 数据
+ * @param {size_t} size 数据大小
+ * @return {uint32_t} 到当前数据为止的CRC
+ */
+uint32_t Crc32c(uint32_t crc, const char* data, size_t size);
+
+/**
+ * @description: 合并相邻两段数据的CRC32C，无需重新读取数据
+ * @param {uint32_t} crc1 前一段数据的CRC
+ * @param {uint32_t} crc2 后一段数据的CRC
+ * @param {file_size_t} len2 后一段数据的长度
+ * @return {uint32_t} 两段数据连起来的CRC
+ */
+uint32_t Crc32cCombine(uint32_t crc1, uint32_t crc2, file_size_t len2);
+
+/**
+ * @description: 将字节转换为小写十六进制字符串
+ * @param {const uint8_t*} data 数据
+ * @param {size_t} size 数据大小
+ * @return {string}
+ */
+string ToHex(const uint8_t* data, size_t size);
+
+class Sha256 {
+public:
+    Sha256();
+
+    /**
+     * @description: 追加数据
+     * @param {const char*} data 数据
+     * @param {size_t} size 数据大小
+     */
+    void Update(const char* data, size_t size);
+
+    /**
+     * @description: 结束计算
+     * @return {string} 十六进制摘要
+     */
+    string Final();
+
+    /**
+     * @description: 结束计算，输出原始摘要
+     * @param {uint8_t*} digest 摘要，长度为SHA256_DIGEST_SIZE
+     */
+    void Final(uint8_t* digest);
+
+private:
+    uint32_t m_state[8]; // 中间状态
+    uint8_t m_buf[SHA256_BLOCK_SIZE]; // 未满一块的数据
+    size_t m_buf_size; // m_buf中的字节数
+    uint64_t m_total; // 已追加的总字节数
+};
+
+#endif
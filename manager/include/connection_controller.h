@@ -0,0 +1,65 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-28 19:12:47
+ * @Description: 连接数控制器，按总吞吐量的变化以加性增、乘性减（AIMD）的方式调整连接数
+ */
+#ifndef _CONNECTION_CONTROLLER_H_
+#define _CONNECTION_CONTROLLER_H_
+
+#define CONN_AUTO_START         2 // 自动模式的初始连接数
+#define CONN_AUTO_MAX           32 // 自动模式默认的最大连接数
+#define CONN_SAMPLE_INTERVAL    1000 // 吞吐量采样间隔，毫秒
+#define CONN_GAIN_THRESHOLD     0.05 // 吞吐量提升超过该比例才认为增加连接有效
+#define CONN_HOLD_SAMPLES       10 // 增加连接无效或退避后保持连接数的采样次数
+#define CONN_RATE_ALPHA         0.5 // 保持期间吞吐量基准的滑动平均权重
+#define CONN_MAX_FAIL_STREAK    10 // 自动模式下已减到一个连接后片段仍连续失败该次数时停止下载
+
+class ConnectionController {
+public:
+    ConnectionController()
+        : m_limit(1)
+        , m_max(1)
+        , m_prev_limit(1)
+        , m_base_rate(0)
+        , m_slow_start(true)
+        , m_settle(0)
+        , m_hold(0) {}
+
+    /**
+     * @description: 初始化控制器
+     * @param {int} start 初始连接数
+     * @param {int} max_limit 最大连接数
+     */
+    void Init(int start, int max_limit);
+
+    /**
+     * @description: 输入一次采样，返回调整后的连接数
+     * @param {double} rate 本次采样间隔内的总吞吐量，字节/秒
+     * @param {bool} congested 采样间隔内是否出现失败或服务器限流
+     * @return {int} 连接数
+     */
+    int Update(double rate, bool congested);
+
+    /**
+     * @description: 获取当前连接数
+     * @return {int}
+     */
+    int GetLimit() { return m_limit; }
+
+private:
+    /**
+     * @description: 增加连接数，慢启动阶段翻倍，之后每次加一
+     */
+    void Grow();
+
+    int m_limit; // 当前连接数
+    int m_max; // 最大连接数
+    int m_prev_limit; // 上次增加前的连接数，增加无效时回退到该值
+    double m_base_rate; // 当前连接数下的吞吐量基准，0表示尚未测得
+    bool m_slow_start; // 是否处于慢启动阶段
+    int m_settle; // 连接数变化后跳过的采样次数，新连接建立期间吞吐量不准确
+    int m_hold; // 剩余的保持采样次数
+};
+
+#endif
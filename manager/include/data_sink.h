@@ -0,0 +1,253 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-25 19:36:14
+ * @Description: 收到数据后的写入流水线，各级（预留、写盘、校验、计数、限速）在编译期组合，
+ *               调用在编译时展开和内联，不经过std::function或虚函数
+ */
+#ifndef _DATA_SINK_H_
+#define _DATA_SINK_H_
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include "cache_line.h"
+#include "segment_scheduler.h"
+#include "pwrite_writer.h"
+#include "stream_verifier.h"
+#include "progress_observer.h"
+#include "bandwidth_limit.h"
+#include "download_metrics.h"
+using namespace std;
+
+// 流经流水线的一块数据，各级可修改位置和范围
+struct SinkChunk {
+    SinkChunk(int conn_id, file_size_t file_pos, const char* buf, size_t buf_size)
+        : conn(conn_id), pos(file_pos), data(buf), size(buf_size), recv_size(buf_size) {}
+    int conn; // 连接序号
+    file_size_t pos; // 数据在文件中的位置
+    const char* data; // 待写入的数据
+    size_t size; // 待写入的字节数
+    size_t recv_size; // 收到的字节数，包括跳过和截断的部分
+};
+
+// 一个连接的写入状态，只由该连接所在的线程访问，按缓存行对齐，相邻连接不会写同一缓存行
+struct alignas(CACHE_LINE_SIZE) ConnWriteState {
+    ConnWriteState(): mem(nullptr), map_offset(0), map_size(0), written_start(0), written_end(0) {}
+    char* mem; // 映射的内存地址
+    file_size_t map_offset; // 映射内存对应的文件位置
+    size_t map_size; // 映射的字节数
+    file_size_t written_start; // 尚未记入日志的已写入区间起始位置
+    file_size_t written_end; // 尚未记入日志的已写入区间结束位置
+};
+
+// 流水线，依次交给各级处理，某一级返回false时中止
+template <class... Stages>
+class SinkPipeline;
+
+template <>
+class SinkPipeline<> {
+public:
+    bool Put(SinkChunk& chunk) { return true; }
+};
+
+template <class Stage, class... Rest>
+class SinkPipeline<Stage, Rest...> {
+public:
+    SinkPipeline(const Stage& stage, const Rest&... rest): m_stage(stage), m_rest(rest...) {}
+
+    /**
+     * @description: 处理一块数据
+     * @param {SinkChunk&} chunk 数据
+     * @return {bool} 各级都成功返回true
+     */
+    inline bool Put(SinkChunk& chunk) { return m_stage.Put(chunk) && m_rest.Put(chunk); }
+
+private:
+    Stage m_stage; // 本级
+    SinkPipeline<Rest...> m_rest; // 之后的各级
+};
+
+/**
+ * @description: 由各级组合出流水线
+ * @param {const Stages&...} stages 各级，按处理顺序排列
+ * @return {SinkPipeline<Stages...>}
+ */
+template <class... Stages>
+inline SinkPipeline<Stages...> MakeSinkPipeline(const Stages&... stages) {
+    return SinkPipeline<Stages...>(stages...);
+}
+
+// 丢弃数据
+class NullSink {
+public:
+    inline bool Put(SinkChunk& chunk) { return true; }
+};
+
+// 在连接当前片段内预留写入区间，跳过已被其他连接写入的开头，截掉已被分走的结尾
+class ReserveSink {
+public:
+    explicit ReserveSink(SegmentScheduler* scheduler): m_scheduler(scheduler) {}
+
+    inline bool Put(SinkChunk& chunk) {
+        size_t skip = 0;
+        chunk.size = m_scheduler->Reserve(chunk.conn, chunk.recv_size, chunk.pos, skip);
+        chunk.data += skip;
+        return true;
+    }
+
+private:
+    SegmentScheduler* m_scheduler;
+};
+
+// 复制到连接的映射内存，超出映射窗口时由Mapper重新映射，Mapper需提供MapToFile和RecordWritten
+template <class Mapper>
+class MmapSink {
+public:
+    MmapSink(Mapper* mapper, ConnWriteState* states): m_mapper(mapper), m_states(states) {}
+
+    inline bool Put(SinkChunk& chunk) {
+        ConnWriteState& state = m_states[chunk.conn];
+        file_size_t pos = chunk.pos;
+        const char* data = chunk.data;
+        size_t remain = chunk.size;
+        // 开始写新的片段时，先记录之前片段已写入的区间
+        if (pos != state.written_end) {
+            m_mapper->RecordWritten(chunk.conn);
+            state.written_start = pos;
+            state.written_end = pos;
+        }
+        while (remain > 0) {
+            if (state.mem == nullptr || pos < state.map_offset || pos >= state.map_offset + state.map_size) {
+                if (!m_mapper->MapToFile(chunk.conn, pos)) {
+                    return false;
+                }
+            }
+            size_t mem_pos = (size_t)(pos - state.map_offset);
+            size_t copy_size = state.map_size - mem_pos < remain ? state.map_size - mem_pos : remain;
+            memcpy(state.mem + mem_pos, data, copy_size);
+            data += copy_size;
+            remain -= copy_size;
+            pos += copy_size;
+            state.written_end = pos;
+        }
+        return true;
+    }
+
+private:
+    Mapper* m_mapper;
+    ConnWriteState* m_states;
+};
+
+// 零拷贝接收时数据已在映射内存中，只记录已写入的区间
+template <class Mapper>
+class MmapCommitSink {
+public:
+    MmapCommitSink(Mapper* mapper, ConnWriteState* states): m_mapper(mapper), m_states(states) {}
+
+    inline bool Put(SinkChunk& chunk) {
+        if (chunk.size == 0) {
+            return true;
+        }
+        ConnWriteState& state = m_states[chunk.conn];
+        if (chunk.pos != state.written_end) {
+            m_mapper->RecordWritten(chunk.conn);
+            state.written_start = chunk.pos;
+        }
+        state.written_end = chunk.pos + chunk.size;
+        return true;
+    }
+
+private:
+    Mapper* m_mapper;
+    ConnWriteState* m_states;
+};
+
+// 放入pwrite写线程的环形缓冲区
+class PwriteSink {
+public:
+    explicit PwriteSink(PwriteWriter* writer): m_writer(writer) {}
+
+    inline bool Put(SinkChunk& chunk) { return m_writer->Write(chunk.conn, chunk.pos, chunk.data, chunk.size); }
+
+private:
+    PwriteWriter* m_writer;
+};
+
+// 统计内层写盘的耗时，不包括期间的重新映射，未设置统计时直接调用内层
+template <class Inner>
+class TimedSink {
+public:
+    TimedSink(const Inner& inner, DownloadMetrics* metrics): m_inner(inner), m_metrics(metrics) {}
+
+    inline bool Put(SinkChunk& chunk) {
+        if (!m_metrics) {
+            return m_inner.Put(chunk);
+        }
+        long long begin_ns = MetricsNow();
+        long long remap_ns = m_metrics->GetRemapTime(chunk.conn);
+        if (!m_inner.Put(chunk)) {
+            return false;
+        }
+        long long copy_ns = MetricsNow() - begin_ns - (m_metrics->GetRemapTime(chunk.conn) - remap_ns);
+        m_metrics->RecordData(chunk.conn, chunk.size, begin_ns, copy_ns);
+        return true;
+    }
+
+private:
+    Inner m_inner;
+    DownloadMetrics* m_metrics;
+};
+
+// 累加连接的校验状态
+class HashSink {
+public:
+    explicit HashSink(StreamVerifier* verifier): m_verifier(verifier) {}
+
+    inline bool Put(SinkChunk& chunk) {
+        m_verifier->Update(chunk.conn, chunk.pos, chunk.data, chunk.size);
+        return true;
+    }
+
+private:
+    StreamVerifier* m_verifier;
+};
+
+// 累加连接已下载的字节数
+class CountSink {
+public:
+    explicit CountSink(ProgressCounters* counters): m_counters(counters) {}
+
+    inline bool Put(SinkChunk& chunk) {
+        m_counters->Add(chunk.conn, chunk.size);
+        return true;
+    }
+
+private:
+    ProgressCounters* m_counters;
+};
+
+// 按收到的字节数扣除总速率的令牌，超出时阻塞当前连接，接收缓冲区填满后由TCP限制对端发送
+class LimitSink {
+public:
+    LimitSink(BandwidthLimit* limit, DownloadMetrics* metrics): m_limit(limit), m_metrics(metrics) {}
+
+    inline bool Put(SinkChunk& chunk) {
+        if (!m_limit) {
+            return true;
+        }
+        long long wait = m_limit->Consume(chunk.recv_size);
+        if (wait > 0) {
+            this_thread::sleep_for(chrono::nanoseconds(wait));
+            if (m_metrics) {
+                m_metrics->RecordLimitWait(chunk.conn, wait);
+            }
+        }
+        return true;
+    }
+
+private:
+    BandwidthLimit* m_limit;
+    DownloadMetrics* m_metrics;
+};
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-20 10:12:36
+ * @Description: 增量下载的块校验索引。索引记录新文件每个整块的弱校验（滚动和）和强校验（SHA-256前缀），
+ *               在本地旧文件中逐字节滑动查找相同的块，找到的块本地复制，其余区间再从服务器下载
+ */
+#ifndef _DELTA_INDEX_H_
+#define _DELTA_INDEX_H_
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "checksum.h"
+using namespace std;
+
+#define DELTA_INDEX_SUFFIX  ".zidx" // 索引文件后缀，默认从下载链接加后缀处获取
+#define DELTA_MAGIC         0x5a44544d // "MTDZ"
+#define DELTA_VERSION       1
+#define DELTA_BLOCK_SIZE    4096 // 默认块大小
+#define DELTA_STRONG_SIZE   16 // 每块保存的SHA-256前缀字节数
+#define DELTA_SCAN_SIZE     (1024 * 1024) // 扫描本地文件时每批计算弱校验的窗口数
+#define DELTA_MIN_RUN       (64 * 1024) // 两段缺失区间之间短于该长度的相同区间也重新下载，合并为一个请求
+#define DELTA_COPY_SIZE     (1024 * 1024) // 复制相同区间的单次大小
+
+// 本地文件与新文件相同的一段连续区间
+struct DeltaRange {
+    file_size_t target; // 在新文件中的起始字节
+    file_size_t seed; // 在本地文件中的起始字节
+    file_size_t size; // 字节数
+};
+
+class DeltaIndex {
+public:
+    DeltaIndex(): m_block_size(0), m_filesize(0), m_filter_shift(0) {}
+
+    /**
+     * @description: 读取文件生成索引
+     * @param {const string&} path 文件路径
+     * @param {uint32_t} block_size 块大小
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Build(const string& path, uint32_t block_size);
+
+    /**
+     * @description: 保存索引
+     * @param {const string&} path 索引文件路径
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Save(const string& path);
+
+    /**
+     * @description: 解析索引内容
+     * @param {const string&} data 索引文件内容
+     * @return {bool} 格式正确返回true， 否则返回false
+     */
+    bool Parse(const string& data);
+
+    /**
+     * @description: 在本地文件中查找与新文件相同的块，相邻的块合并为连续区间
+     * @param {const string&} seed_path 本地文件路径
+     * @param {vector<DeltaRange>&} ranges 相同区间，按在新文件中的位置排序
+     * @return {bool} 成功返回true，本地文件无法读取时返回false
+     */
+    bool Match(const string& seed_path, vector<DeltaRange>& ranges);
+
+    /**
+     * @description: 将本地文件中的相同区间复制到新文件
+     * @param {const string&} seed_path 本地文件路径
+     * @param {int} fd 新文件描述符
+     * @param {const vector<DeltaRange>&} ranges 相同区间
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    static bool Copy(const string& seed_path, int fd, const vector<DeltaRange>& ranges);
+
+    /**
+     * @description: 去掉夹在两段缺失区间之间且短于min_run的相同区间，使缺失区间合并为较少的请求
+     * @param {vector<DeltaRange>&} ranges 相同区间，按在新文件中的位置排序
+     * @param {file_size_t} filesize 新文件大小
+     * @param {file_size_t} min_run 保留的最短长度
+     */
+    static void Coalesce(vector<DeltaRange>& ranges, file_size_t filesize, file_size_t min_run);
+
+    uint32_t GetBlockSize() { return m_block_size; }
+    file_size_t GetFileSize() { return m_filesize; }
+
+    /**
+     * @description: 获取新文件的SHA-256，用于下载后校验
+     * @return {string} 十六进制摘要
+     */
+    string GetSha256() { return ToHex(m_sha256, sizeof(m_sha256)); }
+
+private:
+    /**
+     * @description: 建立弱校验的查找表和过滤位图
+     */
+    void BuildLookup();
+
+    uint32_t m_block_size; // 块大小
+    file_size_t m_filesize; // 新文件大小
+    uint8_t m_sha256[SHA256_DIGEST_SIZE]; // 新文件的SHA-256
+    vector<uint32_t> m_weak; // 各整块的弱校验，末尾不足一块的部分没有校验，总是重新下载
+    vector<uint8_t> m_strong; // 各整块的强校验，每块DELTA_STRONG_SIZE字节
+    vector<pair<uint32_t, uint32_t>> m_lookup; // 按弱校验排序的弱校验和块序号
+    vector<uint64_t> m_filter; // 弱校验的过滤位图，大部分不匹配的窗口只需查一次位图
+    int m_filter_shift; // 弱校验散列后右移的位数，得到位图下标
+};
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-02 19:48:26
+ * @Description: 下载日志，记录已写入的区间以及校验用的文件信息，进程重启后只下载缺失的区间
+ */
+#ifndef _DOWNLOAD_JOURNAL_H_
+#define _DOWNLOAD_JOURNAL_H_
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+#include <condition_variable>
+#include "downloaders.h"
+using namespace std;
+
+#define JOURNAL_SUFFIX          ".journal" // 日志文件后缀
+#define JOURNAL_MAGIC           0x4a44544d // "MTDJ"
+#define JOURNAL_VERSION         1
+#define JOURNAL_FLUSH_INTERVAL  1000 // 后台刷新间隔，毫秒
+#define JOURNAL_FLUSH_BATCH     64 // 积累的区间数达到该值时提前刷新
+
+// 日志校验信息，与服务器当前信息不一致时日志作废
+struct JournalInfo {
+    JournalInfo(): filesize(0) {}
+    file_size_t filesize; // 文件大小
+    string url; // 下载链接
+    string etag; // 服务器返回的ETag
+    string last_modified; // 服务器返回的Last-Modified
+};
+
+class DownloadJournal {
+public:
+    DownloadJournal(): m_fd(-1), m_data_fd(-1), m_stop(false) {}
+    ~DownloadJournal();
+
+    /**
+     * @description: 读取已有日志，校验信息一致时返回已完成区间
+     * @param {const string&} path 日志文件路径
+     * @param {const JournalInfo&} info 当前文件的校验信息
+     * @param {map<file_size_t, file_size_t>&} done 已完成区间，起始字节->结束字节
+     * @return {bool} 日志有效返回true，不存在或已作废返回false
+     */
+    bool Load(const string& path, const JournalInfo& info, map<file_size_t, file_size_t>& done);
+
+    /**
+     * @description: 以合并后的已完成区间重写日志，并启动后台刷新线程
+     * @param {const string&} path 日志文件路径
+     * @param {const JournalInfo&} info 当前文件的校验信息
+     * @param {const map<file_size_t, file_size_t>&} done 已完成区间
+     * @param {int} data_fd 下载文件的描述符，刷新日志前先将其数据落盘
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Open(const string& path, const JournalInfo& info, const map<file_size_t, file_size_t>& done, int data_fd);
+
+    /**
+     * @description: 记录已写入的区间，由后台线程批量落盘
+     * @param {file_size_t} start 起始字节
+     * @param {file_size_t} end 结束字节（不包含）
+     */
+    void Record(file_size_t start, file_size_t end);
+
+    /**
+     * @description: 停止后台线程并刷新剩余记录
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Close();
+
+    /**
+     * @description: 下载完成后关闭并删除日志
+     */
+    void Remove();
+
+private:
+    /**
+     * @description: 后台刷新线程主体
+     */
+    void FlushLoop();
+
+    /**
+     * @description: 先将下载文件落盘，再写入积累的区间记录
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Flush();
+
+    string m_path; // 日志文件路径
+    int m_fd; // 日志文件描述符
+    int m_data_fd; // 下载文件描述符
+    bool m_stop; // 是否停止后台线程
+    mutex m_lock; // 保护m_pending和m_stop
+    mutex m_flush_lock; // 保证同一时间只有一个线程刷新
+    condition_variable m_cond; // 唤醒后台线程
+    vector<file_size_t> m_pending; // 尚未落盘的区间，起始与结束交替存放
+    thread m_flusher; // 后台刷新线程
+};
+
+#endif
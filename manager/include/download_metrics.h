@@ -0,0 +1,222 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-09 20:14:52
+ * @Description: 下载过程的性能统计，每个连接一个按缓存行对齐的槽，只由该连接写入，
+ *               耗时分布使用对数分桶的直方图，可输出JSON报告和Prometheus文本文件
+ */
+#ifndef _DOWNLOAD_METRICS_H_
+#define _DOWNLOAD_METRICS_H_
+#include <string>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include "downloaders.h"
+#include "pwrite_writer.h"
+using namespace std;
+
+#define HIST_SUB_BITS       4 // 每个2的幂区间再分为2^HIST_SUB_BITS个桶，相对误差不超过1/16
+#define HIST_MAX_EXP        36 // 可记录的最大值为2^HIST_MAX_EXP纳秒（约68秒），更大的值记入最后一个桶
+#define HIST_BUCKET_NUM     ((HIST_MAX_EXP - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define METRICS_STALL_NS    (100LL * 1000 * 1000) // 两次收到数据的间隔超过该值计为停顿，纳秒
+
+/**
+ * @description: 获取单调时钟的当前时间
+ * @return {long long} 纳秒
+ */
+inline long long MetricsNow() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 对数分桶的耗时直方图（HDR风格），单个写入者，其他线程可随时读取
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    /**
+     * @description: 记录一个值，只能由一个线程调用
+     * @param {long long} value 纳秒
+     */
+    void Record(long long value);
+
+    /**
+     * @description: 将另一个直方图的数据累加到本直方图，用于汇总
+     * @param {const LatencyHistogram&} other 另一个直方图
+     */
+    void Merge(const LatencyHistogram& other);
+
+    /**
+     * @description: 获取分位数
+     * @param {double} quantile 0~1
+     * @return {long long} 纳秒，所在桶的上界，没有数据时为0
+     */
+    long long GetPercentile(double quantile) const;
+
+    unsigned long long GetCount() const { return m_count.load(memory_order_relaxed); }
+    long long GetSum() const { return m_sum.load(memory_order_relaxed); }
+    long long GetMax() const { return m_max.load(memory_order_relaxed); }
+
+private:
+    /**
+     * @description: 计算值所在的桶
+     * @param {long long} value 纳秒
+     * @return {int} 桶序号
+     */
+    static int BucketIndex(long long value);
+
+    /**
+     * @description: 计算桶的上界
+     * @param {int} index 桶序号
+     * @return {long long} 纳秒
+     */
+    static long long BucketUpper(int index);
+
+    atomic<unsigned long long> m_buckets[HIST_BUCKET_NUM];
+    atomic<unsigned long long> m_count;
+    atomic<long long> m_sum;
+    atomic<long long> m_max;
+};
+
+// 一个连接的统计，计数只由该连接所在的线程写入
+struct alignas(CACHE_LINE_SIZE) ConnMetrics {
+    ConnMetrics();
+    atomic<unsigned long long> bytes; // 写入的字节数
+    atomic<unsigned long long> callbacks; // 数据回调次数
+    atomic<unsigned long long> transfers; // 结束的传输数
+    atomic<unsigned long long> failed_transfers; // 失败或被中断的传输数
+    atomic<long long> copy_ns; // 回调中复制数据的耗时，包括映射内存的缺页，不包括重新映射
+    atomic<long long> remap_ns; // 重新映射（munmap+mmap）的耗时
+    atomic<unsigned long long> remaps; // 重新映射次数
+    atomic<long long> stall_ns; // 超过停顿阈值的收数据间隔总和
+    atomic<long long> limit_wait_ns; // 带宽限制的等待时长
+    atomic<long long> dns_us; // 各传输DNS耗时之和
+    atomic<long long> connect_us; // 各传输建连耗时之和
+    atomic<long long> tls_us; // 各传输TLS握手耗时之和
+    atomic<long long> ttfb_us; // 各传输首字节耗时之和
+    long long last_data_ns; // 上次回调结束的时间，0表示传输刚开始
+    LatencyHistogram copy_hist; // 每次回调的复制耗时
+    LatencyHistogram remap_hist; // 每次重新映射的耗时
+    LatencyHistogram gap_hist; // 相邻两次回调的间隔，即等待网络数据的时间
+    LatencyHistogram ttfb_hist; // 每个传输的首字节耗时
+};
+
+class DownloadMetrics {
+public:
+    DownloadMetrics(): m_slots(nullptr), m_slot_num(0), m_begin_ns(0), m_progress_ns(0), m_last_publish_ns(0) {}
+    ~DownloadMetrics();
+
+    /**
+     * @description: 分配各连接的统计槽
+     * @param {int} slot_num 连接数
+     * @param {const string&} json_path 结束时写入JSON报告的路径，为空不写
+     * @param {const string&} prom_path 运行中定期更新的Prometheus文本文件路径，为空不写
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Init(int slot_num, const string& json_path, const string& prom_path);
+
+    /**
+     * @description: 传输开始，下一次回调不计入收数据间隔
+     * @param {int} slot 连接序号
+     */
+    void BeginTransfer(int slot) { m_slots[slot].last_data_ns = 0; }
+
+    /**
+     * @description: 记录一次数据回调
+     * @param {int} slot 连接序号
+     * @param {size_t} size 写入的字节数
+     * @param {long long} begin_ns 回调开始时间
+     * @param {long long} copy_ns 复制数据耗时
+     */
+    void RecordData(int slot, size_t size, long long begin_ns, long long copy_ns);
+
+    /**
+     * @description: 记录一次重新映射
+     * @param {int} slot 连接序号
+     * @param {long long} ns 耗时
+     */
+    void RecordRemap(int slot, long long ns);
+
+    /**
+     * @description: 获取连接重新映射的累计耗时，用于从回调耗时中扣除
+     * @param {int} slot 连接序号
+     * @return {long long} 纳秒
+     */
+    long long GetRemapTime(int slot) { return m_slots[slot].remap_ns.load(memory_order_relaxed); }
+
+    /**
+     * @description: 记录带宽限制的等待
+     * @param {int} slot 连接序号
+     * @param {long long} ns 等待时长
+     */
+    void RecordLimitWait(int slot, long long ns);
+
+    /**
+     * @description: 记录一个结束的传输
+     * @param {int} slot 连接序号
+     * @param {const TransferTiming*} timing 传输耗时，下载器不提供时为nullptr
+     * @param {bool} ok 是否成功
+     */
+    void RecordTransfer(int slot, const TransferTiming* timing, bool ok);
+
+    /**
+     * @description: 记录进度线程一轮的处理耗时，不包括等待
+     * @param {long long} ns 耗时
+     */
+    void RecordProgress(long long ns) { m_progress_ns += ns; }
+
+    /**
+     * @description: 距上次更新超过间隔时重写Prometheus文本文件，由进度线程调用
+     * @param {int} interval_ms 更新间隔，毫秒
+     */
+    void Publish(int interval_ms);
+
+    /**
+     * @description: 下载结束，写入JSON报告和最终的Prometheus文本文件
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Finish();
+
+private:
+    /**
+     * @description: 按缓存行对齐分配统计槽，C++11的new不保证超过16字节的对齐
+     * @param {int} num 槽数
+     * @return {ConnMetrics*} 失败返回nullptr
+     */
+    static ConnMetrics* AllocSlots(int num);
+
+    /**
+     * @description: 释放统计槽
+     * @param {ConnMetrics*} slots 统计槽
+     * @param {int} num 槽数
+     */
+    static void FreeSlots(ConnMetrics* slots, int num);
+
+    /**
+     * @description: 汇总所有连接的统计
+     * @param {ConnMetrics&} total 汇总结果
+     */
+    void Sum(ConnMetrics& total);
+
+    /**
+     * @description: 写入Prometheus文本文件，先写临时文件再改名，采集方不会读到写了一半的文件
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool WritePrometheus();
+
+    /**
+     * @description: 写入JSON报告
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool WriteJson();
+
+    ConnMetrics* m_slots; // 各连接的统计槽，按缓存行对齐分配
+    int m_slot_num; // 连接数
+    string m_json_path; // JSON报告路径
+    string m_prom_path; // Prometheus文本文件路径
+    long long m_begin_ns; // 开始统计的时间
+    atomic<long long> m_progress_ns; // 进度线程的处理耗时
+    long long m_last_publish_ns; // 上次更新Prometheus文件的时间
+};
+
+#endif
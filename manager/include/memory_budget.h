@@ -0,0 +1,120 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-28 15:06:42
+ * @Description: 内存预算，限制所有连接映射窗口和尚未回写完成的脏页总量，超出时阻塞写入的连接等待最早的区间回写，
+ *               可由多个下载管理器共用
+ */
+#ifndef _MEMORY_BUDGET_H_
+#define _MEMORY_BUDGET_H_
+#include <atomic>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <vector>
+#include <condition_variable>
+#include "downloaders.h"
+using namespace std;
+
+#define BUDGET_MIN_WINDOW   (64 * 1024) // 预算不足时仍分配的最小映射窗口，保证每个连接都能推进
+#define BUDGET_MAPPED_SHARE 4 // 映射窗口最多占预算的1/4，其余留给已解除映射、正在回写的脏页
+#define BUDGET_CGROUP_SHARE 2 // 自动预算取cgroup内存上限的1/2，其余留给进程本身和其他页缓存
+
+class MemoryBudget {
+public:
+    explicit MemoryBudget(file_size_t limit): m_limit(limit), m_mapped(0), m_dirty(0), m_wait_ns(0) {}
+
+    /**
+     * @description: 为映射窗口申请预算，不阻塞，预算不足时缩小窗口，最小为BUDGET_MIN_WINDOW
+     * @param {size_t} want 希望映射的字节数，4K对齐
+     * @return {size_t} 允许映射的字节数，4K对齐且不超过want
+     */
+    size_t AcquireWindow(size_t want);
+
+    /**
+     * @description: 映射窗口已解除，发起回写并转为脏页计入预算，超出预算时等待最早的区间回写完成
+     * @param {int} fd 文件描述符，需在Drain之后才能关闭
+     * @param {file_size_t} offset 窗口在文件中的位置
+     * @param {size_t} size 窗口大小，即AcquireWindow的返回值
+     */
+    void ReleaseWindow(int fd, file_size_t offset, size_t size);
+
+    /**
+     * @description: 撤销未能映射的窗口，只归还预算，不发起回写
+     * @param {size_t} size 窗口大小，即AcquireWindow的返回值
+     */
+    void CancelWindow(size_t size) { m_mapped -= size; }
+
+    /**
+     * @description: 区间已通过pwrite写入页缓存，发起回写并计入预算，超出预算时等待最早的区间回写完成
+     * @param {int} fd 文件描述符，需在Drain之后才能关闭
+     * @param {file_size_t} offset 区间在文件中的位置
+     * @param {size_t} size 区间大小
+     */
+    void AddDirty(int fd, file_size_t offset, size_t size);
+
+    /**
+     * @description: 等待文件所有已登记区间回写完成并移出预算，关闭文件前调用
+     * @param {int} fd 文件描述符
+     */
+    void Drain(int fd);
+
+    /**
+     * @description: 获取因超出预算等待回写的总时长
+     * @return {long long} 纳秒
+     */
+    long long GetWaitTime() { return m_wait_ns; }
+
+    /**
+     * @description: 获取预算
+     * @return {file_size_t} 字节
+     */
+    file_size_t GetLimit() { return m_limit; }
+
+    /**
+     * @description: 读取当前cgroup的内存上限，依次尝试cgroup v2和v1
+     * @return {file_size_t} 字节，没有限制或读取失败时为0
+     */
+    static file_size_t DetectCgroupLimit();
+
+    /**
+     * @description: 解析字节数，支持K、M、G、T后缀（1024进制）
+     * @param {const string&} text 字节数文本，如256M
+     * @param {file_size_t&} size 字节数
+     * @return {bool} 格式正确返回true， 否则返回false
+     */
+    static bool ParseSize(const string& text, file_size_t& size);
+
+private:
+    // 已发起回写、尚未确认完成的区间
+    struct DirtyRange {
+        int fd;
+        file_size_t offset;
+        size_t size;
+    };
+
+    /**
+     * @description: 发起区间的回写并登记，超出预算时按登记顺序等待最早的区间
+     * @param {int} fd 文件描述符
+     * @param {file_size_t} offset 区间在文件中的位置
+     * @param {size_t} size 区间大小
+     */
+    void Push(int fd, file_size_t offset, size_t size);
+
+    /**
+     * @description: 等待区间回写完成，并丢弃其已干净的页缓存
+     * @param {const DirtyRange&} range 区间
+     */
+    static void WaitRange(const DirtyRange& range);
+
+    file_size_t m_limit; // 映射窗口和脏页的总预算，字节
+    atomic<long long> m_mapped; // 已映射的字节数
+    atomic<long long> m_dirty; // 已登记、尚未回写完成的字节数
+    atomic<long long> m_wait_ns; // 等待回写的总时长，纳秒
+    mutex m_lock; // 保护m_ranges和m_waiting
+    condition_variable m_cond; // 有区间等待完成时唤醒Drain
+    deque<DirtyRange> m_ranges; // 按登记顺序排列的脏区间
+    vector<int> m_waiting; // 已取出、正在等待回写的区间所属的文件描述符
+};
+
+#endif
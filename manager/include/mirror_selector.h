@@ -0,0 +1,74 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-25 20:41:09
+ * @Description: 镜像选择器，按各下载源实测的单连接吞吐量加权分配片段，连续失败的下载源被淘汰
+ */
+#ifndef _MIRROR_SELECTOR_H_
+#define _MIRROR_SELECTOR_H_
+#include <mutex>
+#include <random>
+#include <vector>
+#include "downloaders.h"
+using namespace std;
+
+#define MIRROR_EWMA_ALPHA       0.3 // 吞吐量滑动平均中新样本的权重
+#define MIRROR_MIN_SAMPLE_SIZE  (256 * 1024) // 计入吞吐量的最小片段字节数，过小的片段主要反映建连耗时
+#define MIRROR_MAX_FAILURES     3 // 连续失败达到该次数的下载源被淘汰，最后一个可用的下载源除外
+
+class MirrorSelector {
+public:
+    MirrorSelector(): m_random(random_device()()) {}
+
+    /**
+     * @description: 初始化下载源
+     * @param {int} source_num 下载源数量
+     */
+    void Init(int source_num);
+
+    /**
+     * @description: 按吞吐量加权随机选择下载源，尚未测得吞吐量的下载源按当前最快的计算，以便尽快测量
+     * @return {int} 下载源序号，全部被淘汰时返回-1
+     */
+    int Pick();
+
+    /**
+     * @description: 记录一个片段的下载结果
+     * @param {int} source 下载源序号
+     * @param {file_size_t} size 片段实际下载的字节数
+     * @param {double} seconds 片段耗时，秒
+     * @param {bool} ok 是否成功
+     */
+    void Report(int source, file_size_t size, double seconds, bool ok);
+
+    /**
+     * @description: 获取未被淘汰的下载源数量
+     * @return {int}
+     */
+    int GetAliveNum();
+
+    /**
+     * @description: 获取下载源的统计
+     * @param {int} source 下载源序号
+     * @param {file_size_t&} size 已下载的字节数
+     * @param {double&} rate 单连接吞吐量，字节/秒，未测得时为0
+     * @return {bool} 未被淘汰返回true
+     */
+    bool GetStats(int source, file_size_t& size, double& rate);
+
+private:
+    // 下载源状态
+    struct Source {
+        Source(): rate(0), size(0), fail_num(0), alive(true) {}
+        double rate; // 单连接吞吐量的滑动平均，字节/秒，0表示未测得
+        file_size_t size; // 已下载的字节数
+        int fail_num; // 连续失败次数
+        bool alive; // 是否可用
+    };
+
+    mutex m_lock; // 保护以下成员
+    vector<Source> m_sources; // 所有下载源
+    minstd_rand m_random; // 加权选择用的随机数
+};
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-11 21:06:15
+ * @Description: 下载进度的计数和通知，各连接的计数按缓存行分隔，进度由观察者按设定的间隔接收
+ */
+#ifndef _PROGRESS_OBSERVER_H_
+#define _PROGRESS_OBSERVER_H_
+#include <atomic>
+#include <vector>
+#include "downloaders.h"
+#include "pwrite_writer.h"
+using namespace std;
+
+// 一次进度通知的内容
+struct ProgressInfo {
+    ProgressInfo(): total_size(0), downloaded_size(0), speed(0), elapsed(0), conn_num(0) {}
+    file_size_t total_size; // 文件大小，流式下载结束前未知时为0
+    file_size_t downloaded_size; // 已下载的字节数，包括续传恢复的部分
+    double speed; // 距上次通知的平均速度，字节/秒
+    double elapsed; // 下载开始后经过的时间，秒
+    int conn_num; // 当前允许的连接数
+};
+
+// 进度观察者，回调在进度线程中执行，耗时会推迟下一次通知
+class ProgressObserver {
+public:
+    virtual ~ProgressObserver() {}
+
+    /**
+     * @description: 按设定的间隔接收进度，下载开始时先通知一次
+     * @param {const ProgressInfo&} info 进度
+     */
+    virtual void OnProgress(const ProgressInfo& info) = 0;
+
+    /**
+     * @description: 下载结束
+     * @param {bool} ok 是否成功
+     * @param {const ProgressInfo&} info 结束时的进度
+     */
+    virtual void OnFinish(bool ok, const ProgressInfo& info) {}
+};
+
+// 在终端显示进度条
+class ConsoleProgress: public ProgressObserver {
+public:
+    /**
+     * @param {bool} show_conn 是否显示连接数，用于自动连接数模式
+     */
+    explicit ConsoleProgress(bool show_conn = false): m_show_conn(show_conn) {}
+
+    void OnProgress(const ProgressInfo& info);
+
+    void OnFinish(bool ok, const ProgressInfo& info);
+
+private:
+    bool m_show_conn; // 是否显示连接数
+};
+
+// 各连接已下载的字节数，每个计数只由一个连接写入，进度线程无锁读取
+class ProgressCounters {
+public:
+    explicit ProgressCounters(int slot_num): m_counters(slot_num) {}
+
+    /**
+     * @description: 增加连接的计数，同一连接不能并发调用
+     * @param {int} slot 连接序号
+     * @param {file_size_t} size 字节数
+     */
+    void Add(int slot, file_size_t size) {
+        atomic<file_size_t>& value = m_counters[slot].value;
+        value.store(value.load(memory_order_relaxed) + size, memory_order_relaxed);
+    }
+
+    /**
+     * @description: 获取连接的计数
+     * @param {int} slot 连接序号
+     * @return {file_size_t}
+     */
+    file_size_t Get(int slot) const { return m_counters[slot].value.load(memory_order_relaxed); }
+
+    /**
+     * @description: 获取所有连接的计数之和
+     * @return {file_size_t}
+     */
+    file_size_t Sum() const;
+
+private:
+    // 按缓存行大小填充，数组起始地址不对齐时相邻计数也不会落在同一缓存行
+    struct Counter {
+        Counter(): value(0) {}
+        atomic<file_size_t> value;
+        char padding[CACHE_LINE_SIZE - sizeof(atomic<file_size_t>)];
+    };
+
+    vector<Counter> m_counters; // 各连接的计数
+};
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-15 10:22:37
+ * @Description: 独立写盘阶段，网络线程把数据放入各连接的无锁环形缓冲区，写线程用pwritev批量写入文件
+ */
+#ifndef _PWRITE_WRITER_H_
+#define _PWRITE_WRITER_H_
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include "downloaders.h"
+#include "cache_line.h"
+using namespace std;
+
+#define WRITER_SLOT_SIZE    (256 * 1024) // 每个缓冲槽大小
+#define WRITER_SLOT_NUM     8 // 每个连接的缓冲槽数量
+#define WRITER_ALIGN        4096 // O_DIRECT要求的地址、偏移和长度对齐
+#define WRITER_MAX_IOV      WRITER_SLOT_NUM // 单次pwritev合并的最大槽数
+#define WRITER_SPIN_NUM     64 // 等待前自旋检查的次数
+#define WRITER_WAIT_MS      10 // 生产者等待空槽时重新检查的间隔，毫秒
+
+// 写入完成回调，参数为写入的区间
+typedef function<void(file_size_t, file_size_t)> WrittenCallback;
+
+// 写盘方式
+enum WriteMode {
+    WRITE_MMAP, // 网络线程直接写入映射内存
+    WRITE_PWRITE, // 写线程通过pwritev写入
+    WRITE_DIRECT // 写线程通过pwritev写入，对齐的数据使用O_DIRECT
+};
+
+class PwriteWriter {
+public:
+    PwriteWriter(): m_fd(-1), m_direct_fd(-1), m_stop(false), m_failed(false), m_waiting(0) {}
+    ~PwriteWriter();
+
+    /**
+     * @description: 打开文件并启动写线程
+     * @param {const string&} path 文件路径，文件需已创建
+     * @param {int} conn_num 连接数，每个连接一个环形缓冲区
+     * @param {int} writer_num 写线程数
+     * @param {bool} direct 是否对对齐的数据使用O_DIRECT
+     * @param {WrittenCallback} written 数据写入文件后的回调，在写线程中执行
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Start(const string& path, int conn_num, int writer_num, bool direct, WrittenCallback written);
+
+    /**
+     * @description: 将连接收到的数据放入其环形缓冲区，缓冲区满时等待写线程
+     * @param {int} conn_id 连接序号，同一连接只能由一个线程写入
+     * @param {file_size_t} pos 数据在文件中的位置
+     * @param {const char*} data 数据
+     * @param {size_t} size 数据大小
+     * @return {bool} 成功返回true， 写线程出错返回false
+     */
+    bool Write(int conn_id, file_size_t pos, const char* data, size_t size);
+
+    /**
+     * @description: 提交连接未填满的缓冲槽，片段结束时调用
+     * @param {int} conn_id 连接序号
+     */
+    void Flush(int conn_id);
+
+    /**
+     * @description: 等待所有数据写完并停止写线程
+     * @return {bool} 全部写入成功返回true， 否则返回false
+     */
+    bool Stop();
+
+private:
+    // 缓冲槽
+    struct Slot {
+        char* data; // 按WRITER_ALIGN对齐的缓冲区
+        file_size_t offset; // 数据在文件中的位置
+        size_t size; // 已填充的大小
+    };
+
+    // 单生产者单消费者环形缓冲区，生产者为连接的网络线程，消费者为写线程
+    struct Ring {
+        Ring(): head(0), tail(0), filling(false) {
+            for (auto& slot : slots) {
+                slot.data = nullptr;
+                slot.offset = 0;
+                slot.size = 0;
+            }
+        }
+        alignas(CACHE_LINE_SIZE) atomic<unsigned> head; // 生产者已提交的槽数
+        alignas(CACHE_LINE_SIZE) atomic<unsigned> tail; // 消费者已写完的槽数
+        alignas(CACHE_LINE_SIZE) Slot slots[WRITER_SLOT_NUM];
+        bool filling; // 生产者是否有正在填充的槽，只由生产者访问
+    };
+
+    /**
+     * @description: 写线程主体，负责序号对writer_num取余等于writer_id的连接
+     * @param {int} writer_id 写线程序号
+     * @param {int} writer_num 写线程数
+     */
+    void WriterLoop(int writer_id, int writer_num);
+
+    /**
+     * @description: 写出环形缓冲区中已提交的槽，位置连续的槽合并为一次pwritev
+     * @param {Ring&} ring 环形缓冲区
+     * @return {bool} 有数据写出返回true， 否则返回false
+     */
+    bool Drain(Ring& ring);
+
+    /**
+     * @description: 将一组位置连续的槽写入文件
+     * @param {Slot**} slots 槽
+     * @param {int} num 槽数
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool WriteSlots(Slot** slots, int num);
+
+    /**
+     * @description: 分配环形缓冲区的所有缓冲槽
+     * @param {Ring&} ring 环形缓冲区
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool AllocRing(Ring& ring);
+
+    /**
+     * @description: 提交正在填充的槽，必要时唤醒写线程
+     * @param {Ring&} ring 环形缓冲区
+     */
+    void Publish(Ring& ring);
+
+    int m_fd; // 普通写入的文件描述符
+    int m_direct_fd; // O_DIRECT写入的文件描述符，不使用时为-1
+    atomic<bool> m_stop; // 是否停止写线程
+    atomic<bool> m_failed; // 写线程是否出错
+    atomic<int> m_waiting; // 正在休眠的线程数，为0时生产者无需加锁通知
+    mutex m_wait_lock; // 休眠使用的锁
+    condition_variable m_data_cond; // 有新数据时唤醒写线程
+    condition_variable m_space_cond; // 有空槽时唤醒生产者
+    WrittenCallback m_written; // 写入完成回调
+    vector<Ring*> m_rings; // 各连接的环形缓冲区，按缓存行对齐分配
+    vector<thread> m_writers; // 写线程
+};
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-03-20 21:10:32
+ * @Description: 文件片段调度器，按小块分配下载区间，空闲线程可分走最慢线程剩余区间的后半段，
+ *               收尾阶段空闲线程重复下载最慢线程的剩余区间，先到的数据先写入
+ */
+#ifndef _SEGMENT_SCHEDULER_H_
+#define _SEGMENT_SCHEDULER_H_
+#include <map>
+#include <atomic>
+#include <iterator>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include "downloaders.h"
+using namespace std;
+
+#define SEGMENT_ALIGN       4096 // 片段边界对齐大小，与映射块大小一致
+#define SEGMENT_UNIT_FACTOR 4 // 每个线程平均分到的片段数
+#define MIN_SEGMENT_SIZE    (1024 * 1024) // 单次分配的最小片段大小
+#define MIN_STEAL_SIZE      (256 * 1024) // 可被分走的最小剩余区间
+#define ENDGAME_SIZE        (4 * 1024 * 1024) // 下载中的剩余字节不超过该值且无法再分时进入收尾阶段
+
+// 文件片段，左闭右开
+struct Segment {
+    Segment(): start(0), end(0) {}
+    Segment(file_size_t start, file_size_t end): start(start), end(end) {}
+    file_size_t start; // 起始字节
+    file_size_t end; // 结束字节（不包含）
+};
+
+class SegmentScheduler {
+public:
+    SegmentScheduler(): m_filesize(0), m_unit_size(0), m_done_size(0), m_hedge_num(0) {}
+
+    /**
+     * @description: 初始化调度器，整个文件作为一个空闲区间
+     * @param {file_size_t} filesize 文件大小
+     * @param {int} worker_num 工作线程数
+     * @param {file_size_t} unit_size 单次分配的片段大小，为0时按线程数自动计算
+     */
+    void Init(file_size_t filesize, int worker_num, file_size_t unit_size = 0);
+
+    /**
+     * @description: 将区间标记为已完成，用于续传时跳过已下载的部分，需在分配片段前调用
+     * @param {file_size_t} start 起始字节
+     * @param {file_size_t} end 结束字节（不包含）
+     */
+    void MarkDone(file_size_t start, file_size_t end);
+
+    /**
+     * @description: 为线程分配下一个片段，无空闲区间时从剩余耗时最长的线程处分走后半段，
+     *               已无法再分且处于收尾阶段时重复下载该线程的剩余区间
+     * @param {int} worker_id 线程序号
+     * @param {Segment&} seg 分配到的片段
+     * @param {bool} steal 无空闲区间时是否分走或重复下载其他线程的区间
+     * @return {bool} 分配成功返回true，已无可分配的区间返回false
+     */
+    bool Acquire(int worker_id, Segment& seg, bool steal = true);
+
+    /**
+     * @description: 在线程当前片段内预留待写入的字节，片段被分走后只返回仍属于本线程的部分，
+     *               重复下载同一区间的两个连接中落后的一方跳过已被另一方写入的数据
+     * @param {int} worker_id 线程序号
+     * @param {size_t} size 收到的数据大小
+     * @param {file_size_t&} pos 预留区间在文件中的起始位置
+     * @param {size_t&} skip 数据开头已被另一连接写入、需要跳过的字节数
+     * @return {size_t} 跳过之后允许写入的字节数，skip与返回值之和小于size时说明片段已结束
+     */
+    size_t Reserve(int worker_id, size_t size, file_size_t& pos, size_t& skip);
+
+    /**
+     * @description: 结束线程当前片段，已写入部分记为完成，未写入部分归还空闲区间
+     * @param {int} worker_id 线程序号
+     */
+    void Finish(int worker_id);
+
+    /**
+     * @description: 传输失败后保留线程当前片段，已写入部分记为完成，剩余部分仍由本线程从已写入位置重试，
+     *               退避期间其他线程仍可分走剩余区间的后半段
+     * @param {int} worker_id 线程序号
+     * @param {Segment&} seg 剩余区间
+     * @return {bool} 成功返回true，重复下载其他线程的区间或片段已无剩余时返回false
+     */
+    bool Resume(int worker_id, Segment& seg);
+
+    /**
+     * @description: 判断线程当前片段是否已全部写入
+     * @param {int} worker_id 线程序号
+     * @return {bool}
+     */
+    bool IsSegmentDone(int worker_id);
+
+    /**
+     * @description: 获取线程当前片段的结束位置
+     * @param {int} worker_id 线程序号
+     * @return {file_size_t} 结束字节（不包含）
+     */
+    file_size_t GetSegmentEnd(int worker_id);
+
+    /**
+     * @description: 获取已完成的字节数
+     * @return {file_size_t}
+     */
+    file_size_t GetDoneSize();
+
+    /**
+     * @description: 获取收尾阶段发起的重复下载次数
+     * @return {int}
+     */
+    int GetHedgeNum() { return m_hedge_num; }
+
+private:
+    // 线程当前持有的片段
+    struct WorkerSlot {
+        WorkerSlot(): start(0), pos(0), end(0), recv(0), active(false), owner(0), hedger(-1) {}
+        mutex lock; // 只与分走区间以及重复下载的线程竞争
+        file_size_t start; // 片段起始字节
+        file_size_t pos; // 已预留到的位置，重复下载时两个连接共用片段所属线程的该值
+        file_size_t end; // 片段结束字节（不包含）
+        file_size_t recv; // 本线程传输收到的数据对应的文件位置，只由本线程修改
+        bool active; // 是否持有片段
+        chrono::steady_clock::time_point begin_time; // 开始下载片段的时间
+        atomic<int> owner; // 预留位置所在的线程，重复下载时为被重复的线程，否则为本线程
+        int hedger; // 重复下载本线程片段的线程，没有为-1
+    };
+
+    /**
+     * @description: 锁住线程预留位置所在的片段，重复下载时为被重复线程的片段
+     * @param {int} worker_id 线程序号
+     * @param {unique_lock<mutex>&} guard 返回时持有该片段的锁
+     * @return {WorkerSlot&} 预留位置所在的片段
+     */
+    WorkerSlot& LockFront(int worker_id, unique_lock<mutex>& guard);
+
+    /**
+     * @description: 按已下载速度估算片段的剩余耗时，调用前需持有片段的锁
+     * @param {WorkerSlot&} slot 片段
+     * @param {chrono::steady_clock::time_point} now 当前时间
+     * @return {double} 秒，尚无数据时按剩余字节数返回一个极大值
+     */
+    static double EstimateRemainTime(WorkerSlot& slot, chrono::steady_clock::time_point now);
+
+    /**
+     * @description: 从其他线程分走剩余区间的后半段，调用前需持有m_mutex
+     * @param {int} worker_id 线程序号
+     * @param {Segment&} seg 分到的片段
+     * @return {bool} 成功返回true，无可分区间返回false
+     */
+    bool Steal(int worker_id, Segment& seg);
+
+    /**
+     * @description: 收尾阶段重复下载剩余耗时最长的线程的剩余区间，调用前需持有m_mutex
+     * @param {int} worker_id 线程序号
+     * @param {Segment&} seg 重复下载的区间
+     * @return {bool} 成功返回true，未进入收尾阶段或无可重复的区间返回false
+     */
+    bool Hedge(int worker_id, Segment& seg);
+
+    /**
+     * @description: 记录已完成区间并与相邻区间合并，调用前需持有m_mutex
+     * @param {file_size_t} start 起始字节
+     * @param {file_size_t} end 结束字节（不包含）
+     */
+    void AddDone(file_size_t start, file_size_t end);
+
+    mutex m_mutex; // 保护空闲区间、完成区间以及片段分配
+    file_size_t m_filesize; // 文件大小
+    file_size_t m_unit_size; // 单次分配的片段大小
+    file_size_t m_done_size; // 已完成的字节数
+    map<file_size_t, file_size_t> m_free; // 空闲区间，起始字节->结束字节
+    map<file_size_t, file_size_t> m_done; // 已完成区间，起始字节->结束字节
+    vector<unique_ptr<WorkerSlot>> m_slots; // 各线程持有的片段
+    atomic<int> m_hedge_num; // 重复下载的次数
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-19 21:03:17
+ * @Description: 下载过程中计算文件校验值。CRC32C在网络线程中按连接连续区间计算，结束时合并；
+ *               SHA-256由后台线程跟随已写入的连续前沿，从页缓存读回后按顺序计算
+ */
+#ifndef _STREAM_VERIFIER_H_
+#define _STREAM_VERIFIER_H_
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+#include <functional>
+#include <condition_variable>
+#include "checksum.h"
+#include "cache_line.h"
+using namespace std;
+
+#define VERIFIER_READ_SIZE  (1024 * 1024) // 读回文件的单次大小
+#define VERIFIER_UNKNOWN_SIZE   ((file_size_t)-1) // 流式下载开始时文件大小未知，结束后由SetFileSize设置
+
+// 校验算法
+enum ChecksumType {
+    CHECKSUM_NONE,
+    CHECKSUM_SHA256,
+    CHECKSUM_CRC32C
+};
+
+class StreamVerifier {
+public:
+    StreamVerifier(): m_type(CHECKSUM_NONE), m_filesize(0), m_fd(-1), m_conn_spans(nullptr), m_conn_num(0)
+        , m_frontier(0), m_hashed(0), m_stop(false) {}
+    ~StreamVerifier();
+
+    /**
+     * @description: 解析校验参数
+     * @param {const string&} spec 格式为"算法:十六进制值"，只写算法时仅计算并输出
+     * @param {ChecksumType&} type 校验算法
+     * @param {string&} expected 期望的校验值，小写
+     * @return {bool} 格式正确返回true， 否则返回false
+     */
+    static bool Parse(const string& spec, ChecksumType& type, string& expected);
+
+    /**
+     * @description: 初始化，SHA-256方式启动后台计算线程
+     * @param {ChecksumType} type 校验算法
+     * @param {const string&} expected 期望的校验值，为空时不比较
+     * @param {const string&} path 下载的文件路径
+     * @param {file_size_t} filesize 文件大小，未知时为VERIFIER_UNKNOWN_SIZE
+     * @param {int} conn_num 连接数
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Init(ChecksumType type, const string& expected, const string& path, file_size_t filesize, int conn_num);
+
+    /**
+     * @description: 网络线程收到数据后调用，CRC32C方式累加到连接当前的连续区间
+     * @param {int} conn_id 连接序号，同一连接只能由一个线程调用
+     * @param {file_size_t} pos 数据在文件中的位置
+     * @param {const char*} data 数据
+     * @param {size_t} size 数据大小
+     */
+    void Update(int conn_id, file_size_t pos, const char* data, size_t size);
+
+    /**
+     * @description: 区间写入文件后调用，SHA-256方式推进可读回的前沿
+     * @param {file_size_t} start 起始字节
+     * @param {file_size_t} end 结束字节（不包含）
+     */
+    void AddWritten(file_size_t start, file_size_t end);
+
+    /**
+     * @description: 续传时已存在于文件中的区间，结束时从文件读取计算
+     * @param {file_size_t} start 起始字节
+     * @param {file_size_t} end 结束字节（不包含）
+     */
+    void AddExisting(file_size_t start, file_size_t end);
+
+    /**
+     * @description: 流式下载结束后设置实际的文件大小，SHA-256后台线程计算到该位置后结束
+     * @param {file_size_t} filesize 文件大小
+     */
+    void SetFileSize(file_size_t filesize);
+
+    /**
+     * @description: 所有数据写入后调用，等待计算完成并与期望值比较
+     * @return {bool} 一致或未指定期望值返回true， 否则返回false
+     */
+    bool Finish();
+
+    /**
+     * @description: 下载失败时停止后台计算
+     */
+    void Stop();
+
+    /**
+     * @description: 是否需要校验
+     * @return {bool}
+     */
+    bool IsEnabled() { return m_type != CHECKSUM_NONE; }
+
+private:
+    // 连续区间及其CRC
+    struct CrcSpan {
+        CrcSpan(): start(0), end(0), crc(0) {}
+        file_size_t start; // 起始字节
+        file_size_t end; // 结束字节（不包含）
+        uint32_t crc; // 区间的CRC32C
+    };
+
+    // 连接当前的连续区间，独占缓存行避免连接间伪共享
+    struct alignas(CACHE_LINE_SIZE) ConnSpan {
+        CrcSpan span;
+    };
+
+    /**
+     * @description: SHA-256后台线程主体，按顺序读回前沿之前的数据
+     */
+    void HashLoop();
+
+    /**
+     * @description: 从文件读取区间
+     * @param {file_size_t} start 起始字节
+     * @param {file_size_t} end 结束字节（不包含）
+     * @param {function<void(const char*, size_t)>} call 数据处理函数
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool ReadRange(file_size_t start, file_size_t end, function<void(const char*, size_t)> call);
+
+    /**
+     * @description: 合并所有区间的CRC
+     * @param {string&} actual 整个文件的CRC32C
+     * @return {bool} 区间完整覆盖文件返回true， 否则返回false
+     */
+    bool CombineCrc(string& actual);
+
+    ChecksumType m_type; // 校验算法
+    string m_expected; // 期望的校验值
+    file_size_t m_filesize; // 文件大小，流式下载结束前由m_frontier_lock保护
+    int m_fd; // 读回文件的描述符
+    ConnSpan* m_conn_spans; // 各连接当前的连续区间，按缓存行对齐分配
+    int m_conn_num; // m_conn_spans的元素个数
+    mutex m_span_lock; // 保护m_spans
+    vector<CrcSpan> m_spans; // 已结束的连续区间
+    vector<pair<file_size_t, file_size_t>> m_existing; // 续传时已存在的区间
+    mutex m_frontier_lock; // 保护m_frontier和m_pending
+    condition_variable m_frontier_cond; // 前沿推进时唤醒后台线程
+    file_size_t m_frontier; // 从0开始连续写入的结束位置
+    map<file_size_t, file_size_t> m_pending; // 前沿之后已写入的区间
+    file_size_t m_hashed; // 后台线程已计算到的位置
+    bool m_stop; // 是否停止后台线程
+    Sha256 m_sha256; // SHA-256计算状态
+    thread m_hasher; // SHA-256后台线程
+};
+
+#endif
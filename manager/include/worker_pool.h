@@ -0,0 +1,96 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-23 20:14:36
+ * @Description: 固定大小的常驻工作线程池，线程数不超过CPU数，运行不占用线程的异步下载器的事件循环，
+ *               线程在下载之间复用，可绑定到指定CPU
+ */
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+#include <pthread.h>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+using namespace std;
+
+#define SYS_NODE_DIR        "/sys/devices/system/node" // NUMA节点信息目录
+#define SYS_NET_DIR         "/sys/class/net" // 网卡信息目录
+
+// 线程池执行的任务
+typedef function<void()> PoolTask;
+
+class WorkerPool {
+public:
+    /**
+     * @param {int} worker_num 线程数，不大于0时为CPU数，不超过CPU数
+     * @param {const vector<int>&} cpus 线程依次轮流绑定的CPU，为空时不绑定
+     */
+    WorkerPool(int worker_num = 0, const vector<int>& cpus = vector<int>());
+
+    /**
+     * @description: 等待正在执行的任务结束后退出所有线程，未开始的任务被丢弃
+     */
+    ~WorkerPool();
+
+    /**
+     * @description: 提交任务，只交给空闲线程，不排队，任务可长期占用线程
+     * @param {PoolTask} task 任务
+     * @return {bool} 已交给空闲线程返回true， 所有线程都在执行任务时返回false
+     */
+    bool Run(PoolTask task);
+
+    /**
+     * @description: 获取线程数
+     * @return {int}
+     */
+    int GetWorkerNum();
+
+    /**
+     * @description: 将当前线程按序号轮流绑定到线程池的CPU，没有绑定CPU时不做处理
+     * @param {int} index 序号
+     */
+    void PinCurrentThread(int index);
+
+    /**
+     * @description: 解析CPU绑定设置，可为CPU列表如"0-3,8"，"node:N"为NUMA节点N的CPU，
+     *               "nic:网卡名"为与网卡在同一NUMA节点的CPU
+     * @param {const string&} spec 绑定设置
+     * @param {vector<int>&} cpus 解析出的CPU
+     * @return {bool} 成功返回true， 格式错误或设备不存在返回false
+     */
+    static bool ParseAffinity(const string& spec, vector<int>& cpus);
+
+    /**
+     * @description: 将线程绑定到一个CPU
+     * @param {pthread_t} handle 线程
+     * @param {int} cpu CPU序号
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    static bool PinThread(pthread_t handle, int cpu);
+
+private:
+    /**
+     * @description: 工作线程主体，循环取出任务执行，直到线程池析构
+     */
+    void WorkerLoop();
+
+    /**
+     * @description: 新建一个线程并按序号绑定CPU，只在构造时调用，调用前需持有m_lock
+     */
+    void AddWorker();
+
+    vector<int> m_cpus; // 线程依次轮流绑定的CPU
+
+    mutex m_lock; // 保护以下成员
+    condition_variable m_cond; // 有任务提交或线程池析构时唤醒空闲线程
+    vector<thread> m_workers; // 工作线程
+    list<PoolTask> m_tasks; // 未开始的任务
+    int m_idle_num; // 空闲线程数
+    bool m_exit; // 线程池是否正在析构
+};
+
+#endif
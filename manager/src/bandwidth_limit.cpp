@@ -0,0 +1,174 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-03 20:52:10
+ * @Description: 带宽限制实现
+ */
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <fstream>
+#include "bandwidth_limit.h"
+
+atomic<bool> BandwidthLimit::s_reload(false);
+
+/**
+ * @description: 去掉首尾空白
+ * @param {const string&} text 原文本
+ * @return {string}
+ */
+static string Trim(const string& text) {
+    size_t start = text.find_first_not_of(" \t\r\n");
+    if (start == string::npos) {
+        return "";
+    }
+    return text.substr(start, text.find_last_not_of(" \t\r\n") - start + 1);
+}
+
+BandwidthLimit::~BandwidthLimit() {
+    if (m_watch_thread.joinable()) {
+        {
+            lock_guard<mutex> guard(m_watch_lock);
+            m_watch_stop = true;
+        }
+        m_watch_cond.notify_all();
+        m_watch_thread.join();
+    }
+}
+
+/**
+ * @description: 设置速率限制
+ * @param {file_size_t} total_rate 所有连接的总速率，字节/秒，0为不限制
+ * @param {file_size_t} conn_rate 单个连接的速率，字节/秒，0为不限制
+ */
+void BandwidthLimit::SetRates(file_size_t total_rate, file_size_t conn_rate) {
+    m_total_rate = total_rate;
+    m_conn_rate = conn_rate;
+}
+
+/**
+ * @description: 收到数据后按总速率扣除令牌，返回需要等待的时长，多线程并发调用无锁
+ * @param {size_t} size 收到的字节数
+ * @return {long long} 需要等待的纳秒数，不需要等待时为0
+ */
+long long BandwidthLimit::Consume(size_t size) {
+    file_size_t rate = m_total_rate;
+    if (rate == 0 || size == 0) {
+        return 0;
+    }
+
+    // GCRA：每个字节占用1/rate秒，理论到达时间超前当前时间的部分超过突发时长时需要等待
+    long long now = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+    long long cost = (long long)((double)size * 1e9 / rate);
+    long long tat = m_tat.load(memory_order_relaxed);
+    long long new_tat = 0;
+    do {
+        new_tat = (tat > now ? tat : now) + cost;
+    } while (!m_tat.compare_exchange_weak(tat, new_tat, memory_order_relaxed));
+
+    long long wait = new_tat - now - LIMIT_BURST_NS;
+    return wait > 0 ? wait : 0;
+}
+
+/**
+ * @description: 读取控制文件，每行为"rate=速率"或"conn-rate=速率"，#开头为注释，未出现的项为不限制
+ * @param {const string&} path 控制文件路径
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool BandwidthLimit::LoadFile(const string& path) {
+    ifstream file(path);
+    if (!file) {
+        printf("open limit file(%s) failed\n", path.c_str());
+        return false;
+    }
+
+    file_size_t total_rate = 0;
+    file_size_t conn_rate = 0;
+    string line;
+    while (getline(file, line)) {
+        line = Trim(line);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        size_t equal = line.find('=');
+        string name = equal == string::npos ? line : Trim(line.substr(0, equal));
+        string value = equal == string::npos ? "" : Trim(line.substr(equal + 1));
+        file_size_t rate = 0;
+        if ((name != "rate" && name != "conn-rate") || !ParseRate(value, rate)) {
+            printf("invalid line in limit file: %s\n", line.c_str());
+            return false;
+        }
+        (name == "rate" ? total_rate : conn_rate) = rate;
+    }
+    SetRates(total_rate, conn_rate);
+    printf("bandwidth limit: total %llu B/s, per connection %llu B/s (0 = unlimited)\n", total_rate, conn_rate);
+    return true;
+}
+
+/**
+ * @description: 启动后台线程，控制文件修改或收到SIGHUP时重新读取
+ * @param {const string&} path 控制文件路径
+ */
+void BandwidthLimit::Watch(const string& path) {
+    m_watch_path = path;
+    m_watch_thread = thread(&BandwidthLimit::WatchLoop, this);
+}
+
+/**
+ * @description: 后台线程主体，按间隔检查控制文件的修改时间和重新加载请求
+ */
+void BandwidthLimit::WatchLoop() {
+    struct stat file_stat;
+    struct timespec last_mtime = {0, 0};
+    if (0 == stat(m_watch_path.c_str(), &file_stat)) {
+        last_mtime = file_stat.st_mtim;
+    }
+
+    unique_lock<mutex> guard(m_watch_lock);
+    auto interval = chrono::milliseconds(LIMIT_WATCH_INTERVAL);
+    while (!m_watch_cond.wait_for(guard, interval, [this] { return m_watch_stop; })) {
+        bool changed = false;
+        if (0 == stat(m_watch_path.c_str(), &file_stat)) {
+            changed = file_stat.st_mtim.tv_sec != last_mtime.tv_sec || file_stat.st_mtim.tv_nsec != last_mtime.tv_nsec;
+            last_mtime = file_stat.st_mtim;
+        }
+        // 读取失败时保留原有限制
+        if (s_reload.exchange(false) || changed) {
+            LoadFile(m_watch_path);
+        }
+    }
+}
+
+/**
+ * @description: 解析速率，支持K、M、G后缀（1024进制）
+ * @param {const string&} text 速率文本
+ * @param {file_size_t&} rate 字节/秒
+ * @return {bool} 格式正确返回true， 否则返回false
+ */
+bool BandwidthLimit::ParseRate(const string& text, file_size_t& rate) {
+    if (text.empty()) {
+        return false;
+    }
+    char* end = nullptr;
+    double value = strtod(text.c_str(), &end);
+    if (end == text.c_str() || value < 0) {
+        return false;
+    }
+    string unit(end);
+    if (unit == "K" || unit == "k") {
+        value *= 1024;
+    }
+    else if (unit == "M" || unit == "m") {
+        value *= 1024 * 1024;
+    }
+    else if (unit == "G" || unit == "g") {
+        value *= 1024.0 * 1024 * 1024;
+    }
+    else if (!unit.empty()) {
+        return false;
+    }
+    rate = (file_size_t)value;
+    return true;
+}
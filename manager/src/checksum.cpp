@@ -0,0 +1,406 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-18 20:36:05
+ * @Description: 校验算法实现
+ */
+#include <string.h>
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CHECKSUM_X86
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CHECKSUM_ARM
+#endif
+
+typedef uint32_t (*Crc32cFunc)(uint32_t crc, const uint8_t* data, size_t size);
+typedef void (*Sha256Func)(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+ * @description: 软件实现的CRC32C，slicing-by-8查表
+ */
+static uint32_t Crc32cSoft(uint32_t crc, const uint8_t* data, size_t size) {
+    static uint32_t table[8][256];
+    static bool inited = [&]() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int j = 0; j < 8; j++) {
+                value = (value >> 1) ^ (CRC32C_POLY & (0 - (value & 1)));
+            }
+            table[0][i] = value;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int j = 1; j < 8; j++) {
+                table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+            }
+        }
+        return true;
+    }();
+    (void)inited;
+
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^ table[5][(word >> 16) & 0xff]
+            ^ table[4][(word >> 24) & 0xff] ^ table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff]
+            ^ table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef CHECKSUM_X86
+/**
+ * @description: SSE4.2指令实现的CRC32C
+ */
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cSse42(uint32_t crc, const uint8_t* data, size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+/**
+ * @description: SHA扩展指令实现的SHA-256压缩函数
+ */
+__attribute__((target("sha,sse4.1")))
+static void Sha256CompressNi(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // 状态重排为指令要求的ABEF/CDGH
+    __m128i tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);
+    state1 = _mm_shuffle_epi32(state1, 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (blocks-- > 0) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i msgs[4];
+        for (int i = 0; i < 4; i++) {
+            msgs[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), mask);
+        }
+
+        // 每次4轮，同时计算后面第4组消息
+        for (int i = 0; i < 16; i++) {
+            __m128i msg = _mm_add_epi32(msgs[i & 3], _mm_loadu_si128((const __m128i*)&SHA256_K[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+            if (i < 12) {
+                __m128i next = _mm_sha256msg1_epu32(msgs[i & 3], msgs[(i + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(msgs[(i + 3) & 3], msgs[(i + 2) & 3], 4));
+                msgs[i & 3] = _mm_sha256msg2_epu32(next, msgs[(i + 3) & 3]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        data += SHA256_BLOCK_SIZE;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+#endif
+
+#ifdef CHECKSUM_ARM
+/**
+ * @description: ARMv8 CRC指令实现的CRC32C
+ */
+__attribute__((target("+crc")))
+static uint32_t Crc32cArm(uint32_t crc, const uint8_t* data, size_t size) {
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+#define ROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * @description: 软件实现的SHA-256压缩函数
+ */
+static void Sha256CompressSoft(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    uint32_t w[64];
+    while (blocks-- > 0) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16
+                | (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+            uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += SHA256_BLOCK_SIZE;
+    }
+}
+
+/**
+ * @description: 按CPU支持的指令选择CRC32C实现
+ */
+static Crc32cFunc SelectCrc32c() {
+#ifdef CHECKSUM_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        return Crc32cSse42;
+    }
+#endif
+#ifdef CHECKSUM_ARM
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        return Crc32cArm;
+    }
+#endif
+    return Crc32cSoft;
+}
+
+/**
+ * @description: 按CPU支持的指令选择SHA-256实现
+ */
+static Sha256Func SelectSha256() {
+#ifdef CHECKSUM_X86
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (__builtin_cpu_supports("sse4.1") && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)) {
+        return Sha256CompressNi;
+    }
+#endif
+    return Sha256CompressSoft;
+}
+
+/**
+ * @description: 计算CRC32C，可在前一段结果上继续计算
+ * @param {uint32_t} crc 前一段数据的CRC，首段为0
+ * @param {const char*} data 数据
+ * @param {size_t} size 数据大小
+ * @return {uint32_t} 到当前数据为止的CRC
+ */
+uint32_t Crc32c(uint32_t crc, const char* data, size_t size) {
+    static const Crc32cFunc func = SelectCrc32c();
+    return ~func(~crc, (const uint8_t*)data, size);
+}
+
+/**
+ * @description: GF(2)矩阵乘向量
+ */
+static uint32_t Gf2MatrixTimes(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+/**
+ * @description: GF(2)矩阵平方
+ */
+static void Gf2MatrixSquare(uint32_t* square, const uint32_t* mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = Gf2MatrixTimes(mat, mat[n]);
+    }
+}
+
+/**
+ * @description: 合并相邻两段数据的CRC32C，无需重新读取数据
+ * @param {uint32_t} crc1 前一段数据的CRC
+ * @param {uint32_t} crc2 后一段数据的CRC
+ * @param {file_size_t} len2 后一段数据的长度
+ * @return {uint32_t} 两段数据连起来的CRC
+ */
+uint32_t Crc32cCombine(uint32_t crc1, uint32_t crc2, file_size_t len2) {
+    if (len2 == 0) {
+        return crc1;
+    }
+
+    // odd为追加1个0比特的算子，反复平方得到追加2^n个0字节的算子
+    uint32_t even[32];
+    uint32_t odd[32];
+    odd[0] = CRC32C_POLY;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    Gf2MatrixSquare(even, odd);
+    Gf2MatrixSquare(odd, even);
+
+    // 相当于在crc1后追加len2个0字节
+    do {
+        Gf2MatrixSquare(even, odd);
+        if (len2 & 1) {
+            crc1 = Gf2MatrixTimes(even, crc1);
+        }
+        len2 >>= 1;
+        if (len2 == 0) {
+            break;
+        }
+        Gf2MatrixSquare(odd, even);
+        if (len2 & 1) {
+            crc1 = Gf2MatrixTimes(odd, crc1);
+        }
+        len2 >>= 1;
+    } while (len2 != 0);
+    return crc1 ^ crc2;
+}
+
+/**
+ * @description: 将字节转换为小写十六进制字符串
+ * @param {const uint8_t*} data 数据
+ * @param {size_t} size 数据大小
+ * @return {string}
+ */
+string ToHex(const uint8_t* data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (size_t i = 0; i < size; i++) {
+        hex.push_back(digits[data[i] >> 4]);
+        hex.push_back(digits[data[i] & 0xf]);
+    }
+    return hex;
+}
+
+Sha256::Sha256(): m_buf_size(0), m_total(0) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(m_state, init, sizeof(m_state));
+}
+
+/**
+ * @description: 追加数据
+ * @param {const char*} data 数据
+ * @param {size_t} size 数据大小
+ */
+void Sha256::Update(const char* data, size_t size) {
+    static const Sha256Func compress = SelectSha256();
+    const uint8_t* input = (const uint8_t*)data;
+    m_total += size;
+
+    // 先补满缓冲区中的半块
+    if (m_buf_size > 0) {
+        size_t copy_size = SHA256_BLOCK_SIZE - m_buf_size;
+        if (copy_size > size) {
+            copy_size = size;
+        }
+        memcpy(m_buf + m_buf_size, input, copy_size);
+        m_buf_size += copy_size;
+        input += copy_size;
+        size -= copy_size;
+        if (m_buf_size < SHA256_BLOCK_SIZE) {
+            return;
+        }
+        compress(m_state, m_buf, 1);
+        m_buf_size = 0;
+    }
+
+    // 整块直接从输入计算
+    size_t blocks = size / SHA256_BLOCK_SIZE;
+    if (blocks > 0) {
+        compress(m_state, input, blocks);
+        input += blocks * SHA256_BLOCK_SIZE;
+        size -= blocks * SHA256_BLOCK_SIZE;
+    }
+    memcpy(m_buf, input, size);
+    m_buf_size = size;
+}
+
+/**
+ * @description: 结束计算
+ * @return {string} 十六进制摘要
+ */
+string Sha256::Final() {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    Final(digest);
+    return ToHex(digest, sizeof(digest));
+}
+
+/**
+ * @description: 结束计算，输出原始摘要
+ * @param {uint8_t*} digest 摘要，长度为SHA256_DIGEST_SIZE
+ */
+void Sha256::Final(uint8_t* digest) {
+    // 补位：0x80，若干0，64位大端比特长度
+    uint64_t bits = m_total * 8;
+    char pad[SHA256_BLOCK_SIZE * 2] = {(char)0x80};
+    size_t pad_size = (m_buf_size < 56 ? 56 : 120) - m_buf_size;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_size + i] = (char)(bits >> (56 - i * 8));
+    }
+    Update(pad, pad_size + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(m_state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(m_state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(m_state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)m_state[i];
+    }
+}
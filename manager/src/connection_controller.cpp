@@ -0,0 +1,96 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-28 19:40:21
+ * @Description: 连接数控制器实现
+ */
+#include <algorithm>
+#include "connection_controller.h"
+using namespace std;
+
+/**
+ * @description: 初始化控制器
+ * @param {int} start 初始连接数
+ * @param {int} max_limit 最大连接数
+ */
+void ConnectionController::Init(int start, int max_limit) {
+    m_max = max_limit > 0 ? max_limit : 1;
+    m_limit = min(max(start, 1), m_max);
+    m_prev_limit = m_limit;
+    m_base_rate = 0;
+    m_slow_start = true;
+    m_settle = 1;
+    m_hold = 0;
+}
+
+/**
+ * @description: 输入一次采样，返回调整后的连接数
+ * @param {double} rate 本次采样间隔内的总吞吐量，字节/秒
+ * @param {bool} congested 采样间隔内是否出现失败或服务器限流
+ * @return {int} 连接数
+ */
+int ConnectionController::Update(double rate, bool congested) {
+    // 连接数刚变化时的失败多由变化前的连接造成，不重复退避
+    if (m_settle > 0) {
+        m_settle--;
+        return m_limit;
+    }
+
+    // 出现失败或限流时连接数减半，并在一段时间内不再增加
+    if (congested) {
+        m_limit = max(m_limit / 2, 1);
+        m_prev_limit = m_limit;
+        m_base_rate = 0;
+        m_slow_start = false;
+        m_settle = 1;
+        m_hold = CONN_HOLD_SAMPLES;
+        return m_limit;
+    }
+
+    if (m_base_rate == 0) {
+        m_base_rate = rate;
+        if (m_hold == 0) {
+            Grow();
+        }
+        return m_limit;
+    }
+
+    // 保持期间只更新基准，结束后再次尝试增加
+    if (m_hold > 0) {
+        m_base_rate = m_base_rate * (1 - CONN_RATE_ALPHA) + rate * CONN_RATE_ALPHA;
+        if (--m_hold == 0) {
+            Grow();
+        }
+        return m_limit;
+    }
+
+    if (rate > m_base_rate * (1 + CONN_GAIN_THRESHOLD)) {
+        m_base_rate = rate;
+        Grow();
+        return m_limit;
+    }
+
+    // 吞吐量不再提升，回退上次增加的连接
+    m_slow_start = false;
+    m_hold = CONN_HOLD_SAMPLES;
+    if (m_limit != m_prev_limit) {
+        m_limit = m_prev_limit;
+        m_base_rate = 0;
+        m_settle = 1;
+    }
+    return m_limit;
+}
+
+/**
+ * @description: 增加连接数，慢启动阶段翻倍，之后每次加一
+ */
+void ConnectionController::Grow() {
+    if (m_limit >= m_max) {
+        m_prev_limit = m_limit;
+        m_hold = CONN_HOLD_SAMPLES;
+        return;
+    }
+    m_prev_limit = m_limit;
+    m_limit = m_slow_start ? min(m_limit * 2, m_max) : m_limit + 1;
+    m_settle = 1;
+}
@@ -0,0 +1,480 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-20 10:40:18
+ * @Description: 增量下载的块校验索引实现
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include "delta_index.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DELTA_X86
+#endif
+
+#define DELTA_HEADER_SIZE   (4 + 4 + 4 + 8 + SHA256_DIGEST_SIZE) // 魔数、版本、块大小、文件大小和SHA-256
+#define DELTA_ENTRY_SIZE    (4 + DELTA_STRONG_SIZE) // 每块的弱校验和强校验
+#define DELTA_MAX_BLOCK     (16 * 1024 * 1024) // 块大小上限
+#define DELTA_HASH_MUL      0x9e3779b1 // 弱校验散列到位图下标的乘数
+
+typedef void (*WeakScanFunc)(const uint32_t* sum1, const uint32_t* sum2, uint32_t block_size, size_t count,
+    uint32_t* weak);
+
+/**
+ * @description: 计算一块数据的弱校验，a为字节和，b为各字节乘以其到块尾距离之和，各取低16位
+ * @param {const uint8_t*} data 数据
+ * @param {size_t} size 数据大小
+ * @return {uint32_t} 低16位为a，高16位为b
+ */
+static uint32_t WeakSum(const uint8_t* data, size_t size) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < size; i++) {
+        a += data[i];
+        b += a;
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+/**
+ * @description: 由前缀和计算每个窗口起点的弱校验，各窗口之间没有依赖
+ *               窗口k的a = S1[k+n] - S1[k]，b = (k+n) * a - (S2[k+n] - S2[k])，其中S2为字节乘以位置的前缀和
+ * @param {const uint32_t*} sum1 字节前缀和，长度为count + block_size + 1
+ * @param {const uint32_t*} sum2 字节乘以位置的前缀和，长度同上
+ * @param {uint32_t} block_size 窗口大小
+ * @param {size_t} count 窗口数
+ * @param {uint32_t*} weak 各窗口的弱校验
+ */
+static void WeakScanSoft(const uint32_t* sum1, const uint32_t* sum2, uint32_t block_size, size_t count,
+    uint32_t* weak) {
+    for (size_t k = 0; k < count; k++) {
+        uint32_t a = sum1[k + block_size] - sum1[k];
+        uint32_t b = (uint32_t)(k + block_size) * a - (sum2[k + block_size] - sum2[k]);
+        weak[k] = (a & 0xffff) | (b << 16);
+    }
+}
+
+#ifdef DELTA_X86
+/**
+ * @description: AVX2实现，每次计算8个窗口
+ */
+__attribute__((target("avx2")))
+static void WeakScanAvx2(const uint32_t* sum1, const uint32_t* sum2, uint32_t block_size, size_t count,
+    uint32_t* weak) {
+    const __m256i low = _mm256_set1_epi32(0xffff);
+    const __m256i step = _mm256_set1_epi32(8);
+    __m256i pos = _mm256_add_epi32(_mm256_set1_epi32(block_size), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    size_t k = 0;
+    for (; k + 8 <= count; k += 8) {
+        __m256i a = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(sum1 + k + block_size)),
+            _mm256_loadu_si256((const __m256i*)(sum1 + k)));
+        __m256i s2 = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(sum2 + k + block_size)),
+            _mm256_loadu_si256((const __m256i*)(sum2 + k)));
+        __m256i b = _mm256_sub_epi32(_mm256_mullo_epi32(pos, a), s2);
+        _mm256_storeu_si256((__m256i*)(weak + k), _mm256_or_si256(_mm256_and_si256(a, low), _mm256_slli_epi32(b, 16)));
+        pos = _mm256_add_epi32(pos, step);
+    }
+    for (; k < count; k++) {
+        uint32_t a = sum1[k + block_size] - sum1[k];
+        uint32_t b = (uint32_t)(k + block_size) * a - (sum2[k + block_size] - sum2[k]);
+        weak[k] = (a & 0xffff) | (b << 16);
+    }
+}
+#endif
+
+/**
+ * @description: 按CPU支持的指令选择弱校验扫描实现
+ */
+static WeakScanFunc SelectWeakScan() {
+#ifdef DELTA_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return WeakScanAvx2;
+    }
+#endif
+    return WeakScanSoft;
+}
+
+/**
+ * @description: 计算一块数据的强校验
+ * @param {const uint8_t*} data 数据
+ * @param {size_t} size 数据大小
+ * @param {uint8_t*} strong 强校验，长度为DELTA_STRONG_SIZE
+ */
+static void StrongSum(const uint8_t* data, size_t size, uint8_t* strong) {
+    Sha256 sha256;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256.Update((const char*)data, size);
+    sha256.Final(digest);
+    memcpy(strong, digest, DELTA_STRONG_SIZE);
+}
+
+/**
+ * @description: 追加定长整数
+ * @param {string&} buf 缓冲区
+ * @param {uint64_t} value 整数值
+ * @param {size_t} size 字节数
+ */
+static void PutInt(string& buf, uint64_t value, size_t size) {
+    buf.append((const char*)&value, size);
+}
+
+/**
+ * @description: 读取定长整数
+ * @param {const char*} data 数据
+ * @param {size_t} size 字节数
+ * @return {uint64_t}
+ */
+static uint64_t GetInt(const char* data, size_t size) {
+    uint64_t value = 0;
+    memcpy(&value, data, size);
+    return value;
+}
+
+/**
+ * @description: 读取文件生成索引
+ * @param {const string&} path 文件路径
+ * @param {uint32_t} block_size 块大小
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DeltaIndex::Build(const string& path, uint32_t block_size) {
+    if (block_size == 0 || block_size > DELTA_MAX_BLOCK) {
+        printf("invalid block size: %u\n", block_size);
+        return false;
+    }
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        perror("open file failed:");
+        return false;
+    }
+    struct stat file_stat;
+    if (-1 == fstat(fd, &file_stat)) {
+        perror("stat file failed:");
+        close(fd);
+        return false;
+    }
+    m_block_size = block_size;
+    m_filesize = file_stat.st_size;
+    file_size_t block_num = m_filesize / block_size;
+    m_weak.resize(block_num);
+    m_strong.resize(block_num * DELTA_STRONG_SIZE);
+
+    // 每次读入整数个块，同时计算整个文件的SHA-256
+    size_t buf_size = DELTA_COPY_SIZE > block_size ? DELTA_COPY_SIZE / block_size * block_size : block_size;
+    vector<char> buf(buf_size);
+    Sha256 sha256;
+    file_size_t pos = 0;
+    while (pos < m_filesize) {
+        size_t want = m_filesize - pos < buf_size ? (size_t)(m_filesize - pos) : buf_size;
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = pread(fd, buf.data() + got, want - got, pos + got);
+            if (n <= 0) {
+                perror("read file failed:");
+                close(fd);
+                return false;
+            }
+            got += n;
+        }
+        sha256.Update(buf.data(), want);
+        for (size_t off = 0; off + block_size <= want; off += block_size) {
+            file_size_t block = (pos + off) / block_size;
+            const uint8_t* data = (const uint8_t*)buf.data() + off;
+            m_weak[block] = WeakSum(data, block_size);
+            StrongSum(data, block_size, &m_strong[block * DELTA_STRONG_SIZE]);
+        }
+        pos += want;
+    }
+    close(fd);
+    sha256.Final(m_sha256);
+    BuildLookup();
+    return true;
+}
+
+/**
+ * @description: 保存索引
+ * @param {const string&} path 索引文件路径
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DeltaIndex::Save(const string& path) {
+    string content;
+    PutInt(content, DELTA_MAGIC, sizeof(uint32_t));
+    PutInt(content, DELTA_VERSION, sizeof(uint32_t));
+    PutInt(content, m_block_size, sizeof(uint32_t));
+    PutInt(content, m_filesize, sizeof(uint64_t));
+    content.append((const char*)m_sha256, sizeof(m_sha256));
+    for (size_t i = 0; i < m_weak.size(); i++) {
+        PutInt(content, m_weak[i], sizeof(uint32_t));
+        content.append((const char*)&m_strong[i * DELTA_STRONG_SIZE], DELTA_STRONG_SIZE);
+    }
+
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 00644);
+    if (fd == -1) {
+        perror("create index failed:");
+        return false;
+    }
+    const char* data = content.data();
+    size_t size = content.size();
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n <= 0) {
+            perror("write index failed:");
+            close(fd);
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    close(fd);
+    return true;
+}
+
+/**
+ * @description: 解析索引内容
+ * @param {const string&} data 索引文件内容
+ * @return {bool} 格式正确返回true， 否则返回false
+ */
+bool DeltaIndex::Parse(const string& data) {
+    if (data.size() < DELTA_HEADER_SIZE || GetInt(data.data(), sizeof(uint32_t)) != DELTA_MAGIC
+        || GetInt(data.data() + 4, sizeof(uint32_t)) != DELTA_VERSION) {
+        return false;
+    }
+    m_block_size = GetInt(data.data() + 8, sizeof(uint32_t));
+    m_filesize = GetInt(data.data() + 12, sizeof(uint64_t));
+    if (m_block_size == 0 || m_block_size > DELTA_MAX_BLOCK) {
+        return false;
+    }
+    file_size_t block_num = m_filesize / m_block_size;
+    if ((data.size() - DELTA_HEADER_SIZE) / DELTA_ENTRY_SIZE != block_num
+        || (data.size() - DELTA_HEADER_SIZE) % DELTA_ENTRY_SIZE != 0) {
+        return false;
+    }
+    memcpy(m_sha256, data.data() + 20, sizeof(m_sha256));
+    m_weak.resize(block_num);
+    m_strong.resize(block_num * DELTA_STRONG_SIZE);
+    const char* entry = data.data() + DELTA_HEADER_SIZE;
+    for (file_size_t i = 0; i < block_num; i++) {
+        m_weak[i] = GetInt(entry, sizeof(uint32_t));
+        memcpy(&m_strong[i * DELTA_STRONG_SIZE], entry + 4, DELTA_STRONG_SIZE);
+        entry += DELTA_ENTRY_SIZE;
+    }
+    BuildLookup();
+    return true;
+}
+
+/**
+ * @description: 建立弱校验的查找表和过滤位图
+ */
+void DeltaIndex::BuildLookup() {
+    m_lookup.resize(m_weak.size());
+    for (size_t i = 0; i < m_weak.size(); i++) {
+        m_lookup[i] = make_pair(m_weak[i], (uint32_t)i);
+    }
+    sort(m_lookup.begin(), m_lookup.end());
+
+    // 位图位数约为块数的32倍，不匹配的窗口约97%在位图中即被排除，最大32MB
+    int bits = 16;
+    while (bits < 28 && ((size_t)1 << bits) < m_weak.size() * 32) {
+        bits++;
+    }
+    m_filter.assign(((size_t)1 << bits) / 64, 0);
+    m_filter_shift = 32 - bits;
+    for (uint32_t weak : m_weak) {
+        uint32_t hash = (weak * DELTA_HASH_MUL) >> m_filter_shift;
+        m_filter[hash / 64] |= (uint64_t)1 << (hash % 64);
+    }
+}
+
+/**
+ * @description: 在本地文件中查找与新文件相同的块，相邻的块合并为连续区间
+ * @param {const string&} seed_path 本地文件路径
+ * @param {vector<DeltaRange>&} ranges 相同区间，按在新文件中的位置排序
+ * @return {bool} 成功返回true，本地文件无法读取时返回false
+ */
+bool DeltaIndex::Match(const string& seed_path, vector<DeltaRange>& ranges) {
+    static const WeakScanFunc scan = SelectWeakScan();
+    ranges.clear();
+    int fd = open(seed_path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        perror("open seed file failed:");
+        return false;
+    }
+    struct stat file_stat;
+    if (-1 == fstat(fd, &file_stat)) {
+        perror("stat seed file failed:");
+        close(fd);
+        return false;
+    }
+    file_size_t seed_size = file_stat.st_size;
+    const uint32_t n = m_block_size;
+    if (m_weak.empty() || seed_size < n) {
+        close(fd);
+        return true;
+    }
+    const uint8_t* seed = (const uint8_t*)mmap(nullptr, seed_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (seed == MAP_FAILED) {
+        perror("map seed file failed:");
+        return false;
+    }
+    madvise((void*)seed, seed_size, MADV_SEQUENTIAL);
+
+    // 每批先算出所有窗口起点的弱校验，再逐个查位图，命中后跳过整块，与rsync相同
+    const file_size_t no_match = (file_size_t)-1;
+    vector<file_size_t> matched(m_weak.size(), no_match);
+    size_t matched_num = 0;
+    vector<uint32_t> sum1(DELTA_SCAN_SIZE + n + 1);
+    vector<uint32_t> sum2(DELTA_SCAN_SIZE + n + 1);
+    vector<uint32_t> weak(DELTA_SCAN_SIZE);
+    uint8_t strong[DELTA_STRONG_SIZE];
+    file_size_t window_num = seed_size - n + 1;
+    file_size_t next = 0;
+    for (file_size_t base = 0; base < window_num && matched_num < m_weak.size(); base += DELTA_SCAN_SIZE) {
+        size_t count = window_num - base < DELTA_SCAN_SIZE ? (size_t)(window_num - base) : DELTA_SCAN_SIZE;
+        if (next >= base + count) {
+            continue;
+        }
+        // 热循环直接使用指针，未开启优化编译时也不经过容器的下标函数
+        const uint8_t* data = seed + base;
+        uint32_t* s1 = sum1.data();
+        uint32_t* s2 = sum2.data();
+        const uint32_t* w = weak.data();
+        const uint64_t* filter = m_filter.data();
+        uint32_t total1 = 0;
+        uint32_t total2 = 0;
+        uint32_t len = count + n - 1;
+        s1[0] = 0;
+        s2[0] = 0;
+        for (uint32_t t = 0; t < len; t++) {
+            total1 += data[t];
+            total2 += t * data[t];
+            s1[t + 1] = total1;
+            s2[t + 1] = total2;
+        }
+        scan(s1, s2, n, count, weak.data());
+
+        for (size_t k = next > base ? (size_t)(next - base) : 0; k < count; k++) {
+            uint32_t hash = (w[k] * DELTA_HASH_MUL) >> m_filter_shift;
+            if (!(filter[hash / 64] >> (hash % 64) & 1)) {
+                continue;
+            }
+            auto it = lower_bound(m_lookup.begin(), m_lookup.end(), make_pair(weak[k], (uint32_t)0));
+            if (it == m_lookup.end() || it->first != weak[k]) {
+                continue;
+            }
+            // 内容相同的块（如全零块）一次全部匹配
+            StrongSum(data + k, n, strong);
+            bool hit = false;
+            for (; it != m_lookup.end() && it->first == weak[k]; ++it) {
+                if (memcmp(strong, &m_strong[(size_t)it->second * DELTA_STRONG_SIZE], DELTA_STRONG_SIZE) != 0) {
+                    continue;
+                }
+                hit = true;
+                if (matched[it->second] == no_match) {
+                    matched[it->second] = base + k;
+                    matched_num++;
+                }
+            }
+            if (hit) {
+                next = base + k + n;
+                k += n - 1;
+            }
+        }
+    }
+    munmap((void*)seed, seed_size);
+
+    // 新文件中相邻且在本地文件中也相邻的块合并为一个区间
+    for (size_t block = 0; block < matched.size(); block++) {
+        if (matched[block] == no_match) {
+            continue;
+        }
+        file_size_t target = (file_size_t)block * n;
+        if (!ranges.empty() && ranges.back().target + ranges.back().size == target
+            && ranges.back().seed + ranges.back().size == matched[block]) {
+            ranges.back().size += n;
+            continue;
+        }
+        ranges.push_back({target, matched[block], n});
+    }
+    return true;
+}
+
+/**
+ * @description: 去掉夹在两段缺失区间之间且短于min_run的相同区间，使缺失区间合并为较少的请求
+ * @param {vector<DeltaRange>&} ranges 相同区间，按在新文件中的位置排序
+ * @param {file_size_t} filesize 新文件大小
+ * @param {file_size_t} min_run 保留的最短长度
+ */
+void DeltaIndex::Coalesce(vector<DeltaRange>& ranges, file_size_t filesize, file_size_t min_run) {
+    // 按原始的相邻关系判断，去掉一段不会使另一段变为孤立
+    vector<DeltaRange> kept;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        file_size_t prev_end = i > 0 ? ranges[i - 1].target + ranges[i - 1].size : 0;
+        file_size_t next_start = i + 1 < ranges.size() ? ranges[i + 1].target : filesize;
+        file_size_t end = ranges[i].target + ranges[i].size;
+        bool isolated = ranges[i].target > prev_end && next_start > end;
+        if (!isolated || ranges[i].size >= min_run) {
+            kept.push_back(ranges[i]);
+        }
+    }
+    ranges.swap(kept);
+}
+
+/**
+ * @description: 将本地文件中的相同区间复制到新文件
+ * @param {const string&} seed_path 本地文件路径
+ * @param {int} fd 新文件描述符
+ * @param {const vector<DeltaRange>&} ranges 相同区间
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DeltaIndex::Copy(const string& seed_path, int fd, const vector<DeltaRange>& ranges) {
+    int seed_fd = open(seed_path.c_str(), O_RDONLY);
+    if (seed_fd == -1) {
+        perror("open seed file failed:");
+        return false;
+    }
+    // 优先在内核中复制，同一文件系统上可能直接共享数据块；不支持时读写复制
+    bool in_kernel = true;
+    vector<char> buf;
+    for (auto& range : ranges) {
+        loff_t in_pos = range.seed;
+        loff_t out_pos = range.target;
+        file_size_t remain = range.size;
+        while (remain > 0) {
+            size_t size = remain < DELTA_COPY_SIZE ? (size_t)remain : DELTA_COPY_SIZE;
+            ssize_t n = -1;
+            if (in_kernel) {
+                n = copy_file_range(seed_fd, &in_pos, fd, &out_pos, size, 0);
+                if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    in_kernel = false;
+                    buf.resize(DELTA_COPY_SIZE);
+                    continue;
+                }
+            }
+            else {
+                n = pread(seed_fd, buf.data(), size, in_pos);
+                if (n > 0) {
+                    n = pwrite(fd, buf.data(), n, out_pos);
+                }
+                if (n > 0) {
+                    in_pos += n;
+                    out_pos += n;
+                }
+            }
+            if (n <= 0) {
+                perror("copy from seed file failed:");
+                close(seed_fd);
+                return false;
+            }
+            remain -= n;
+        }
+    }
+    close(seed_fd);
+    return true;
+}
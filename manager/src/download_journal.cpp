@@ -0,0 +1,274 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-02 20:31:09
+ * @Description: 下载日志实现
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <iterator>
+#include "download_journal.h"
+
+/**
+ * @description: 追加定长整数
+ * @param {string&} buf 缓冲区
+ * @param {uint64_t} value 整数值
+ * @param {size_t} size 字节数
+ */
+static void PutInt(string& buf, uint64_t value, size_t size) {
+    buf.append((const char*)&value, size);
+}
+
+/**
+ * @description: 追加带长度前缀的字符串
+ * @param {string&} buf 缓冲区
+ * @param {const string&} value 字符串
+ */
+static void PutString(string& buf, const string& value) {
+    PutInt(buf, value.size(), sizeof(uint32_t));
+    buf.append(value);
+}
+
+/**
+ * @description: 序列化日志头
+ * @param {const JournalInfo&} info 校验信息
+ * @return {string}
+ */
+static string EncodeHeader(const JournalInfo& info) {
+    string buf;
+    PutInt(buf, JOURNAL_MAGIC, sizeof(uint32_t));
+    PutInt(buf, JOURNAL_VERSION, sizeof(uint32_t));
+    PutInt(buf, info.filesize, sizeof(uint64_t));
+    PutString(buf, info.url);
+    PutString(buf, info.etag);
+    PutString(buf, info.last_modified);
+    return buf;
+}
+
+/**
+ * @description: 写入全部数据
+ * @param {int} fd 文件描述符
+ * @param {const char*} data 数据
+ * @param {size_t} size 数据大小
+ * @return {bool} 成功返回true， 失败返回false
+ */
+static bool WriteAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+DownloadJournal::~DownloadJournal() {
+    Close();
+}
+
+/**
+ * @description: 读取已有日志，校验信息一致时返回已完成区间
+ * @param {const string&} path 日志文件路径
+ * @param {const JournalInfo&} info 当前文件的校验信息
+ * @param {map<file_size_t, file_size_t>&} done 已完成区间，起始字节->结束字节
+ * @return {bool} 日志有效返回true，不存在或已作废返回false
+ */
+bool DownloadJournal::Load(const string& path, const JournalInfo& info, map<file_size_t, file_size_t>& done) {
+    done.clear();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    string content;
+    char buf[65536];
+    ssize_t n = 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        content.append(buf, n);
+    }
+    close(fd);
+
+    // 头部需与当前的大小、链接、ETag、Last-Modified完全一致
+    string header = EncodeHeader(info);
+    if (content.compare(0, header.size(), header) != 0) {
+        printf("journal %s does not match the remote file, restart download\n", path.c_str());
+        return false;
+    }
+
+    // 进程崩溃可能留下不完整的末尾记录，直接忽略
+    size_t record_size = sizeof(uint64_t) * 2;
+    for (size_t pos = header.size(); pos + record_size <= content.size(); pos += record_size) {
+        uint64_t start = *(const uint64_t*)(content.data() + pos);
+        uint64_t end = *(const uint64_t*)(content.data() + pos + sizeof(uint64_t));
+        if (start >= end || end > info.filesize) {
+            continue;
+        }
+
+        // 与已有区间合并
+        auto next = done.upper_bound(start);
+        if (next != done.begin() && std::prev(next)->second >= start) {
+            --next;
+            start = next->first;
+            if (next->second > end) {
+                end = next->second;
+            }
+            next = done.erase(next);
+        }
+        while (next != done.end() && next->first <= end) {
+            if (next->second > end) {
+                end = next->second;
+            }
+            next = done.erase(next);
+        }
+        done[start] = end;
+    }
+    return true;
+}
+
+/**
+ * @description: 以合并后的已完成区间重写日志，并启动后台刷新线程
+ * @param {const string&} path 日志文件路径
+ * @param {const JournalInfo&} info 当前文件的校验信息
+ * @param {const map<file_size_t, file_size_t>&} done 已完成区间
+ * @param {int} data_fd 下载文件的描述符，刷新日志前先将其数据落盘
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadJournal::Open(const string& path, const JournalInfo& info, const map<file_size_t, file_size_t>& done,
+    int data_fd) {
+    string content = EncodeHeader(info);
+    for (auto& range : done) {
+        PutInt(content, range.first, sizeof(uint64_t));
+        PutInt(content, range.second, sizeof(uint64_t));
+    }
+
+    // 先写临时文件再改名，避免重写过程中崩溃丢失旧日志
+    string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 00644);
+    if (fd == -1) {
+        perror("create journal failed:");
+        return false;
+    }
+    if (!WriteAll(fd, content.data(), content.size()) || -1 == fdatasync(fd)
+        || -1 == rename(tmp_path.c_str(), path.c_str())) {
+        perror("write journal failed:");
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    m_fd = open(path.c_str(), O_WRONLY | O_APPEND);
+    if (m_fd == -1) {
+        perror("open journal failed:");
+        return false;
+    }
+    m_path = path;
+    m_data_fd = data_fd;
+    m_stop = false;
+    m_flusher = thread(&DownloadJournal::FlushLoop, this);
+    return true;
+}
+
+/**
+ * @description: 记录已写入的区间，由后台线程批量落盘
+ * @param {file_size_t} start 起始字节
+ * @param {file_size_t} end 结束字节（不包含）
+ */
+void DownloadJournal::Record(file_size_t start, file_size_t end) {
+    if (m_fd == -1 || start >= end) {
+        return;
+    }
+    lock_guard<mutex> guard(m_lock);
+    m_pending.push_back(start);
+    m_pending.push_back(end);
+    if (m_pending.size() >= JOURNAL_FLUSH_BATCH * 2) {
+        m_cond.notify_one();
+    }
+}
+
+/**
+ * @description: 后台刷新线程主体
+ */
+void DownloadJournal::FlushLoop() {
+    unique_lock<mutex> guard(m_lock);
+    while (!m_stop) {
+        m_cond.wait_for(guard, chrono::milliseconds(JOURNAL_FLUSH_INTERVAL));
+        if (m_pending.empty()) {
+            continue;
+        }
+        guard.unlock();
+        Flush();
+        guard.lock();
+    }
+}
+
+/**
+ * @description: 先将下载文件落盘，再写入积累的区间记录
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadJournal::Flush() {
+    lock_guard<mutex> flush_guard(m_flush_lock);
+    vector<file_size_t> records;
+    {
+        lock_guard<mutex> guard(m_lock);
+        records.swap(m_pending);
+    }
+    if (records.empty()) {
+        return true;
+    }
+
+    // 日志只能记录已经落盘的数据，否则掉电后日志会领先于文件内容
+    if (m_data_fd != -1 && -1 == fdatasync(m_data_fd)) {
+        perror("sync download file failed:");
+        return false;
+    }
+    string content;
+    for (auto pos : records) {
+        PutInt(content, pos, sizeof(uint64_t));
+    }
+    if (!WriteAll(m_fd, content.data(), content.size())) {
+        perror("write journal failed:");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @description: 停止后台线程并刷新剩余记录
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadJournal::Close() {
+    if (m_fd == -1) {
+        return true;
+    }
+    {
+        lock_guard<mutex> guard(m_lock);
+        m_stop = true;
+        m_cond.notify_one();
+    }
+    if (m_flusher.joinable()) {
+        m_flusher.join();
+    }
+    bool ok = Flush();
+    close(m_fd);
+    m_fd = -1;
+    return ok;
+}
+
+/**
+ * @description: 下载完成后关闭并删除日志
+ */
+void DownloadJournal::Remove() {
+    // 文件已完整，剩余记录无需刷新
+    {
+        lock_guard<mutex> guard(m_lock);
+        m_pending.clear();
+    }
+    Close();
+    if (!m_path.empty()) {
+        unlink(m_path.c_str());
+    }
+}
@@ -0,0 +1,486 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-09 21:03:27
+ * @Description: 下载过程的性能统计实现
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include "download_metrics.h"
+
+/**
+ * @description: 单个写入者累加计数，避免带锁的原子加
+ * @param {atomic<T>&} counter 计数
+ * @param {T} value 增加的值
+ */
+template <typename T>
+static inline void AddRelaxed(atomic<T>& counter, T value) {
+    counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+LatencyHistogram::LatencyHistogram(): m_count(0), m_sum(0), m_max(0) {
+    for (auto& bucket : m_buckets) {
+        bucket.store(0, memory_order_relaxed);
+    }
+}
+
+/**
+ * @description: 计算值所在的桶
+ * @param {long long} value 纳秒
+ * @return {int} 桶序号
+ */
+int LatencyHistogram::BucketIndex(long long value) {
+    if (value < (1LL << HIST_SUB_BITS)) {
+        return value > 0 ? (int)value : 0;
+    }
+    if (value >= (1LL << HIST_MAX_EXP)) {
+        return HIST_BUCKET_NUM - 1;
+    }
+    // 最高位决定所在的2的幂区间，其后HIST_SUB_BITS位决定区间内的桶
+    int exp = 63 - __builtin_clzll((unsigned long long)value);
+    int sub = (int)((value >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+/**
+ * @description: 计算桶的上界
+ * @param {int} index 桶序号
+ * @return {long long} 纳秒
+ */
+long long LatencyHistogram::BucketUpper(int index) {
+    if (index < (1 << HIST_SUB_BITS)) {
+        return index;
+    }
+    int exp = (index >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    long long sub = index & ((1 << HIST_SUB_BITS) - 1);
+    long long width = 1LL << (exp - HIST_SUB_BITS);
+    return (((1LL << HIST_SUB_BITS) + sub) << (exp - HIST_SUB_BITS)) + width - 1;
+}
+
+/**
+ * @description: 记录一个值，只能由一个线程调用
+ * @param {long long} value 纳秒
+ */
+void LatencyHistogram::Record(long long value) {
+    AddRelaxed(m_buckets[BucketIndex(value)], 1ULL);
+    AddRelaxed(m_count, 1ULL);
+    AddRelaxed(m_sum, value);
+    if (value > m_max.load(memory_order_relaxed)) {
+        m_max.store(value, memory_order_relaxed);
+    }
+}
+
+/**
+ * @description: 将另一个直方图的数据累加到本直方图，用于汇总
+ * @param {const LatencyHistogram&} other 另一个直方图
+ */
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+    for (int i = 0; i < HIST_BUCKET_NUM; i++) {
+        AddRelaxed(m_buckets[i], other.m_buckets[i].load(memory_order_relaxed));
+    }
+    AddRelaxed(m_count, other.GetCount());
+    AddRelaxed(m_sum, other.GetSum());
+    if (other.GetMax() > GetMax()) {
+        m_max.store(other.GetMax(), memory_order_relaxed);
+    }
+}
+
+/**
+ * @description: 获取分位数
+ * @param {double} quantile 0~1
+ * @return {long long} 纳秒，所在桶的上界，没有数据时为0
+ */
+long long LatencyHistogram::GetPercentile(double quantile) const {
+    // 读取期间可能有新数据写入，按各桶之和计算
+    unsigned long long total = 0;
+    for (auto& bucket : m_buckets) {
+        total += bucket.load(memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    unsigned long long rank = (unsigned long long)(quantile * total + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_BUCKET_NUM; i++) {
+        seen += m_buckets[i].load(memory_order_relaxed);
+        if (seen >= rank) {
+            long long upper = BucketUpper(i);
+            long long max_value = GetMax();
+            return upper < max_value ? upper : max_value;
+        }
+    }
+    return GetMax();
+}
+
+ConnMetrics::ConnMetrics()
+    : bytes(0)
+    , callbacks(0)
+    , transfers(0)
+    , failed_transfers(0)
+    , copy_ns(0)
+    , remap_ns(0)
+    , remaps(0)
+    , stall_ns(0)
+    , limit_wait_ns(0)
+    , dns_us(0)
+    , connect_us(0)
+    , tls_us(0)
+    , ttfb_us(0)
+    , last_data_ns(0) {
+
+}
+
+DownloadMetrics::~DownloadMetrics() {
+    FreeSlots(m_slots, m_slot_num);
+}
+
+/**
+ * @description: 按缓存行对齐分配统计槽，C++11的new不保证超过16字节的对齐
+ * @param {int} num 槽数
+ * @return {ConnMetrics*} 失败返回nullptr
+ */
+ConnMetrics* DownloadMetrics::AllocSlots(int num) {
+    void* mem = nullptr;
+    if (0 != posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(ConnMetrics) * num)) {
+        return nullptr;
+    }
+    ConnMetrics* slots = (ConnMetrics*)mem;
+    for (int i = 0; i < num; i++) {
+        new (&slots[i]) ConnMetrics();
+    }
+    return slots;
+}
+
+/**
+ * @description: 释放统计槽
+ * @param {ConnMetrics*} slots 统计槽
+ * @param {int} num 槽数
+ */
+void DownloadMetrics::FreeSlots(ConnMetrics* slots, int num) {
+    for (int i = 0; i < num; i++) {
+        slots[i].~ConnMetrics();
+    }
+    free(slots);
+}
+
+/**
+ * @description: 分配各连接的统计槽
+ * @param {int} slot_num 连接数
+ * @param {const string&} json_path 结束时写入JSON报告的路径，为空不写
+ * @param {const string&} prom_path 运行中定期更新的Prometheus文本文件路径，为空不写
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadMetrics::Init(int slot_num, const string& json_path, const string& prom_path) {
+    // 槽按缓存行对齐，相邻连接的计数不会互相失效缓存
+    m_slots = AllocSlots(slot_num);
+    if (!m_slots) {
+        printf("alloc metrics failed\n");
+        return false;
+    }
+    m_slot_num = slot_num;
+    m_json_path = json_path;
+    m_prom_path = prom_path;
+    m_begin_ns = MetricsNow();
+    return true;
+}
+
+/**
+ * @description: 记录一次数据回调
+ * @param {int} slot 连接序号
+ * @param {size_t} size 写入的字节数
+ * @param {long long} begin_ns 回调开始时间
+ * @param {long long} copy_ns 复制数据耗时
+ */
+void DownloadMetrics::RecordData(int slot, size_t size, long long begin_ns, long long copy_ns) {
+    ConnMetrics& metrics = m_slots[slot];
+    AddRelaxed(metrics.bytes, (unsigned long long)size);
+    AddRelaxed(metrics.callbacks, 1ULL);
+    AddRelaxed(metrics.copy_ns, copy_ns);
+    metrics.copy_hist.Record(copy_ns);
+
+    // 间隔从上次回调结束算起，是等待网络数据的时间
+    if (metrics.last_data_ns > 0) {
+        long long gap = begin_ns - metrics.last_data_ns;
+        metrics.gap_hist.Record(gap);
+        if (gap > METRICS_STALL_NS) {
+            AddRelaxed(metrics.stall_ns, gap);
+        }
+    }
+    metrics.last_data_ns = MetricsNow();
+}
+
+/**
+ * @description: 记录一次重新映射
+ * @param {int} slot 连接序号
+ * @param {long long} ns 耗时
+ */
+void DownloadMetrics::RecordRemap(int slot, long long ns) {
+    ConnMetrics& metrics = m_slots[slot];
+    AddRelaxed(metrics.remap_ns, ns);
+    AddRelaxed(metrics.remaps, 1ULL);
+    metrics.remap_hist.Record(ns);
+}
+
+/**
+ * @description: 记录带宽限制的等待
+ * @param {int} slot 连接序号
+ * @param {long long} ns 等待时长
+ */
+void DownloadMetrics::RecordLimitWait(int slot, long long ns) {
+    AddRelaxed(m_slots[slot].limit_wait_ns, ns);
+}
+
+/**
+ * @description: 记录一个结束的传输
+ * @param {int} slot 连接序号
+ * @param {const TransferTiming*} timing 传输耗时，下载器不提供时为nullptr
+ * @param {bool} ok 是否成功
+ */
+void DownloadMetrics::RecordTransfer(int slot, const TransferTiming* timing, bool ok) {
+    ConnMetrics& metrics = m_slots[slot];
+    AddRelaxed(metrics.transfers, 1ULL);
+    if (!ok) {
+        AddRelaxed(metrics.failed_transfers, 1ULL);
+    }
+    if (timing) {
+        AddRelaxed(metrics.dns_us, timing->dns_us);
+        AddRelaxed(metrics.connect_us, timing->connect_us);
+        AddRelaxed(metrics.tls_us, timing->tls_us);
+        AddRelaxed(metrics.ttfb_us, timing->ttfb_us);
+        metrics.ttfb_hist.Record(timing->ttfb_us * 1000);
+    }
+}
+
+/**
+ * @description: 距上次更新超过间隔时重写Prometheus文本文件，由进度线程调用
+ * @param {int} interval_ms 更新间隔，毫秒
+ */
+void DownloadMetrics::Publish(int interval_ms) {
+    long long now = MetricsNow();
+    // 进度线程因线程结束提前醒来时间隔会略短，不足半个间隔才跳过
+    if (m_prom_path.empty() || now - m_last_publish_ns < interval_ms * 1000000LL / 2) {
+        return;
+    }
+    m_last_publish_ns = now;
+    WritePrometheus();
+}
+
+/**
+ * @description: 下载结束，写入JSON报告和最终的Prometheus文本文件
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadMetrics::Finish() {
+    bool ok = true;
+    if (!m_prom_path.empty()) {
+        ok = WritePrometheus() && ok;
+    }
+    if (!m_json_path.empty()) {
+        ok = WriteJson() && ok;
+    }
+    return ok;
+}
+
+/**
+ * @description: 汇总所有连接的统计
+ * @param {ConnMetrics&} total 汇总结果
+ */
+void DownloadMetrics::Sum(ConnMetrics& total) {
+    for (int i = 0; i < m_slot_num; i++) {
+        ConnMetrics& one = m_slots[i];
+        AddRelaxed(total.bytes, one.bytes.load(memory_order_relaxed));
+        AddRelaxed(total.callbacks, one.callbacks.load(memory_order_relaxed));
+        AddRelaxed(total.transfers, one.transfers.load(memory_order_relaxed));
+        AddRelaxed(total.failed_transfers, one.failed_transfers.load(memory_order_relaxed));
+        AddRelaxed(total.copy_ns, one.copy_ns.load(memory_order_relaxed));
+        AddRelaxed(total.remap_ns, one.remap_ns.load(memory_order_relaxed));
+        AddRelaxed(total.remaps, one.remaps.load(memory_order_relaxed));
+        AddRelaxed(total.stall_ns, one.stall_ns.load(memory_order_relaxed));
+        AddRelaxed(total.limit_wait_ns, one.limit_wait_ns.load(memory_order_relaxed));
+        AddRelaxed(total.dns_us, one.dns_us.load(memory_order_relaxed));
+        AddRelaxed(total.connect_us, one.connect_us.load(memory_order_relaxed));
+        AddRelaxed(total.tls_us, one.tls_us.load(memory_order_relaxed));
+        AddRelaxed(total.ttfb_us, one.ttfb_us.load(memory_order_relaxed));
+        total.copy_hist.Merge(one.copy_hist);
+        total.remap_hist.Merge(one.remap_hist);
+        total.gap_hist.Merge(one.gap_hist);
+        total.ttfb_hist.Merge(one.ttfb_hist);
+    }
+}
+
+/**
+ * @description: 以Prometheus summary格式输出一个直方图
+ * @param {FILE*} file 输出文件
+ * @param {const char*} name 指标名
+ * @param {const string&} labels 标签，不含花括号
+ * @param {const LatencyHistogram&} hist 直方图
+ */
+static void WriteSummary(FILE* file, const char* name, const string& labels, const LatencyHistogram& hist) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (double quantile : quantiles) {
+        fprintf(file, "%s{%s,quantile=\"%g\"} %.9f\n", name, labels.c_str(), quantile,
+            hist.GetPercentile(quantile) / 1e9);
+    }
+    fprintf(file, "%s_sum{%s} %.9f\n", name, labels.c_str(), hist.GetSum() / 1e9);
+    fprintf(file, "%s_count{%s} %llu\n", name, labels.c_str(), hist.GetCount());
+}
+
+/**
+ * @description: 写入Prometheus文本文件，先写临时文件再改名，采集方不会读到写了一半的文件
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadMetrics::WritePrometheus() {
+    string tmp_path = m_prom_path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "w");
+    if (!file) {
+        perror("open prometheus file failed:");
+        return false;
+    }
+
+    fprintf(file, "# HELP downloader_elapsed_seconds Time since the download started.\n");
+    fprintf(file, "# TYPE downloader_elapsed_seconds gauge\n");
+    fprintf(file, "downloader_elapsed_seconds %.3f\n", (MetricsNow() - m_begin_ns) / 1e9);
+    fprintf(file, "# HELP downloader_progress_loop_seconds_total Busy time of the progress thread.\n");
+    fprintf(file, "# TYPE downloader_progress_loop_seconds_total counter\n");
+    fprintf(file, "downloader_progress_loop_seconds_total %.6f\n", m_progress_ns.load() / 1e9);
+
+    // 计数类指标，每个连接一行
+    struct Counter {
+        const char* name;
+        const char* help;
+        function<double(ConnMetrics&)> value;
+    };
+    const Counter counters[] = {
+        {"downloader_bytes_total", "Bytes written by the connection.",
+            [](ConnMetrics& m) { return (double)m.bytes.load(memory_order_relaxed); }},
+        {"downloader_callbacks_total", "Data callbacks of the connection.",
+            [](ConnMetrics& m) { return (double)m.callbacks.load(memory_order_relaxed); }},
+        {"downloader_transfers_total", "Finished range transfers of the connection.",
+            [](ConnMetrics& m) { return (double)m.transfers.load(memory_order_relaxed); }},
+        {"downloader_failed_transfers_total", "Failed or aborted range transfers of the connection.",
+            [](ConnMetrics& m) { return (double)m.failed_transfers.load(memory_order_relaxed); }},
+        {"downloader_remaps_total", "munmap+mmap window moves of the connection.",
+            [](ConnMetrics& m) { return (double)m.remaps.load(memory_order_relaxed); }},
+        {"downloader_stall_seconds_total", "Gaps between data callbacks longer than the stall threshold.",
+            [](ConnMetrics& m) { return m.stall_ns.load(memory_order_relaxed) / 1e9; }},
+        {"downloader_limit_wait_seconds_total", "Time slept by the bandwidth limit.",
+            [](ConnMetrics& m) { return m.limit_wait_ns.load(memory_order_relaxed) / 1e9; }},
+        {"downloader_dns_seconds_total", "DNS lookup time of the connection's transfers.",
+            [](ConnMetrics& m) { return m.dns_us.load(memory_order_relaxed) / 1e6; }},
+        {"downloader_connect_seconds_total", "TCP connect time of the connection's transfers.",
+            [](ConnMetrics& m) { return m.connect_us.load(memory_order_relaxed) / 1e6; }},
+        {"downloader_tls_seconds_total", "TLS handshake time of the connection's transfers.",
+            [](ConnMetrics& m) { return m.tls_us.load(memory_order_relaxed) / 1e6; }},
+    };
+    for (auto& counter : counters) {
+        fprintf(file, "# HELP %s %s\n# TYPE %s counter\n", counter.name, counter.help, counter.name);
+        for (int i = 0; i < m_slot_num; i++) {
+            fprintf(file, "%s{conn=\"%d\"} %.9g\n", counter.name, i, counter.value(m_slots[i]));
+        }
+    }
+
+    // 耗时分布，每个连接一组分位数
+    struct Summary {
+        const char* name;
+        const char* help;
+        LatencyHistogram ConnMetrics::* hist;
+    };
+    const Summary summaries[] = {
+        {"downloader_copy_seconds", "Time to copy one callback's data into the file or writer buffer.",
+            &ConnMetrics::copy_hist},
+        {"downloader_remap_seconds", "Time of one munmap+mmap window move.", &ConnMetrics::remap_hist},
+        {"downloader_data_gap_seconds", "Time between two data callbacks of a transfer.", &ConnMetrics::gap_hist},
+        {"downloader_ttfb_seconds", "Time from sending the request to the first response byte.",
+            &ConnMetrics::ttfb_hist},
+    };
+    for (auto& summary : summaries) {
+        fprintf(file, "# HELP %s %s\n# TYPE %s summary\n", summary.name, summary.help, summary.name);
+        for (int i = 0; i < m_slot_num; i++) {
+            WriteSummary(file, summary.name, "conn=\"" + to_string(i) + "\"", m_slots[i].*summary.hist);
+        }
+    }
+
+    bool ok = fclose(file) == 0;
+    if (!ok || 0 != rename(tmp_path.c_str(), m_prom_path.c_str())) {
+        perror("write prometheus file failed:");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @description: 以JSON对象输出一个直方图的分位数，单位微秒
+ * @param {FILE*} file 输出文件
+ * @param {const char*} name 字段名
+ * @param {const LatencyHistogram&} hist 直方图
+ * @param {bool} last 是否为对象的最后一个字段
+ */
+static void WriteHistJson(FILE* file, const char* name, const LatencyHistogram& hist, bool last) {
+    fprintf(file, "\"%s\": {\"count\": %llu, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+        "\"p999_us\": %.1f, \"max_us\": %.1f}%s", name, hist.GetCount(), hist.GetPercentile(0.5) / 1e3,
+        hist.GetPercentile(0.9) / 1e3, hist.GetPercentile(0.99) / 1e3, hist.GetPercentile(0.999) / 1e3,
+        hist.GetMax() / 1e3, last ? "" : ", ");
+}
+
+/**
+ * @description: 以JSON对象输出一个连接或汇总的统计
+ * @param {FILE*} file 输出文件
+ * @param {ConnMetrics&} metrics 统计
+ */
+static void WriteConnJson(FILE* file, ConnMetrics& metrics) {
+    fprintf(file, "\"bytes\": %llu, \"callbacks\": %llu, \"transfers\": %llu, \"failed_transfers\": %llu, "
+        "\"copy_ms\": %.3f, \"remap_ms\": %.3f, \"remaps\": %llu, \"stall_ms\": %.3f, \"limit_wait_ms\": %.3f, "
+        "\"dns_ms\": %.3f, \"connect_ms\": %.3f, \"tls_ms\": %.3f, \"ttfb_ms\": %.3f, \"histograms\": {",
+        metrics.bytes.load(), metrics.callbacks.load(), metrics.transfers.load(), metrics.failed_transfers.load(),
+        metrics.copy_ns.load() / 1e6, metrics.remap_ns.load() / 1e6, metrics.remaps.load(),
+        metrics.stall_ns.load() / 1e6, metrics.limit_wait_ns.load() / 1e6, metrics.dns_us.load() / 1e3,
+        metrics.connect_us.load() / 1e3, metrics.tls_us.load() / 1e3, metrics.ttfb_us.load() / 1e3);
+    WriteHistJson(file, "copy", metrics.copy_hist, false);
+    WriteHistJson(file, "remap", metrics.remap_hist, false);
+    WriteHistJson(file, "data_gap", metrics.gap_hist, false);
+    WriteHistJson(file, "ttfb", metrics.ttfb_hist, true);
+    fprintf(file, "}");
+}
+
+/**
+ * @description: 写入JSON报告
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadMetrics::WriteJson() {
+    FILE* file = fopen(m_json_path.c_str(), "w");
+    if (!file) {
+        perror("open metrics report failed:");
+        return false;
+    }
+    // 汇总槽较大，不放在栈上
+    ConnMetrics* total = AllocSlots(1);
+    if (!total) {
+        fclose(file);
+        return false;
+    }
+    Sum(*total);
+    fprintf(file, "{\n  \"elapsed_seconds\": %.3f,\n  \"progress_loop_ms\": %.3f,\n  \"total\": {",
+        (MetricsNow() - m_begin_ns) / 1e9, m_progress_ns.load() / 1e6);
+    WriteConnJson(file, *total);
+    fprintf(file, "},\n  \"connections\": [");
+    bool first = true;
+    for (int i = 0; i < m_slot_num; i++) {
+        // 从未启动的连接不输出
+        if (m_slots[i].transfers == 0 && m_slots[i].callbacks == 0) {
+            continue;
+        }
+        fprintf(file, "%s\n    {\"id\": %d, ", first ? "" : ",", i);
+        WriteConnJson(file, m_slots[i]);
+        fprintf(file, "}");
+        first = false;
+    }
+    fprintf(file, "\n  ]\n}\n");
+    FreeSlots(total, 1);
+    if (fclose(file) != 0) {
+        perror("write metrics report failed:");
+        return false;
+    }
+    printf("metrics report written to %s\n", m_json_path.c_str());
+    return true;
+}
@@ -0,0 +1,199 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-28 15:41:17
+ * @Description: 内存预算实现
+ */
+#include <fcntl.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include "memory_budget.h"
+
+#define CGROUP_UNLIMITED    (1ULL << 60) // cgroup v1不限制时上限为接近最大值的页对齐数
+
+/**
+ * @description: 为映射窗口申请预算，不阻塞，预算不足时缩小窗口，最小为BUDGET_MIN_WINDOW
+ * @param {size_t} want 希望映射的字节数，4K对齐
+ * @return {size_t} 允许映射的字节数，4K对齐且不超过want
+ */
+size_t MemoryBudget::AcquireWindow(size_t want) {
+    // 映射时不等待：连接在等待前已持有窗口，多路复用的连接共用IO线程，等待其他连接释放可能死锁
+    long long cap = (long long)(m_limit / BUDGET_MAPPED_SHARE);
+    long long mapped = m_mapped.load(memory_order_relaxed);
+    size_t grant = 0;
+    do {
+        // 每次最多取剩余额度的一半，先映射的连接不会占满额度，后来的连接不至于只剩最小窗口
+        long long room = (cap - mapped) / 2;
+        grant = want;
+        if ((long long)grant > room) {
+            grant = room > BUDGET_MIN_WINDOW ? (size_t)room / BUDGET_MIN_WINDOW * BUDGET_MIN_WINDOW
+                : BUDGET_MIN_WINDOW;
+            grant = min(grant, want);
+        }
+    } while (!m_mapped.compare_exchange_weak(mapped, mapped + grant, memory_order_relaxed));
+    return grant;
+}
+
+/**
+ * @description: 映射窗口已解除，发起回写并转为脏页计入预算，超出预算时等待最早的区间回写完成
+ * @param {int} fd 文件描述符，需在Drain之后才能关闭
+ * @param {file_size_t} offset 窗口在文件中的位置
+ * @param {size_t} size 窗口大小，即AcquireWindow的返回值
+ */
+void MemoryBudget::ReleaseWindow(int fd, file_size_t offset, size_t size) {
+    m_mapped -= size;
+    Push(fd, offset, size);
+}
+
+/**
+ * @description: 区间已通过pwrite写入页缓存，发起回写并计入预算，超出预算时等待最早的区间回写完成
+ * @param {int} fd 文件描述符，需在Drain之后才能关闭
+ * @param {file_size_t} offset 区间在文件中的位置
+ * @param {size_t} size 区间大小
+ */
+void MemoryBudget::AddDirty(int fd, file_size_t offset, size_t size) {
+    Push(fd, offset, size);
+}
+
+/**
+ * @description: 发起区间的回写并登记，超出预算时按登记顺序等待最早的区间
+ * @param {int} fd 文件描述符
+ * @param {file_size_t} offset 区间在文件中的位置
+ * @param {size_t} size 区间大小
+ */
+void MemoryBudget::Push(int fd, file_size_t offset, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    // 尽早发起回写，等到超出预算时最早的区间多半已写完，等待很短
+    sync_file_range(fd, offset, size, SYNC_FILE_RANGE_WRITE);
+    {
+        lock_guard<mutex> guard(m_lock);
+        m_ranges.push_back({fd, offset, size});
+    }
+    m_dirty += size;
+
+    // 由写入的连接等待，阻塞期间不再读取套接字，接收缓冲区填满后由TCP限制对端发送
+    while (m_mapped + m_dirty > (long long)m_limit) {
+        DirtyRange range;
+        {
+            lock_guard<mutex> guard(m_lock);
+            if (m_ranges.empty()) {
+                break;
+            }
+            range = m_ranges.front();
+            m_ranges.pop_front();
+            m_waiting.push_back(range.fd);
+        }
+        auto begin_time = chrono::steady_clock::now();
+        WaitRange(range);
+        m_dirty -= range.size;
+        m_wait_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin_time).count();
+        {
+            lock_guard<mutex> guard(m_lock);
+            m_waiting.erase(find(m_waiting.begin(), m_waiting.end(), range.fd));
+        }
+        m_cond.notify_all();
+    }
+}
+
+/**
+ * @description: 等待文件所有已登记区间回写完成并移出预算，关闭文件前调用
+ * @param {int} fd 文件描述符
+ */
+void MemoryBudget::Drain(int fd) {
+    vector<DirtyRange> ranges;
+    {
+        lock_guard<mutex> guard(m_lock);
+        for (auto it = m_ranges.begin(); it != m_ranges.end();) {
+            if (it->fd == fd) {
+                ranges.push_back(*it);
+                it = m_ranges.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+    for (auto& range : ranges) {
+        WaitRange(range);
+        m_dirty -= range.size;
+    }
+
+    // 其他连接取出的区间仍在等待时，文件关闭后描述符可能被复用
+    unique_lock<mutex> lock(m_lock);
+    m_cond.wait(lock, [this, fd] { return find(m_waiting.begin(), m_waiting.end(), fd) == m_waiting.end(); });
+}
+
+/**
+ * @description: 等待区间回写完成，并丢弃其已干净的页缓存
+ * @param {const DirtyRange&} range 区间
+ */
+void MemoryBudget::WaitRange(const DirtyRange& range) {
+    sync_file_range(range.fd, range.offset, range.size,
+        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    // 干净的页缓存同样计入cgroup的内存用量，下载的数据一般不会再读，直接丢弃，仍被映射的页不受影响
+    posix_fadvise(range.fd, range.offset, range.size, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * @description: 读取当前cgroup的内存上限，依次尝试cgroup v2和v1
+ * @return {file_size_t} 字节，没有限制或读取失败时为0
+ */
+file_size_t MemoryBudget::DetectCgroupLimit() {
+    const char* paths[] = {"/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes"};
+    for (auto path : paths) {
+        ifstream file(path);
+        string value;
+        if (!(file >> value)) {
+            continue;
+        }
+        if (value == "max") {
+            return 0;
+        }
+        file_size_t limit = strtoull(value.c_str(), nullptr, 10);
+        return limit >= CGROUP_UNLIMITED ? 0 : limit;
+    }
+    return 0;
+}
+
+/**
+ * @description: 解析字节数，支持K、M、G、T后缀（1024进制）
+ * @param {const string&} text 字节数文本，如256M
+ * @param {file_size_t&} size 字节数
+ * @return {bool} 格式正确返回true， 否则返回false
+ */
+bool MemoryBudget::ParseSize(const string& text, file_size_t& size) {
+    if (text.empty() || !isdigit((unsigned char)text[0])) {
+        return false;
+    }
+    char* end = nullptr;
+    file_size_t value = strtoull(text.c_str(), &end, 10);
+    string unit(end);
+    int shift = 0;
+    if (unit == "K" || unit == "k") {
+        shift = 10;
+    }
+    else if (unit == "M" || unit == "m") {
+        shift = 20;
+    }
+    else if (unit == "G" || unit == "g") {
+        shift = 30;
+    }
+    else if (unit == "T" || unit == "t") {
+        shift = 40;
+    }
+    else if (!unit.empty()) {
+        return false;
+    }
+    // 超出file_size_t范围视为格式错误
+    if (value > (~(file_size_t)0 >> shift)) {
+        return false;
+    }
+    size = value << shift;
+    return true;
+}
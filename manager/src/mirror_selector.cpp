@@ -0,0 +1,119 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-25 21:05:33
+ * @Description: 镜像选择器实现
+ */
+#include <stdio.h>
+#include <algorithm>
+#include "mirror_selector.h"
+
+/**
+ * @description: 初始化下载源
+ * @param {int} source_num 下载源数量
+ */
+void MirrorSelector::Init(int source_num) {
+    lock_guard<mutex> guard(m_lock);
+    m_sources.assign(source_num, Source());
+}
+
+/**
+ * @description: 按吞吐量加权随机选择下载源，尚未测得吞吐量的下载源按当前最快的计算，以便尽快测量
+ * @return {int} 下载源序号，全部被淘汰时返回-1
+ */
+int MirrorSelector::Pick() {
+    lock_guard<mutex> guard(m_lock);
+    if (m_sources.size() == 1) {
+        return m_sources[0].alive ? 0 : -1;
+    }
+
+    double best = 0;
+    for (auto& source : m_sources) {
+        if (source.alive) {
+            best = max(best, source.rate);
+        }
+    }
+    if (best == 0) {
+        best = 1;
+    }
+
+    vector<double> weights(m_sources.size(), 0);
+    double total = 0;
+    for (size_t i = 0; i < m_sources.size(); i++) {
+        if (m_sources[i].alive) {
+            weights[i] = m_sources[i].rate > 0 ? m_sources[i].rate : best;
+            total += weights[i];
+        }
+    }
+    if (total == 0) {
+        return -1;
+    }
+
+    double point = uniform_real_distribution<double>(0, total)(m_random);
+    for (size_t i = 0; i < weights.size(); i++) {
+        if (weights[i] > 0 && point < weights[i]) {
+            return i;
+        }
+        point -= weights[i];
+    }
+
+    // 浮点误差时取最后一个可用的下载源
+    for (int i = (int)weights.size() - 1; i >= 0; i--) {
+        if (weights[i] > 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @description: 记录一个片段的下载结果
+ * @param {int} source 下载源序号
+ * @param {file_size_t} size 片段实际下载的字节数
+ * @param {double} seconds 片段耗时，秒
+ * @param {bool} ok 是否成功
+ */
+void MirrorSelector::Report(int source, file_size_t size, double seconds, bool ok) {
+    lock_guard<mutex> guard(m_lock);
+    Source& one = m_sources[source];
+    one.size += size;
+    if (!ok) {
+        // 最后一个可用的下载源不淘汰，由调用方决定是否失败
+        int alive_num = (int)count_if(m_sources.begin(), m_sources.end(), [](const Source& s) { return s.alive; });
+        if (++one.fail_num >= MIRROR_MAX_FAILURES && one.alive && alive_num > 1) {
+            one.alive = false;
+            printf("mirror %d dropped after %d failures\n", source, one.fail_num);
+        }
+        return;
+    }
+
+    one.fail_num = 0;
+    if (size < MIRROR_MIN_SAMPLE_SIZE || seconds <= 0) {
+        return;
+    }
+    double rate = size / seconds;
+    one.rate = one.rate > 0 ? one.rate * (1 - MIRROR_EWMA_ALPHA) + rate * MIRROR_EWMA_ALPHA : rate;
+}
+
+/**
+ * @description: 获取未被淘汰的下载源数量
+ * @return {int}
+ */
+int MirrorSelector::GetAliveNum() {
+    lock_guard<mutex> guard(m_lock);
+    return (int)count_if(m_sources.begin(), m_sources.end(), [](const Source& one) { return one.alive; });
+}
+
+/**
+ * @description: 获取下载源的统计
+ * @param {int} source 下载源序号
+ * @param {file_size_t&} size 已下载的字节数
+ * @param {double&} rate 单连接吞吐量，字节/秒，未测得时为0
+ * @return {bool} 未被淘汰返回true
+ */
+bool MirrorSelector::GetStats(int source, file_size_t& size, double& rate) {
+    lock_guard<mutex> guard(m_lock);
+    size = m_sources[source].size;
+    rate = m_sources[source].rate;
+    return m_sources[source].alive;
+}
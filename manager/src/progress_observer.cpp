@@ -0,0 +1,84 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-11 21:30:42
+ * @Description: 下载进度的计数和终端进度条实现
+ */
+#include <stdio.h>
+#include <string>
+#include "progress_observer.h"
+using namespace std;
+
+/**
+ * @description: 转换字节大小
+ * @param {double} size 原大小
+ * @param {string&} unit 转换后单位
+ * @return {int} 转换后大小
+ */
+static int ConvertSize(double size, string& unit) {
+    static const char* all_units[] = {"KB", "MB", "GB", "TB"};
+    unit = "B";
+    for (auto one_unit : all_units) {
+        if (size <= 1024) {
+            break;
+        }
+        size /= 1024;
+        unit = one_unit;
+    }
+    return (int)size;
+}
+
+/**
+ * @description: 获取所有连接的计数之和
+ * @return {file_size_t}
+ */
+file_size_t ProgressCounters::Sum() const {
+    file_size_t total = 0;
+    for (auto& counter : m_counters) {
+        total += counter.value.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+/**
+ * @description: 显示进度条，回车后不换行，下次覆盖
+ * @param {const ProgressInfo&} info 进度
+ */
+void ConsoleProgress::OnProgress(const ProgressInfo& info) {
+    // 大小未知时没有百分比，只显示已下载的大小
+    if (info.total_size == 0) {
+        string downloaded_unit;
+        string speed_unit;
+        int downloaded = ConvertSize(info.downloaded_size, downloaded_unit);
+        int speed = ConvertSize(info.speed, speed_unit);
+        printf("[%4d%s downloaded][%3d%s/s]\r", downloaded, downloaded_unit.c_str(), speed, speed_unit.c_str());
+        fflush(stdout);
+        return;
+    }
+    int progress = info.total_size ? (int)(info.downloaded_size * 100 / info.total_size) : 0;
+    string bar(progress, '=');
+    string speed_size;
+    int speed = ConvertSize(info.speed, speed_size);
+    if (m_show_conn) {
+        printf("[%-100s][%3d%%][%3d%s/s][%2d conn]\r", bar.c_str(), progress, speed, speed_size.c_str(),
+            info.conn_num);
+    }
+    else {
+        printf("[%-100s][%3d%%][%3d%s/s]\r", bar.c_str(), progress, speed, speed_size.c_str());
+    }
+    fflush(stdout);
+}
+
+/**
+ * @description: 成功时显示完整的进度条，失败时换行，之后的错误信息不会覆盖进度条
+ * @param {bool} ok 是否成功
+ * @param {const ProgressInfo&} info 结束时的进度
+ */
+void ConsoleProgress::OnFinish(bool ok, const ProgressInfo& info) {
+    if (!ok) {
+        printf("\n");
+        return;
+    }
+    string bar(100, '=');
+    printf("[%-100s][%3d%%]\r\n", bar.c_str(), 100);
+}
@@ -0,0 +1,336 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-15 11:05:48
+ * @Description: 独立写盘阶段实现
+ */
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <chrono>
+#include "pwrite_writer.h"
+
+PwriteWriter::~PwriteWriter() {
+    Stop();
+    for (auto ring : m_rings) {
+        for (auto& slot : ring->slots) {
+            free(slot.data);
+        }
+        ring->~Ring();
+        free(ring);
+    }
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+    if (m_direct_fd != -1) {
+        close(m_direct_fd);
+    }
+}
+
+/**
+ * @description: 打开文件并启动写线程
+ * @param {const string&} path 文件路径，文件需已创建
+ * @param {int} conn_num 连接数，每个连接一个环形缓冲区
+ * @param {int} writer_num 写线程数
+ * @param {bool} direct 是否对对齐的数据使用O_DIRECT
+ * @param {WrittenCallback} written 数据写入文件后的回调，在写线程中执行
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool PwriteWriter::Start(const string& path, int conn_num, int writer_num, bool direct, WrittenCallback written) {
+    m_fd = open(path.c_str(), O_WRONLY);
+    if (m_fd == -1) {
+        perror("open file for pwrite failed:");
+        return false;
+    }
+
+    // tmpfs等文件系统不支持O_DIRECT，此时退回普通写入
+    if (direct) {
+        m_direct_fd = open(path.c_str(), O_WRONLY | O_DIRECT);
+        if (m_direct_fd == -1) {
+            perror("O_DIRECT is unavailable, use buffered pwrite:");
+        }
+    }
+
+    // 缓冲槽在连接第一次写入时分配，未使用的连接不占内存，C++11的new不保证超过16字节的对齐
+    for (int i = 0; i < conn_num; i++) {
+        void* mem = nullptr;
+        if (0 != posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(Ring))) {
+            printf("alloc writer ring failed\n");
+            return false;
+        }
+        m_rings.push_back(new (mem) Ring());
+    }
+
+    m_written = written;
+    if (writer_num > conn_num) {
+        writer_num = conn_num;
+    }
+    for (int i = 0; i < writer_num; i++) {
+        m_writers.emplace_back(&PwriteWriter::WriterLoop, this, i, writer_num);
+    }
+    return true;
+}
+
+/**
+ * @description: 将连接收到的数据放入其环形缓冲区，缓冲区满时等待写线程
+ * @param {int} conn_id 连接序号，同一连接只能由一个线程写入
+ * @param {file_size_t} pos 数据在文件中的位置
+ * @param {const char*} data 数据
+ * @param {size_t} size 数据大小
+ * @return {bool} 成功返回true， 写线程出错返回false
+ */
+bool PwriteWriter::Write(int conn_id, file_size_t pos, const char* data, size_t size) {
+    Ring& ring = *m_rings[conn_id];
+    if (ring.slots[0].data == nullptr && !AllocRing(ring)) {
+        m_failed = true;
+        return false;
+    }
+    while (size > 0) {
+        if (m_failed) {
+            return false;
+        }
+
+        // 正在填充的槽已满或位置不连续时先提交
+        unsigned head = ring.head.load(memory_order_relaxed);
+        Slot* slot = &ring.slots[head % WRITER_SLOT_NUM];
+        if (ring.filling && (slot->size == WRITER_SLOT_SIZE || slot->offset + slot->size != pos)) {
+            Publish(ring);
+            continue;
+        }
+
+        if (!ring.filling) {
+            // 没有空槽时先自旋，仍没有再休眠等待写线程
+            for (int i = 0; head - ring.tail.load(memory_order_acquire) >= WRITER_SLOT_NUM; i++) {
+                if (i < WRITER_SPIN_NUM) {
+                    this_thread::yield();
+                    continue;
+                }
+                unique_lock<mutex> guard(m_wait_lock);
+                m_waiting++;
+                // 与写线程的fence配对：写线程要么看到m_waiting并通知，要么这里看到新的tail
+                atomic_thread_fence(memory_order_seq_cst);
+                // 限时等待兜底，即使错过通知也不会一直休眠
+                while (!m_space_cond.wait_for(guard, chrono::milliseconds(WRITER_WAIT_MS), [&]() {
+                    return head - ring.tail.load(memory_order_acquire) < WRITER_SLOT_NUM || m_failed;
+                })) {}
+                m_waiting--;
+                if (m_failed) {
+                    return false;
+                }
+            }
+            slot->offset = pos;
+            slot->size = 0;
+            ring.filling = true;
+        }
+
+        size_t copy_size = WRITER_SLOT_SIZE - slot->size;
+        if (copy_size > size) {
+            copy_size = size;
+        }
+        memcpy(slot->data + slot->size, data, copy_size);
+        slot->size += copy_size;
+        data += copy_size;
+        pos += copy_size;
+        size -= copy_size;
+    }
+    return true;
+}
+
+/**
+ * @description: 分配环形缓冲区的所有缓冲槽
+ * @param {Ring&} ring 环形缓冲区
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool PwriteWriter::AllocRing(Ring& ring) {
+    for (auto& slot : ring.slots) {
+        if (0 != posix_memalign((void**)&slot.data, WRITER_ALIGN, WRITER_SLOT_SIZE)) {
+            slot.data = nullptr;
+            printf("alloc writer buffer failed\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @description: 提交连接未填满的缓冲槽，片段结束时调用
+ * @param {int} conn_id 连接序号
+ */
+void PwriteWriter::Flush(int conn_id) {
+    Ring& ring = *m_rings[conn_id];
+    if (ring.filling) {
+        Publish(ring);
+    }
+}
+
+/**
+ * @description: 提交正在填充的槽，必要时唤醒写线程
+ * @param {Ring&} ring 环形缓冲区
+ */
+void PwriteWriter::Publish(Ring& ring) {
+    ring.head.fetch_add(1, memory_order_release);
+    ring.filling = false;
+    // 提交与读取m_waiting不能重排，否则可能与休眠的写线程互相错过
+    atomic_thread_fence(memory_order_seq_cst);
+    if (m_waiting > 0) {
+        lock_guard<mutex> guard(m_wait_lock);
+        m_data_cond.notify_all();
+    }
+}
+
+/**
+ * @description: 写线程主体，负责序号对writer_num取余等于writer_id的连接
+ * @param {int} writer_id 写线程序号
+ * @param {int} writer_num 写线程数
+ */
+void PwriteWriter::WriterLoop(int writer_id, int writer_num) {
+    auto has_data = [&]() {
+        for (size_t i = writer_id; i < m_rings.size(); i += writer_num) {
+            if (m_rings[i]->head.load(memory_order_acquire) != m_rings[i]->tail.load(memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    int idle_num = 0;
+    while (!m_failed) {
+        bool busy = false;
+        for (size_t i = writer_id; i < m_rings.size(); i += writer_num) {
+            if (Drain(*m_rings[i])) {
+                busy = true;
+            }
+        }
+        if (busy) {
+            idle_num = 0;
+            // tail的release写入后仍可能先读到m_waiting，需要fence避免与等待空槽的生产者互相错过
+            atomic_thread_fence(memory_order_seq_cst);
+            if (m_waiting > 0) {
+                lock_guard<mutex> guard(m_wait_lock);
+                m_space_cond.notify_all();
+            }
+            continue;
+        }
+
+        // 生产者已全部提交后才能退出
+        if (m_stop && !has_data()) {
+            break;
+        }
+        if (++idle_num < WRITER_SPIN_NUM) {
+            this_thread::yield();
+            continue;
+        }
+        unique_lock<mutex> guard(m_wait_lock);
+        m_waiting++;
+        m_data_cond.wait_for(guard, chrono::milliseconds(100), [&]() { return m_stop || has_data(); });
+        m_waiting--;
+    }
+
+    // 出错时唤醒等待空槽的生产者
+    lock_guard<mutex> guard(m_wait_lock);
+    m_space_cond.notify_all();
+}
+
+/**
+ * @description: 写出环形缓冲区中已提交的槽，位置连续的槽合并为一次pwritev
+ * @param {Ring&} ring 环形缓冲区
+ * @return {bool} 有数据写出返回true， 否则返回false
+ */
+bool PwriteWriter::Drain(Ring& ring) {
+    unsigned tail = ring.tail.load(memory_order_relaxed);
+    unsigned head = ring.head.load(memory_order_acquire);
+    if (tail == head) {
+        return false;
+    }
+
+    Slot* slots[WRITER_MAX_IOV];
+    int num = 0;
+    while (tail + num != head && num < WRITER_MAX_IOV) {
+        Slot* slot = &ring.slots[(tail + num) % WRITER_SLOT_NUM];
+        if (num > 0 && slots[num - 1]->offset + slots[num - 1]->size != slot->offset) {
+            break;
+        }
+        slots[num++] = slot;
+    }
+    if (!WriteSlots(slots, num)) {
+        m_failed = true;
+        return false;
+    }
+
+    file_size_t start = slots[0]->offset;
+    file_size_t end = slots[num - 1]->offset + slots[num - 1]->size;
+    ring.tail.store(tail + num, memory_order_release);
+    if (m_written) {
+        m_written(start, end);
+    }
+    return true;
+}
+
+/**
+ * @description: 将一组位置连续的槽写入文件
+ * @param {Slot**} slots 槽
+ * @param {int} num 槽数
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool PwriteWriter::WriteSlots(Slot** slots, int num) {
+    iovec iov[WRITER_MAX_IOV];
+    size_t total = 0;
+    bool aligned = slots[0]->offset % WRITER_ALIGN == 0;
+    for (int i = 0; i < num; i++) {
+        iov[i].iov_base = slots[i]->data;
+        iov[i].iov_len = slots[i]->size;
+        total += slots[i]->size;
+        aligned = aligned && slots[i]->size % WRITER_ALIGN == 0;
+    }
+
+    // 文件末尾等未对齐的数据只能走页缓存
+    int fd = aligned && m_direct_fd != -1 ? m_direct_fd : m_fd;
+    file_size_t offset = slots[0]->offset;
+    iovec* cur = iov;
+    while (total > 0) {
+        ssize_t n = pwritev(fd, cur, num, offset);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            perror("pwritev failed:");
+            return false;
+        }
+
+        // 部分写入时跳过已写的部分，剩余数据可能不再对齐
+        total -= n;
+        offset += n;
+        while (num > 0 && (size_t)n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            num--;
+        }
+        if (num > 0) {
+            cur->iov_base = (char*)cur->iov_base + n;
+            cur->iov_len -= n;
+            fd = m_fd;
+        }
+    }
+    return true;
+}
+
+/**
+ * @description: 等待所有数据写完并停止写线程
+ * @return {bool} 全部写入成功返回true， 否则返回false
+ */
+bool PwriteWriter::Stop() {
+    {
+        lock_guard<mutex> guard(m_wait_lock);
+        m_stop = true;
+        m_data_cond.notify_all();
+    }
+    for (auto& writer : m_writers) {
+        writer.join();
+    }
+    m_writers.clear();
+    return !m_failed;
+}
@@ -0,0 +1,417 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-03-20 21:46:05
+ * @Description: 文件片段调度器实现
+ */
+#include "segment_scheduler.h"
+
+#define ALIGN_UP(a, b)  (((a) + (b) - 1) / (b) * (b))
+
+/**
+ * @description: 初始化调度器，整个文件作为一个空闲区间
+ * @param {file_size_t} filesize 文件大小
+ * @param {int} worker_num 工作线程数
+ * @param {file_size_t} unit_size 单次分配的片段大小，为0时按线程数自动计算
+ */
+void SegmentScheduler::Init(file_size_t filesize, int worker_num, file_size_t unit_size) {
+    lock_guard<mutex> guard(m_mutex);
+    m_filesize = filesize;
+    m_done_size = 0;
+    m_free.clear();
+    m_done.clear();
+    if (filesize > 0) {
+        m_free[0] = filesize;
+    }
+
+    if (unit_size == 0) {
+        unit_size = filesize / ((file_size_t)worker_num * SEGMENT_UNIT_FACTOR);
+        if (unit_size < MIN_SEGMENT_SIZE) {
+            unit_size = MIN_SEGMENT_SIZE;
+        }
+    }
+    m_unit_size = ALIGN_UP(unit_size, SEGMENT_ALIGN);
+
+    m_slots.clear();
+    for (int i = 0; i < worker_num; i++) {
+        m_slots.emplace_back(new WorkerSlot());
+        m_slots.back()->owner = i;
+    }
+    m_hedge_num = 0;
+}
+
+/**
+ * @description: 将区间标记为已完成，用于续传时跳过已下载的部分，需在分配片段前调用
+ * @param {file_size_t} start 起始字节
+ * @param {file_size_t} end 结束字节（不包含）
+ */
+void SegmentScheduler::MarkDone(file_size_t start, file_size_t end) {
+    lock_guard<mutex> guard(m_mutex);
+    if (end > m_filesize) {
+        end = m_filesize;
+    }
+    if (start >= end) {
+        return;
+    }
+
+    // 从与之重叠的空闲区间中扣除，只统计实际扣除的部分
+    auto it = m_free.upper_bound(start);
+    if (it != m_free.begin()) {
+        --it;
+    }
+    while (it != m_free.end() && it->first < end) {
+        file_size_t free_start = it->first;
+        file_size_t free_end = it->second;
+        if (free_end <= start) {
+            ++it;
+            continue;
+        }
+        it = m_free.erase(it);
+        if (free_start < start) {
+            m_free[free_start] = start;
+        }
+        if (free_end > end) {
+            m_free[end] = free_end;
+        }
+        AddDone(free_start > start ? free_start : start, free_end < end ? free_end : end);
+    }
+}
+
+/**
+ * @description: 为线程分配下一个片段，无空闲区间时从剩余耗时最长的线程处分走后半段，
+ *               已无法再分且处于收尾阶段时重复下载该线程的剩余区间
+ * @param {int} worker_id 线程序号
+ * @param {Segment&} seg 分配到的片段
+ * @param {bool} steal 无空闲区间时是否分走或重复下载其他线程的区间
+ * @return {bool} 分配成功返回true，已无可分配的区间返回false
+ */
+bool SegmentScheduler::Acquire(int worker_id, Segment& seg, bool steal) {
+    lock_guard<mutex> guard(m_mutex);
+    if (m_free.empty()) {
+        if (!steal) {
+            return false;
+        }
+        if (!Steal(worker_id, seg)) {
+            return Hedge(worker_id, seg);
+        }
+    }
+    else {
+        // 从最靠前的空闲区间切出一个片段
+        auto it = m_free.begin();
+        seg.start = it->first;
+        seg.end = it->second - it->first > m_unit_size ? it->first + m_unit_size : it->second;
+        if (seg.end < it->second) {
+            m_free[seg.end] = it->second;
+        }
+        m_free.erase(it);
+    }
+
+    WorkerSlot& slot = *m_slots[worker_id];
+    lock_guard<mutex> slot_guard(slot.lock);
+    slot.start = seg.start;
+    slot.pos = seg.start;
+    slot.end = seg.end;
+    slot.recv = seg.start;
+    slot.active = true;
+    slot.begin_time = chrono::steady_clock::now();
+    return true;
+}
+
+/**
+ * @description: 从其他线程分走剩余区间的后半段，调用前需持有m_mutex
+ * @param {int} worker_id 线程序号
+ * @param {Segment&} seg 分到的片段
+ * @return {bool} 成功返回true，无可分区间返回false
+ */
+bool SegmentScheduler::Steal(int worker_id, Segment& seg) {
+    auto now = chrono::steady_clock::now();
+    int victim = -1;
+    double max_remain_time = 0;
+
+    // 按已下载速度估算剩余耗时，选出最慢的线程，重复下载中的片段不再分
+    for (int i = 0; i < (int)m_slots.size(); i++) {
+        if (i == worker_id) {
+            continue;
+        }
+        WorkerSlot& slot = *m_slots[i];
+        lock_guard<mutex> slot_guard(slot.lock);
+        if (!slot.active || slot.owner != i || slot.hedger != -1 || slot.end - slot.pos < MIN_STEAL_SIZE * 2) {
+            continue;
+        }
+        double remain_time = EstimateRemainTime(slot, now);
+        if (remain_time > max_remain_time) {
+            max_remain_time = remain_time;
+            victim = i;
+        }
+    }
+    if (victim == -1) {
+        return false;
+    }
+
+    // 重新加锁后再确认一次，期间目标线程可能已继续写入
+    WorkerSlot& slot = *m_slots[victim];
+    lock_guard<mutex> slot_guard(slot.lock);
+    file_size_t split = ALIGN_UP(slot.pos + (slot.end - slot.pos) / 2, SEGMENT_ALIGN);
+    if (!slot.active || split <= slot.pos || split >= slot.end || slot.end - split < MIN_STEAL_SIZE) {
+        return false;
+    }
+    seg.start = split;
+    seg.end = slot.end;
+    slot.end = split;
+    return true;
+}
+
+/**
+ * @description: 收尾阶段重复下载剩余耗时最长的线程的剩余区间，调用前需持有m_mutex
+ * @param {int} worker_id 线程序号
+ * @param {Segment&} seg 重复下载的区间
+ * @return {bool} 成功返回true，未进入收尾阶段或无可重复的区间返回false
+ */
+bool SegmentScheduler::Hedge(int worker_id, Segment& seg) {
+    auto now = chrono::steady_clock::now();
+    int victim = -1;
+    double max_remain_time = 0;
+    file_size_t remain_size = 0;
+
+    // 统计所有下载中的剩余字节，同时选出尚未被重复下载的最慢线程
+    for (int i = 0; i < (int)m_slots.size(); i++) {
+        if (i == worker_id) {
+            continue;
+        }
+        WorkerSlot& slot = *m_slots[i];
+        lock_guard<mutex> slot_guard(slot.lock);
+        if (!slot.active || slot.owner != i || slot.pos >= slot.end) {
+            continue;
+        }
+        remain_size += slot.end - slot.pos;
+        if (slot.hedger != -1) {
+            continue;
+        }
+        double remain_time = EstimateRemainTime(slot, now);
+        if (remain_time > max_remain_time) {
+            max_remain_time = remain_time;
+            victim = i;
+        }
+    }
+    if (victim == -1 || remain_size > ENDGAME_SIZE) {
+        return false;
+    }
+
+    // 从被重复线程当前的预留位置开始下载，两个连接共用该位置
+    WorkerSlot& front = *m_slots[victim];
+    lock_guard<mutex> front_guard(front.lock);
+    if (!front.active || front.hedger != -1 || front.pos >= front.end) {
+        return false;
+    }
+    WorkerSlot& slot = *m_slots[worker_id];
+    lock_guard<mutex> slot_guard(slot.lock);
+    seg.start = front.pos;
+    seg.end = front.end;
+    slot.start = seg.start;
+    slot.pos = seg.start;
+    slot.end = seg.end;
+    slot.recv = seg.start;
+    slot.active = true;
+    slot.begin_time = now;
+    slot.owner = victim;
+    front.hedger = worker_id;
+    m_hedge_num++;
+    return true;
+}
+
+/**
+ * @description: 按已下载速度估算片段的剩余耗时，调用前需持有片段的锁
+ * @param {WorkerSlot&} slot 片段
+ * @param {chrono::steady_clock::time_point} now 当前时间
+ * @return {double} 秒，尚无数据时按剩余字节数返回一个极大值
+ */
+double SegmentScheduler::EstimateRemainTime(WorkerSlot& slot, chrono::steady_clock::time_point now) {
+    double remain = (double)(slot.end - slot.pos);
+    double elapsed = chrono::duration<double>(now - slot.begin_time).count();
+    double remain_time = remain * 1e9; // 尚无数据时视为最慢，再按剩余量排序
+    if (slot.pos > slot.start && elapsed > 0) {
+        remain_time = remain / ((double)(slot.pos - slot.start) / elapsed);
+    }
+    return remain_time;
+}
+
+/**
+ * @description: 锁住线程预留位置所在的片段，重复下载时为被重复线程的片段
+ * @param {int} worker_id 线程序号
+ * @param {unique_lock<mutex>&} guard 返回时持有该片段的锁
+ * @return {WorkerSlot&} 预留位置所在的片段
+ */
+SegmentScheduler::WorkerSlot& SegmentScheduler::LockFront(int worker_id, unique_lock<mutex>& guard) {
+    WorkerSlot& slot = *m_slots[worker_id];
+    while (true) {
+        int owner = slot.owner;
+        WorkerSlot& front = *m_slots[owner];
+        guard = unique_lock<mutex>(front.lock);
+        // 加锁前被重复的线程可能已结束并把剩余区间移交给本线程
+        if (slot.owner == owner) {
+            return front;
+        }
+        guard.unlock();
+    }
+}
+
+/**
+ * @description: 在线程当前片段内预留待写入的字节，片段被分走后只返回仍属于本线程的部分，
+ *               重复下载同一区间的两个连接中落后的一方跳过已被另一方写入的数据
+ * @param {int} worker_id 线程序号
+ * @param {size_t} size 收到的数据大小
+ * @param {file_size_t&} pos 预留区间在文件中的起始位置
+ * @param {size_t&} skip 数据开头已被另一连接写入、需要跳过的字节数
+ * @return {size_t} 跳过之后允许写入的字节数，skip与返回值之和小于size时说明片段已结束
+ */
+size_t SegmentScheduler::Reserve(int worker_id, size_t size, file_size_t& pos, size_t& skip) {
+    WorkerSlot& slot = *m_slots[worker_id];
+    unique_lock<mutex> guard;
+    WorkerSlot& front = LockFront(worker_id, guard);
+
+    // 传输收到的位置不会超过共用的预留位置，落后的部分已由另一连接写入
+    file_size_t recv = slot.recv;
+    slot.recv += size;
+    pos = front.pos;
+    skip = 0;
+    if (front.pos >= front.end) {
+        return 0;
+    }
+    if (front.pos - recv >= size) {
+        skip = size;
+        return 0;
+    }
+    skip = (size_t)(front.pos - recv);
+    size -= skip;
+    if (front.pos + size > front.end) {
+        size = (size_t)(front.end - front.pos);
+    }
+    front.pos += size;
+    return size;
+}
+
+/**
+ * @description: 结束线程当前片段，已写入部分记为完成，未写入部分归还空闲区间
+ * @param {int} worker_id 线程序号
+ */
+void SegmentScheduler::Finish(int worker_id) {
+    lock_guard<mutex> guard(m_mutex);
+    WorkerSlot& slot = *m_slots[worker_id];
+
+    // 重复下载的线程写入的数据已计入被重复线程的片段，只需解除关联
+    int owner = slot.owner;
+    if (owner != worker_id) {
+        WorkerSlot& front = *m_slots[owner];
+        lock_guard<mutex> front_guard(front.lock);
+        lock_guard<mutex> slot_guard(slot.lock);
+        front.hedger = -1;
+        slot.owner = worker_id;
+        slot.active = false;
+        return;
+    }
+
+    lock_guard<mutex> slot_guard(slot.lock);
+    if (!slot.active) {
+        return;
+    }
+    if (slot.pos > slot.start) {
+        AddDone(slot.start, slot.pos);
+    }
+    if (slot.hedger != -1) {
+        // 被重复的线程先结束时，剩余区间移交给重复下载的线程继续写入
+        WorkerSlot& hedge = *m_slots[slot.hedger];
+        lock_guard<mutex> hedge_guard(hedge.lock);
+        hedge.start = slot.pos;
+        hedge.pos = slot.pos;
+        hedge.end = slot.end;
+        hedge.owner = slot.hedger;
+        slot.hedger = -1;
+    }
+    else if (slot.pos < slot.end) {
+        m_free[slot.pos] = slot.end;
+    }
+    slot.active = false;
+}
+
+/**
+ * @description: 传输失败后保留线程当前片段，已写入部分记为完成，剩余部分仍由本线程从已写入位置重试，
+ *               退避期间其他线程仍可分走剩余区间的后半段
+ * @param {int} worker_id 线程序号
+ * @param {Segment&} seg 剩余区间
+ * @return {bool} 成功返回true，重复下载其他线程的区间或片段已无剩余时返回false
+ */
+bool SegmentScheduler::Resume(int worker_id, Segment& seg) {
+    lock_guard<mutex> guard(m_mutex);
+    WorkerSlot& slot = *m_slots[worker_id];
+    if (slot.owner != worker_id) {
+        return false;
+    }
+    lock_guard<mutex> slot_guard(slot.lock);
+    if (!slot.active || slot.pos >= slot.end) {
+        return false;
+    }
+    if (slot.pos > slot.start) {
+        AddDone(slot.start, slot.pos);
+    }
+    // 重新计时后尚无数据的片段被视为最慢，空闲线程会优先分走它的后半段
+    slot.start = slot.pos;
+    slot.recv = slot.pos;
+    slot.begin_time = chrono::steady_clock::now();
+    seg.start = slot.pos;
+    seg.end = slot.end;
+    return true;
+}
+
+/**
+ * @description: 记录已完成区间并与相邻区间合并，调用前需持有m_mutex
+ * @param {file_size_t} start 起始字节
+ * @param {file_size_t} end 结束字节（不包含）
+ */
+void SegmentScheduler::AddDone(file_size_t start, file_size_t end) {
+    m_done_size += end - start;
+
+    auto next = m_done.lower_bound(start);
+    if (next != m_done.begin()) {
+        auto prev = std::prev(next);
+        if (prev->second == start) {
+            start = prev->first;
+            m_done.erase(prev);
+        }
+    }
+    if (next != m_done.end() && next->first == end) {
+        end = next->second;
+        m_done.erase(next);
+    }
+    m_done[start] = end;
+}
+
+/**
+ * @description: 判断线程当前片段是否已全部写入
+ * @param {int} worker_id 线程序号
+ * @return {bool}
+ */
+bool SegmentScheduler::IsSegmentDone(int worker_id) {
+    unique_lock<mutex> guard;
+    WorkerSlot& front = LockFront(worker_id, guard);
+    return front.pos >= front.end;
+}
+
+/**
+ * @description: 获取线程当前片段的结束位置
+ * @param {int} worker_id 线程序号
+ * @return {file_size_t} 结束字节（不包含）
+ */
+file_size_t SegmentScheduler::GetSegmentEnd(int worker_id) {
+    unique_lock<mutex> guard;
+    WorkerSlot& front = LockFront(worker_id, guard);
+    return front.end;
+}
+
+/**
+ * @description: 获取已完成的字节数
+ * @return {file_size_t}
+ */
+file_size_t SegmentScheduler::GetDoneSize() {
+    lock_guard<mutex> guard(m_mutex);
+    return m_done_size;
+}
@@ -0,0 +1,317 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-04-19 21:47:40
+ * @Description: 下载过程中计算文件校验值的实现
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <strings.h>
+#include <algorithm>
+#include "stream_verifier.h"
+
+StreamVerifier::~StreamVerifier() {
+    Stop();
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+    FreeCacheAligned(m_conn_spans, m_conn_num);
+}
+
+/**
+ * @description: 解析校验参数
+ * @param {const string&} spec 格式为"算法:十六进制值"，只写算法时仅计算并输出
+ * @param {ChecksumType&} type 校验算法
+ * @param {string&} expected 期望的校验值，小写
+ * @return {bool} 格式正确返回true， 否则返回false
+ */
+bool StreamVerifier::Parse(const string& spec, ChecksumType& type, string& expected) {
+    size_t colon = spec.find(':');
+    string name = spec.substr(0, colon);
+    expected = colon == string::npos ? "" : spec.substr(colon + 1);
+    size_t digest_size = 0;
+    if (0 == strcasecmp(name.c_str(), "sha256")) {
+        type = CHECKSUM_SHA256;
+        digest_size = SHA256_DIGEST_SIZE;
+    }
+    else if (0 == strcasecmp(name.c_str(), "crc32c")) {
+        type = CHECKSUM_CRC32C;
+        digest_size = sizeof(uint32_t);
+    }
+    else {
+        return false;
+    }
+
+    if (expected.empty()) {
+        return true;
+    }
+    if (expected.size() != digest_size * 2) {
+        return false;
+    }
+    for (auto& ch : expected) {
+        if (!isxdigit((unsigned char)ch)) {
+            return false;
+        }
+        ch = tolower((unsigned char)ch);
+    }
+    return true;
+}
+
+/**
+ * @description: 初始化，SHA-256方式启动后台计算线程
+ * @param {ChecksumType} type 校验算法
+ * @param {const string&} expected 期望的校验值，为空时不比较
+ * @param {const string&} path 下载的文件路径
+ * @param {file_size_t} filesize 文件大小，未知时为VERIFIER_UNKNOWN_SIZE
+ * @param {int} conn_num 连接数
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool StreamVerifier::Init(ChecksumType type, const string& expected, const string& path, file_size_t filesize,
+    int conn_num) {
+    m_type = type;
+    m_expected = expected;
+    m_filesize = filesize;
+    if (m_type == CHECKSUM_NONE) {
+        return true;
+    }
+
+    m_fd = open(path.c_str(), O_RDONLY);
+    if (m_fd == -1) {
+        perror("open file for checksum failed:");
+        return false;
+    }
+    m_conn_spans = AllocCacheAligned<ConnSpan>(conn_num);
+    if (!m_conn_spans) {
+        printf("alloc checksum spans failed\n");
+        return false;
+    }
+    m_conn_num = conn_num;
+    if (m_type == CHECKSUM_SHA256) {
+        m_hasher = thread(&StreamVerifier::HashLoop, this);
+    }
+    return true;
+}
+
+/**
+ * @description: 网络线程收到数据后调用，CRC32C方式累加到连接当前的连续区间
+ * @param {int} conn_id 连接序号，同一连接只能由一个线程调用
+ * @param {file_size_t} pos 数据在文件中的位置
+ * @param {const char*} data 数据
+ * @param {size_t} size 数据大小
+ */
+void StreamVerifier::Update(int conn_id, file_size_t pos, const char* data, size_t size) {
+    if (m_type != CHECKSUM_CRC32C || size == 0) {
+        return;
+    }
+
+    // 与当前区间不连续说明开始了新的片段，保存之前的区间
+    CrcSpan& span = m_conn_spans[conn_id].span;
+    if (pos != span.end) {
+        if (span.end > span.start) {
+            lock_guard<mutex> guard(m_span_lock);
+            m_spans.push_back(span);
+        }
+        span.start = pos;
+        span.end = pos;
+        span.crc = 0;
+    }
+    span.crc = Crc32c(span.crc, data, size);
+    span.end += size;
+}
+
+/**
+ * @description: 区间写入文件后调用，SHA-256方式推进可读回的前沿
+ * @param {file_size_t} start 起始字节
+ * @param {file_size_t} end 结束字节（不包含）
+ */
+void StreamVerifier::AddWritten(file_size_t start, file_size_t end) {
+    if (m_type != CHECKSUM_SHA256 || start >= end) {
+        return;
+    }
+
+    lock_guard<mutex> guard(m_frontier_lock);
+    m_pending[start] = end;
+    file_size_t old_frontier = m_frontier;
+    auto it = m_pending.begin();
+    while (it != m_pending.end() && it->first <= m_frontier) {
+        m_frontier = max(m_frontier, it->second);
+        it = m_pending.erase(it);
+    }
+    if (m_frontier != old_frontier) {
+        m_frontier_cond.notify_one();
+    }
+}
+
+/**
+ * @description: 续传时已存在于文件中的区间，结束时从文件读取计算
+ * @param {file_size_t} start 起始字节
+ * @param {file_size_t} end 结束字节（不包含）
+ */
+void StreamVerifier::AddExisting(file_size_t start, file_size_t end) {
+    // SHA-256本来就从文件读回，与新写入的区间相同处理
+    if (m_type == CHECKSUM_SHA256) {
+        AddWritten(start, end);
+    }
+    else if (m_type == CHECKSUM_CRC32C && start < end) {
+        m_existing.push_back(make_pair(start, end));
+    }
+}
+
+/**
+ * @description: SHA-256后台线程主体，按顺序读回前沿之前的数据
+ */
+void StreamVerifier::HashLoop() {
+    while (true) {
+        file_size_t frontier = 0;
+        {
+            // 流式下载的文件大小在结束时才确定，需在锁内读取
+            unique_lock<mutex> guard(m_frontier_lock);
+            m_frontier_cond.wait(guard, [this]() { return m_stop || m_frontier > m_hashed || m_hashed >= m_filesize; });
+            if (m_stop || m_hashed >= m_filesize) {
+                return;
+            }
+            frontier = m_frontier;
+        }
+        if (!ReadRange(m_hashed, frontier, [this](const char* data, size_t size) { m_sha256.Update(data, size); })) {
+            return;
+        }
+        m_hashed = frontier;
+    }
+}
+
+/**
+ * @description: 从文件读取区间
+ * @param {file_size_t} start 起始字节
+ * @param {file_size_t} end 结束字节（不包含）
+ * @param {function<void(const char*, size_t)>} call 数据处理函数
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool StreamVerifier::ReadRange(file_size_t start, file_size_t end, function<void(const char*, size_t)> call) {
+    vector<char> buf(VERIFIER_READ_SIZE);
+    while (start < end) {
+        size_t read_size = end - start < buf.size() ? (size_t)(end - start) : buf.size();
+        ssize_t n = pread(m_fd, buf.data(), read_size, start);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            perror("read file for checksum failed:");
+            return false;
+        }
+        call(buf.data(), n);
+        start += n;
+    }
+    return true;
+}
+
+/**
+ * @description: 合并所有区间的CRC
+ * @param {string&} actual 整个文件的CRC32C
+ * @return {bool} 区间完整覆盖文件返回true， 否则返回false
+ */
+bool StreamVerifier::CombineCrc(string& actual) {
+    for (int i = 0; i < m_conn_num; i++) {
+        CrcSpan& span = m_conn_spans[i].span;
+        if (span.end > span.start) {
+            m_spans.push_back(span);
+        }
+    }
+    for (auto& range : m_existing) {
+        CrcSpan span;
+        span.start = range.first;
+        span.end = range.first;
+        if (!ReadRange(range.first, range.second,
+            [&span](const char* data, size_t size) { span.crc = Crc32c(span.crc, data, size); })) {
+            return false;
+        }
+        span.end = range.second;
+        m_spans.push_back(span);
+    }
+
+    sort(m_spans.begin(), m_spans.end(), [](const CrcSpan& a, const CrcSpan& b) { return a.start < b.start; });
+    uint32_t crc = 0;
+    file_size_t pos = 0;
+    for (auto& span : m_spans) {
+        if (span.start != pos) {
+            printf("checksum ranges are not contiguous at %llu\n", pos);
+            return false;
+        }
+        crc = Crc32cCombine(crc, span.crc, span.end - span.start);
+        pos = span.end;
+    }
+    if (pos != m_filesize) {
+        printf("checksum ranges end at %llu, file size is %llu\n", pos, m_filesize);
+        return false;
+    }
+
+    uint8_t digest[sizeof(uint32_t)] = {(uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc};
+    actual = ToHex(digest, sizeof(digest));
+    return true;
+}
+
+/**
+ * @description: 流式下载结束后设置实际的文件大小，SHA-256后台线程计算到该位置后结束
+ * @param {file_size_t} filesize 文件大小
+ */
+void StreamVerifier::SetFileSize(file_size_t filesize) {
+    lock_guard<mutex> guard(m_frontier_lock);
+    m_filesize = filesize;
+    m_frontier_cond.notify_one();
+}
+
+/**
+ * @description: 所有数据写入后调用，等待计算完成并与期望值比较
+ * @return {bool} 一致或未指定期望值返回true， 否则返回false
+ */
+bool StreamVerifier::Finish() {
+    string name;
+    string actual;
+    if (m_type == CHECKSUM_NONE) {
+        return true;
+    }
+    if (m_type == CHECKSUM_SHA256) {
+        name = "sha256";
+        if (m_hasher.joinable()) {
+            m_hasher.join();
+        }
+        if (m_hashed != m_filesize) {
+            printf("sha256 stopped at %llu, file size is %llu\n", m_hashed, m_filesize);
+            return false;
+        }
+        actual = m_sha256.Final();
+    }
+    else {
+        name = "crc32c";
+        if (!CombineCrc(actual)) {
+            return false;
+        }
+    }
+
+    if (m_expected.empty()) {
+        printf("%s: %s\n", name.c_str(), actual.c_str());
+        return true;
+    }
+    if (actual != m_expected) {
+        printf("%s mismatch, expected %s, actual %s\n", name.c_str(), m_expected.c_str(), actual.c_str());
+        return false;
+    }
+    printf("%s verified: %s\n", name.c_str(), actual.c_str());
+    return true;
+}
+
+/**
+ * @description: 下载失败时停止后台计算
+ */
+void StreamVerifier::Stop() {
+    {
+        lock_guard<mutex> guard(m_frontier_lock);
+        m_stop = true;
+        m_frontier_cond.notify_one();
+    }
+    if (m_hasher.joinable()) {
+        m_hasher.join();
+    }
+}
@@ -0,0 +1,226 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-23 20:40:52
+ * @Description: 固定大小的常驻工作线程池实现
+ */
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include "worker_pool.h"
+
+/**
+ * @description: 解析CPU列表，格式同/sys中的cpulist，如"0-3,8"
+ * @param {const string&} text CPU列表
+ * @param {vector<int>&} cpus 解析出的CPU
+ * @return {bool} 格式正确且不为空返回true， 否则返回false
+ */
+static bool ParseCpuList(const string& text, vector<int>& cpus) {
+    cpus.clear();
+    stringstream items(text);
+    string item;
+    while (getline(items, item, ',')) {
+        if (item.empty()) {
+            continue;
+        }
+        char* end = nullptr;
+        long first = strtol(item.c_str(), &end, 10);
+        long last = first;
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (end == item.c_str() || *end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return !cpus.empty();
+}
+
+/**
+ * @description: 读取/sys中的单行文件
+ * @param {const string&} path 文件路径
+ * @param {string&} line 文件内容
+ * @return {bool} 成功返回true， 文件不存在返回false
+ */
+static bool ReadSysLine(const string& path, string& line) {
+    ifstream file(path);
+    return file && getline(file, line);
+}
+
+WorkerPool::WorkerPool(int worker_num, const vector<int>& cpus)
+    : m_cpus(cpus)
+    , m_idle_num(0)
+    , m_exit(false) {
+    // 默认每个CPU一个线程，绑定CPU时为绑定的CPU数；线程数不再增长，多出的线程只会争抢同样的CPU
+    int cpu_num = !m_cpus.empty() ? (int)m_cpus.size() : (int)thread::hardware_concurrency();
+    cpu_num = max(cpu_num, 1);
+    worker_num = worker_num > 0 ? min(worker_num, cpu_num) : cpu_num;
+    lock_guard<mutex> guard(m_lock);
+    for (int i = 0; i < worker_num; i++) {
+        AddWorker();
+    }
+}
+
+/**
+ * @description: 等待正在执行的任务结束后退出所有线程，未开始的任务被丢弃
+ */
+WorkerPool::~WorkerPool() {
+    {
+        lock_guard<mutex> guard(m_lock);
+        m_exit = true;
+        m_tasks.clear();
+        m_cond.notify_all();
+    }
+    for (auto& worker : m_workers) {
+        worker.join();
+    }
+}
+
+/**
+ * @description: 提交任务，只交给空闲线程，不排队，任务可长期占用线程
+ * @param {PoolTask} task 任务
+ * @return {bool} 已交给空闲线程返回true， 所有线程都在执行任务时返回false
+ */
+bool WorkerPool::Run(PoolTask task) {
+    {
+        lock_guard<mutex> guard(m_lock);
+        // 空闲线程包括已被唤醒但尚未取出任务的线程，排队的任务不能多于空闲线程，否则会等待其他长期任务结束
+        if (m_exit || (int)m_tasks.size() >= m_idle_num) {
+            return false;
+        }
+        m_tasks.push_back(move(task));
+    }
+    // 解锁后再唤醒，被唤醒的线程不必立即等待锁
+    m_cond.notify_one();
+    return true;
+}
+
+/**
+ * @description: 获取线程数
+ * @return {int}
+ */
+int WorkerPool::GetWorkerNum() {
+    lock_guard<mutex> guard(m_lock);
+    return m_workers.size();
+}
+
+/**
+ * @description: 工作线程主体，循环取出任务执行，直到线程池析构
+ */
+void WorkerPool::WorkerLoop() {
+    unique_lock<mutex> guard(m_lock);
+    while (true) {
+        m_cond.wait(guard, [this]() { return m_exit || !m_tasks.empty(); });
+        if (m_exit) {
+            return;
+        }
+        PoolTask task = move(m_tasks.front());
+        m_tasks.pop_front();
+        m_idle_num--;
+        guard.unlock();
+        task();
+        // 任务对象可能持有下载器的引用，在加锁前释放
+        task = nullptr;
+        guard.lock();
+        m_idle_num++;
+    }
+}
+
+/**
+ * @description: 将当前线程按序号轮流绑定到线程池的CPU，没有绑定CPU时不做处理
+ * @param {int} index 序号
+ */
+void WorkerPool::PinCurrentThread(int index) {
+    if (!m_cpus.empty()) {
+        PinThread(pthread_self(), m_cpus[index % m_cpus.size()]);
+    }
+}
+
+/**
+ * @description: 新建一个线程并按序号绑定CPU，只在构造时调用，调用前需持有m_lock
+ */
+void WorkerPool::AddWorker() {
+    m_workers.emplace_back(&WorkerPool::WorkerLoop, this);
+    m_idle_num++;
+    if (!m_cpus.empty()) {
+        PinThread(m_workers.back().native_handle(), m_cpus[(m_workers.size() - 1) % m_cpus.size()]);
+    }
+}
+
+/**
+ * @description: 解析CPU绑定设置，可为CPU列表如"0-3,8"，"node:N"为NUMA节点N的CPU，
+ *               "nic:网卡名"为与网卡在同一NUMA节点的CPU
+ * @param {const string&} spec 绑定设置
+ * @param {vector<int>&} cpus 解析出的CPU
+ * @return {bool} 成功返回true， 格式错误或设备不存在返回false
+ */
+bool WorkerPool::ParseAffinity(const string& spec, vector<int>& cpus) {
+    string list;
+    if (spec.compare(0, 5, "node:") == 0) {
+        if (!ReadSysLine(string(SYS_NODE_DIR) + "/node" + spec.substr(5) + "/cpulist", list)) {
+            printf("numa node %s not found\n", spec.substr(5).c_str());
+            return false;
+        }
+    }
+    else if (spec.compare(0, 4, "nic:") == 0) {
+        // PCI设备直接给出本地CPU，否则按所在NUMA节点取CPU，网卡中断默认也分布在这些CPU上
+        string device = string(SYS_NET_DIR) + "/" + spec.substr(4) + "/device";
+        string node;
+        if (!ReadSysLine(device + "/local_cpulist", list)) {
+            if (!ReadSysLine(device + "/numa_node", node) || atoi(node.c_str()) < 0
+                || !ReadSysLine(string(SYS_NODE_DIR) + "/node" + to_string(atoi(node.c_str())) + "/cpulist", list)) {
+                printf("cpus local to %s not found, it may be a virtual device\n", spec.substr(4).c_str());
+                return false;
+            }
+        }
+    }
+    else {
+        list = spec;
+    }
+    if (!ParseCpuList(list, cpus)) {
+        printf("invalid cpu list: %s\n", list.c_str());
+        return false;
+    }
+    // 只保留当前进程可用的CPU，避免绑定到被cgroup或taskset排除的CPU上
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (0 == sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        vector<int> usable;
+        for (int cpu : cpus) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                usable.push_back(cpu);
+            }
+        }
+        if (usable.empty()) {
+            printf("none of cpus %s is available to this process\n", list.c_str());
+            return false;
+        }
+        cpus.swap(usable);
+    }
+    return true;
+}
+
+/**
+ * @description: 将线程绑定到一个CPU
+ * @param {pthread_t} handle 线程
+ * @param {int} cpu CPU序号
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool WorkerPool::PinThread(pthread_t handle, int cpu) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    int ret = pthread_setaffinity_np(handle, sizeof(cpu_set), &cpu_set);
+    if (ret != 0) {
+        printf("bind thread to cpu %d failed: %s\n", cpu, strerror(ret));
+        return false;
+    }
+    return true;
+}
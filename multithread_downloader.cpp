@@ -10,13 +10,30 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <thread>
 #include <future>
-#include <iostream>
-#include <getopt.h>
+#include <memory>
 #include <math.h>
+#include <random>
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
 #include "multithread_downloader.h"
-#include "version.h"
+
+/**
+ * @description: 计算片段第n次重试前的退避时间，指数增长并随机取其后一半，避免多个连接同时重试
+ * @param {int} retry_num 重试次数，从1开始
+ * @return {int} 毫秒
+ */
+static int RetryDelayMs(int retry_num) {
+    static thread_local minstd_rand engine(random_device{}());
+    int delay = SEGMENT_RETRY_CAP_MS;
+    if (retry_num < 16) {
+        delay = min(SEGMENT_RETRY_CAP_MS, SEGMENT_RETRY_BASE_MS << (retry_num - 1));
+    }
+    return delay / 2 + uniform_int_distribution<int>(0, delay / 2)(engine);
+}
 
  /**
   * @description: 获取文件下载器
@@ -27,71 +44,83 @@ Downloader* GetDownloader(DownloaderType type) {
     if (type == HTTP) {
         return new HttpDownloader();
     }
-    return nullptr;
-}
-
-/**
- * @description: 转换字节大小
- * @param {int} size 原大小
- * @param {string&} unit 转换后单位
- * @return {int} 转换后大小
- */
-int ConvertSize(int size, string& unit) {
-    vector<string> all_units = {"KB", "MB", "GB", "TB"};
-    unit = "B";
-    for (auto &one_unit : all_units) {
-        if (size > BYTE_SCALE) {
-            size = (double)size / BYTE_SCALE;
-            unit = one_unit;
-        }
-        else {            
-            return size;
-        }
+    if (type == HTTP_MULTI) {
+        return new MultiHttpDownloader();
+    }
+    if (type == HTTP_NATIVE) {
+        return new NativeHttpDownloader();
     }
-    return size;
+    return nullptr;
 }
 
-
 /**
  * @description: 解除内存映射
  * @return {bool} 成功返回true， 失败返回false
  */
 bool DownloadManager::ReleaseMem() {
     bool flag = true;
-    for (auto& mem : m_mems) {
-        if (mem != nullptr && -1 == munmap(mem, BLOCK_4K)) {
-            perror("unmap failed");
-            flag = false;
+    for (int i = 0; i < m_slot_num; i++) {
+        ConnWriteState& state = m_conn_states[i];
+        if (state.mem != nullptr) {
+            if (-1 == munmap(state.mem, state.map_size)) {
+                perror("unmap failed");
+                flag = false;
+            }
+            if (m_budget) {
+                m_budget->ReleaseWindow(m_w_fd, state.map_offset, state.map_size);
+            }
         }
+        state.mem = nullptr;
+        RecordWritten(i);
     }
     return flag;
 }
 
 DownloadManager::~DownloadManager() {
-    if (m_downloader) {
-        delete m_downloader;
+    for (auto source : m_sources) {
+        delete source;
     }
+    // 预算中登记的区间需在文件关闭前移出
+    ReleaseMem();
     if (m_w_fd != -1) {
+        if (m_budget) {
+            m_budget->Drain(m_w_fd);
+        }
         close(m_w_fd);
         m_w_fd = -1;
     }
-    ReleaseMem();
+    FreeCacheAligned(m_conn_states, m_slot_num);
 }
 
 /**
  * @description: 创建空文件
+ * @param {bool} truncate 是否清空已有文件，续传时保留
  * @return {bool} 成功返回true， 失败返回false
  */
-bool DownloadManager::CreateEmptyFile() {
+bool DownloadManager::CreateEmptyFile(bool truncate) {
     // To do 添加递归创建文件夹逻辑
 
     string file_full_name = m_file_save_path + "/" + m_filename;
-    m_w_fd = open(file_full_name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 00777);
-    if (!m_w_fd) {
+    m_w_fd = open(file_full_name.c_str(), O_CREAT | O_RDWR | (truncate ? O_TRUNC : 0), 00777);
+    if (m_w_fd == -1) {
         printf("create file(%s) failed\n", file_full_name.c_str());
         return false;
     }
-    if (m_filesize > 0 && -1 == lseek(m_w_fd, m_filesize - 1, SEEK_SET)) {
+    if (!truncate || m_filesize == 0) {
+        return true;
+    }
+
+    // 预分配的文件写入时不再分配块，不支持fallocate的文件系统退回稀疏文件，不使用posix_fallocate的逐块写零
+    if (m_io_options & IO_PREALLOC) {
+        if (0 == fallocate(m_w_fd, 0, 0, m_filesize)) {
+            return true;
+        }
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            perror("fallocate failed:");
+            return false;
+        }
+    }
+    if (-1 == lseek(m_w_fd, m_filesize - 1, SEEK_SET)) {
         perror("lseek error:");
         return false;
     }
@@ -111,27 +140,190 @@ bool DownloadManager::Init(const DownloadInfo& info, const string& save_path) {
     if (!m_downloader) {
         return false;
     }
-    if (!m_downloader->Init(info.url)) {
-        printf("downloader init error");
+    ConfigureSource(m_downloader, info);
+    m_sources.push_back(m_downloader);
+    m_source_urls.push_back(info.url);
+    // 已知大小的小文件只有一个片段，省去探测请求
+    bool probe = info.filesize == 0 || info.filesize > SMALL_FILE_SIZE;
+    if (!(probe ? m_downloader->Init(info.url) : m_downloader->InitKnownSize(info.url, info.filesize))) {
+        printf("downloader init error\n");
         return false;
     }
 
-    m_filename = info.url.substr(info.url.find_last_of('/') + 1);
+    if (m_filename.empty()) {
+        m_filename = info.url.substr(info.url.find_last_of('/') + 1);
+    }
     printf("filename is %s\n", m_filename.c_str());
     m_url = info.url;
     m_file_save_path = save_path;
 
     // 服务器不支持多线程下载，自动转换为单线程
     if (!m_downloader->IsRangeAvailable()) {
-        printf("multi-thread downloading is not supported, adjust to single-thread\n");
+        if (probe) {
+            printf("multi-thread downloading is not supported, adjust to single-thread\n");
+        }
         m_thread_num = 1;
     }
 
     m_filesize = m_downloader->GetFileSize();
-    printf("file size: %lu\n", m_filesize);
+    // 大小未知时只能单连接从头下载到响应结束，不能续传也不能使用镜像，映射窗口随文件扩展
+    m_stream = !m_downloader->IsSizeKnown();
+    if (m_stream) {
+        printf("file size: unknown\n");
+        m_thread_num = 1;
+        m_auto_conn = false;
+        if (m_write_mode != WRITE_MMAP) {
+            printf("write mode is switched to mmap for streaming download\n");
+            m_write_mode = WRITE_MMAP;
+        }
+    }
+    else {
+        printf("file size: %llu\n", m_filesize);
+    }
+    if (info.filesize > 0 && !m_stream && info.filesize != m_filesize) {
+        printf("file size mismatch, expected %llu\n", info.filesize);
+        return false;
+    }
 
-    // 创建对应大小空文件
-    return CreateEmptyFile();
+    // 只有一个片段时镜像无法分担
+    if (probe && m_downloader->IsRangeAvailable() && m_filesize > 0) {
+        AddMirrors(info);
+    }
+    m_selector.Init(m_sources.size());
+
+    // 不支持断点续传的服务器无法只下载缺失区间，不使用日志
+    if (m_filesize == 0 || !m_downloader->IsRangeAvailable()) {
+        if (!m_delta_seed.empty()) {
+            printf("delta download needs range requests and a known file size, download the whole file\n");
+        }
+        if (!CreateEmptyFile(true)) {
+            return false;
+        }
+    }
+    else {
+        // 创建对应大小空文件，日志有效时保留已下载内容，从旧文件复制过的区间已记在日志中
+        DeltaIndex delta;
+        bool use_delta = !m_delta_seed.empty() && LoadDeltaIndex(delta);
+        bool resume = LoadJournal();
+        if (!CreateEmptyFile(!resume)) {
+            return false;
+        }
+        if (use_delta && !resume) {
+            ApplyDelta(delta);
+        }
+        string journal_path = m_file_save_path + "/" + m_filename + JOURNAL_SUFFIX;
+        if (!m_journal.Open(journal_path, m_journal_info, m_resumed, m_w_fd)) {
+            printf("journal is unavailable, download cannot be resumed if interrupted\n");
+        }
+    }
+
+    // 续传的区间已在文件中，校验时直接读取
+    string file_full_name = m_file_save_path + "/" + m_filename;
+    if (!m_verifier.Init(m_checksum_type, m_checksum_expected, file_full_name,
+        m_stream ? VERIFIER_UNKNOWN_SIZE : m_filesize, m_slot_num)) {
+        return false;
+    }
+    for (auto& range : m_resumed) {
+        m_verifier.AddExisting(range.first, range.second);
+    }
+
+    // pwrite方式由写线程落盘，写完的区间直接记入日志
+    if (m_write_mode != WRITE_MMAP && m_filesize > 0) {
+        return m_writer.Start(file_full_name, m_slot_num, m_writer_num, m_write_mode == WRITE_DIRECT,
+            [this](file_size_t start, file_size_t end) {
+                OnWritten(start, end);
+                // 写线程等待回写时环形缓冲区逐渐填满，网络线程随之等待
+                if (m_budget) {
+                    m_budget->AddDirty(m_w_fd, start, (size_t)(end - start));
+                }
+            });
+    }
+    return true;
+}
+
+/**
+ * @description: 探测镜像并与主下载源比较文件大小和ETag，一致的镜像加入下载源
+ * @param {const DownloadInfo&} info 下载信息
+ */
+void DownloadManager::AddMirrors(const DownloadInfo& info) {
+    string etag = m_downloader->GetETag();
+    for (auto& url : info.mirrors) {
+        // 各下载源的区间混合写入同一文件，内容必须完全一致
+        Downloader* mirror = GetDownloader(info.type);
+        const char* reason = nullptr;
+        if (mirror) {
+            ConfigureSource(mirror, info);
+        }
+        if (!mirror || !mirror->Init(url)) {
+            reason = "probe failed";
+        }
+        else if (mirror->GetFileSize() != m_filesize) {
+            reason = "file size differs";
+        }
+        else if (!etag.empty() && !mirror->GetETag().empty() && mirror->GetETag() != etag) {
+            reason = "etag differs";
+        }
+        else if (!mirror->IsRangeAvailable()) {
+            reason = "range requests not supported";
+        }
+        if (reason) {
+            printf("mirror %s ignored: %s\n", url.c_str(), reason);
+            delete mirror;
+            continue;
+        }
+        m_sources.push_back(mirror);
+        m_source_urls.push_back(url);
+    }
+    if (m_sources.size() > 1) {
+        printf("downloading from %d sources\n", (int)m_sources.size());
+    }
+}
+
+/**
+ * @description: 设置写盘方式，需在Init前调用
+ * @param {WriteMode} mode 写盘方式
+ * @param {int} writer_num 写线程数，仅pwrite方式有效
+ */
+void DownloadManager::SetWriteMode(WriteMode mode, int writer_num) {
+    m_write_mode = mode;
+    m_writer_num = writer_num > 0 ? writer_num : 1;
+}
+
+/**
+ * @description: 设置下载完成后需满足的校验值，需在Init前调用
+ * @param {const string&} spec 格式为"sha256:十六进制值"或"crc32c:十六进制值"，只写算法时仅计算并输出
+ * @return {bool} 格式正确返回true， 否则返回false
+ */
+bool DownloadManager::SetChecksum(const string& spec) {
+    return StreamVerifier::Parse(spec, m_checksum_type, m_checksum_expected);
+}
+
+/**
+ * @description: 读取续传日志，校验通过时恢复已完成区间
+ * @return {bool} 可以续传返回true， 否则返回false
+ */
+bool DownloadManager::LoadJournal() {
+    m_journal_info.filesize = m_filesize;
+    m_journal_info.url = m_url;
+    m_journal_info.etag = m_downloader->GetETag();
+    m_journal_info.last_modified = m_downloader->GetLastModified();
+
+    // 文件大小不符说明文件已被改动，日志不可信
+    string file_full_name = m_file_save_path + "/" + m_filename;
+    struct stat file_stat;
+    if (-1 == stat(file_full_name.c_str(), &file_stat) || (file_size_t)file_stat.st_size != m_filesize) {
+        return false;
+    }
+    if (!m_journal.Load(file_full_name + JOURNAL_SUFFIX, m_journal_info, m_resumed)) {
+        m_resumed.clear();
+        return false;
+    }
+
+    for (auto& range : m_resumed) {
+        m_resumed_size += range.second - range.first;
+    }
+    printf("resume download, %llu bytes already downloaded\n", m_resumed_size);
+    return true;
 }
 
 /**
@@ -139,120 +331,740 @@ bool DownloadManager::Init(const DownloadInfo& info, const string& save_path) {
  * @return {bool} 成功返回true， 失败返回false
  */
 bool DownloadManager::Download() {
-    if (m_filesize == 0) {
-        return true;
+    if (m_filesize == 0 && !m_stream) {
+        return m_verifier.Finish();
     }
 
     // 计算文件大小可以分成的块数(每块4k)
     int num_of_4k_block = (int)ceil((double)m_filesize / BLOCK_4K);
-    if (num_of_4k_block < m_thread_num) {
+    if (!m_stream && num_of_4k_block < m_thread_num) {
         m_thread_num = num_of_4k_block;
         printf("due to small file size, auto adjust thread num to %d\n", num_of_4k_block);
     }
+    Prepare();
 
-    // 创建线程，分配下载的文件片段
-    int base_blk_num = num_of_4k_block / m_thread_num;
-    int remain_blk_num = num_of_4k_block - (base_blk_num * m_thread_num);
-    file_size_t last_pos = 0;
-    int last_blk = 0;
-
+    // 自动模式从少量连接开始，由进度线程按吞吐量增减
+    if (m_auto_conn) {
+        m_controller.Init(CONN_AUTO_START, m_thread_num);
+        m_conn_limit = m_controller.GetLimit();
+    }
+    else {
+        m_conn_limit = m_thread_num;
+    }
+    m_async_results.resize(m_slot_num);
+    auto begin_time = chrono::steady_clock::now();
+    StartConnections();
 
-    // 分配各线程要处理的数据位置
-    for (int i = 1; i < m_thread_num; i++) {
-        int block_num = base_blk_num;
-        if (remain_blk_num) {
-            block_num++;
-            remain_blk_num--;
+    bool ok = WatchProgress();
+    if (!ok) {
+        // 通知其他线程停止，等待全部退出后保存已下载的区间，正在退避的异步片段立即提交以便连接退出
+        m_stop = true;
+        for (auto& one_thread : m_threads) {
+            while (one_thread.second.valid()
+                && one_thread.second.wait_for(chrono::milliseconds(SEGMENT_RETRY_POLL_MS)) != future_status::ready) {
+                RunRetries(true);
+            }
         }
-        m_block_idxs[i] = last_blk;
+    }
+    ok = Complete(ok);
+    if (m_observer) {
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin_time).count();
+        m_observer->OnFinish(ok, GetProgress(elapsed > 0 ? m_filesize / elapsed : 0, elapsed));
+    }
+    if (!ok) {
+        return false;
+    }
+
+    string report = m_downloader->GetConnectionReport();
+    if (!report.empty()) {
+        printf("%s\n", report.c_str());
+    }
+    if (m_scheduler.GetHedgeNum() > 0) {
+        printf("endgame: %d hedged requests for tail segments\n", m_scheduler.GetHedgeNum());
+    }
+    ShowMirrorReport();
+    if (m_metrics) {
+        m_metrics->Finish();
+    }
+    return true;
+}
 
-        // 创建回调函数，记录线程序号
-        DataDealCallback callback = [this, i](const char* data, size_t size)->bool {
-            return WriteFileBulkCallback(data, size, i);
+/**
+ * @description: 获取并解析块校验索引，未指定校验值时使用索引中的SHA-256
+ * @param {DeltaIndex&} index 解析后的索引
+ * @return {bool} 索引可用返回true， 否则返回false，此时下载整个文件
+ */
+bool DownloadManager::LoadDeltaIndex(DeltaIndex& index) {
+    string location = m_delta_index.empty() ? m_url + DELTA_INDEX_SUFFIX : m_delta_index;
+    string data;
+    bool ok = false;
+    if (location.find("://") != string::npos) {
+        // 索引很小，单连接下载到内存
+        HttpDownloader fetcher;
+        DataDealCallback call = [&data](const char* buf, size_t size)->bool {
+            data.append(buf, size);
+            return true;
         };
-        m_threads.emplace_back(std::async(std::launch::async, &Downloader::Download, m_downloader, last_pos,
-            last_pos + block_num * BLOCK_4K - 1, callback));
-        last_pos += block_num * BLOCK_4K;
-        last_blk += block_num;
-        m_remain_block_num[i] = block_num;
+        ok = fetcher.Init(location) && (!fetcher.IsSizeKnown() || fetcher.GetFileSize() > 0)
+            && fetcher.Download(0, fetcher.IsSizeKnown() ? fetcher.GetFileSize() - 1 : RANGE_END_UNKNOWN, call);
+    }
+    else {
+        ifstream file(location, ios::binary);
+        data.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        ok = file.good() || file.eof();
+    }
+    if (!ok || !index.Parse(data)) {
+        printf("delta index %s is unavailable, download the whole file\n", location.c_str());
+        return false;
+    }
+    if (index.GetFileSize() != m_filesize) {
+        printf("delta index is for a file of %llu bytes, download the whole file\n", index.GetFileSize());
+        return false;
+    }
+    if (m_checksum_type == CHECKSUM_NONE || (m_checksum_type == CHECKSUM_SHA256 && m_checksum_expected.empty())) {
+        m_checksum_type = CHECKSUM_SHA256;
+        m_checksum_expected = index.GetSha256();
+    }
+    return true;
+}
+
+/**
+ * @description: 从本地旧文件复制相同的块，复制的区间与续传区间一样在下载时跳过，复制失败时下载整个文件
+ * @param {DeltaIndex&} index 块校验索引
+ */
+void DownloadManager::ApplyDelta(DeltaIndex& index) {
+    auto begin_time = chrono::steady_clock::now();
+    vector<DeltaRange> ranges;
+    if (!index.Match(m_delta_seed, ranges)) {
+        printf("seed file is unavailable, download the whole file\n");
+        return;
+    }
+    DeltaIndex::Coalesce(ranges, m_filesize, DELTA_MIN_RUN);
+    // 复制的数据先落盘，之后才能作为已完成区间写入日志
+    if (!DeltaIndex::Copy(m_delta_seed, m_w_fd, ranges) || -1 == fdatasync(m_w_fd)) {
+        printf("copy from seed file failed, download the whole file\n");
+        return;
+    }
+    file_size_t copied = 0;
+    for (auto& range : ranges) {
+        m_resumed[range.target] = range.target + range.size;
+        copied += range.size;
+    }
+    m_resumed_size += copied;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin_time).count();
+    printf("delta: %llu of %llu bytes copied from %s in %.2f s, %llu bytes to download\n", copied, m_filesize,
+        m_delta_seed.c_str(), seconds, m_filesize - copied);
+}
+
+/**
+ * @description: 启动序号小于当前连接数且未在运行的连接，所有连接都已退出但仍有区间未完成时重新启动
+ */
+void DownloadManager::StartConnections() {
+    // 退出的连接会归还未完成的区间，其他连接可能已先因无区间可领而结束
+    bool orphaned = m_threads.empty() && !m_stop && !IsFinished();
+    for (int i = 0; i < m_conn_limit; i++) {
+        if (m_slot_states[i] == SLOT_IDLE || (orphaned && m_slot_states[i] == SLOT_DONE)) {
+            StartConnection(i);
+        }
     }
+}
 
-    m_block_idxs[0] = last_blk;
-    m_threads.emplace_back(std::async(std::launch::async, &Downloader::Download, m_downloader, last_pos, m_filesize - 1,
-        [this](const char* data, size_t size)->bool {
-            return WriteFileBulkCallback(data, size, 0);
+/**
+ * @description: 初始化前设置下载源的连接选项，设置了线程池时异步下载器的事件循环在池中的线程上运行
+ * @param {Downloader*} source 下载源
+ * @param {const DownloadInfo&} info 下载信息
+ */
+void DownloadManager::ConfigureSource(Downloader* source, const DownloadInfo& info) {
+    source->SetHttp2(info.http2_conns);
+    source->SetStallTimeout(info.stall_timeout);
+    if (m_workers) {
+        WorkerPool* workers = m_workers;
+        source->SetTaskRunner([workers](PoolTask task) { return workers->Run(task); }, workers->GetWorkerNum());
+    }
+}
+
+/**
+ * @description: 启动一个连接，线程模式创建线程，异步模式提交第一个片段
+ * @param {const int} thread_id 连接序号
+ */
+void DownloadManager::StartConnection(const int thread_id) {
+    m_slot_states[thread_id] = SLOT_RUNNING;
+    // 流式下载只有一个阻塞的传输，总是使用线程
+    if (m_downloader->IsAsyncSupported() && !m_stream) {
+        // 异步下载器由IO线程驱动所有连接，不再为每个连接创建线程，连接每次启动使用新的结果对象
+        m_async_results[thread_id] = promise<bool>();
+        m_threads.emplace_back(thread_id, m_async_results[thread_id].get_future());
+        StartAsyncSegment(thread_id);
+    }
+    else {
+        // 阻塞的连接各占一个线程，不放入大小固定的线程池，以免占满后其他连接排队；设置了线程池时按序号绑定到其CPU
+        m_threads.emplace_back(thread_id, std::async(std::launch::async, [this, thread_id]() {
+            if (m_workers) {
+                m_workers->PinCurrentThread(thread_id);
+            }
+            bool ok = DownloadWorker(thread_id);
+            NotifyExit(thread_id);
+            return ok;
         }));
-    m_remain_block_num[0] = num_of_4k_block - last_blk;
+    }
+}
 
-    // 显示进度条
-    if (!ShowProgress()) {
-        return false;
+/**
+ * @description: 连接退出后通知进度线程回收，需在连接的结果已设置后调用
+ * @param {const int} thread_id 连接序号
+ */
+void DownloadManager::NotifyExit(const int thread_id) {
+    lock_guard<mutex> lock(m_exit_lock);
+    m_exited.push_back(thread_id);
+    m_exit_cond.notify_one();
+}
+
+/**
+ * @description: 异步下载器使用，设置连接的执行结果和状态，并通知进度线程
+ * @param {const int} thread_id 连接序号
+ * @param {bool} ok 执行结果
+ * @param {SlotState} state 连接退出后的状态
+ */
+void DownloadManager::ExitAsyncConnection(const int thread_id, bool ok, SlotState state) {
+    // 先设置结果再修改状态，状态变为空闲后结果对象可能被进度线程替换
+    m_async_results[thread_id].set_value(ok);
+    m_slot_states[thread_id] = state;
+    NotifyExit(thread_id);
+}
+
+/**
+ * @description: 根据一次吞吐量采样和期间的失败、限流情况调整连接数
+ * @param {double} rate 总吞吐量，字节/秒
+ */
+void DownloadManager::AdjustConnections(double rate) {
+    int congestion = m_error_num;
+    for (auto source : m_sources) {
+        congestion += source->GetThrottledNum();
     }
+    m_conn_limit = m_controller.Update(rate, congestion != m_last_congestion);
+    m_last_congestion = congestion;
+}
+
+/**
+ * @description: 初始化片段调度器，由外部驱动下载时在Init后调用
+ */
+void DownloadManager::Prepare() {
+    // 流式下载不切分片段，由第一个领取的连接下载整个文件
+    if (m_stream) {
+        return;
+    }
+    // 调度器按构造时的线程数分配，外部驱动时线程序号可以取到该数量
+    // 不支持断点续传时只能整个文件作为一个片段下载
+    m_scheduler.Init(m_filesize, m_slot_num, m_downloader->IsRangeAvailable() ? 0 : m_filesize);
+    for (auto& range : m_resumed) {
+        m_scheduler.MarkDone(range.first, range.second);
+    }
+}
 
+/**
+ * @description: 为线程领取下一个片段
+ * @param {const int} thread_id 线程序号，小于构造时的线程数
+ * @param {Segment&} seg 领取到的片段
+ * @param {bool} steal 无空闲区间时是否分走其他线程的区间
+ * @return {bool} 领取成功返回true， 无可下载区间或已停止返回false
+ */
+bool DownloadManager::AcquireSegment(const int thread_id, Segment& seg, bool steal) {
+    if (m_stream) {
+        if (m_stop || m_paused || m_stream_taken.exchange(true)) {
+            return false;
+        }
+        seg.start = 0;
+        seg.end = RANGE_END_UNKNOWN;
+        return true;
+    }
+    // 不支持断点续传的服务器无法下载文件中间的区间
+    return !m_stop && !m_paused && m_scheduler.Acquire(thread_id, seg, steal && m_downloader->IsRangeAvailable());
+}
+
+/**
+ * @description: 下载领取到的片段
+ * @param {const int} thread_id 线程序号
+ * @param {const Segment&} seg 片段
+ * @return {bool} 成功返回true， 失败返回false，失败后其他线程的传输也会停止
+ */
+bool DownloadManager::DownloadSegment(const int thread_id, const Segment& seg) {
+    if (m_stream) {
+        return DownloadStream(thread_id);
+    }
+
+    // 创建回调函数，记录线程序号
+    DataDealCallback callback = [this, thread_id](const char* data, size_t size)->bool {
+        return WriteFileBulkCallback(data, size, thread_id);
+    };
+
+    // 失败后从已写入的位置重新请求剩余区间，退避期间其他线程可能分走后半段，结束位置重新读取
+    Segment range = seg;
+    while (true) {
+        int source = BeginSegment(thread_id);
+        if (source < 0) {
+            m_scheduler.Finish(thread_id);
+            m_stop = true;
+            return false;
+        }
+        // mmap方式下支持零拷贝的下载器直接收到映射窗口中，接收位置从片段起始开始推进
+        Downloader* downloader = m_sources[source];
+        bool ok = false;
+        if (m_write_mode == WRITE_MMAP && downloader->IsZeroCopySupported()) {
+            file_size_t recv_pos = range.start;
+            BufferAcquireCallback acquire = [this, thread_id, &recv_pos](size_t& size)->char* {
+                return AcquireMem(thread_id, recv_pos, size);
+            };
+            BufferCommitCallback commit = [this, thread_id, &recv_pos](const char* data, size_t size)->bool {
+                recv_pos += size;
+                return CommitMem(thread_id, data, size);
+            };
+            ok = downloader->DownloadInto(range.start, range.end - 1, acquire, commit);
+        }
+        else {
+            ok = downloader->Download(range.start, range.end - 1, callback);
+        }
+        SegmentEnd result = EndSegment(thread_id, ok);
+        if (result != SEGMENT_RETRY || !WaitRetry(thread_id, result)) {
+            return result != SEGMENT_FAIL;
+        }
+        range.start = m_segment_stats[thread_id].retry_pos;
+        range.end = m_scheduler.GetSegmentEnd(thread_id);
+    }
+}
+
+/**
+ * @description: 线程模式下等待片段重试的退避时间，期间停止、暂停或连接数减少时放弃重试并归还区间
+ * @param {const int} thread_id 线程序号
+ * @param {SegmentEnd&} result 放弃重试时连接的下一步
+ * @return {bool} 可以重试返回true
+ */
+bool DownloadManager::WaitRetry(const int thread_id, SegmentEnd& result) {
+    auto retry_time = m_segment_stats[thread_id].retry_time;
+    while (!m_stop && !m_paused && thread_id < m_conn_limit) {
+        auto now = chrono::steady_clock::now();
+        if (now >= retry_time) {
+            break;
+        }
+        this_thread::sleep_for(min<chrono::steady_clock::duration>(retry_time - now,
+            chrono::milliseconds(SEGMENT_RETRY_POLL_MS)));
+    }
+    // 剩余区间可能已被其他线程全部分走
+    if (!m_stop && !m_paused && thread_id < m_conn_limit && !m_scheduler.IsSegmentDone(thread_id)) {
+        return true;
+    }
+    m_scheduler.Finish(thread_id);
+    result = m_stop ? SEGMENT_FAIL : SEGMENT_NEXT;
+    return false;
+}
+
+/**
+ * @description: 片段开始下载前选择下载源并记录开始状态
+ * @param {const int} thread_id 线程序号
+ * @return {int} 下载源序号，没有可用的下载源时返回-1
+ */
+int DownloadManager::BeginSegment(const int thread_id) {
+    SegmentStat& stat = m_segment_stats[thread_id];
+    stat.source = m_selector.Pick();
+    // 单连接限速由下载器在创建传输时设置，限制调整后从下一个片段生效
+    if (m_limit && stat.source >= 0) {
+        m_sources[stat.source]->SetConnectionRate(m_limit->GetConnRate());
+    }
+    stat.begin_size = m_downloaded_sizes.Get(thread_id);
+    stat.begin_time = chrono::steady_clock::now();
+    if (m_metrics) {
+        m_metrics->BeginTransfer(thread_id);
+    }
+    return stat.source;
+}
+
+/**
+ * @description: 片段结束后提交数据、统计下载源速度并归还未完成的区间，只有一个下载源时失败的片段保留给本连接重试
+ * @param {const int} thread_id 线程序号
+ * @param {bool} ok 传输是否成功
+ * @return {SegmentEnd} 重试时剩余区间记在片段统计中，失败且重试次数用尽时返回SEGMENT_FAIL
+ */
+SegmentEnd DownloadManager::EndSegment(const int thread_id, bool ok) {
+    FlushSegment(thread_id);
+    SegmentStat& stat = m_segment_stats[thread_id];
+    if (m_metrics) {
+        // 传输结束与此处在同一线程，可以取到该传输的耗时
+        TransferTiming timing;
+        bool has_timing = stat.source >= 0 && m_sources[stat.source]->GetLastTiming(timing);
+        m_metrics->RecordTransfer(thread_id, has_timing ? &timing : nullptr, ok);
+    }
+    // 片段后半段被分走时回调会主动中断传输，此时片段已写完，不算失败
+    bool done = ok || m_scheduler.IsSegmentDone(thread_id);
+    // 连接数减少时多出的连接和暂停时的连接也会主动中断
+    bool retired = !done && (thread_id >= m_conn_limit || m_paused);
+    // 已停止时传输是被主动中断的，不计入下载源的失败
+    if (!m_stop && !retired) {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - stat.begin_time).count();
+        m_selector.Report(stat.source, m_downloaded_sizes.Get(thread_id) - stat.begin_size, seconds, done);
+    }
+    if (done || retired) {
+        // 未完成的部分归还为空闲区间，可由其他下载源或连接重新下载
+        m_scheduler.Finish(thread_id);
+        if (done) {
+            m_fail_streak = 0;
+            stat.retry_num = 0;
+        }
+        return SEGMENT_NEXT;
+    }
+    // 有进展的失败多为偶发断线，重新计数
+    if (m_downloaded_sizes.Get(thread_id) > stat.begin_size) {
+        stat.retry_num = 0;
+    }
+    m_error_num++;
+    if (m_selector.GetAliveNum() > 1) {
+        m_scheduler.Finish(thread_id);
+        printf("segment failed on %s, retry with other sources\n", m_source_urls[stat.source].c_str());
+        return SEGMENT_NEXT;
+    }
+    // 自动模式下失败会使连接数减半，连接先退出，避免在退避前反复请求
+    if (m_auto_conn && (m_conn_limit > 1 || ++m_fail_streak < CONN_MAX_FAIL_STREAK)) {
+        m_scheduler.Finish(thread_id);
+        printf("segment failed on %s, retry with fewer connections\n", m_source_urls[stat.source].c_str());
+        stat.backoff = true;
+        return SEGMENT_NEXT;
+    }
+    // 只有一个下载源时退避后从已写入的位置重试，重复下载其他线程区间的请求失败时直接放弃
+    if (!m_stop && m_downloader->IsRangeAvailable() && ++stat.retry_num <= SEGMENT_RETRY_MAX) {
+        Segment rest;
+        if (!m_scheduler.Resume(thread_id, rest)) {
+            m_scheduler.Finish(thread_id);
+            return SEGMENT_NEXT;
+        }
+        int delay = RetryDelayMs(stat.retry_num);
+        stat.retry_pos = rest.start;
+        stat.retry_time = chrono::steady_clock::now() + chrono::milliseconds(delay);
+        printf("segment failed on %s, retry from byte %llu in %d ms (%d/%d)\n", m_source_urls[stat.source].c_str(),
+            (unsigned long long)rest.start, delay, stat.retry_num, SEGMENT_RETRY_MAX);
+        return SEGMENT_RETRY;
+    }
+    m_scheduler.Finish(thread_id);
+    m_stop = true;
+    return SEGMENT_FAIL;
+}
+
+/**
+ * @description: 输出各下载源的下载量和速度，只有一个下载源时不输出
+ */
+void DownloadManager::ShowMirrorReport() {
+    if (m_sources.size() <= 1) {
+        return;
+    }
+    file_size_t total = 0;
+    for (size_t i = 0; i < m_sources.size(); i++) {
+        file_size_t size = 0;
+        double rate = 0;
+        m_selector.GetStats(i, size, rate);
+        total += size;
+    }
+    for (size_t i = 0; i < m_sources.size(); i++) {
+        file_size_t size = 0;
+        double rate = 0;
+        bool alive = m_selector.GetStats(i, size, rate);
+        printf("source %s: %llu bytes (%.1f%%), %.2f MB/s per connection%s\n", m_source_urls[i].c_str(), size,
+            total ? size * 100.0 / total : 0, rate / BYTE_SCALE / BYTE_SCALE, alive ? "" : ", dropped");
+    }
+}
+
+/**
+ * @description: 所有线程结束后刷新磁盘、校验并处理续传日志
+ * @param {bool} ok 各片段是否全部下载成功
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadManager::Complete(bool ok) {
     // 刷新磁盘
-    if (!ReleaseMem()) {
+    bool flushed = ReleaseMem();
+    flushed = StopWriter() && flushed;
+    // 等待本文件的脏页写完，预算留给仍在下载的文件
+    if (m_budget) {
+        m_budget->Drain(m_w_fd);
+    }
+    // 流式下载去掉预先扩展的部分，失败时保留已收到的内容
+    if (m_stream) {
+        if (-1 == ftruncate(m_w_fd, m_stream_size)) {
+            perror("truncate file failed:");
+            flushed = false;
+        }
+        m_filesize = m_stream_size;
+        m_verifier.SetFileSize(m_stream_size);
+    }
+    if (!ok || !flushed) {
+        m_verifier.Stop();
+        m_journal.Close();
+        if (m_stream) {
+            printf("streaming download failed after %llu bytes, cannot be resumed\n", m_stream_size);
+        }
+        else {
+            printf("download progress saved, run again to resume\n");
+        }
         return false;
     }
 
-    string bar(100, '=');
-    printf("[%-100s][%3d%%]\r\n", bar.c_str(), 100);
-    return true;
+    // 校验失败时已下载的内容不可信，不再续传
+    bool verified = m_verifier.Finish();
+    m_journal.Remove();
+    return verified;
 }
 
 /**
- * @description: 显示下载进度条
- * @return {bool} 下载成功返回true， 失败返回false
+ * @description: 获取当前进度
+ * @param {double} speed 速度，字节/秒
+ * @param {double} elapsed 已用时间，秒
+ * @return {ProgressInfo}
  */
-bool DownloadManager::ShowProgress() {
+ProgressInfo DownloadManager::GetProgress(double speed, double elapsed) {
+    ProgressInfo info;
+    info.total_size = m_filesize;
+    info.downloaded_size = m_resumed_size + m_downloaded_sizes.Sum();
+    info.speed = speed;
+    info.elapsed = elapsed;
+    info.conn_num = m_conn_limit;
+    return info;
+}
 
-    file_size_t total_size = 0;
-    file_size_t last_size = 0;
-    int undone_thread_num = m_thread_num; // 未执行完线程数
-    int wait_time = PROGRESS_INTERVAL / undone_thread_num;
-    auto last_time = chrono::system_clock::now();
-    int speed = 0;
-    string speed_size = "KB";
+/**
+ * @description: 等待所有连接退出，期间按间隔通知进度观察者，自动模式下调整连接数
+ * @return {bool} 下载成功返回true， 有连接失败时立即返回false
+ */
+bool DownloadManager::WatchProgress() {
+    // 各周期任务下次执行的时间，进度线程只在最近的时间或有连接退出时醒来
+    typedef chrono::steady_clock::time_point time_point;
+    auto begin_time = chrono::steady_clock::now();
+    time_point next_report = begin_time;
+    time_point next_sample = begin_time + chrono::milliseconds(CONN_SAMPLE_INTERVAL);
+    time_point next_publish = begin_time;
+    time_point last_report = begin_time;
+    time_point last_sample = begin_time;
+    file_size_t report_size = m_resumed_size;
+    file_size_t sample_size = m_resumed_size;
 
-    while (undone_thread_num != 0) {
-        // 计算已下载文件大小, 鉴于进度条只是粗略估算，此处不加锁
-        total_size = 0;
-        for (auto& size : m_downloaded_sizes) {
-            total_size += size;
+    while (true) {
+        long long busy_begin = m_metrics ? MetricsNow() : 0;
+        if (m_auto_conn) {
+            StartConnections();
+        }
+        if (m_threads.empty()) {
+            break;
         }
 
-        // 显示进度条
-        int progress = (int)(total_size * 100 / m_filesize);
-        string bar(progress, '=');
-        int diff_time = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now() - last_time).count();
-        if (diff_time > 1) {
-            file_size_t diff_size = total_size - last_size;
-            speed = ConvertSize((double)diff_size / diff_time, speed_size);
+        // 速度按实际经过的时间计算，不足一个间隔被唤醒时不采样
+        auto now = chrono::steady_clock::now();
+        file_size_t total_size = m_resumed_size + m_downloaded_sizes.Sum();
+        if (m_auto_conn && now >= next_sample) {
+            double seconds = chrono::duration<double>(now - last_sample).count();
+            AdjustConnections((total_size - sample_size) / seconds);
+            sample_size = total_size;
+            last_sample = now;
+            next_sample = now + chrono::milliseconds(CONN_SAMPLE_INTERVAL);
+        }
+        if (m_observer && now >= next_report) {
+            double seconds = chrono::duration<double>(now - last_report).count();
+            double speed = seconds > 0 ? (total_size - report_size) / seconds : 0;
+            m_observer->OnProgress(GetProgress(speed, chrono::duration<double>(now - begin_time).count()));
+            report_size = total_size;
+            last_report = now;
+            next_report = now + chrono::milliseconds(m_observer_interval);
+        }
+        if (m_metrics) {
+            m_metrics->RecordProgress(MetricsNow() - busy_begin);
+            if (now >= next_publish) {
+                m_metrics->Publish(PROGRESS_INTERVAL);
+                next_publish = now + chrono::milliseconds(PROGRESS_INTERVAL);
+            }
         }
-        printf("[%-100s][%3d%%][%3d%s/s]\r", bar.c_str(), progress, speed, speed_size.c_str());
-        fflush(stdout);
 
-        // 检测线程是否执行完毕
-        std::vector<std::future<bool>>::iterator it = m_threads.begin();
-        for (; it != m_threads.end(); ) {
-            std::future_status status = it->wait_for(chrono::milliseconds(wait_time));
-            if (status != std::future_status::ready) {
+        // 没有周期任务时一直等到有连接退出或登记重试
+        time_point deadline = RunRetries(m_stop);
+        if (m_auto_conn) {
+            deadline = min(deadline, next_sample);
+        }
+        if (m_observer) {
+            deadline = min(deadline, next_report);
+        }
+        if (m_metrics) {
+            deadline = min(deadline, next_publish);
+        }
+        vector<int> exited;
+        {
+            unique_lock<mutex> lock(m_exit_lock);
+            auto has_exited = [this]() { return !m_exited.empty() || m_retry_added; };
+            if (deadline == time_point::max()) {
+                m_exit_cond.wait(lock, has_exited);
+            }
+            else {
+                m_exit_cond.wait_until(lock, deadline, has_exited);
+            }
+            exited.swap(m_exited);
+        }
+
+        // 回收退出的连接，同一序号可能已被重新启动，先启动的先退出
+        for (int thread_id : exited) {
+            auto it = m_threads.begin();
+            while (it != m_threads.end() && it->first != thread_id) {
                 ++it;
+            }
+            if (it == m_threads.end()) {
                 continue;
             }
-
-            // 有线程执行失败，直接返回
-            if (!it->get()) {
+            // 线程模式在通知后才设置结果，此处最多等待线程函数返回
+            bool ok = it->second.get();
+            m_threads.erase(it);
+            if (!ok) {
                 return false;
             }
+        }
+    }
+    return true;
+}
 
-            // 执行成功，则从集合中移除
-            it = m_threads.erase(it);
-            if (--undone_thread_num) {
-                wait_time = PROGRESS_INTERVAL / undone_thread_num;
+/**
+ * @description: 工作线程循环领取片段并下载，直到没有可分配的区间
+ * @param {const int} thread_id 线程序号
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadManager::DownloadWorker(const int thread_id) {
+    Segment seg;
+    while (true) {
+        // 连接数减少或退避时退出，之后由进度线程重新启动
+        if (thread_id >= m_conn_limit || m_segment_stats[thread_id].backoff) {
+            m_segment_stats[thread_id].backoff = false;
+            m_slot_states[thread_id] = SLOT_IDLE;
+            return true;
+        }
+        if (!AcquireSegment(thread_id, seg)) {
+            m_slot_states[thread_id] = SLOT_DONE;
+            return true;
+        }
+        if (!DownloadSegment(thread_id, seg)) {
+            m_slot_states[thread_id] = SLOT_DONE;
+            return false;
+        }
+    }
+}
+
+/**
+ * @description: 异步下载器使用，为连接领取下一个片段并提交下载，片段结束后在IO线程中继续领取
+ * @param {const int} thread_id 连接序号
+ */
+void DownloadManager::StartAsyncSegment(const int thread_id) {
+    if (m_stop) {
+        ExitAsyncConnection(thread_id, false, SLOT_DONE);
+        return;
+    }
+    if (thread_id >= m_conn_limit || m_segment_stats[thread_id].backoff) {
+        m_segment_stats[thread_id].backoff = false;
+        ExitAsyncConnection(thread_id, true, SLOT_IDLE);
+        return;
+    }
+    Segment seg;
+    if (!m_scheduler.Acquire(thread_id, seg)) {
+        ExitAsyncConnection(thread_id, true, SLOT_DONE);
+        return;
+    }
+    SubmitAsyncSegment(thread_id, seg);
+}
+
+/**
+ * @description: 异步下载器使用，提交连接的片段，片段结束后在IO线程中继续领取或登记重试
+ * @param {const int} thread_id 连接序号
+ * @param {const Segment&} seg 片段
+ */
+void DownloadManager::SubmitAsyncSegment(const int thread_id, const Segment& seg) {
+    DataDealCallback callback = [this, thread_id](const char* data, size_t size)->bool {
+        return WriteFileBulkCallback(data, size, thread_id);
+    };
+    DownloadDoneCallback done = [this, thread_id](bool ok) {
+        // 与线程模式相同，片段被分走导致的中断不算失败
+        SegmentEnd result = EndSegment(thread_id, ok);
+        if (result == SEGMENT_FAIL) {
+            ExitAsyncConnection(thread_id, false, SLOT_DONE);
+            return;
+        }
+        // IO线程不能阻塞，退避由进度线程计时，到期后重新提交
+        if (result == SEGMENT_RETRY) {
+            lock_guard<mutex> lock(m_exit_lock);
+            m_retries.push_back(thread_id);
+            m_retry_added = true;
+            m_exit_cond.notify_one();
+            return;
+        }
+        StartAsyncSegment(thread_id);
+    };
+    int source = BeginSegment(thread_id);
+    if (source < 0 || !m_sources[source]->DownloadAsync(seg.start, seg.end - 1, callback, done)) {
+        m_scheduler.Finish(thread_id);
+        ExitAsyncConnection(thread_id, false, SLOT_DONE);
+    }
+}
+
+/**
+ * @description: 异步下载器使用，退避时间到后由进度线程重新提交连接的剩余区间
+ * @param {const int} thread_id 连接序号
+ */
+void DownloadManager::RetryAsyncSegment(const int thread_id) {
+    if (m_stop) {
+        m_scheduler.Finish(thread_id);
+        ExitAsyncConnection(thread_id, false, SLOT_DONE);
+        return;
+    }
+    // 剩余区间已被其他连接全部分走时继续领取下一个片段
+    if (thread_id >= m_conn_limit || m_scheduler.IsSegmentDone(thread_id)) {
+        m_scheduler.Finish(thread_id);
+        StartAsyncSegment(thread_id);
+        return;
+    }
+    Segment seg;
+    seg.start = m_segment_stats[thread_id].retry_pos;
+    seg.end = m_scheduler.GetSegmentEnd(thread_id);
+    SubmitAsyncSegment(thread_id, seg);
+}
+
+/**
+ * @description: 进度线程使用，重新提交退避时间已到的异步片段，已停止时全部提交以便连接退出
+ * @param {bool} all 是否不等退避结束全部提交
+ * @return {chrono::steady_clock::time_point} 剩余片段中最早的重试时间，没有时为最大值
+ */
+chrono::steady_clock::time_point DownloadManager::RunRetries(bool all) {
+    auto now = chrono::steady_clock::now();
+    auto earliest = chrono::steady_clock::time_point::max();
+    vector<int> due;
+    {
+        lock_guard<mutex> lock(m_exit_lock);
+        m_retry_added = false;
+        auto it = m_retries.begin();
+        while (it != m_retries.end()) {
+            auto retry_time = m_segment_stats[*it].retry_time;
+            if (all || retry_time <= now) {
+                due.push_back(*it);
+                it = m_retries.erase(it);
+                continue;
             }
+            earliest = min(earliest, retry_time);
+            ++it;
         }
     }
-    return true;
+    // 提交时可能立即结束并再次登记，不能持有锁
+    for (int thread_id : due) {
+        RetryAsyncSegment(thread_id);
+    }
+    return earliest;
+}
+
+/**
+ * @description: 将一块数据依次交给前置级、写盘级，再推进校验、进度计数并按总速率限制节流
+ * @param {const Front&} front 前置级，确定写入位置和范围
+ * @param {const Writer&} writer 写盘级
+ * @param {SinkChunk&} chunk 数据
+ * @return {bool} 成功返回true， 写入失败返回false
+ */
+template <class Front, class Writer>
+bool DownloadManager::PutChunk(const Front& front, const Writer& writer, SinkChunk& chunk) {
+    // 各级在编译期确定，整条流水线展开为直接调用
+    return MakeSinkPipeline(front, TimedSink<Writer>(writer, m_metrics), HashSink(&m_verifier),
+        CountSink(&m_downloaded_sizes), LimitSink(m_limit, m_metrics)).Put(chunk);
 }
 
 /**
@@ -263,136 +1075,252 @@ bool DownloadManager::ShowProgress() {
  * @return {bool} 成功返回true， 失败返回false
  */
 bool DownloadManager::WriteFileBulkCallback(const char* data, size_t size, const int thread_id) {
-    // 若未映射内存，则进行映射
-    if (m_mems[thread_id] == nullptr && !MapToFile(thread_id)) {
+    // 已停止、暂停或连接被收回时中断传输，未写入的区间由Finish归还
+    if (m_stop || m_paused || thread_id >= m_conn_limit) {
         return false;
     }
+    // 连接空闲时下载器传入0字节检查，收尾阶段片段已由另一连接写完时中断，落后的请求不再占用连接
+    if (size == 0) {
+        return !m_scheduler.IsSegmentDone(thread_id);
+    }
+    // 只写入仍属于本线程片段的数据，超出部分已被其他线程分走，收尾阶段已被另一连接写入的部分跳过
+    SinkChunk chunk(thread_id, 0, data, size);
+    bool ok = m_write_mode == WRITE_MMAP
+        ? PutChunk(ReserveSink(&m_scheduler), MmapSink<DownloadManager>(this, m_conn_states), chunk)
+        : PutChunk(ReserveSink(&m_scheduler), PwriteSink(&m_writer), chunk);
+    return ok && chunk.data + chunk.size == data + size;
+}
 
-    size_t remain_data_size = size; // 未写入数据大小
-    size_t remain_mem_size = m_current_block_size[thread_id] - m_current_mem_pos[thread_id]; // 可写内存剩余大小
-    size_t data_offset = 0; // 数据偏移量
-
-    // 未写入数据量大于内存大小时，先写部分数据再重新映射空间
-    while (remain_data_size > remain_mem_size) {
-        memcpy(m_mems[thread_id] + m_current_mem_pos[thread_id], data + data_offset, remain_mem_size);
-        remain_data_size -= remain_mem_size;
-        data_offset += remain_mem_size;
-        // 重新映射内存
-        if (!MapToFile(thread_id)) {
-            return false;
+/**
+ * @description: 零拷贝接收时为下载器提供接收位置所在的映射内存，超出当前映射时重新映射
+ * @param {const int} thread_id 线程序号
+ * @param {file_size_t} pos 接收位置
+ * @param {size_t&} size 传入希望接收的字节数，返回映射内存中可写的字节数
+ * @return {char*} 成功返回映射内存， 已停止、片段已被分走或映射失败返回nullptr
+ */
+char* DownloadManager::AcquireMem(const int thread_id, file_size_t pos, size_t& size) {
+    if (m_stop || m_paused || thread_id >= m_conn_limit) {
+        return nullptr;
+    }
+    ConnWriteState& state = m_conn_states[thread_id];
+    if (state.mem == nullptr || pos < state.map_offset || pos >= state.map_offset + state.map_size) {
+        // 接收位置之后已被其他线程分走，不再映射，由提交时的判断中断传输
+        if (pos >= m_scheduler.GetSegmentEnd(thread_id) || !MapToFile(thread_id, pos)) {
+            return nullptr;
         }
+    }
+    size_t mem_pos = (size_t)(pos - state.map_offset);
+    if (size > state.map_size - mem_pos) {
+        size = state.map_size - mem_pos;
+    }
+    return state.mem + mem_pos;
+}
 
-        // 更新剩余空间值
-        remain_mem_size = m_current_block_size[thread_id] - m_current_mem_pos[thread_id];
+/**
+ * @description: 零拷贝接收后提交已收到映射内存中的数据
+ * @param {const int} thread_id 线程序号
+ * @param {const char*} data 数据在映射内存中的位置
+ * @param {size_t} size 收到的字节数
+ * @return {bool} 成功返回true， 已停止或片段剩余部分已被分走时返回false
+ */
+bool DownloadManager::CommitMem(const int thread_id, const char* data, size_t size) {
+    if (m_stop || m_paused || thread_id >= m_conn_limit) {
+        return false;
+    }
+    if (size == 0) {
+        return !m_scheduler.IsSegmentDone(thread_id);
+    }
+    // 数据已在文件的映射内存中，预留时跳过和截断的部分与其他连接写入的内容相同，覆盖不影响结果
+    SinkChunk chunk(thread_id, 0, data, size);
+    bool ok = PutChunk(ReserveSink(&m_scheduler), MmapCommitSink<DownloadManager>(this, m_conn_states), chunk);
+    return ok && chunk.data + chunk.size == data + size;
+}
+
+/**
+ * @description: 大小未知时从头到尾单连接下载整个文件
+ * @param {const int} thread_id 线程序号
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadManager::DownloadStream(const int thread_id) {
+    DataDealCallback callback = [this, thread_id](const char* data, size_t size)->bool {
+        return WriteStreamCallback(data, size, thread_id);
+    };
+    int source = BeginSegment(thread_id);
+    bool ok = source >= 0 && m_sources[source]->Download(0, RANGE_END_UNKNOWN, callback);
+    if (m_metrics) {
+        TransferTiming timing;
+        bool has_timing = source >= 0 && m_sources[source]->GetLastTiming(timing);
+        m_metrics->RecordTransfer(thread_id, has_timing ? &timing : nullptr, ok);
     }
-    memcpy(m_mems[thread_id] + m_current_mem_pos[thread_id], data + data_offset, remain_data_size);
-    m_current_mem_pos[thread_id] += remain_data_size;
-    m_downloaded_sizes[thread_id] += size;
+    // 没有区间可以归还，失败后无法由其他连接接着下载
+    if (!ok) {
+        m_stop = true;
+        return false;
+    }
+    m_stream_done = true;
     return true;
 }
 
 /**
- * @description: 映射文件到内存
+ * @description: 流式下载时按顺序追加数据，超出已扩展的文件大小时先扩展文件
+ * @param {const char*} data 接收的数据
+ * @param {size_t} size 数据大小
  * @param {const int} thread_id 线程序号
  * @return {bool} 成功返回true， 失败返回false
  */
-bool DownloadManager::MapToFile(const int thread_id) {
-    // 如果原来的地址有映射，要先刷盘
-    if (m_mems[thread_id] != nullptr) {
-        if (-1 == munmap(m_mems[thread_id], m_current_block_size[thread_id])) {
-            perror("unmap failed:");
-            printf("unmap failed, thread id is %d\n", thread_id);
+bool DownloadManager::WriteStreamCallback(const char* data, size_t size, const int thread_id) {
+    if (m_stop || m_paused) {
+        return false;
+    }
+    if (size == 0) {
+        return true;
+    }
+    file_size_t pos = m_stream_size;
+    if (pos + size > m_stream_capacity && !GrowStreamFile(pos + size)) {
+        return false;
+    }
+    // 按顺序追加，不经过调度器预留
+    SinkChunk chunk(thread_id, pos, data, size);
+    if (!PutChunk(NullSink(), MmapSink<DownloadManager>(this, m_conn_states), chunk)) {
+        return false;
+    }
+    m_stream_size = pos + size;
+    return true;
+}
+
+/**
+ * @description: 流式下载时按STREAM_GROW_SIZE的整数倍扩展文件
+ * @param {file_size_t} size 至少需要的文件大小
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadManager::GrowStreamFile(file_size_t size) {
+    file_size_t capacity = (size + STREAM_GROW_SIZE - 1) / STREAM_GROW_SIZE * STREAM_GROW_SIZE;
+    if (m_io_options & IO_PREALLOC) {
+        if (0 == fallocate(m_w_fd, 0, m_stream_capacity, capacity - m_stream_capacity)) {
+            m_stream_capacity = capacity;
+            return true;
+        }
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            perror("fallocate failed:");
             return false;
         }
     }
-    int to_map_block_num = m_remain_block_num[thread_id] > m_map_page_num ? m_map_page_num : m_remain_block_num[thread_id];
-    if (to_map_block_num <= 0) {
-        printf("map failed, remain block num is 0, thread id is %d\n", thread_id);
+    if (-1 == ftruncate(m_w_fd, capacity)) {
+        perror("ftruncate failed:");
         return false;
     }
-    m_mems[thread_id] = (char*)mmap(0, BLOCK_4K * to_map_block_num, PROT_WRITE, MAP_SHARED, m_w_fd,
-        m_block_idxs[thread_id] * BLOCK_4K);
-    if (m_mems[thread_id] == MAP_FAILED) {
-        m_mems[thread_id] = nullptr;
-        perror("map failed:");
-        printf("map failed, block_idx is %d, remain_block_num is, to_map_block_num is %d\n", m_block_idxs[thread_id],
-            m_remain_block_num[thread_id], to_map_block_num);
+    m_stream_capacity = capacity;
+    return true;
+}
+
+/**
+ * @description: 片段结束时提交线程缓冲的数据，仅pwrite方式需要
+ * @param {const int} thread_id 线程序号
+ */
+void DownloadManager::FlushSegment(const int thread_id) {
+    if (m_write_mode != WRITE_MMAP) {
+        m_writer.Flush(thread_id);
+    }
+}
+
+/**
+ * @description: 提交所有缓冲数据并等待写线程写完，仅pwrite方式需要
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadManager::StopWriter() {
+    if (m_write_mode == WRITE_MMAP || m_filesize == 0) {
+        return true;
+    }
+    for (int i = 0; i < m_slot_num; i++) {
+        m_writer.Flush(i);
+    }
+    if (!m_writer.Stop()) {
+        printf("write file failed\n");
         return false;
     }
-    m_current_mem_pos[thread_id] = 0;
-    m_block_idxs[thread_id] += to_map_block_num;
-    m_remain_block_num[thread_id] -= to_map_block_num;
-    m_current_block_size[thread_id] = to_map_block_num * BLOCK_4K;
     return true;
 }
 
+/**
+ * @description: 将线程已写入且尚未记录的区间交给日志
+ * @param {const int} thread_id 线程序号
+ */
+void DownloadManager::RecordWritten(const int thread_id) {
+    ConnWriteState& state = m_conn_states[thread_id];
+    OnWritten(state.written_start, state.written_end);
+    state.written_start = state.written_end;
+}
 
-int main(int argc, char* argv[]) {
-    int ch;
-    string url;
-    string path;
-    int thread_num = 5;
-    int map_page_num = 256;
+/**
+ * @description: 区间已写入文件，记入日志并推进校验
+ * @param {file_size_t} start 起始字节
+ * @param {file_size_t} end 结束字节（不包含）
+ */
+void DownloadManager::OnWritten(file_size_t start, file_size_t end) {
+    m_journal.Record(start, end);
+    m_verifier.AddWritten(start, end);
+}
 
-    while ((ch = getopt(argc, argv, "t:u:d:p:hv")) != EOF) {
-        switch (ch) {
-        case 'u':
-        {
-            url.assign(optarg);
-            break;
-        }
-        case 'd':
-        {
-            path.assign(optarg);
-            cout << "filepath is  " << optarg << endl;
-            break;
-        }
-        case 'h':
-        {
-            cout << "Usage:" << endl;
-            cout << "-u * set URL" << endl;
-            cout << "-d * set file path to save result" << endl;
-            cout << "-h show this help" << endl;
-            cout << "-t set thread num, default = 5" << endl;
-            cout << "-s set map_page_num, default = 256" << endl;
-            cout << "e.g. ./multithread_downloader -u "
-                "http://mirrors.163.com/centos-vault/6.2/isos/x86_64/CentOS-6.2-x86_64-netinstall.iso -d /root/"
-                << endl;
-            return 0;
-        }
-        case 't':
-        {
-            thread_num = atoi(optarg);
-            break;
-        }
-        case 'p':
-        {
-            map_page_num = atoi(optarg);
-            break;
-        }
-        case 'v':
-        {
-            printf("version: %d.%d\n", MULTITHREAD_DOWNLOADER_VERSION_MAJOR, MULTITHREAD_DOWNLOADER_VERSION_MINOR);
-            break;
+/**
+ * @description: 映射文件到内存
+ * @param {const int} thread_id 线程序号
+ * @param {file_size_t} pos 需要写入的文件位置，映射从其所在的块开始
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool DownloadManager::MapToFile(const int thread_id, file_size_t pos) {
+    long long begin_ns = m_metrics ? MetricsNow() : 0;
+    ConnWriteState& state = m_conn_states[thread_id];
+    // 如果原来的地址有映射，要先刷盘
+    if (state.mem != nullptr) {
+        if (-1 == munmap(state.mem, state.map_size)) {
+            perror("unmap failed:");
+            printf("unmap failed, thread id is %d\n", thread_id);
+            return false;
         }
-        default:
-        {
-            cout << "undefined option: -" << ch << endl;
+        state.mem = nullptr;
+
+        // 只发起回写不等待完成，脏页分散写出，日志同步时的fdatasync不再集中刷盘，设置预算时总是回写
+        if (m_budget) {
+            m_budget->ReleaseWindow(m_w_fd, state.map_offset, state.map_size);
         }
+        else if (m_io_options & IO_WRITEBACK) {
+            sync_file_range(m_w_fd, state.map_offset, state.map_size, SYNC_FILE_RANGE_WRITE);
         }
+
+        // 映射窗口解除后与日志同步
+        RecordWritten(thread_id);
+    }
+
+    // 映射到片段结束为止，最多m_map_page_num块，流式下载映射到已扩展的文件大小为止
+    file_size_t block_idx = pos / BLOCK_4K;
+    file_size_t seg_end = m_stream ? m_stream_capacity : m_scheduler.GetSegmentEnd(thread_id);
+    int to_map_block_num = (int)((seg_end - block_idx * BLOCK_4K + BLOCK_4K - 1) / BLOCK_4K);
+    if (to_map_block_num > m_map_page_num) {
+        to_map_block_num = m_map_page_num;
+    }
+    if (to_map_block_num <= 0) {
+        printf("map failed, remain block num is 0, thread id is %d\n", thread_id);
+        return false;
     }
-    if (url.empty() || path.empty()) {
-        cout << "please insert url by -u, and output path by -d!!" << endl;
+    // 预算不足时缩小窗口
+    if (m_budget) {
+        to_map_block_num = (int)(m_budget->AcquireWindow((size_t)to_map_block_num * BLOCK_4K) / BLOCK_4K);
     }
-    DownloadManager app(thread_num, map_page_num);
-    DownloadInfo info(HTTP, url);
-    if (!app.Init(info, path)) {
-        cout << "error occur, please try again" << endl;
-        return -1;
+    int flags = MAP_SHARED | (m_io_options & IO_POPULATE ? MAP_POPULATE : 0);
+    state.mem = (char*)mmap(0, BLOCK_4K * to_map_block_num, PROT_WRITE, flags, m_w_fd, block_idx * BLOCK_4K);
+    if (state.mem == MAP_FAILED) {
+        state.mem = nullptr;
+        if (m_budget) {
+            m_budget->CancelWindow((size_t)to_map_block_num * BLOCK_4K);
+        }
+        perror("map failed:");
+        printf("map failed, block_idx is %llu, to_map_block_num is %d\n", block_idx, to_map_block_num);
+        return false;
     }
-    if (!app.Download()) {
-        cout << "download failed, please try again" << endl;
-        return -1;
+    state.map_offset = block_idx * BLOCK_4K;
+    state.map_size = to_map_block_num * BLOCK_4K;
+    if (m_metrics) {
+        m_metrics->RecordRemap(thread_id, MetricsNow() - begin_ns);
     }
-    return 0;
+    return true;
 }
@@ -5,31 +5,115 @@
  * @Description: 多线程文件下载管理器
  */
 #ifndef _MULTITHREAD_DOWNLOADER_H_
+#define _MULTITHREAD_DOWNLOADER_H_
 #include <string>
 #include <functional>
 #include <vector>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
 #include "httpdownloader.h"
+#include "multihttpdownloader.h"
+#include "nativehttpdownloader.h"
+#include "segment_scheduler.h"
+#include "download_journal.h"
+#include "delta_index.h"
+#include "pwrite_writer.h"
+#include "stream_verifier.h"
+#include "mirror_selector.h"
+#include "connection_controller.h"
+#include "bandwidth_limit.h"
+#include "memory_budget.h"
+#include "worker_pool.h"
+#include "download_metrics.h"
+#include "progress_observer.h"
+#include "data_sink.h"
 using namespace std;
 
 #define BLOCK_4K    4096
 #define BYTE_SCALE  1024
-#define PROGRESS_INTERVAL   3000 // 3000毫秒，用于控制进度条刷新时间
+#define MAP_PAGE_NUM        1024 // 默认每次映射的4K块数，即4MB的映射窗口
+#define PROGRESS_INTERVAL   1000 // 1000毫秒，进度通知的默认间隔
 #define INT_DIVIDE(a, b)    ((int)((double)(a/b) + 0.5))
+#define SMALL_FILE_SIZE     (4 * 1024 * 1024) // 已知大小且不超过该值的文件不探测，整体作为一个片段下载
+#define STREAM_GROW_SIZE    (64 * 1024 * 1024) // 大小未知的文件每次扩展的字节数，结束时截断到实际大小
+#define SEGMENT_RETRY_MAX       5 // 片段连续没有进展的失败次数上限，超过后下载失败
+#define SEGMENT_RETRY_BASE_MS   250 // 片段第一次重试前的退避时间，毫秒，之后每次翻倍
+#define SEGMENT_RETRY_CAP_MS    8000 // 片段重试的最长退避时间，毫秒
+#define SEGMENT_RETRY_POLL_MS   50 // 退避期间检查停止和暂停的间隔，毫秒
+
+// 文件和映射内存的IO选项，可按位组合
+enum IoOption {
+    IO_PREALLOC = 1, // 创建文件时用fallocate分配磁盘空间，写入时不再逐块分配
+    IO_POPULATE = 2, // 映射时预先建立页表（MAP_POPULATE），缺页集中在映射时处理
+    IO_WRITEBACK = 4 // 映射窗口解除后用sync_file_range发起后台回写，日志同步时不再集中刷盘
+};
+#define IO_DEFAULT_OPTIONS  (IO_PREALLOC | IO_WRITEBACK)
+
+// 连接（线程）的运行状态
+enum SlotState {
+    SLOT_IDLE, // 未启动或因连接数减少而退出，连接数增加时可重新启动
+    SLOT_RUNNING, // 正在下载
+    SLOT_DONE // 没有可领取的区间而退出
+};
+
+// 片段结束后连接的下一步
+enum SegmentEnd {
+    SEGMENT_NEXT, // 领取下一个片段
+    SEGMENT_RETRY, // 退避后从已写入的位置重试当前片段
+    SEGMENT_FAIL // 下载失败，连接退出
+};
+
+/**
+ * @description: 获取文件下载器
+ * @param {DownloaderType} type 下载器类型
+ * @return {Downloader*} 下载器对象，由调用方释放
+ */
+Downloader* GetDownloader(DownloaderType type);
 
 class DownloadManager {
 public:
-    DownloadManager(int thread_num = 5, int map_page_num = 256)
+    DownloadManager(int thread_num = 5, int map_page_num = MAP_PAGE_NUM)
         : m_downloader(nullptr)
+        , m_segment_stats(thread_num)
         , m_filesize(0)
         , m_thread_num(thread_num)
+        , m_slot_num(thread_num)
         , m_w_fd(-1)
         , m_map_page_num(map_page_num)
-        , m_downloaded_sizes(thread_num, 0)
-        , m_mems(thread_num, nullptr)
-        , m_block_idxs(thread_num, 0)
-        , m_remain_block_num(thread_num, 0)
-        , m_current_block_size(thread_num, 0)
-        , m_current_mem_pos(thread_num, 0) {};
+        , m_downloaded_sizes(thread_num)
+        , m_conn_states(AllocCacheAligned<ConnWriteState>(thread_num))
+        , m_resumed_size(0)
+        , m_stream(false)
+        , m_stream_taken(false)
+        , m_stream_done(false)
+        , m_stream_size(0)
+        , m_stream_capacity(0)
+        , m_stop(false)
+        , m_paused(false)
+        , m_write_mode(WRITE_MMAP)
+        , m_writer_num(1)
+        , m_io_options(IO_DEFAULT_OPTIONS)
+        , m_checksum_type(CHECKSUM_NONE)
+        , m_slot_states(thread_num)
+        , m_auto_conn(false)
+        , m_conn_limit(thread_num)
+        , m_error_num(0)
+        , m_fail_streak(0)
+        , m_last_congestion(0)
+        , m_limit(nullptr)
+        , m_budget(nullptr)
+        , m_workers(nullptr)
+        , m_metrics(nullptr)
+        , m_observer(nullptr)
+        , m_observer_interval(PROGRESS_INTERVAL)
+        , m_retry_added(false) {
+        if (!m_conn_states) {
+            throw bad_alloc();
+        }
+    };
     ~DownloadManager();
 
     /**
@@ -46,7 +130,263 @@ public:
      */
     bool Download();
 
+    /**
+     * @description: 初始化片段调度器，由外部驱动下载时在Init后调用
+     */
+    void Prepare();
+
+    /**
+     * @description: 为线程领取下一个片段
+     * @param {const int} thread_id 线程序号，小于构造时的线程数
+     * @param {Segment&} seg 领取到的片段
+     * @param {bool} steal 无空闲区间时是否分走其他线程的区间
+     * @return {bool} 领取成功返回true， 无可下载区间或已停止返回false
+     */
+    bool AcquireSegment(const int thread_id, Segment& seg, bool steal = true);
+
+    /**
+     * @description: 下载领取到的片段
+     * @param {const int} thread_id 线程序号
+     * @param {const Segment&} seg 片段
+     * @return {bool} 成功返回true， 失败返回false，失败后其他线程的传输也会停止
+     */
+    bool DownloadSegment(const int thread_id, const Segment& seg);
+
+    /**
+     * @description: 所有线程结束后刷新磁盘、校验并处理续传日志
+     * @param {bool} ok 各片段是否全部下载成功
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Complete(bool ok);
+
+    /**
+     * @description: 停止下载，进行中的传输在下次收到数据时中断，已下载的区间在Complete时记入续传日志
+     */
+    void Stop() { m_stop = true; }
+
+    /**
+     * @description: 暂停或恢复下载，暂停后进行中的传输在下次收到数据时中断并归还区间，不再领取新片段
+     * @param {bool} paused 是否暂停
+     */
+    void SetPaused(bool paused) { m_paused = paused; }
+
+    /**
+     * @description: 是否已下载完所有区间
+     * @return {bool}
+     */
+    bool IsFinished() { return m_stream ? m_stream_done.load() : m_scheduler.GetDoneSize() >= m_filesize; }
+
+    /**
+     * @description: 服务器是否支持断点续传，不支持时片段不能被分走
+     * @return {bool}
+     */
+    bool IsRangeAvailable() { return m_downloader->IsRangeAvailable(); }
+
+    /**
+     * @description: 获取文件大小
+     * @return {file_size_t} 大小未知的文件在下载结束前为0
+     */
+    file_size_t GetFileSize() { return m_filesize; }
+
+    /**
+     * @description: 设置保存的文件名，需在Init前调用，不设置时取url的最后一段
+     * @param {const string&} filename 文件名
+     */
+    void SetFileName(const string& filename) { m_filename = filename; }
+
+    /**
+     * @description: 设置写盘方式，需在Init前调用
+     * @param {WriteMode} mode 写盘方式
+     * @param {int} writer_num 写线程数，仅pwrite方式有效
+     */
+    void SetWriteMode(WriteMode mode, int writer_num = 1);
+
+    /**
+     * @description: 设置文件和映射内存的IO选项，需在Init前调用
+     * @param {int} options IoOption的按位组合
+     */
+    void SetIoOptions(int options) { m_io_options = options; }
+
+    /**
+     * @description: 设置下载完成后需满足的校验值，需在Init前调用
+     * @param {const string&} spec 格式为"sha256:十六进制值"或"crc32c:十六进制值"，只写算法时仅计算并输出
+     * @return {bool} 格式正确返回true， 否则返回false
+     */
+    bool SetChecksum(const string& spec);
+
+    /**
+     * @description: 开启增量下载，本地旧文件中与新文件相同的块直接复制，只下载其余区间，需在Init前调用
+     * @param {const string&} seed_path 本地旧文件路径
+     * @param {const string&} index 新文件的块校验索引，本地路径或链接，为空时取下载链接加DELTA_INDEX_SUFFIX
+     */
+    void SetDelta(const string& seed_path, const string& index) {
+        m_delta_seed = seed_path;
+        m_delta_index = index;
+    }
+
+    /**
+     * @description: 开启自动连接数，从少量连接开始，按总吞吐量的变化增减，构造时的线程数为上限
+     * @param {bool} enable 是否开启
+     */
+    void SetAutoConnections(bool enable) { m_auto_conn = enable; }
+
+    /**
+     * @description: 设置带宽限制，可与其他下载管理器共用，需在下载结束前保持有效
+     * @param {BandwidthLimit*} limit 带宽限制，为nullptr时不限制
+     */
+    void SetBandwidthLimit(BandwidthLimit* limit) { m_limit = limit; }
+
+    /**
+     * @description: 设置内存预算，限制映射窗口和脏页总量，可与其他下载管理器共用，需在下载结束前保持有效
+     * @param {MemoryBudget*} budget 内存预算，为nullptr时不限制
+     */
+    void SetMemoryBudget(MemoryBudget* budget) { m_budget = budget; }
+
+    /**
+     * @description: 设置线程池，需在初始化前调用，可与其他下载管理器共用，需在下载结束前保持有效；
+     *               异步下载器的事件循环在池中的空闲线程上运行，阻塞的下载器每个连接仍各占一个线程并按序号绑定到池的CPU
+     * @param {WorkerPool*} workers 线程池，为nullptr时异步下载器自建IO线程，连接线程不绑定CPU
+     */
+    void SetWorkerPool(WorkerPool* workers) { m_workers = workers; }
+
+    /**
+     * @description: 设置性能统计，统计槽数需不少于构造时的线程数，需在下载结束前保持有效
+     * @param {DownloadMetrics*} metrics 性能统计，为nullptr时不统计
+     */
+    void SetMetrics(DownloadMetrics* metrics) { m_metrics = metrics; }
+
+    /**
+     * @description: 设置进度观察者，不设置时不输出进度，需在下载结束前保持有效
+     * @param {ProgressObserver*} observer 进度观察者，为nullptr时不通知
+     * @param {int} interval_ms 通知间隔，毫秒
+     */
+    void SetProgressObserver(ProgressObserver* observer, int interval_ms = PROGRESS_INTERVAL) {
+        m_observer = observer;
+        m_observer_interval = interval_ms > 0 ? interval_ms : PROGRESS_INTERVAL;
+    }
+
 private:
+    // 写入流水线的映射级需调用MapToFile和RecordWritten
+    friend class MmapSink<DownloadManager>;
+    friend class MmapCommitSink<DownloadManager>;
+
+    // 线程当前片段的下载源和开始时的状态，用于统计下载源速度
+    struct SegmentStat {
+        SegmentStat(): source(0), begin_size(0), backoff(false), retry_num(0), retry_pos(0) {}
+        int source; // 下载源序号
+        file_size_t begin_size; // 片段开始时线程已下载的字节数
+        chrono::steady_clock::time_point begin_time; // 片段开始时间
+        bool backoff; // 自动模式下片段失败，连接退出，等待进度线程下次采样后重新启动
+        int retry_num; // 片段连续没有进展的失败次数
+        file_size_t retry_pos; // 重试的起始字节，即失败前已写入的位置
+        chrono::steady_clock::time_point retry_time; // 退避结束、可以重试的时间
+    };
+
+    /**
+     * @description: 探测镜像并与主下载源比较文件大小和ETag，一致的镜像加入下载源
+     * @param {const DownloadInfo&} info 下载信息
+     */
+    void AddMirrors(const DownloadInfo& info);
+
+    /**
+     * @description: 片段开始下载前选择下载源并记录开始状态
+     * @param {const int} thread_id 线程序号
+     * @return {int} 下载源序号，没有可用的下载源时返回-1
+     */
+    int BeginSegment(const int thread_id);
+
+    /**
+     * @description: 片段结束后提交数据、统计下载源速度并归还未完成的区间，只有一个下载源时失败的片段保留给本连接重试
+     * @param {const int} thread_id 线程序号
+     * @param {bool} ok 传输是否成功
+     * @return {SegmentEnd} 重试时剩余区间记在片段统计中，失败且重试次数用尽时返回SEGMENT_FAIL
+     */
+    SegmentEnd EndSegment(const int thread_id, bool ok);
+
+    /**
+     * @description: 线程模式下等待片段重试的退避时间，期间停止、暂停或连接数减少时放弃重试并归还区间
+     * @param {const int} thread_id 线程序号
+     * @param {SegmentEnd&} result 放弃重试时连接的下一步
+     * @return {bool} 可以重试返回true
+     */
+    bool WaitRetry(const int thread_id, SegmentEnd& result);
+
+    /**
+     * @description: 输出各下载源的下载量和速度，只有一个下载源时不输出
+     */
+    void ShowMirrorReport();
+
+    /**
+     * @description: 初始化前设置下载源的连接选项，设置了线程池时异步下载器的事件循环在池中的线程上运行
+     * @param {Downloader*} source 下载源
+     * @param {const DownloadInfo&} info 下载信息
+     */
+    void ConfigureSource(Downloader* source, const DownloadInfo& info);
+
+    /**
+     * @description: 启动序号小于当前连接数且未在运行的连接，所有连接都已退出但仍有区间未完成时重新启动
+     */
+    void StartConnections();
+
+    /**
+     * @description: 启动一个连接，线程模式创建线程，异步模式提交第一个片段
+     * @param {const int} thread_id 连接序号
+     */
+    void StartConnection(const int thread_id);
+
+    /**
+     * @description: 根据一次吞吐量采样和期间的失败、限流情况调整连接数
+     * @param {double} rate 总吞吐量，字节/秒
+     */
+    void AdjustConnections(double rate);
+
+    /**
+     * @description: 连接退出后通知进度线程回收，需在连接的结果已设置后调用
+     * @param {const int} thread_id 连接序号
+     */
+    void NotifyExit(const int thread_id);
+
+    /**
+     * @description: 异步下载器使用，设置连接的执行结果和状态，并通知进度线程
+     * @param {const int} thread_id 连接序号
+     * @param {bool} ok 执行结果
+     * @param {SlotState} state 连接退出后的状态
+     */
+    void ExitAsyncConnection(const int thread_id, bool ok, SlotState state);
+
+    /**
+     * @description: 工作线程循环领取片段并下载，直到没有可分配的区间
+     * @param {const int} thread_id 线程序号
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool DownloadWorker(const int thread_id);
+
+    /**
+     * @description: 异步下载器使用，为连接领取下一个片段并提交下载，片段结束后在IO线程中继续领取
+     * @param {const int} thread_id 连接序号
+     */
+    void StartAsyncSegment(const int thread_id);
+
+    /**
+     * @description: 异步下载器使用，提交连接的片段，片段结束后在IO线程中继续领取或登记重试
+     * @param {const int} thread_id 连接序号
+     * @param {const Segment&} seg 片段
+     */
+    void SubmitAsyncSegment(const int thread_id, const Segment& seg);
+
+    /**
+     * @description: 异步下载器使用，退避时间到后由进度线程重新提交连接的剩余区间
+     * @param {const int} thread_id 连接序号
+     */
+    void RetryAsyncSegment(const int thread_id);
+
+    /**
+     * @description: 进度线程使用，重新提交退避时间已到的异步片段，已停止时全部提交以便连接退出
+     * @param {bool} all 是否不等退避结束全部提交
+     * @return {chrono::steady_clock::time_point} 剩余片段中最早的重试时间，没有时为最大值
+     */
+    chrono::steady_clock::time_point RunRetries(bool all);
+
     /**
      * @description: 接收数据并执行写入行为的回调函数
      * @param {const char*} data 接收的数据
@@ -56,12 +396,108 @@ private:
      */
     bool WriteFileBulkCallback(const char* data, size_t size, const int thread_id);
 
+    /**
+     * @description: 大小未知时从头到尾单连接下载整个文件
+     * @param {const int} thread_id 线程序号
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool DownloadStream(const int thread_id);
+
+    /**
+     * @description: 流式下载时按顺序追加数据，超出已扩展的文件大小时先扩展文件
+     * @param {const char*} data 接收的数据
+     * @param {size_t} size 数据大小
+     * @param {const int} thread_id 线程序号
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool WriteStreamCallback(const char* data, size_t size, const int thread_id);
+
+    /**
+     * @description: 流式下载时按STREAM_GROW_SIZE的整数倍扩展文件
+     * @param {file_size_t} size 至少需要的文件大小
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool GrowStreamFile(file_size_t size);
+
+    /**
+     * @description: 将一块数据依次交给前置级、写盘级，再推进校验、进度计数并按总速率限制节流
+     * @param {const Front&} front 前置级，确定写入位置和范围
+     * @param {const Writer&} writer 写盘级
+     * @param {SinkChunk&} chunk 数据
+     * @return {bool} 成功返回true， 写入失败返回false
+     */
+    template <class Front, class Writer>
+    bool PutChunk(const Front& front, const Writer& writer, SinkChunk& chunk);
+
+    /**
+     * @description: 零拷贝接收时为下载器提供接收位置所在的映射内存，超出当前映射时重新映射
+     * @param {const int} thread_id 线程序号
+     * @param {file_size_t} pos 接收位置
+     * @param {size_t&} size 传入希望接收的字节数，返回映射内存中可写的字节数
+     * @return {char*} 成功返回映射内存， 已停止、片段已被分走或映射失败返回nullptr
+     */
+    char* AcquireMem(const int thread_id, file_size_t pos, size_t& size);
+
+    /**
+     * @description: 零拷贝接收后提交已收到映射内存中的数据
+     * @param {const int} thread_id 线程序号
+     * @param {const char*} data 数据在映射内存中的位置
+     * @param {size_t} size 收到的字节数
+     * @return {bool} 成功返回true， 已停止或片段剩余部分已被分走时返回false
+     */
+    bool CommitMem(const int thread_id, const char* data, size_t size);
+
+    /**
+     * @description: 片段结束时提交线程缓冲的数据，仅pwrite方式需要
+     * @param {const int} thread_id 线程序号
+     */
+    void FlushSegment(const int thread_id);
+
+    /**
+     * @description: 提交所有缓冲数据并等待写线程写完，仅pwrite方式需要
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool StopWriter();
+
     /**
      * @description: 映射文件到内存
      * @param {const int} thread_id 线程序号
+     * @param {file_size_t} pos 需要写入的文件位置，映射从其所在的块开始
      * @return {bool} 成功返回true， 失败返回false
      */
-    bool MapToFile(const int thread_id);
+    bool MapToFile(const int thread_id, file_size_t pos);
+
+    /**
+     * @description: 将线程已写入且尚未记录的区间交给日志
+     * @param {const int} thread_id 线程序号
+     */
+    void RecordWritten(const int thread_id);
+
+    /**
+     * @description: 区间已写入文件，记入日志并推进校验
+     * @param {file_size_t} start 起始字节
+     * @param {file_size_t} end 结束字节（不包含）
+     */
+    void OnWritten(file_size_t start, file_size_t end);
+
+    /**
+     * @description: 读取续传日志，校验通过时恢复已完成区间
+     * @return {bool} 可以续传返回true， 否则返回false
+     */
+    bool LoadJournal();
+
+    /**
+     * @description: 获取并解析块校验索引，未指定校验值时使用索引中的SHA-256
+     * @param {DeltaIndex&} index 解析后的索引
+     * @return {bool} 索引可用返回true， 否则返回false，此时下载整个文件
+     */
+    bool LoadDeltaIndex(DeltaIndex& index);
+
+    /**
+     * @description: 从本地旧文件复制相同的块，复制的区间与续传区间一样在下载时跳过，复制失败时下载整个文件
+     * @param {DeltaIndex&} index 块校验索引
+     */
+    void ApplyDelta(DeltaIndex& index);
 
     /**
      * @description: 解除内存映射
@@ -71,31 +507,81 @@ private:
 
     /**
      * @description: 创建空文件
+     * @param {bool} truncate 是否清空已有文件，续传时保留
      * @return {bool} 成功返回true， 失败返回false
      */
-    bool CreateEmptyFile();
+    bool CreateEmptyFile(bool truncate);
+
+    /**
+     * @description: 获取当前进度
+     * @param {double} speed 速度，字节/秒
+     * @param {double} elapsed 已用时间，秒
+     * @return {ProgressInfo}
+     */
+    ProgressInfo GetProgress(double speed, double elapsed);
 
     /**
-     * @description: 显示下载进度条
-     * @return {bool} 下载成功返回true， 失败返回false
+     * @description: 等待所有连接退出，期间按间隔通知进度观察者，自动模式下调整连接数
+     * @return {bool} 下载成功返回true， 有连接失败时立即返回false
      */
-    bool ShowProgress();
+    bool WatchProgress();
 
-    Downloader* m_downloader; // 文件下载器
+    Downloader* m_downloader; // 文件下载器，即主下载源
+    vector<Downloader*> m_sources; // 所有下载源，第一个为主下载源
+    vector<string> m_source_urls; // 各下载源的链接
+    MirrorSelector m_selector; // 按实测速度为片段选择下载源
+    vector<SegmentStat> m_segment_stats; // 各线程当前片段的统计
     string m_url; // 下载的文件链接
     string m_file_save_path; // 文件保存位置
     string m_filename; // 文件名
     file_size_t m_filesize; // 文件大小
     int m_thread_num; // 线程数量（包括主线程）
+    int m_slot_num; // 构造时的线程数，各线程数据按此数量分配
     int m_w_fd; // 打开的文件描述符
     int m_map_page_num; // 默认映射的页数
-    std::vector<std::future<bool>> m_threads; // 线程future对象集合
-    vector<file_size_t> m_downloaded_sizes; // 已下载的文件大小
-    vector<char*> m_mems; // 各线程映射的内存地址
-    vector<int> m_block_idxs; // 各线程当前映射的块位置
-    vector<int> m_remain_block_num; // 未映射的块数
-    vector<int> m_current_block_size; // 存放分配的块大小
-    vector<size_t> m_current_mem_pos; // 当前映射内存使用的位置
+    std::vector<pair<int, std::future<bool>>> m_threads; // 运行中的连接序号和结果，同一序号先启动的在前
+    std::vector<std::promise<bool>> m_async_results; // 异步下载器各连接的执行结果
+    ProgressCounters m_downloaded_sizes; // 各线程已下载的文件大小
+    ConnWriteState* m_conn_states; // 各线程的映射窗口和尚未记入日志的已写入区间，按缓存行对齐
+    SegmentScheduler m_scheduler; // 片段调度器，记录空闲、下载中和已完成的区间
+    DownloadJournal m_journal; // 续传日志
+    JournalInfo m_journal_info; // 续传日志的校验信息
+    map<file_size_t, file_size_t> m_resumed; // 续传时已完成的区间
+    file_size_t m_resumed_size; // 续传时已完成的字节数
+    string m_delta_seed; // 增量下载的本地旧文件，为空时不使用增量下载
+    string m_delta_index; // 块校验索引的本地路径或链接
+    bool m_stream; // 文件大小未知，整个文件由一个连接流式下载
+    atomic<bool> m_stream_taken; // 流式下载的唯一片段是否已被领取
+    atomic<bool> m_stream_done; // 流式下载是否已完成
+    file_size_t m_stream_size; // 流式下载已写入的字节数
+    file_size_t m_stream_capacity; // 流式下载时文件已扩展到的大小
+    atomic<bool> m_stop; // 有线程失败时通知其他线程停止
+    atomic<bool> m_paused; // 是否暂停，暂停时不领取片段，进行中的传输被中断
+    WriteMode m_write_mode; // 写盘方式
+    int m_writer_num; // pwrite方式的写线程数
+    int m_io_options; // IO选项，IoOption的按位组合
+    PwriteWriter m_writer; // pwrite方式的写盘阶段
+    ChecksumType m_checksum_type; // 校验算法
+    string m_checksum_expected; // 期望的校验值
+    StreamVerifier m_verifier; // 下载过程中计算校验值
+    vector<atomic<int>> m_slot_states; // 各连接的运行状态，取值为SlotState
+    bool m_auto_conn; // 是否自动调整连接数
+    ConnectionController m_controller; // 自动模式的连接数控制器
+    atomic<int> m_conn_limit; // 当前允许的连接数，序号不小于该值的连接在片段结束或收到数据时退出
+    atomic<int> m_error_num; // 失败的片段数
+    atomic<int> m_fail_streak; // 片段连续失败的次数
+    int m_last_congestion; // 上次调整连接数时的失败和限流总次数
+    BandwidthLimit* m_limit; // 带宽限制，不限制时为nullptr
+    MemoryBudget* m_budget; // 内存预算，不限制时为nullptr
+    WorkerPool* m_workers; // 执行连接的线程池，未设置时为nullptr
+    DownloadMetrics* m_metrics; // 性能统计，不统计时为nullptr
+    ProgressObserver* m_observer; // 进度观察者，不通知时为nullptr
+    int m_observer_interval; // 进度通知间隔，毫秒
+    mutex m_exit_lock; // 保护m_exited和m_retries
+    condition_variable m_exit_cond; // 有连接退出或登记重试时唤醒进度线程
+    vector<int> m_exited; // 已退出、尚未被进度线程回收的连接序号
+    vector<int> m_retries; // 异步模式下等待退避结束后重试的连接序号
+    bool m_retry_added; // 是否有新登记的重试，进度线程醒来后重新计算等待时间
 };
 
 #endif
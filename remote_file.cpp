@@ -0,0 +1,269 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-21 14:52:07
+ * @Description: 远程文件的随机读取接口实现
+ */
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "remote_file.h"
+
+RemoteFile::RemoteFile(size_t block_size, size_t cache_size)
+    : m_downloader(nullptr)
+    , m_filesize(0)
+    , m_block_size(block_size > 0 ? block_size : REMOTE_BLOCK_SIZE)
+    , m_readahead_max(REMOTE_READAHEAD_MAX)
+    , m_cache_fd(-1)
+    , m_next_offset(0)
+    , m_readahead(0) {
+    m_max_blocks = max(cache_size / m_block_size, (size_t)1);
+}
+
+RemoteFile::~RemoteFile() {
+    if (m_downloader) {
+        delete m_downloader;
+    }
+    if (m_cache_fd != -1) {
+        close(m_cache_fd);
+        unlink(m_cache_path.c_str());
+    }
+}
+
+/**
+ * @description: 将块缓存在磁盘文件中，需在Open前调用，缓存文件在关闭时删除
+ * @param {const string&} path 缓存文件路径
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool RemoteFile::SetCacheFile(const string& path) {
+    m_cache_fd = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 00644);
+    if (m_cache_fd == -1) {
+        perror("create cache file failed:");
+        return false;
+    }
+    m_cache_path = path;
+    return true;
+}
+
+/**
+ * @description: 探测远程文件，服务器需支持区间请求且文件大小已知
+ * @param {const string&} url 链接
+ * @param {DownloaderType} type 下载器类型，异步下载器也按阻塞方式使用
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool RemoteFile::Open(const string& url, DownloaderType type) {
+    m_downloader = GetDownloader(type);
+    if (!m_downloader || !m_downloader->Init(url)) {
+        printf("open %s failed\n", url.c_str());
+        return false;
+    }
+    if (!m_downloader->IsSizeKnown() || !m_downloader->IsRangeAvailable()) {
+        printf("random access needs range requests and a known file size\n");
+        return false;
+    }
+    m_filesize = m_downloader->GetFileSize();
+    return true;
+}
+
+/**
+ * @description: 读取文件的一段，与pread相同，多线程调用时依次执行
+ * @param {char*} buf 缓冲区
+ * @param {size_t} size 读取的字节数
+ * @param {file_size_t} offset 起始字节
+ * @return {ssize_t} 读到的字节数，超过文件末尾的部分不读，请求失败返回-1
+ */
+ssize_t RemoteFile::Pread(char* buf, size_t size, file_size_t offset) {
+    lock_guard<mutex> guard(m_lock);
+    if (!m_downloader || m_filesize == 0) {
+        return -1;
+    }
+    if (offset >= m_filesize || size == 0) {
+        return 0;
+    }
+    if (size > m_filesize - offset) {
+        size = m_filesize - offset;
+    }
+    file_size_t first = offset / m_block_size;
+    file_size_t last = (offset + size - 1) / m_block_size;
+
+    // 紧接上次读取的位置视为顺序读，预读块数逐次翻倍，预读的块最多占缓存的一半
+    size_t max_readahead = min(m_readahead_max / m_block_size, m_max_blocks / 2);
+    if (offset == m_next_offset && max_readahead > 0) {
+        m_readahead = m_readahead == 0 ? 1 : min(m_readahead * 2, max_readahead);
+    }
+    else {
+        m_readahead = 0;
+    }
+    m_next_offset = offset + size;
+
+    // 所读的块都已缓存时不预读，否则预读窗口内的每次读取都会只为窗口末尾多下载一块
+    bool missed = false;
+    for (file_size_t block = first; block <= last; block++) {
+        if (m_blocks.count(block) > 0) {
+            m_stats.hit_blocks++;
+        }
+        else {
+            m_stats.miss_blocks++;
+            missed = true;
+        }
+    }
+    file_size_t end_block = missed ? min(last + m_readahead, (m_filesize - 1) / m_block_size) : last;
+
+    // 相邻的缺失块合并为一个请求
+    file_size_t run_start = 0;
+    bool in_run = false;
+    for (file_size_t block = first; missed && block <= end_block; block++) {
+        bool cached = m_blocks.count(block) > 0;
+        if (!cached && !in_run) {
+            run_start = block;
+            in_run = true;
+        }
+        else if (cached && in_run) {
+            if (!Fetch(run_start, block - 1)) {
+                return -1;
+            }
+            in_run = false;
+        }
+    }
+    if (in_run && !Fetch(run_start, end_block)) {
+        return -1;
+    }
+
+    // 本次读取期间不淘汰，读完后再降到缓存上限以内
+    size_t copied = 0;
+    for (file_size_t block = first; block <= last; block++) {
+        size_t block_offset = block == first ? offset % m_block_size : 0;
+        size_t copy_size = min(size - copied, m_block_size - block_offset);
+        if (!Load(block, block_offset, buf + copied, copy_size)) {
+            return -1;
+        }
+        copied += copy_size;
+    }
+    Evict();
+    return copied;
+}
+
+/**
+ * @description: 获取缓存统计
+ * @return {RemoteFileStats}
+ */
+RemoteFileStats RemoteFile::GetStats() {
+    lock_guard<mutex> guard(m_lock);
+    return m_stats;
+}
+
+/**
+ * @description: 用一个区间请求下载连续的块并放入缓存，调用前需持有m_lock
+ * @param {file_size_t} first 第一块序号
+ * @param {file_size_t} last 最后一块序号
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool RemoteFile::Fetch(file_size_t first, file_size_t last) {
+    file_size_t start = first * m_block_size;
+    file_size_t end = min((last + 1) * m_block_size, m_filesize) - 1;
+    vector<char> data;
+    data.reserve(end - start + 1);
+    DataDealCallback call = [&data](const char* buf, size_t size)->bool {
+        data.insert(data.end(), buf, buf + size);
+        return true;
+    };
+    bool ok = false;
+    for (int attempt = 0; attempt <= REMOTE_FETCH_RETRY && !ok; attempt++) {
+        data.clear();
+        m_stats.requests++;
+        ok = m_downloader->Download(start, end, call) && data.size() == end - start + 1;
+    }
+    if (!ok) {
+        printf("fetch bytes %llu-%llu failed\n", start, end);
+        return false;
+    }
+    m_stats.fetched_bytes += data.size();
+    for (file_size_t block = first; block <= last; block++) {
+        size_t pos = (block - first) * m_block_size;
+        if (!Store(block, data.data() + pos, min(m_block_size, data.size() - pos))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @description: 将块放入缓存，调用前需持有m_lock
+ * @param {file_size_t} block 块序号
+ * @param {const char*} data 数据
+ * @param {size_t} size 字节数
+ * @return {bool} 成功返回true， 写缓存文件失败返回false
+ */
+bool RemoteFile::Store(file_size_t block, const char* data, size_t size) {
+    if (m_blocks.count(block) > 0) {
+        return true;
+    }
+    // 磁盘缓存按块序号放在对应位置，缓存文件是稀疏的
+    if (m_cache_fd != -1) {
+        size_t written = 0;
+        while (written < size) {
+            ssize_t n = pwrite(m_cache_fd, data + written, size - written, block * m_block_size + written);
+            if (n <= 0) {
+                perror("write cache file failed:");
+                return false;
+            }
+            written += n;
+        }
+    }
+    CacheBlock& entry = m_blocks[block];
+    m_lru.push_front(block);
+    entry.lru = m_lru.begin();
+    entry.size = size;
+    if (m_cache_fd == -1) {
+        entry.data.assign(data, data + size);
+    }
+    return true;
+}
+
+/**
+ * @description: 从缓存的块中复制数据，并将块移到LRU链表头部，调用前需持有m_lock
+ * @param {file_size_t} block 块序号
+ * @param {size_t} offset 块内起始字节
+ * @param {char*} buf 缓冲区
+ * @param {size_t} size 字节数
+ * @return {bool} 成功返回true， 读缓存文件失败返回false
+ */
+bool RemoteFile::Load(file_size_t block, size_t offset, char* buf, size_t size) {
+    auto it = m_blocks.find(block);
+    if (it == m_blocks.end() || offset + size > it->second.size) {
+        return false;
+    }
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    if (m_cache_fd == -1) {
+        memcpy(buf, it->second.data.data() + offset, size);
+        return true;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(m_cache_fd, buf + done, size - done, block * m_block_size + offset + done);
+        if (n <= 0) {
+            perror("read cache file failed:");
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * @description: 淘汰最久未使用的块直到不超过缓存上限，调用前需持有m_lock
+ */
+void RemoteFile::Evict() {
+    while (m_blocks.size() > m_max_blocks) {
+        file_size_t block = m_lru.back();
+        m_lru.pop_back();
+        // 磁盘缓存释放对应的磁盘空间，文件大小不变
+        if (m_cache_fd != -1) {
+            fallocate(m_cache_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, block * m_block_size,
+                m_blocks[block].size);
+        }
+        m_blocks.erase(block);
+    }
+}
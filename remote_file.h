@@ -0,0 +1,140 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-21 14:08:31
+ * @Description: 远程文件的随机读取接口，按对齐的块发区间请求，块缓存在内存或磁盘中，按LRU淘汰，
+ *               顺序读时预读，相邻的缺失块合并为一个请求
+ */
+#ifndef _REMOTE_FILE_H_
+#define _REMOTE_FILE_H_
+#include <sys/types.h>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "multithread_downloader.h"
+using namespace std;
+
+#define REMOTE_BLOCK_SIZE       (256 * 1024) // 默认缓存块大小
+#define REMOTE_CACHE_SIZE       (64 * 1024 * 1024) // 默认缓存上限
+#define REMOTE_READAHEAD_MAX    (4 * 1024 * 1024) // 顺序读时预读的最大字节数，另受缓存上限的一半限制
+#define REMOTE_FETCH_RETRY      3 // 区间请求失败后的重试次数
+
+// 缓存统计
+struct RemoteFileStats {
+    RemoteFileStats(): hit_blocks(0), miss_blocks(0), requests(0), fetched_bytes(0) {}
+    file_size_t hit_blocks; // 读取时已在缓存中的块数
+    file_size_t miss_blocks; // 读取时需要下载的块数，不含预读的块
+    file_size_t requests; // 区间请求数
+    file_size_t fetched_bytes; // 下载的字节数
+};
+
+class RemoteFile {
+public:
+    /**
+     * @param {size_t} block_size 缓存块大小
+     * @param {size_t} cache_size 缓存上限，至少缓存一个块
+     */
+    RemoteFile(size_t block_size = REMOTE_BLOCK_SIZE, size_t cache_size = REMOTE_CACHE_SIZE);
+    ~RemoteFile();
+
+    /**
+     * @description: 将块缓存在磁盘文件中，需在Open前调用，缓存文件在关闭时删除
+     * @param {const string&} path 缓存文件路径
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool SetCacheFile(const string& path);
+
+    /**
+     * @description: 设置顺序读时预读的最大字节数，读取范围已知时可设为0关闭预读
+     * @param {size_t} max_bytes 最大字节数
+     */
+    void SetReadahead(size_t max_bytes) { m_readahead_max = max_bytes; }
+
+    /**
+     * @description: 探测远程文件，服务器需支持区间请求且文件大小已知
+     * @param {const string&} url 链接
+     * @param {DownloaderType} type 下载器类型，异步下载器也按阻塞方式使用
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Open(const string& url, DownloaderType type = HTTP);
+
+    /**
+     * @description: 读取文件的一段，与pread相同，多线程调用时依次执行
+     * @param {char*} buf 缓冲区
+     * @param {size_t} size 读取的字节数
+     * @param {file_size_t} offset 起始字节
+     * @return {ssize_t} 读到的字节数，超过文件末尾的部分不读，请求失败返回-1
+     */
+    ssize_t Pread(char* buf, size_t size, file_size_t offset);
+
+    /**
+     * @description: 获取文件大小
+     * @return {file_size_t}
+     */
+    file_size_t GetFileSize() { return m_filesize; }
+
+    /**
+     * @description: 获取缓存统计
+     * @return {RemoteFileStats}
+     */
+    RemoteFileStats GetStats();
+
+private:
+    // 缓存的块
+    struct CacheBlock {
+        list<file_size_t>::iterator lru; // 在LRU链表中的位置
+        vector<char> data; // 内存缓存的数据，磁盘缓存时为空
+        size_t size; // 块的字节数，文件最后一块可能不足一块
+    };
+
+    /**
+     * @description: 用一个区间请求下载连续的块并放入缓存，调用前需持有m_lock
+     * @param {file_size_t} first 第一块序号
+     * @param {file_size_t} last 最后一块序号
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Fetch(file_size_t first, file_size_t last);
+
+    /**
+     * @description: 将块放入缓存，调用前需持有m_lock
+     * @param {file_size_t} block 块序号
+     * @param {const char*} data 数据
+     * @param {size_t} size 字节数
+     * @return {bool} 成功返回true， 写缓存文件失败返回false
+     */
+    bool Store(file_size_t block, const char* data, size_t size);
+
+    /**
+     * @description: 从缓存的块中复制数据，并将块移到LRU链表头部，调用前需持有m_lock
+     * @param {file_size_t} block 块序号
+     * @param {size_t} offset 块内起始字节
+     * @param {char*} buf 缓冲区
+     * @param {size_t} size 字节数
+     * @return {bool} 成功返回true， 读缓存文件失败返回false
+     */
+    bool Load(file_size_t block, size_t offset, char* buf, size_t size);
+
+    /**
+     * @description: 淘汰最久未使用的块直到不超过缓存上限，调用前需持有m_lock
+     */
+    void Evict();
+
+    Downloader* m_downloader; // 下载器
+    file_size_t m_filesize; // 文件大小
+    size_t m_block_size; // 块大小
+    size_t m_max_blocks; // 缓存的最大块数
+    size_t m_readahead_max; // 预读的最大字节数
+    string m_cache_path; // 磁盘缓存文件路径，为空时缓存在内存中
+    int m_cache_fd; // 磁盘缓存文件描述符，块按序号存放在对应位置
+
+    mutex m_lock; // 保护以下成员
+    list<file_size_t> m_lru; // 缓存的块序号，最近使用的在前
+    unordered_map<file_size_t, CacheBlock> m_blocks; // 缓存的块
+    file_size_t m_next_offset; // 上次读取的结束位置，下次从此处开始视为顺序读
+    size_t m_readahead; // 当前的预读块数，顺序读时逐次翻倍
+    RemoteFileStats m_stats; // 缓存统计
+};
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-21 16:47:12
+ * @Description: 远程ZIP文件的目录读取和成员解压实现
+ */
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include "zip_reader.h"
+
+#define ZIP_EOCD_SIG        0x06054b50 // 目录结束记录
+#define ZIP64_LOCATOR_SIG   0x07064b50 // ZIP64目录结束记录的定位记录
+#define ZIP64_EOCD_SIG      0x06064b50 // ZIP64目录结束记录
+#define ZIP_CENTRAL_SIG     0x02014b50 // 中央目录成员记录
+#define ZIP_LOCAL_SIG       0x04034b50 // 本地文件头
+#define ZIP_CENTRAL_SIZE    46 // 中央目录成员记录的固定部分
+#define ZIP_LOCAL_SIZE      30 // 本地文件头的固定部分
+#define ZIP64_LOCATOR_SIZE  20
+#define ZIP64_EOCD_SIZE     56
+#define ZIP64_EXTRA_ID      0x0001 // ZIP64扩展字段
+#define ZIP_METHOD_STORE    0
+#define ZIP_METHOD_DEFLATE  8
+
+/**
+ * @description: 读取小端整数
+ * @param {const char*} data 数据
+ * @param {size_t} size 字节数
+ * @return {uint64_t}
+ */
+static uint64_t GetLe(const char* data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= (uint64_t)(uint8_t)data[i] << (i * 8);
+    }
+    return value;
+}
+
+/**
+ * @description: 读取一段数据，不足时视为失败
+ * @param {file_size_t} offset 起始字节
+ * @param {size_t} size 字节数
+ * @param {string&} data 读到的数据
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool ZipReader::ReadAt(file_size_t offset, size_t size, string& data) {
+    data.resize(size);
+    return size == 0 || m_file->Pread(&data[0], size, offset) == (ssize_t)size;
+}
+
+/**
+ * @description: 读取中央目录
+ * @return {bool} 成功返回true，不是ZIP文件或请求失败返回false
+ */
+bool ZipReader::Open() {
+    // 目录结束记录在文件末尾，之后只有注释
+    file_size_t filesize = m_file->GetFileSize();
+    if (filesize < ZIP_EOCD_SIZE) {
+        return false;
+    }
+    size_t tail_size = filesize < ZIP_EOCD_SEARCH ? (size_t)filesize : ZIP_EOCD_SEARCH;
+    file_size_t tail_start = filesize - tail_size;
+    string tail;
+    if (!ReadAt(tail_start, tail_size, tail)) {
+        return false;
+    }
+    size_t eocd = string::npos;
+    for (size_t pos = tail_size - ZIP_EOCD_SIZE + 1; pos-- > 0;) {
+        if (GetLe(&tail[pos], 4) == ZIP_EOCD_SIG) {
+            eocd = pos;
+            break;
+        }
+    }
+    if (eocd == string::npos) {
+        printf("end of central directory not found, not a zip file\n");
+        return false;
+    }
+    file_size_t entry_num = GetLe(&tail[eocd + 10], 2);
+    file_size_t dir_size = GetLe(&tail[eocd + 12], 4);
+    file_size_t dir_offset = GetLe(&tail[eocd + 16], 4);
+
+    // 超出32位的取值记在ZIP64目录结束记录中，定位记录紧挨在目录结束记录之前
+    if (entry_num == 0xffff || dir_size == 0xffffffff || dir_offset == 0xffffffff) {
+        file_size_t locator = tail_start + eocd;
+        string record;
+        if (locator < ZIP64_LOCATOR_SIZE || !ReadAt(locator - ZIP64_LOCATOR_SIZE, ZIP64_LOCATOR_SIZE, record)
+            || GetLe(&record[0], 4) != ZIP64_LOCATOR_SIG) {
+            printf("zip64 locator not found\n");
+            return false;
+        }
+        file_size_t eocd64 = GetLe(&record[8], 8);
+        if (!ReadAt(eocd64, ZIP64_EOCD_SIZE, record) || GetLe(&record[0], 4) != ZIP64_EOCD_SIG) {
+            printf("zip64 end of central directory not found\n");
+            return false;
+        }
+        entry_num = GetLe(&record[32], 8);
+        dir_size = GetLe(&record[40], 8);
+        dir_offset = GetLe(&record[48], 8);
+    }
+    string dir;
+    if (dir_offset + dir_size > filesize || !ReadAt(dir_offset, dir_size, dir)) {
+        printf("read central directory failed\n");
+        return false;
+    }
+    return ParseDirectory(dir, entry_num);
+}
+
+/**
+ * @description: 解析中央目录中的成员记录
+ * @param {const string&} dir 中央目录
+ * @param {file_size_t} entry_num 成员数
+ * @return {bool} 格式正确返回true， 否则返回false
+ */
+bool ZipReader::ParseDirectory(const string& dir, file_size_t entry_num) {
+    m_entries.clear();
+    size_t pos = 0;
+    for (file_size_t i = 0; i < entry_num; i++) {
+        if (pos + ZIP_CENTRAL_SIZE > dir.size() || GetLe(&dir[pos], 4) != ZIP_CENTRAL_SIG) {
+            printf("bad central directory entry\n");
+            return false;
+        }
+        const char* record = &dir[pos];
+        size_t name_len = GetLe(record + 28, 2);
+        size_t extra_len = GetLe(record + 30, 2);
+        size_t comment_len = GetLe(record + 32, 2);
+        if (pos + ZIP_CENTRAL_SIZE + name_len + extra_len + comment_len > dir.size()) {
+            printf("bad central directory entry\n");
+            return false;
+        }
+        ZipEntry entry;
+        entry.flags = GetLe(record + 8, 2);
+        entry.method = GetLe(record + 10, 2);
+        entry.crc = GetLe(record + 16, 4);
+        entry.compressed_size = GetLe(record + 20, 4);
+        entry.size = GetLe(record + 24, 4);
+        entry.local_offset = GetLe(record + 42, 4);
+        entry.name.assign(record + ZIP_CENTRAL_SIZE, name_len);
+
+        // ZIP64扩展字段按顺序只包含32位字段取值为全1的项
+        const char* extra = record + ZIP_CENTRAL_SIZE + name_len;
+        const char* extra_end = extra + extra_len;
+        while (extra + 4 <= extra_end) {
+            uint16_t id = GetLe(extra, 2);
+            uint16_t size = GetLe(extra + 2, 2);
+            const char* field = extra + 4;
+            const char* field_end = field + size > extra_end ? extra_end : field + size;
+            if (id == ZIP64_EXTRA_ID) {
+                file_size_t* values[] = {&entry.size, &entry.compressed_size, &entry.local_offset};
+                for (auto value : values) {
+                    if (*value == 0xffffffff && field + 8 <= field_end) {
+                        *value = GetLe(field, 8);
+                        field += 8;
+                    }
+                }
+            }
+            extra += 4 + size;
+        }
+        m_entries.push_back(entry);
+        pos += ZIP_CENTRAL_SIZE + name_len + extra_len + comment_len;
+    }
+    return true;
+}
+
+/**
+ * @description: 按路径查找成员
+ * @param {const string&} name 成员路径
+ * @return {const ZipEntry*} 不存在返回nullptr
+ */
+const ZipEntry* ZipReader::Find(const string& name) {
+    for (auto& entry : m_entries) {
+        if (entry.name == name) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * @description: 解压成员，数据按顺序交给回调函数，结束时校验CRC32
+ * @param {const ZipEntry&} entry 成员
+ * @param {DataDealCallback} call 接收解压数据的回调函数，返回false时中止
+ * @return {bool} 成功返回true， 失败返回false
+ */
+bool ZipReader::Extract(const ZipEntry& entry, DataDealCallback call) {
+    if (entry.flags & 1) {
+        printf("%s is encrypted\n", entry.name.c_str());
+        return false;
+    }
+    if (entry.method != ZIP_METHOD_STORE && entry.method != ZIP_METHOD_DEFLATE) {
+        printf("%s uses unsupported compression method %d\n", entry.name.c_str(), entry.method);
+        return false;
+    }
+    // 本地文件头的扩展字段可能与中央目录中的不同，数据位置以本地文件头为准
+    string header;
+    if (!ReadAt(entry.local_offset, ZIP_LOCAL_SIZE, header) || GetLe(&header[0], 4) != ZIP_LOCAL_SIG) {
+        printf("bad local header of %s\n", entry.name.c_str());
+        return false;
+    }
+    file_size_t data_offset = entry.local_offset + ZIP_LOCAL_SIZE + GetLe(&header[26], 2) + GetLe(&header[28], 2);
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 负的窗口位数表示没有zlib头的原始deflate数据
+    if (entry.method == ZIP_METHOD_DEFLATE && inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+        return false;
+    }
+    vector<char> out(ZIP_READ_SIZE);
+    string in;
+    uLong crc = crc32(0, Z_NULL, 0);
+    file_size_t read_pos = 0;
+    file_size_t out_size = 0;
+    bool ok = true;
+    bool stream_end = false;
+    // 顺序读取压缩数据，远程文件识别为顺序读后会预读后续的块
+    while (ok && !stream_end && read_pos < entry.compressed_size) {
+        size_t size = entry.compressed_size - read_pos < ZIP_READ_SIZE ? (size_t)(entry.compressed_size - read_pos)
+            : ZIP_READ_SIZE;
+        if (!ReadAt(data_offset + read_pos, size, in)) {
+            ok = false;
+            break;
+        }
+        read_pos += size;
+        if (entry.method == ZIP_METHOD_STORE) {
+            crc = crc32(crc, (const Bytef*)in.data(), size);
+            out_size += size;
+            ok = call(in.data(), size);
+            continue;
+        }
+        stream.next_in = (Bytef*)&in[0];
+        stream.avail_in = size;
+        // 输出缓冲区没有写满说明这段输入已全部处理
+        while (ok && !stream_end) {
+            stream.next_out = (Bytef*)out.data();
+            stream.avail_out = out.size();
+            int ret = inflate(&stream, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                printf("inflate %s failed: %s\n", entry.name.c_str(), stream.msg ? stream.msg : "bad data");
+                ok = false;
+                break;
+            }
+            size_t produced = out.size() - stream.avail_out;
+            crc = crc32(crc, (const Bytef*)out.data(), produced);
+            out_size += produced;
+            ok = produced == 0 || call(out.data(), produced);
+            stream_end = ret == Z_STREAM_END;
+            if (stream.avail_out > 0) {
+                break;
+            }
+        }
+    }
+    if (entry.method == ZIP_METHOD_DEFLATE) {
+        inflateEnd(&stream);
+    }
+    if (!ok) {
+        return false;
+    }
+    if ((entry.method == ZIP_METHOD_DEFLATE && !stream_end) || out_size != entry.size || crc != entry.crc) {
+        printf("%s is corrupted: crc32 or size mismatch\n", entry.name.c_str());
+        return false;
+    }
+    return true;
+}
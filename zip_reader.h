@@ -0,0 +1,87 @@
+/*
+ * @Author: xuqiaxin
+ * @Mail: qiaxin.xu@foxmail.com
+ * @Date: 2023-05-21 16:20:45
+ * @Description: 远程ZIP文件的目录读取和成员解压，只下载目录和所需成员所在的区间，支持ZIP64，
+ *               成员为存储或deflate压缩，不支持加密
+ */
+#ifndef _ZIP_READER_H_
+#define _ZIP_READER_H_
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "remote_file.h"
+using namespace std;
+
+#define ZIP_EOCD_SIZE       22 // 目录结束记录的固定部分
+#define ZIP_EOCD_SEARCH     (ZIP_EOCD_SIZE + 65535) // 从文件末尾查找目录结束记录的范围，包含最长的注释
+#define ZIP_READ_SIZE       (256 * 1024) // 解压时每次读取的压缩数据大小
+
+// ZIP成员
+struct ZipEntry {
+    string name; // 成员路径
+    uint16_t method; // 压缩方式，0为存储，8为deflate
+    uint16_t flags; // 通用标志位
+    uint32_t crc; // 解压后数据的CRC32
+    file_size_t compressed_size; // 压缩后大小
+    file_size_t size; // 解压后大小
+    file_size_t local_offset; // 本地文件头的位置
+};
+
+class ZipReader {
+public:
+    /**
+     * @param {RemoteFile*} file 已打开的远程文件，需比ZipReader后析构
+     */
+    ZipReader(RemoteFile* file): m_file(file) {}
+
+    /**
+     * @description: 读取中央目录
+     * @return {bool} 成功返回true，不是ZIP文件或请求失败返回false
+     */
+    bool Open();
+
+    /**
+     * @description: 获取所有成员
+     * @return {const vector<ZipEntry>&}
+     */
+    const vector<ZipEntry>& GetEntries() { return m_entries; }
+
+    /**
+     * @description: 按路径查找成员
+     * @param {const string&} name 成员路径
+     * @return {const ZipEntry*} 不存在返回nullptr
+     */
+    const ZipEntry* Find(const string& name);
+
+    /**
+     * @description: 解压成员，数据按顺序交给回调函数，结束时校验CRC32
+     * @param {const ZipEntry&} entry 成员
+     * @param {DataDealCallback} call 接收解压数据的回调函数，返回false时中止
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool Extract(const ZipEntry& entry, DataDealCallback call);
+
+private:
+    /**
+     * @description: 读取一段数据，不足时视为失败
+     * @param {file_size_t} offset 起始字节
+     * @param {size_t} size 字节数
+     * @param {string&} data 读到的数据
+     * @return {bool} 成功返回true， 失败返回false
+     */
+    bool ReadAt(file_size_t offset, size_t size, string& data);
+
+    /**
+     * @description: 解析中央目录中的成员记录
+     * @param {const string&} dir 中央目录
+     * @param {file_size_t} entry_num 成员数
+     * @return {bool} 格式正确返回true， 否则返回false
+     */
+    bool ParseDirectory(const string& dir, file_size_t entry_num);
+
+    RemoteFile* m_file; // 远程文件
+    vector<ZipEntry> m_entries; // 成员
+};
+
+#endif